@@ -46,6 +46,7 @@ char *base64_encode(const char *buffer, size_t len)
 {
     int clen;
     char *cbuf, *c;
+    const unsigned char *ubuf = (const unsigned char *)buffer;
     uint32_t word, hextet;
     unsigned int i;
     clen = base64_encoded_len(len);
@@ -53,8 +54,9 @@ char *base64_encode(const char *buffer, size_t len)
     if (cbuf != NULL) {
         c = cbuf;
         /* loop over data, turning every 3 bytes into 4 characters */
-        for (i = 0; i < len - 2; i += 3) {
-            word = buffer[i] << 16 | buffer[i + 1] << 8 | buffer[i + 2];
+        /* 按无符号字节取, 二进制数据的高位不能带符号扩展 */
+        for (i = 0; i + 2 < len; i += 3) {
+            word = ubuf[i] << 16 | ubuf[i + 1] << 8 | ubuf[i + 2];
             hextet = (word & 0x00FC0000) >> 18;
             *c++ = _base64_charmap[hextet];
             hextet = (word & 0x0003F000) >> 12;
@@ -1,52 +1,271 @@
 ﻿/*
  * hash.c hash表实现
+ * 链式hash, 槽数量是2的幂, 超过负载因子以后自动扩容, 扩容是渐进的,
+ * 每次增删查迁移一个槽, 不会在某一次插入的时候停顿
 */
+#ifdef WIN32
+// rand_s
+#define _CRT_RAND_S
+#endif
+
 #include "hash.h"
 #include "mm.h"
 #include "stringutils.h"
 
+#include <stdio.h>
+
+#ifdef WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#endif
+#ifdef POSIX
+#include <pthread.h>
+#include <time.h>
+#endif
+
+// 默认负载因子, 平均每个槽的key数量 * 100
+#define HASH_LOAD_FACTOR 100
+#define HASH_MIN_SIZE 4
+// 每次迁移最多跳过的空槽
+#define HASH_REHASH_EMPTY_VISITS 16
+
 typedef struct _hashentry_t hashentry_t;
 struct _hashentry_t {
     hashentry_t *next;
-    char *key;
+    uint64_t hash;
+    char *key;                          // 普通表的key紧跟在节点后面
     void *value;
 };
 
+// 槽数组, 扩容的时候新旧两个同时存在
+typedef struct _hash_slots_t {
+    hashentry_t **entries;
+    unsigned long size;                 // 2的幂
+    unsigned long used;
+} hash_slots_t;
+
 struct _hash_t {
     unsigned int ref;
     hash_free_func free;
-    int length;                         // hash槽的数量，越多性能越高，如果为1则退化成为链表
     int num_keys;
-    hashentry_t **entries;
+    int load_factor;
+    hash_slots_t slots[2];
+    long rehash_index;                  // 正在迁移的旧槽位置, -1表示没有在扩容
+    int iterators;                      // 存在迭代器的时候暂停迁移
+    mem_arena_t *arena;                 // 不为NULL时内存都来自线性分配器
 };
 
 struct _hash_iterator_t {
     unsigned int ref;
     hash_t *table;
+    int slots;
+    long index;
     hashentry_t *entry;
-    int index;
+    // 提前取好的下一个节点, 这样可以删除当前节点
+    hashentry_t *next;
 };
 
+// 进程启动的时候随机生成, 服务器无法构造大量冲突的key
+static uint64_t hash_seed[2];
+
+#ifdef WIN32
+static INIT_ONCE hash_seed_once = INIT_ONCE_STATIC_INIT;
+#endif
+#ifdef POSIX
+static pthread_once_t hash_seed_once = PTHREAD_ONCE_INIT;
+#endif
+
+static void _hash_seed_generate()
+{
+    unsigned char buf[sizeof(hash_seed)];
+    size_t got = 0, i;
+#ifdef WIN32
+    unsigned int r;
+    for (i = 0; i < sizeof(buf); i += sizeof(r)) {
+        if (rand_s(&r) != 0)
+            break;
+        memcpy(buf + i, &r, sizeof(r));
+        got = i + sizeof(r);
+    }
+#endif
+#ifdef POSIX
+    FILE *fp = fopen("/dev/urandom", "rb");
+    if (fp) {
+        got = fread(buf, 1, sizeof(buf), fp);
+        fclose(fp);
+    }
+#endif
+    memcpy(hash_seed, buf, got);
+    if (got < sizeof(buf)) {
+        // 取不到随机数的时候至少每个进程不一样
+        uint64_t x = (uint64_t)(uintptr_t)&got ^ (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)buf;
+        for (i = 0; i < 2; i++) {
+            x ^= x >> 33;
+            x *= 0xff51afd7ed558ccdULL;
+            x ^= x >> 33;
+            hash_seed[i] ^= x;
+        }
+    }
+}
+
+#ifdef WIN32
+static BOOL CALLBACK _hash_seed_init(PINIT_ONCE once, void *param, void **context)
+{
+    _hash_seed_generate();
+    return TRUE;
+}
+#define hash_seed_init() InitOnceExecuteOnce(&hash_seed_once, _hash_seed_init, NULL, NULL)
+#endif
+#ifdef POSIX
+#define hash_seed_init() pthread_once(&hash_seed_once, _hash_seed_generate)
+#endif
+
+// SipHash-1-3
+#define ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND \
+    do { \
+        v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+        v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+    } while (0)
+
+static inline uint64_t _hash_load64(const unsigned char *p)
+{
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) |
+           ((uint64_t)p[3] << 24) | ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+           ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static uint64_t _hash_siphash(const unsigned char *in, size_t len)
+{
+    uint64_t k0 = hash_seed[0], k1 = hash_seed[1];
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+    const unsigned char *end = in + len - (len % 8);
+    uint64_t b = ((uint64_t)len) << 56;
+    uint64_t m;
+    size_t i;
+
+    for (; in != end; in += 8) {
+        m = _hash_load64(in);
+        v3 ^= m;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    // 剩下不足8字节的部分按小端放进b的低位
+    for (i = len & 7; i > 0; i--)
+        b |= ((uint64_t)in[i - 1]) << (8 * (i - 1));
+
+    v3 ^= b;
+    SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static inline uint64_t _hash_key(const char *key)
+{
+    return _hash_siphash((const unsigned char *)key, strlen(key));
+}
+
+uint64_t hash_bytes(const void *data, size_t len)
+{
+    hash_seed_init();
+    return _hash_siphash((const unsigned char *)data, len);
+}
+
+static unsigned long _hash_round_size(int size)
+{
+    unsigned long n = HASH_MIN_SIZE;
+    while (n < (unsigned long)size)
+        n <<= 1;
+    return n;
+}
+
+static void *_hash_alloc(hash_t *table, size_t s)
+{
+    if (table->arena)
+        return arena_alloc(table->arena, s);
+    return safe_mem_malloc(s, NULL);
+}
+
+static void _hash_free_mem(hash_t *table, void *p)
+{
+    if (!table->arena)
+        safe_mem_free(p);
+}
+
+static int _hash_slots_init(hash_t *table, hash_slots_t *slots, unsigned long size)
+{
+    slots->entries = _hash_alloc(table, size * sizeof(hashentry_t *));
+    if (!slots->entries)
+        return -1;
+    memset(slots->entries, 0, size * sizeof(hashentry_t *));
+    slots->size = size;
+    slots->used = 0;
+    return 0;
+}
+
+static hash_t *_hash_init(hash_t *result, int size, hash_free_func free, mem_arena_t *arena)
+{
+    result->free = free;
+    result->num_keys = 0;
+    result->ref = 1;
+    result->load_factor = HASH_LOAD_FACTOR;
+    result->rehash_index = -1;
+    result->iterators = 0;
+    result->arena = arena;
+    memset(&result->slots[1], 0, sizeof(hash_slots_t));
+    if (_hash_slots_init(result, &result->slots[0], _hash_round_size(size)))
+        return NULL;
+    hash_seed_init();
+    return result;
+}
+
 // 如果不提供free函数，插入时如果key冲突将导致插入失败
 hash_t *hash_new(int size, hash_free_func free)
 {
     hash_t *result = NULL;
     result = safe_mem_malloc(sizeof(hash_t), NULL);
     if (result != NULL) {
-        result->entries = safe_mem_calloc(size*sizeof(hashentry_t*), NULL);
-        if (result->entries == NULL) {
+        if (!_hash_init(result, size, free, NULL)) {
             safe_mem_free(result);
             return NULL;
         }
-        
-        result->length = size;
-        result->free = free;
-        result->num_keys = 0;
-        result->ref = 1;
     }
     return result;
 }
 
+hash_t *hash_new_arena(int size, hash_free_func free, mem_arena_t *arena)
+{
+    hash_t *result = NULL;
+    result = arena_alloc(arena, sizeof(hash_t));
+    if (result != NULL)
+        result = _hash_init(result, size, free, arena);
+    return result;
+}
+
+void hash_set_load_factor(hash_t *table, int percent)
+{
+    table->load_factor = percent > 0 ? percent : HASH_LOAD_FACTOR;
+}
+
+static void _hash_entry_free(hash_t *table, hashentry_t *entry)
+{
+    if (table->free)
+        table->free(entry->value);
+    _hash_free_mem(table, entry);
+}
+
 hash_t *hash_clone(hash_t *table)
 {
     table->ref++;
@@ -56,65 +275,153 @@ hash_t *hash_clone(hash_t *table)
 void hash_release(hash_t *table)
 {
     hashentry_t *entry, *next;
-    int i;
+    unsigned long i;
+    int t;
     if (table->ref > 1)
         table->ref--;
     else {
-        for (i = 0; i < table->length; i++) {
-            entry = table->entries[i];
-            while (entry != NULL) {
-                next = entry->next;
-                safe_mem_free(entry->key);
-                if (table->free)
-                    table->free(entry->value);
-                safe_mem_free(entry);
-                entry = next;
+        for (t = 0; t < 2; t++) {
+            for (i = 0; i < table->slots[t].size; i++) {
+                entry = table->slots[t].entries[i];
+                while (entry != NULL) {
+                    next = entry->next;
+                    _hash_entry_free(table, entry);
+                    entry = next;
+                }
             }
+            if (table->slots[t].entries)
+                _hash_free_mem(table, table->slots[t].entries);
         }
-        safe_mem_free(table->entries);
-        safe_mem_free(table);
+        _hash_free_mem(table, table);
     }
 }
 
-static int _hash_key(hash_t *table, const char *key)
+static inline int _hash_rehashing(hash_t *table)
 {
-    int hash = 0;
-    int shift = 0;
-    const char *c = key;
-    while (*c != '\0') {
-        hash ^= ((int)*c++ << shift);
-        shift += 8;
-        if (shift > 24) shift = 0;
+    return table->rehash_index >= 0;
+}
+
+// 迁移一个旧槽里面的所有节点
+static void _hash_rehash_step(hash_t *table)
+{
+    hash_slots_t *from = &table->slots[0], *to = &table->slots[1];
+    hashentry_t *entry, *next;
+    unsigned long index;
+    int empty = HASH_REHASH_EMPTY_VISITS;
+
+    if (table->iterators > 0)
+        return;
+
+    while ((unsigned long)table->rehash_index < from->size &&
+           !from->entries[table->rehash_index]) {
+        table->rehash_index++;
+        if (--empty == 0)
+            return;
+    }
+
+    if ((unsigned long)table->rehash_index < from->size) {
+        entry = from->entries[table->rehash_index];
+        while (entry) {
+            next = entry->next;
+            index = (unsigned long)entry->hash & (to->size - 1);
+            entry->next = to->entries[index];
+            to->entries[index] = entry;
+            from->used--;
+            to->used++;
+            entry = next;
+        }
+        from->entries[table->rehash_index] = NULL;
+        table->rehash_index++;
+    }
+
+    if (from->used == 0) {
+        // 迁移完成, 新槽变成主槽
+        _hash_free_mem(table, from->entries);
+        *from = *to;
+        memset(to, 0, sizeof(hash_slots_t));
+        table->rehash_index = -1;
+    }
+}
+
+// 超过负载因子以后开始扩容到两倍
+static void _hash_expand_if_needed(hash_t *table)
+{
+    hash_slots_t *slots = &table->slots[0];
+
+    if (_hash_rehashing(table))
+        return;
+    if ((uint64_t)table->num_keys * 100 < (uint64_t)slots->size * table->load_factor)
+        return;
+    if (_hash_slots_init(table, &table->slots[1], slots->size * 2))
+        return;
+    table->rehash_index = 0;
+}
+
+// link和slots返回节点的前驱指针和所在的槽数组, 用于删除
+static hashentry_t *_hash_find(hash_t *table, const char *key, uint64_t hash,
+                               hashentry_t ***link, int *slots_index)
+{
+    hashentry_t **pentry, *entry;
+    hash_slots_t *slots;
+    int t;
+
+    for (t = 0; t < 2; t++) {
+        slots = &table->slots[t];
+        if (!slots->entries)
+            break;
+        pentry = &slots->entries[(unsigned long)hash & (slots->size - 1)];
+        for (entry = *pentry; entry; pentry = &entry->next, entry = entry->next) {
+            if (entry->hash == hash && !im_strcmp(key, entry->key)) {
+                if (link) {
+                    *link = pentry;
+                    *slots_index = t;
+                }
+                return entry;
+            }
+        }
+        if (!_hash_rehashing(table))
+            break;
     }
-    return hash % table->length;
+    return NULL;
 }
 
 int hash_add(hash_t *table, const char *key, void *data)
 {
     hashentry_t *entry = NULL;
-    int index = _hash_key(table, key);
-    if (table->free) {
+    hash_slots_t *slots;
+    unsigned long index;
+    uint64_t hash = _hash_key(key);
+    size_t len;
+
+    if (_hash_rehashing(table))
+        _hash_rehash_step(table);
+
+    if (table->free || table->arena) {
         hash_drop(table, key);
     } else {
         // 没有指定释放函数，有冲突的话插入失败
-        if (!hash_get(table, key)) {
+        if (_hash_find(table, key, hash, NULL, NULL)) {
             return -1;
         }
     }
     
-    entry = safe_mem_calloc(sizeof(hashentry_t), NULL);
+    _hash_expand_if_needed(table);
+
+    len = im_strlen(key);
+    entry = _hash_alloc(table, sizeof(hashentry_t) + len + 1);
     if (!entry)
         return -1;
-        
-    entry->key = im_strndup(key, im_strlen(key));
-    if (!entry->key) {
-        safe_mem_free(entry);
-        return -1;
-    }
+    entry->key = (char *)(entry + 1);
+    memcpy(entry->key, key, len + 1);
+    entry->hash = hash;
     entry->value = data;
     
-    entry->next = table->entries[index];
-    table->entries[index] = entry;
+    // 扩容期间新节点直接放进新槽
+    slots = &table->slots[_hash_rehashing(table) ? 1 : 0];
+    index = (unsigned long)hash & (slots->size - 1);
+    entry->next = slots->entries[index];
+    slots->entries[index] = entry;
+    slots->used++;
     table->num_keys++;
     return 0;
 }
@@ -123,53 +430,37 @@ int hash_add(hash_t *table, const char *key, void *data)
 void *hash_get(hash_t *table, const char *key)
 {
     hashentry_t *entry;
-    int index = _hash_key(table, key);
-    void *result = NULL;
-    
-    entry = table->entries[index];
-    while (entry != NULL) {
-        if (!im_strcmp(key, entry->key)) {
-            // 匹配
-            result = entry->value;
-            return result;
-        }
-        entry = entry->next;
-    }
-    // 没有匹配
-    return result;
+
+    if (_hash_rehashing(table))
+        _hash_rehash_step(table);
+
+    entry = _hash_find(table, key, _hash_key(key), NULL, NULL);
+    // 没有匹配返回NULL
+    return entry ? entry->value : NULL;
 }
 
 int hash_drop(hash_t *table, const char *key)
 {
-    hashentry_t *entry, *prev;
-    int index = _hash_key(table, key);
-    
-    // entry和key都需要释放
-    entry = table->entries[index];
-    prev = NULL;
-    
-    while (entry != NULL) {
-        if (!im_strcmp(key, entry->key)) {
-            safe_mem_free(entry->key);
-            // 自定义释放
-            if (table->free)
-                table->free(entry->value);
-                
-            if (prev == NULL) {
-                table->entries[index] = entry->next;
-            } else {
-                prev->next = entry->next;
-            }
-            
-            safe_mem_free(entry);
-            table->num_keys--;
-            return 0;
-        }
-        prev = entry;
-        entry = entry->next;
+    hashentry_t *entry, **link;
+    uint64_t hash = _hash_key(key);
+    int t;
+
+    if (_hash_rehashing(table))
+        _hash_rehash_step(table);
+
+    entry = _hash_find(table, key, hash, &link, &t);
+    if (!entry) {
+        // key不存在
+        return -1;
     }
-    // key不存在
-    return -1;
+
+    *link = entry->next;
+    table->slots[t].used--;
+    table->num_keys--;
+
+    // 自定义释放
+    _hash_entry_free(table, entry);
+    return 0;
 }
 
 int hash_num_keys(hash_t *table)
@@ -184,8 +475,11 @@ hash_iterator_t *hash_iter_new(hash_t *table)
     if (iter != NULL) {
         iter->ref = 1;
         iter->table = hash_clone(table);          // 增加引用计数
-        iter->entry = NULL;
+        iter->table->iterators++;
+        iter->slots = 0;
         iter->index = -1;
+        iter->entry = NULL;
+        iter->next = NULL;
     }
     return iter;
 }
@@ -194,37 +488,37 @@ void hash_iter_release(hash_iterator_t *iter)
 {
     iter->ref--;
     if (iter->ref <= 0) {
+        iter->table->iterators--;
         hash_release(iter->table);
         safe_mem_free(iter);
     }
 }
 
+// 迭代期间暂停迁移, 可以删除刚刚返回的key
 const char *hash_iter_next(hash_iterator_t *iter)
 {
     hash_t *table = iter->table;
-    hashentry_t *entry = iter->entry;
-    int i;
+    hashentry_t *entry = iter->next;
+    hash_slots_t *slots;
     
     // 迭代出来的keyvalue数据的顺序是不确定的
-    if (entry != NULL)
-        entry = entry->next;
-        
-    if (entry == NULL) {
-        i = iter->index + 1;
-        while (i < iter->table->length) {
-            entry = table->entries[i];
-            if (entry != NULL) {
-                iter->index = i;
-                break;
-            }
-            i++;
+    while (entry == NULL) {
+        slots = &table->slots[iter->slots];
+        if (!slots->entries)
+            return NULL;
+        iter->index++;
+        if ((unsigned long)iter->index >= slots->size) {
+            if (iter->slots == 1 || !_hash_rehashing(table))
+                return NULL;
+            // 扩容期间接着遍历新槽
+            iter->slots = 1;
+            iter->index = -1;
+            continue;
         }
-    }
-    if (entry == NULL) {
-        return NULL;
+        entry = slots->entries[iter->index];
     }
     
     iter->entry = entry;
+    iter->next = entry->next;
     return entry->key;
 }
-
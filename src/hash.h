@@ -4,14 +4,23 @@
 #ifndef __IMCORE_HASH_H__
 #define __IMCORE_HASH_H__
 
+#include <stdint.h>
+
+#include "mm.h"
+
 // 私有结构定义
 typedef struct _hash_t hash_t;
 
 // 自定义释放回调函数签名
 typedef void (*hash_free_func)(void* p);
 
-// 创建、克隆、释放
+// 创建、克隆、释放, size是初始的槽数量, 会向上取整到2的幂
 hash_t *hash_new(int size, hash_free_func free);
+// 表、节点和key都从线性分配器分配, 释放的时候只调用free回调, 内存随分配器一起回收
+// 这种表插入重复的key总是覆盖
+hash_t *hash_new_arena(int size, hash_free_func free, mem_arena_t *arena);
+// 负载因子, 平均每个槽的key数量 * 100, 超过以后渐进扩容到两倍, 默认100
+void hash_set_load_factor(hash_t *table, int percent);
 hash_t *hash_clone(hash_t *table);
 void hash_release(hash_t *table);
 
@@ -21,6 +30,9 @@ void *hash_get(hash_t *table, const char *key);
 int hash_drop(hash_t *table, const char *key);
 int hash_num_keys(hash_t *table);
 
+// 用hash表同样的带种子的SipHash计算任意数据的hash值
+uint64_t hash_bytes(const void *data, size_t len);
+
 // hash迭代器
 typedef struct _hash_iterator_t hash_iterator_t;
 hash_iterator_t *hash_iter_new(hash_t *table);
@@ -0,0 +1,127 @@
+/*
+* im-atomic.h
+* 原子操作, 封装Interlocked系列函数以及gcc的__atomic内建函数
+* 所有操作都是全内存屏障(seq_cst)语义
+*/
+#ifndef _IMCORE_ATOMIC_H
+#define _IMCORE_ATOMIC_H
+
+#include "common.h"
+
+#ifdef WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#endif
+
+// 读取指针
+static inline void *im_atomic_load_ptr(void *volatile *p)
+{
+#ifdef WIN32
+    void *v = *p;
+    MemoryBarrier();
+    return v;
+#else
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// 写入指针
+static inline void im_atomic_store_ptr(void *volatile *p, void *v)
+{
+#ifdef WIN32
+    InterlockedExchangePointer(p, v);
+#else
+    __atomic_store_n(p, v, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// 交换指针, 返回旧值
+static inline void *im_atomic_xchg_ptr(void *volatile *p, void *v)
+{
+#ifdef WIN32
+    return InterlockedExchangePointer(p, v);
+#else
+    return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// 比较交换指针, 成功返回true
+static inline bool im_atomic_cas_ptr(void *volatile *p, void *expected, void *desired)
+{
+#ifdef WIN32
+    return InterlockedCompareExchangePointer(p, desired, expected) == expected;
+#else
+    return __atomic_compare_exchange_n(p, &expected, desired, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// 读取整数
+static inline long im_atomic_load(volatile long *p)
+{
+#ifdef WIN32
+    long v = *p;
+    MemoryBarrier();
+    return v;
+#else
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// 写入整数
+static inline void im_atomic_store(volatile long *p, long v)
+{
+#ifdef WIN32
+    InterlockedExchange(p, v);
+#else
+    __atomic_store_n(p, v, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// 交换整数, 返回旧值
+static inline long im_atomic_xchg(volatile long *p, long v)
+{
+#ifdef WIN32
+    return InterlockedExchange(p, v);
+#else
+    return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// 比较交换整数, 成功返回true
+static inline bool im_atomic_cas(volatile long *p, long expected, long desired)
+{
+#ifdef WIN32
+    return InterlockedCompareExchange(p, desired, expected) == expected;
+#else
+    return __atomic_compare_exchange_n(p, &expected, desired, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// 原子加法, 返回相加以后的值
+static inline long im_atomic_add(volatile long *p, long v)
+{
+#ifdef WIN32
+    return InterlockedExchangeAdd(p, v) + v;
+#else
+    return __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST);
+#endif
+}
+
+#define im_atomic_inc(p) im_atomic_add(p, 1)
+#define im_atomic_dec(p) im_atomic_add(p, -1)
+
+// 全内存屏障
+static inline void im_atomic_fence()
+{
+#ifdef WIN32
+    MemoryBarrier();
+#else
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+#endif // _IMCORE_ATOMIC_H
@@ -1,5 +1,8 @@
 #include "im-inl.h"
 
+// ź߳ÿλദpostϢ, ֤xmpp socketĶд
+#define IM_SIGNAL_THREAD_QUANTUM 32
+
 static void _xmpp_conn_handler(xmpp_conn_t *conn, xmpp_conn_event_t status,
                                const int error, xmpp_stream_error_t *stream_error,
                                void *userdata);
@@ -8,12 +11,13 @@ static void _im_conn_pre_free(im_conn_t *conn);
 
 
 
-im_conn_t *im_conn_new(const char *host,
-                       const char *username,
-                       const char *password,
-                       im_conn_state_cb statecb,
-                       im_conn_recive_cb msgcb,
-                       void *userdate)
+static im_conn_t *_im_conn_new(im_conn_group_t *group,
+                               const char *host,
+                               const char *username,
+                               const char *password,
+                               im_conn_state_cb statecb,
+                               im_conn_recive_cb msgcb,
+                               void *userdate)
 {
     im_conn_t *conn = NULL;
 
@@ -29,15 +33,25 @@ im_conn_t *im_conn_new(const char *host,
         if (!conn)
             break;
 
-        conn->signal_thread = im_thread_new();
-        conn->work_thread = im_thread_new();
-        if (!conn->signal_thread &&  !conn->work_thread)
-            break;
+        if (group) {
+            // 䵽ڵĹ߳, ̵߳xmpp
+            long n = (long)((unsigned long)im_atomic_inc(&group->next) % group->size);
+            conn->group = group;
+            conn->signal_thread = im_executor_get_thread(group->executor, n);
+            conn->work_thread = im_executor_next_thread(group->executor);
+            conn->xmpp_ctx = xmpp_ctx_clone(group->xmpp_ctxs[n]);
+        } else {
+            conn->signal_thread = im_thread_new();
+            conn->work_thread = im_thread_new();
+            if (!conn->signal_thread || !conn->work_thread)
+                break;
+            im_thread_set_quantum(conn->signal_thread, IM_SIGNAL_THREAD_QUANTUM);
 
-        // xmppĹź߳
-        conn->xmpp_ctx = xmpp_ctx_new(conn->signal_thread, NULL);
-        if (!conn->xmpp_ctx)
-            break;
+            // xmppĹź߳
+            conn->xmpp_ctx = xmpp_ctx_new(conn->signal_thread, NULL);
+            if (!conn->xmpp_ctx)
+                break;
+        }
 
         conn->xmpp_conn = xmpp_conn_new(conn->xmpp_ctx);
         if (!conn->xmpp_conn)
@@ -72,12 +86,51 @@ im_conn_t *im_conn_new(const char *host,
     return conn;
 }
 
+im_conn_t *im_conn_new(const char *host,
+                       const char *username,
+                       const char *password,
+                       im_conn_state_cb statecb,
+                       im_conn_recive_cb msgcb,
+                       void *userdate)
+{
+    return _im_conn_new(NULL, host, username, password, statecb, msgcb, userdate);
+}
+
+im_conn_t *im_conn_new_in_group(im_conn_group_t *group,
+                                const char *host,
+                                const char *username,
+                                const char *password,
+                                im_conn_state_cb statecb,
+                                im_conn_recive_cb msgcb,
+                                void *userdate)
+{
+    assert(group);
+    if (!group)
+        return NULL;
+
+    return _im_conn_new(group, host, username, password, statecb, msgcb, userdate);
+}
+
+static void _im_conn_open_proxy(int msg_id, void *userdata)
+{
+    im_conn_t *conn = userdata;
+
+    xmpp_connect_client(conn->xmpp_conn, conn->xmpp_host, 5222,
+                        _xmpp_conn_handler, conn);
+}
+
 IMCORE_API int im_conn_open(im_conn_t *conn)
 {
     if (conn->state != IM_STATE_INIT) {
         return -1;
     }
 
+    if (conn->group) {
+        // ڵ߳Ѿ, ӱ߳Ϸ
+        im_thread_post(conn->signal_thread, 0, _im_conn_open_proxy, 0, conn);
+        return 0;
+    }
+
     xmpp_connect_client(conn->xmpp_conn, conn->xmpp_host, 5222,
                         _xmpp_conn_handler, conn);
 
@@ -90,7 +143,90 @@ IMCORE_API int im_conn_open(im_conn_t *conn)
 
 static void _im_conn_pre_free(im_conn_t *conn)
 {
+    if (conn->xmpp_conn)
+        xmpp_conn_release(conn->xmpp_conn);
+    if (conn->xmpp_ctx)
+        xmpp_ctx_free(conn->xmpp_ctx);
+
+    // ڵ߳
+    if (!conn->group) {
+        if (conn->signal_thread)
+            im_thread_free(conn->signal_thread);
+        if (conn->work_thread)
+            im_thread_free(conn->work_thread);
+    }
+
+    if (conn->xmpp_host)
+        safe_mem_free(conn->xmpp_host);
+    safe_mem_free(conn);
+}
+
+static void _im_conn_free_proxy(int msg_id, void *userdata)
+{
+    _im_conn_pre_free(userdata);
+}
+
+void im_conn_free(im_conn_t *conn)
+{
+    if (conn->group) {
+        // ڵ̻߳, ӵ¼߳ͷ
+        im_thread_send(conn->signal_thread, 0, _im_conn_free_proxy, conn);
+    } else {
+        // ֹͣ߳ͷ
+        im_thread_stop(conn->signal_thread);
+        im_thread_stop(conn->work_thread);
+        _im_conn_pre_free(conn);
+    }
+}
 
+im_conn_group_t *im_conn_group_new(int nthreads)
+{
+    im_conn_group_t *group = safe_mem_calloc(sizeof(im_conn_group_t), NULL);
+    if (!group)
+        return NULL;
+
+    group->executor = im_executor_new(nthreads);
+    if (!group->executor) {
+        safe_mem_free(group);
+        return NULL;
+    }
+
+    group->size = im_executor_get_size(group->executor);
+    group->xmpp_ctxs = safe_mem_calloc(sizeof(xmpp_ctx_t *) * group->size, NULL);
+    if (!group->xmpp_ctxs) {
+        im_conn_group_free(group);
+        return NULL;
+    }
+
+    // һĴSSL_CTX, Ĺ
+    for (int i = 0; i < group->size; i++) {
+        im_thread_t *t = im_executor_get_thread(group->executor, i);
+        im_thread_set_quantum(t, IM_SIGNAL_THREAD_QUANTUM);
+        if (i == 0)
+            group->xmpp_ctxs[i] = xmpp_ctx_new(t, NULL);
+        else
+            group->xmpp_ctxs[i] = xmpp_ctx_fork(group->xmpp_ctxs[0], t);
+        if (!group->xmpp_ctxs[i]) {
+            im_conn_group_free(group);
+            return NULL;
+        }
+    }
+    return group;
+}
+
+void im_conn_group_free(im_conn_group_t *group)
+{
+    // ֹͣ߳, ͷ߳ϵ
+    im_executor_free(group->executor);
+
+    if (group->xmpp_ctxs) {
+        for (int i = 0; i < group->size; i++) {
+            if (group->xmpp_ctxs[i])
+                xmpp_ctx_free(group->xmpp_ctxs[i]);
+        }
+        safe_mem_free(group->xmpp_ctxs);
+    }
+    safe_mem_free(group);
 }
 
 static void _xmpp_conn_handler(xmpp_conn_t *xmpp_conn, xmpp_conn_event_t status,
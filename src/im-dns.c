@@ -0,0 +1,531 @@
+#include "im-dns.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <event2/event.h>
+#include <event2/dns.h>
+#include <event2/util.h>
+
+#ifdef WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#endif
+#ifdef POSIX
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#include "mm.h"
+#include "hash.h"
+#include "im-atomic.h"
+#include "im-thread.h"
+
+// 缓存条目上限, 满了先清理过期的, 还是满的话整个清空
+#define IM_DNS_CACHE_MAX 4096
+// TTL上限, 秒
+#define IM_DNS_MAX_TTL 86400
+// 域名不存在或者没有记录的缓存时间, 秒. 不解析SOA, 使用固定值
+#define IM_DNS_NEGATIVE_TTL 60
+// nameserver没有应答的缓存时间, 秒. 防止DNS故障的时候所有连接反复查询
+#define IM_DNS_FAIL_TTL 5
+// hosts文件里面的地址没有TTL, 秒
+#define IM_DNS_HOSTS_TTL 300
+// 缓存key的长度, 类型前缀加上域名
+#define IM_DNS_KEY_SIZE 320
+
+// 缓存条目, 记录和条目在同一块内存里面
+typedef struct im_dns_entry {
+    uint64_t expire;
+    int result;
+    int count;
+    union {
+        im_srv_record_t srv[1];
+        im_dns_addr_t addr[1];
+    } data;
+} im_dns_entry_t;
+
+struct im_dns_request {
+    struct event_base *base;
+    struct evdns_base *dns;
+    char key[IM_DNS_KEY_SIZE];
+    char host[256];
+    int family;
+
+    // 同一时间只有一个在进行
+    im_srv_request_t *srv;
+    struct evdns_request *query;
+    struct evdns_getaddrinfo_request *gai;
+
+    // 正在调用evdns_getaddrinfo, 同步回调的结果先放在请求里面
+    int calling;
+    int canceled;
+    int result;
+    int count;
+    im_dns_addr_t addrs[IM_DNS_MAX_ADDRS];
+
+    im_dns_srv_cb srv_cb;
+    im_dns_host_cb host_cb;
+    void *userdata;
+};
+
+// 进程共享的缓存, 锁在第一次使用的时候创建
+static im_thread_mutex_t *volatile im_dns_lock = NULL;
+static hash_t *im_dns_cache = NULL;
+
+static uint64_t _im_dns_now_ms()
+{
+#ifdef WIN32
+    return GetTickCount64();
+#endif
+#ifdef POSIX
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static void _im_dns_entry_free(void *p)
+{
+    safe_mem_free(p);
+}
+
+static im_thread_mutex_t *_im_dns_get_lock()
+{
+    im_thread_mutex_t *lock = im_atomic_load_ptr((void *volatile *)&im_dns_lock);
+
+    if (!lock) {
+        lock = im_thread_mutex_create();
+        if (!im_atomic_cas_ptr((void *volatile *)&im_dns_lock, NULL, lock)) {
+            // 其他线程已经创建了
+            im_thread_mutex_destroy(lock);
+            lock = im_atomic_load_ptr((void *volatile *)&im_dns_lock);
+        }
+    }
+    return lock;
+}
+
+// 类型前缀加上小写的域名, 太长的域名不缓存
+static bool _im_dns_make_key(char *key, const char *type, const char *name)
+{
+    size_t tlen = strlen(type), nlen = strlen(name), i;
+
+    if (tlen + nlen + 2 > IM_DNS_KEY_SIZE)
+        return false;
+    memcpy(key, type, tlen);
+    key[tlen] = ' ';
+    for (i = 0; i < nlen; i++)
+        key[tlen + 1 + i] = (char)tolower((unsigned char)name[i]);
+    key[tlen + 1 + nlen] = '\0';
+    return true;
+}
+
+// 找到没有过期的结果返回result并且复制记录, 没有返回-1
+static int _im_dns_cache_get(const char *key, void *out, size_t elem, int max, int *count)
+{
+    im_thread_mutex_t *lock = _im_dns_get_lock();
+    im_dns_entry_t *entry;
+    int result = -1;
+
+    if (!lock)
+        return -1;
+
+    im_thread_mutex_lock(lock);
+    if (im_dns_cache && (entry = hash_get(im_dns_cache, key)) != NULL) {
+        if (entry->expire > _im_dns_now_ms()) {
+            result = entry->result;
+            *count = entry->count < max ? entry->count : max;
+            memcpy(out, &entry->data, elem * *count);
+        } else {
+            hash_drop(im_dns_cache, key);
+        }
+    }
+    im_thread_mutex_unlock(lock);
+    return result;
+}
+
+// 清理过期的条目, 调用者持有锁
+static void _im_dns_cache_evict()
+{
+    hash_iterator_t *iter;
+    const char **keys;
+    const char *key;
+    uint64_t now = _im_dns_now_ms();
+    int n = 0, i;
+
+    keys = safe_mem_malloc(sizeof(char *) * hash_num_keys(im_dns_cache), NULL);
+    iter = hash_iter_new(im_dns_cache);
+    if (keys && iter) {
+        while ((key = hash_iter_next(iter)) != NULL) {
+            im_dns_entry_t *entry = hash_get(im_dns_cache, key);
+            if (entry->expire <= now)
+                keys[n++] = key;
+        }
+    }
+    if (iter)
+        hash_iter_release(iter);
+
+    // key在条目释放之前一直有效
+    for (i = 0; i < n; i++)
+        hash_drop(im_dns_cache, keys[i]);
+    safe_mem_free(keys);
+
+    if (hash_num_keys(im_dns_cache) >= IM_DNS_CACHE_MAX) {
+        hash_release(im_dns_cache);
+        im_dns_cache = NULL;
+    }
+}
+
+static void _im_dns_cache_put(const char *key, int result, const void *data, size_t elem,
+                              int count, unsigned int ttl)
+{
+    im_thread_mutex_t *lock = _im_dns_get_lock();
+    im_dns_entry_t *entry;
+
+    if (!lock || ttl == 0)
+        return;
+    if (ttl > IM_DNS_MAX_TTL)
+        ttl = IM_DNS_MAX_TTL;
+
+    entry = safe_mem_malloc(sizeof(im_dns_entry_t) + elem * count, NULL);
+    if (!entry)
+        return;
+    entry->expire = _im_dns_now_ms() + (uint64_t)ttl * 1000;
+    entry->result = result;
+    entry->count = count;
+    if (count)
+        memcpy(&entry->data, data, elem * count);
+
+    im_thread_mutex_lock(lock);
+    if (im_dns_cache && hash_num_keys(im_dns_cache) >= IM_DNS_CACHE_MAX)
+        _im_dns_cache_evict();
+    if (!im_dns_cache)
+        im_dns_cache = hash_new(64, _im_dns_entry_free);
+    if (!im_dns_cache || hash_add(im_dns_cache, key, entry) != 0)
+        safe_mem_free(entry);
+    im_thread_mutex_unlock(lock);
+}
+
+// RFC 2782: 按priority分组, 组内weight为0的放在前面, 然后按weight加权随机依次选出
+// 输入已经按priority稳定排序
+static void _im_dns_srv_order(im_srv_record_t *records, int count)
+{
+    im_srv_record_t rec;
+    unsigned long sum, running, r;
+    int start, end, i, j, k;
+
+    for (start = 0; start < count; start = end) {
+        for (end = start; end < count && records[end].priority == records[start].priority; end++)
+            ;
+
+        // weight为0的稳定移到组的前面
+        for (i = start, k = start; i < end; i++) {
+            if (records[i].weight == 0) {
+                rec = records[i];
+                for (j = i; j > k; j--)
+                    records[j] = records[j - 1];
+                records[k++] = rec;
+            }
+        }
+
+        for (i = start; i < end - 1; i++) {
+            sum = 0;
+            for (j = i; j < end; j++)
+                sum += records[j].weight;
+
+            // [0, sum]之间均匀选一个数, 选中第一个累计weight不小于它的记录
+            evutil_secure_rng_get_bytes(&r, sizeof(r));
+            r %= sum + 1;
+            running = 0;
+            for (j = i; j < end - 1; j++) {
+                running += records[j].weight;
+                if (running >= r)
+                    break;
+            }
+
+            // 选中的放到第i个, 剩下的保持原来的顺序
+            rec = records[j];
+            for (k = j; k > i; k--)
+                records[k] = records[k - 1];
+            records[i] = rec;
+        }
+    }
+}
+
+static void _im_dns_srv_done(int result, const im_srv_record_t *records, int count,
+                             void *userdata)
+{
+    im_dns_request_t *req = userdata;
+    im_srv_record_t ordered[IM_SRV_MAX_RECORDS];
+    unsigned int ttl;
+    int status, i;
+
+    req->srv = NULL;
+    if (result != 0) {
+        status = IM_DNS_FAIL;
+        ttl = IM_DNS_FAIL_TTL;
+    } else if (count == 0) {
+        status = IM_DNS_NOTFOUND;
+        ttl = IM_DNS_NEGATIVE_TTL;
+    } else {
+        status = IM_DNS_OK;
+        ttl = records[0].ttl;
+        for (i = 1; i < count; i++) {
+            if (records[i].ttl < ttl)
+                ttl = records[i].ttl;
+        }
+    }
+    _im_dns_cache_put(req->key, status, records, sizeof(im_srv_record_t), count, ttl);
+
+    if (count)
+        memcpy(ordered, records, sizeof(im_srv_record_t) * count);
+    _im_dns_srv_order(ordered, count);
+    req->srv_cb(status, ordered, count, req->userdata);
+    safe_mem_free(req);
+}
+
+im_dns_request_t *im_dns_srv_lookup(struct event_base *base, struct evdns_base *dns,
+                                    const char *service, const char *proto,
+                                    const char *domain, im_dns_srv_cb cb, void *userdata)
+{
+    im_srv_record_t records[IM_SRV_MAX_RECORDS];
+    char name[IM_DNS_KEY_SIZE];
+    im_dns_request_t *req;
+    int result, count = 0;
+
+    req = safe_mem_calloc(sizeof(im_dns_request_t), NULL);
+    if (!req || strlen(service) + strlen(proto) + strlen(domain) + 5 > sizeof(name)) {
+        safe_mem_free(req);
+        cb(IM_DNS_FAIL, NULL, 0, userdata);
+        return NULL;
+    }
+
+    sprintf(name, "_%s._%s.%s", service, proto, domain);
+    if (_im_dns_make_key(req->key, "SRV", name)) {
+        result = _im_dns_cache_get(req->key, records, sizeof(im_srv_record_t),
+                                   IM_SRV_MAX_RECORDS, &count);
+        if (result >= 0) {
+            safe_mem_free(req);
+            _im_dns_srv_order(records, count);
+            cb(result, records, count, userdata);
+            return NULL;
+        }
+    }
+
+    req->base = base;
+    req->dns = dns;
+    req->srv_cb = cb;
+    req->userdata = userdata;
+    req->srv = im_srv_lookup_async(base, dns, service, proto, domain, _im_dns_srv_done, req);
+    if (!req->srv) {
+        safe_mem_free(req);
+        cb(IM_DNS_FAIL, NULL, 0, userdata);
+        return NULL;
+    }
+    return req;
+}
+
+// 地址查询结束, 放进缓存以后回调
+static void _im_dns_host_complete(im_dns_request_t *req, unsigned int ttl)
+{
+    int status = req->count > 0 ? IM_DNS_OK : req->result;
+
+    if (status == IM_DNS_NOTFOUND)
+        ttl = IM_DNS_NEGATIVE_TTL;
+    else if (status == IM_DNS_FAIL)
+        ttl = IM_DNS_FAIL_TTL;
+    _im_dns_cache_put(req->key, status, req->addrs, sizeof(im_dns_addr_t), req->count, ttl);
+
+    req->host_cb(status, req->addrs, req->count, req->userdata);
+    safe_mem_free(req);
+}
+
+static void _im_dns_gai_done(int err, struct evutil_addrinfo *res, void *arg)
+{
+    im_dns_request_t *req = arg;
+    struct evutil_addrinfo *ai;
+
+    if (err == EVUTIL_EAI_CANCEL) {
+        safe_mem_free(req);
+        return;
+    }
+    req->gai = NULL;
+    // 名字不存在以外的错误按nameserver出错缓存
+    if (err != 0 && err != EVUTIL_EAI_NONAME)
+        req->result = IM_DNS_FAIL;
+
+    for (ai = res; ai && req->count < IM_DNS_MAX_ADDRS; ai = ai->ai_next) {
+        im_dns_addr_t *addr = &req->addrs[req->count];
+        if (ai->ai_family == AF_INET && req->family == AF_INET) {
+            addr->family = AF_INET;
+            memcpy(addr->addr, &((struct sockaddr_in *)ai->ai_addr)->sin_addr, 4);
+            req->count++;
+        } else if (ai->ai_family == AF_INET6 && req->family == AF_INET6) {
+            addr->family = AF_INET6;
+            memcpy(addr->addr, &((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr, 16);
+            req->count++;
+        }
+    }
+    if (res)
+        evutil_freeaddrinfo(res);
+
+    if (!req->calling)
+        _im_dns_host_complete(req, IM_DNS_HOSTS_TTL);
+}
+
+// 域名不存在的时候再用getaddrinfo查一次, 主要是hosts文件里面的名字. 返回true表示还在进行.
+// 同样的nameserver刚刚回答过不存在, 这里查到的地址基本只会来自hosts文件, 所以用hosts的TTL
+static bool _im_dns_hosts_lookup(im_dns_request_t *req)
+{
+    struct evdns_getaddrinfo_request *gai;
+    struct evutil_addrinfo hints;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = req->family;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    req->calling = 1;
+    gai = evdns_getaddrinfo(req->dns, req->host, NULL, &hints, _im_dns_gai_done, req);
+    req->calling = 0;
+    if (gai) {
+        req->gai = gai;
+        return true;
+    }
+
+    // 已经同步回调过
+    _im_dns_host_complete(req, IM_DNS_HOSTS_TTL);
+    return false;
+}
+
+static void _im_dns_host_done(int result, char type, int count, int ttl, void *addresses,
+                              void *arg)
+{
+    im_dns_request_t *req = arg;
+    size_t alen = req->family == AF_INET6 ? 16 : 4;
+    int i;
+
+    req->query = NULL;
+    if (result == DNS_ERR_CANCEL || req->canceled) {
+        safe_mem_free(req);
+        return;
+    }
+
+    if (result == DNS_ERR_NONE && count > 0) {
+        for (i = 0; i < count && i < IM_DNS_MAX_ADDRS; i++) {
+            req->addrs[i].family = req->family;
+            memcpy(req->addrs[i].addr, (char *)addresses + i * alen, alen);
+        }
+        req->count = i;
+        _im_dns_host_complete(req, ttl > 0 ? (unsigned int)ttl : 0);
+        return;
+    }
+
+    // nameserver没有应答或者出错的时候不再查一次, getaddrinfo会再问同样的nameserver,
+    // 连接的延迟翻倍
+    if (result != DNS_ERR_NOTEXIST && result != DNS_ERR_NONE) {
+        req->result = IM_DNS_FAIL;
+        _im_dns_host_complete(req, IM_DNS_FAIL_TTL);
+        return;
+    }
+    req->result = IM_DNS_NOTFOUND;
+    _im_dns_hosts_lookup(req);
+}
+
+im_dns_request_t *im_dns_host_lookup(struct event_base *base, struct evdns_base *dns,
+                                     const char *host, int family, im_dns_host_cb cb,
+                                     void *userdata)
+{
+    im_dns_request_t *req;
+    im_dns_addr_t addrs[IM_DNS_MAX_ADDRS];
+    int result, count = 0;
+
+    // 数字地址
+    memset(addrs, 0, sizeof(im_dns_addr_t));
+    addrs[0].family = family;
+    if (evutil_inet_pton(family, host, addrs[0].addr) == 1) {
+        cb(IM_DNS_OK, addrs, 1, userdata);
+        return NULL;
+    }
+
+    req = safe_mem_calloc(sizeof(im_dns_request_t), NULL);
+    if (!req || strlen(host) >= sizeof(req->host) ||
+        !_im_dns_make_key(req->key, family == AF_INET6 ? "AAAA" : "A", host)) {
+        safe_mem_free(req);
+        cb(IM_DNS_FAIL, NULL, 0, userdata);
+        return NULL;
+    }
+
+    result = _im_dns_cache_get(req->key, addrs, sizeof(im_dns_addr_t), IM_DNS_MAX_ADDRS, &count);
+    if (result >= 0) {
+        safe_mem_free(req);
+        cb(result, addrs, count, userdata);
+        return NULL;
+    }
+
+    req->base = base;
+    req->dns = dns;
+    req->family = family;
+    strcpy(req->host, host);
+    req->host_cb = cb;
+    req->userdata = userdata;
+
+    if (family == AF_INET6)
+        req->query = evdns_base_resolve_ipv6(dns, host, 0, _im_dns_host_done, req);
+    else
+        req->query = evdns_base_resolve_ipv4(dns, host, 0, _im_dns_host_done, req);
+    if (req->query)
+        return req;
+
+    req->result = IM_DNS_FAIL;
+    _im_dns_host_complete(req, IM_DNS_FAIL_TTL);
+    return NULL;
+}
+
+void im_dns_cancel(im_dns_request_t *req)
+{
+    if (req->srv) {
+        im_srv_cancel(req->srv);
+        safe_mem_free(req);
+        return;
+    }
+
+    // evdns取消以后还会回调一次, 在回调里面释放
+    req->canceled = 1;
+    if (req->query)
+        evdns_cancel_request(req->dns, req->query);
+    else if (req->gai)
+        evdns_getaddrinfo_cancel(req->gai);
+}
+
+void im_dns_cache_clear(void)
+{
+    im_thread_mutex_t *lock = _im_dns_get_lock();
+
+    if (!lock)
+        return;
+    im_thread_mutex_lock(lock);
+    if (im_dns_cache) {
+        hash_release(im_dns_cache);
+        im_dns_cache = NULL;
+    }
+    im_thread_mutex_unlock(lock);
+}
+
+int im_dns_cache_size(void)
+{
+    im_thread_mutex_t *lock = _im_dns_get_lock();
+    int n = 0;
+
+    if (!lock)
+        return 0;
+    im_thread_mutex_lock(lock);
+    if (im_dns_cache)
+        n = hash_num_keys(im_dns_cache);
+    im_thread_mutex_unlock(lock);
+    return n;
+}
@@ -0,0 +1,122 @@
+/*
+* im-dns.h
+* 进程共享的DNS缓存, SRV记录和服务器地址都按TTL缓存, 没有记录的结果也缓存
+* 缓存加锁, 可以在任意IM线程上使用, 查询和回调在调用者的event_base上进行
+*/
+#ifndef _IMCORE_DNS_H
+#define _IMCORE_DNS_H
+
+#include "srv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct event_base;
+struct evdns_base;
+
+// 查询结果
+#define IM_DNS_OK 0             // 有记录
+#define IM_DNS_NOTFOUND 1       // 域名不存在或者没有这种记录
+#define IM_DNS_FAIL 2           // nameserver没有应答或者出错
+
+// 一个域名最多保留的地址数量
+#define IM_DNS_MAX_ADDRS 16
+
+/**
+ * @brief 服务器地址
+ */
+typedef struct im_dns_addr {
+    int family;                 // AF_INET 或者 AF_INET6
+    unsigned char addr[16];     // 网络字节序, ipv4只用前4个字节
+} im_dns_addr_t;
+
+/**
+ * @brief 查询指针
+ */
+typedef struct im_dns_request im_dns_request_t;
+
+/**
+ * @brief SRV查询回调
+ * @details 记录已经按RFC 2782排好顺序: priority从小到大, 相同priority按weight随机排列,
+ * 每次查询的顺序都重新计算, 同一个缓存结果的连接会分散到不同的服务器.
+ *
+ * @param result IM_DNS_OK IM_DNS_NOTFOUND IM_DNS_FAIL
+ * @param records 排好顺序的记录
+ * @param count 记录数量
+ * @param userdata 自定义数据
+ */
+typedef void(*im_dns_srv_cb)(int result, const im_srv_record_t *records, int count,
+                             void *userdata);
+
+/**
+ * @brief 地址查询回调
+ *
+ * @param result IM_DNS_OK IM_DNS_NOTFOUND IM_DNS_FAIL
+ * @param addrs 地址
+ * @param count 地址数量
+ * @param userdata 自定义数据
+ */
+typedef void(*im_dns_host_cb)(int result, const im_dns_addr_t *addrs, int count,
+                              void *userdata);
+
+/**
+ * @brief 查询_service._proto.domain的SRV记录
+ * @details 缓存里面有没过期的结果时直接回调并且返回NULL, 否则在base上异步查询,
+ * 结果按记录里面最小的TTL缓存.
+ *
+ * @param base 回调所在的event_base
+ * @param dns 提供nameserver配置
+ * @param service 服务名, 比如xmpp-client
+ * @param proto 协议, 比如tcp
+ * @param domain 域名
+ * @param cb 回调
+ * @param userdata 自定义数据
+ * @return im_dns_request_t* 或者 NULL 表示已经回调
+ */
+im_dns_request_t *im_dns_srv_lookup(struct event_base *base, struct evdns_base *dns,
+                                    const char *service, const char *proto,
+                                    const char *domain, im_dns_srv_cb cb, void *userdata);
+
+/**
+ * @brief 查询主机地址
+ * @details 数字地址和缓存里面的结果直接回调并且返回NULL. 域名不存在的时候再查一次hosts文件,
+ *          nameserver没有应答或者出错的时候直接报告IM_DNS_FAIL.
+ *
+ * @param base 回调所在的event_base
+ * @param dns 使用的evdns
+ * @param host 主机名或者数字地址
+ * @param family AF_INET 或者 AF_INET6
+ * @param cb 回调
+ * @param userdata 自定义数据
+ * @return im_dns_request_t* 或者 NULL 表示已经回调
+ */
+im_dns_request_t *im_dns_host_lookup(struct event_base *base, struct evdns_base *dns,
+                                     const char *host, int family, im_dns_host_cb cb,
+                                     void *userdata);
+
+/**
+ * @brief 取消还没有完成的查询
+ * @details 取消以后不会再回调.
+ *
+ * @param req 查询指针
+ */
+void im_dns_cancel(im_dns_request_t *req);
+
+/**
+ * @brief 清空缓存
+ */
+void im_dns_cache_clear(void);
+
+/**
+ * @brief 缓存的条目数量, 包括已经过期还没有清理的
+ *
+ * @return 条目数量
+ */
+int im_dns_cache_size(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _IMCORE_DNS_H
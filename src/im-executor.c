@@ -0,0 +1,391 @@
+#include "im-executor.h"
+
+#include <assert.h>
+
+#ifdef POSIX
+#include <unistd.h>
+#endif
+
+#include "mm.h"
+#include "im-atomic.h"
+
+// 每个工作线程本地队列的容量, 必须是2的幂
+#define IM_EXECUTOR_DEQUE_SIZE 1024
+#define IM_EXECUTOR_DEQUE_MASK (IM_EXECUTOR_DEQUE_SIZE - 1)
+
+// 每次调度最多执行的任务数, 执行完让出事件循环处理I/O
+#define IM_EXECUTOR_BATCH 64
+
+// 任务
+typedef struct im_executor_task {
+    int msg_id;
+    im_thread_msg_handler handler;
+    void *userdata;
+} im_executor_task_t;
+
+// Chase-Lev双端队列, 固定容量
+// 所属线程在bottom端push/pop, 其他线程在top端窃取
+typedef struct im_executor_deque {
+    volatile long top;
+    volatile long bottom;
+    im_executor_task_t *volatile tasks[IM_EXECUTOR_DEQUE_SIZE];
+} im_executor_deque_t;
+
+// 工作线程
+typedef struct im_executor_worker {
+    im_executor_t *executor;
+    im_thread_t *thread;
+    int index;
+    im_executor_deque_t deque;
+    // 邮箱里面是否已经有调度消息
+    volatile long scheduled;
+    // 是否空闲, 空闲的线程可以被其他线程唤醒去窃取任务
+    volatile long idle;
+} im_executor_worker_t;
+
+struct im_executor {
+    int size;
+    im_executor_worker_t *workers;
+    // 外部提交轮流分配的序号
+    volatile long next;
+    // 空闲线程数量
+    volatile long idle_count;
+    // 正在释放, 不再接受任务
+    volatile long closing;
+};
+
+static bool _im_executor_deque_push(im_executor_deque_t *dq, im_executor_task_t *task)
+{
+    long b = im_atomic_load(&dq->bottom);
+    long t = im_atomic_load(&dq->top);
+
+    if (b - t >= IM_EXECUTOR_DEQUE_SIZE)
+        return false;
+    im_atomic_store_ptr((void *volatile *)&dq->tasks[b & IM_EXECUTOR_DEQUE_MASK], task);
+    im_atomic_store(&dq->bottom, b + 1);
+    return true;
+}
+
+// 只有所属线程调用
+static im_executor_task_t *_im_executor_deque_pop(im_executor_deque_t *dq)
+{
+    im_executor_task_t *task;
+    long b = im_atomic_load(&dq->bottom) - 1;
+    long t;
+
+    im_atomic_store(&dq->bottom, b);
+    t = im_atomic_load(&dq->top);
+    if (t > b) {
+        // 队列为空
+        im_atomic_store(&dq->bottom, b + 1);
+        return NULL;
+    }
+
+    task = im_atomic_load_ptr((void *volatile *)&dq->tasks[b & IM_EXECUTOR_DEQUE_MASK]);
+    if (t == b) {
+        // 最后一个任务, 和窃取线程竞争
+        if (!im_atomic_cas(&dq->top, t, t + 1))
+            task = NULL;
+        im_atomic_store(&dq->bottom, b + 1);
+    }
+    return task;
+}
+
+// 任意线程调用, 竞争失败也返回NULL
+static im_executor_task_t *_im_executor_deque_steal(im_executor_deque_t *dq)
+{
+    im_executor_task_t *task;
+    long t = im_atomic_load(&dq->top);
+    long b = im_atomic_load(&dq->bottom);
+
+    if (t >= b)
+        return NULL;
+    task = im_atomic_load_ptr((void *volatile *)&dq->tasks[t & IM_EXECUTOR_DEQUE_MASK]);
+    if (!im_atomic_cas(&dq->top, t, t + 1))
+        return NULL;
+    return task;
+}
+
+static bool _im_executor_deque_empty(im_executor_deque_t *dq)
+{
+    return im_atomic_load(&dq->bottom) - im_atomic_load(&dq->top) <= 0;
+}
+
+static void _im_executor_task_run(im_executor_task_t *task)
+{
+    task->handler(task->msg_id, task->userdata);
+    safe_mem_free(task);
+}
+
+static void _im_executor_work(int msg_id, void *userdata);
+
+// 保证工作线程的邮箱里面有一个调度消息
+static void _im_executor_schedule(im_executor_worker_t *w)
+{
+    if (im_atomic_xchg(&w->scheduled, 1) == 0) {
+        im_thread_post(w->thread, 0, _im_executor_work, 0, w);
+    }
+}
+
+static void _im_executor_set_busy(im_executor_worker_t *w)
+{
+    if (im_atomic_cas(&w->idle, 1, 0))
+        im_atomic_dec(&w->executor->idle_count);
+}
+
+static void _im_executor_set_idle(im_executor_worker_t *w)
+{
+    if (im_atomic_cas(&w->idle, 0, 1))
+        im_atomic_inc(&w->executor->idle_count);
+}
+
+// 有新任务入队以后唤醒一个空闲的兄弟线程来窃取
+static void _im_executor_nudge(im_executor_t *ex, im_executor_worker_t *self)
+{
+    if (im_atomic_load(&ex->idle_count) <= 0)
+        return;
+
+    for (int i = 1; i < ex->size; i++) {
+        im_executor_worker_t *w = &ex->workers[(self->index + i) % ex->size];
+        if (im_atomic_cas(&w->idle, 1, 0)) {
+            im_atomic_dec(&ex->idle_count);
+            _im_executor_schedule(w);
+            return;
+        }
+    }
+}
+
+// 从兄弟线程窃取一个任务
+static im_executor_task_t *_im_executor_steal(im_executor_worker_t *self)
+{
+    im_executor_t *ex = self->executor;
+    im_executor_task_t *task;
+
+    for (int i = 1; i < ex->size; i++) {
+        im_executor_worker_t *w = &ex->workers[(self->index + i) % ex->size];
+        task = _im_executor_deque_steal(&w->deque);
+        if (task)
+            return task;
+    }
+    return NULL;
+}
+
+static bool _im_executor_has_work(im_executor_t *ex)
+{
+    for (int i = 0; i < ex->size; i++) {
+        if (!_im_executor_deque_empty(&ex->workers[i].deque))
+            return true;
+    }
+    return false;
+}
+
+// 调度消息处理函数, 先执行本地任务, 本地没有再去窃取
+static void _im_executor_work(int msg_id, void *userdata)
+{
+    im_executor_worker_t *w = userdata;
+    im_executor_t *ex = w->executor;
+    im_executor_task_t *task;
+    int n = 0;
+
+    im_atomic_xchg(&w->scheduled, 0);
+    _im_executor_set_busy(w);
+
+    while (n < IM_EXECUTOR_BATCH) {
+        task = _im_executor_deque_pop(&w->deque);
+        if (!task)
+            task = _im_executor_steal(w);
+        if (!task)
+            break;
+        _im_executor_task_run(task);
+        n++;
+    }
+
+    if (n == IM_EXECUTOR_BATCH) {
+        // 还有任务, 让出循环以后继续
+        _im_executor_schedule(w);
+        return;
+    }
+
+    // 进入空闲以后再检查一次, 防止错过标记空闲之前入队的任务
+    _im_executor_set_idle(w);
+    if (_im_executor_has_work(ex)) {
+        _im_executor_set_busy(w);
+        _im_executor_schedule(w);
+    }
+}
+
+// 在工作线程上把任务放进本地队列
+static void _im_executor_push_local(im_executor_worker_t *w, im_executor_task_t *task)
+{
+    if (!_im_executor_deque_push(&w->deque, task)) {
+        // 本地队列已满, 直接执行
+        _im_executor_task_run(task);
+        return;
+    }
+    _im_executor_schedule(w);
+    _im_executor_nudge(w->executor, w);
+}
+
+// 外部提交的任务通过邮箱转交给工作线程
+static void _im_executor_inject(int msg_id, void *userdata)
+{
+    im_executor_task_t *task = userdata;
+    im_executor_worker_t *w = im_thread_get_userdata(NULL);
+
+    _im_executor_push_local(w, task);
+}
+
+// 释放之前执行完当前线程所有的任务
+static void _im_executor_flush(int msg_id, void *userdata)
+{
+    im_executor_worker_t *w = userdata;
+    im_executor_task_t *task;
+
+    while ((task = _im_executor_deque_pop(&w->deque)) != NULL) {
+        _im_executor_task_run(task);
+    }
+}
+
+static im_executor_worker_t *_im_executor_current_worker(im_executor_t *ex)
+{
+    im_thread_t *current = im_thread_current();
+    if (!current)
+        return NULL;
+
+    for (int i = 0; i < ex->size; i++) {
+        if (ex->workers[i].thread == current)
+            return &ex->workers[i];
+    }
+    return NULL;
+}
+
+static int _im_executor_cpu_count()
+{
+#ifdef WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#endif
+#ifdef POSIX
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+im_executor_t *im_executor_new(int nworkers)
+{
+    im_executor_t *ex;
+    int i;
+
+    if (nworkers <= 0)
+        nworkers = _im_executor_cpu_count();
+
+    ex = safe_mem_calloc(sizeof(im_executor_t), NULL);
+    if (!ex)
+        return NULL;
+
+    ex->workers = safe_mem_calloc(sizeof(im_executor_worker_t) * nworkers, NULL);
+    if (!ex->workers) {
+        safe_mem_free(ex);
+        return NULL;
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        im_executor_worker_t *w = &ex->workers[i];
+        w->executor = ex;
+        w->index = i;
+        w->idle = 1;
+        w->thread = im_thread_new();
+        if (!w->thread)
+            break;
+    }
+    ex->size = i;
+    ex->idle_count = i;
+
+    if (ex->size < nworkers) {
+        for (i = 0; i < ex->size; i++)
+            im_thread_free(ex->workers[i].thread);
+        safe_mem_free(ex->workers);
+        safe_mem_free(ex);
+        return NULL;
+    }
+
+    for (i = 0; i < ex->size; i++) {
+        im_thread_start(ex->workers[i].thread, &ex->workers[i]);
+    }
+    return ex;
+}
+
+void im_executor_free(im_executor_t *ex)
+{
+    im_executor_task_t *task;
+    int i;
+
+    // 不能在工作线程里面释放
+    assert(!_im_executor_current_worker(ex));
+
+    im_atomic_store(&ex->closing, 1);
+
+    // 邮箱先进先出, send返回的时候之前转交的任务都已经入队, 执行完本地队列
+    for (i = 0; i < ex->size; i++) {
+        im_thread_send(ex->workers[i].thread, 0, _im_executor_flush, &ex->workers[i]);
+    }
+
+    for (i = 0; i < ex->size; i++) {
+        im_thread_free(ex->workers[i].thread);
+    }
+
+    // 线程都已经停止, 释放期间还在执行的任务新提交的任务直接丢弃
+    for (i = 0; i < ex->size; i++) {
+        while ((task = _im_executor_deque_pop(&ex->workers[i].deque)) != NULL) {
+            safe_mem_free(task);
+        }
+    }
+
+    safe_mem_free(ex->workers);
+    safe_mem_free(ex);
+}
+
+int im_executor_get_size(im_executor_t *ex)
+{
+    return ex->size;
+}
+
+im_thread_t *im_executor_get_thread(im_executor_t *ex, int index)
+{
+    if (index < 0 || index >= ex->size)
+        return NULL;
+    return ex->workers[index].thread;
+}
+
+im_thread_t *im_executor_next_thread(im_executor_t *ex)
+{
+    unsigned long n = (unsigned long)im_atomic_inc(&ex->next);
+    return ex->workers[n % ex->size].thread;
+}
+
+bool im_executor_submit(im_executor_t *ex, int msg_id, im_thread_msg_handler handler,
+                        void *userdata)
+{
+    im_executor_worker_t *w;
+    im_executor_task_t *task;
+
+    if (im_atomic_load(&ex->closing))
+        return false;
+
+    task = safe_mem_malloc(sizeof(im_executor_task_t), NULL);
+    if (!task)
+        return false;
+    task->msg_id = msg_id;
+    task->handler = handler;
+    task->userdata = userdata;
+
+    w = _im_executor_current_worker(ex);
+    if (w) {
+        _im_executor_push_local(w, task);
+    } else {
+        // 本地队列只能由所属线程push, 外部任务通过邮箱转交
+        im_thread_post(im_executor_next_thread(ex), msg_id, _im_executor_inject, 0, task);
+    }
+    return true;
+}
@@ -0,0 +1,82 @@
+/*
+* im-executor.h
+* 共享线程池, 固定数量的IM线程, 每个线程带一个work-stealing双端队列
+*/
+#ifndef _IMCORE_EXECUTOR_H
+#define _IMCORE_EXECUTOR_H
+
+#include "im-thread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief 线程池指针
+ */
+typedef struct im_executor im_executor_t;
+
+/**
+ * @brief 创建线程池并且启动所有工作线程
+ * @details 工作线程就是普通的IM线程, 可以直接把连接的事件循环放在上面.
+ * 提交给线程池的任务进入工作线程的本地队列, 空闲的工作线程会从其他线程的队列里面窃取任务.
+ *
+ * @param nworkers 工作线程数量, 小于等于0表示使用CPU核数
+ * @return im_executor_t* 或者 NULL
+ */
+im_executor_t *im_executor_new(int nworkers);
+
+/**
+ * @brief 释放线程池
+ * @details 释放以后不再接受新任务, 已经提交的任务会执行完, 然后停止并释放所有工作线程.
+ * 不能在工作线程里面调用.
+ *
+ * @param ex 线程池指针
+ */
+void im_executor_free(im_executor_t *ex);
+
+/**
+ * @brief 获取工作线程数量
+ *
+ * @param ex 线程池指针
+ * @return 工作线程数量
+ */
+int im_executor_get_size(im_executor_t *ex);
+
+/**
+ * @brief 获取指定的工作线程
+ *
+ * @param ex 线程池指针
+ * @param index 工作线程序号
+ * @return im_thread_t* 或者 NULL 序号越界
+ */
+im_thread_t *im_executor_get_thread(im_executor_t *ex, int index);
+
+/**
+ * @brief 轮流获取工作线程
+ * @details 用于把连接分散固定到工作线程上, 多个连接共用一个线程的事件循环.
+ *
+ * @param ex 线程池指针
+ * @return im_thread_t*
+ */
+im_thread_t *im_executor_next_thread(im_executor_t *ex);
+
+/**
+ * @brief 提交一个任务
+ * @details 在工作线程里面提交的任务放进当前线程的本地队列, 其他线程提交的任务轮流分配给工作线程.
+ * 任务不保证执行顺序, 也不保证在哪个工作线程执行. 本地队列满的时候直接在当前线程执行.
+ *
+ * @param ex 线程池指针
+ * @param msg_id 消息id
+ * @param handler 任务处理函数
+ * @param userdata 自定义数据
+ * @return true 表示已经提交, false 表示线程池正在释放或者内存不足
+ */
+bool im_executor_submit(im_executor_t *ex, int msg_id, im_thread_msg_handler handler,
+                        void *userdata);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _IMCORE_EXECUTOR_H
@@ -12,6 +12,8 @@
 
 #include "mm.h"
 #include "im-thread.h"
+#include "im-executor.h"
+#include "im-atomic.h"
 #include "xmpp.h"
 #include "stringutils.h"
 
@@ -19,7 +21,19 @@
 #include "im-msg-text.h"
 #include "im-msg-file.h"
 
+struct im_conn_group {
+    // 组内连接共享的工作线程
+    im_executor_t *executor;
+    // 每个工作线程一个xmpp上下文, 共享SSL_CTX
+    xmpp_ctx_t **xmpp_ctxs;
+    int size;
+    // 新连接轮流分配到工作线程
+    volatile long next;
+};
+
 struct im_conn {
+    // 所属连接组, NULL表示连接独占线程
+    im_conn_group_t *group;
     xmpp_ctx_t  *xmpp_ctx;
     xmpp_conn_t *xmpp_conn;
     char *xmpp_host;
@@ -7,6 +7,8 @@
 
 #include "list.h"
 #include "mm.h"
+#include "im-atomic.h"
+#include "im-timer.h"
 
 // 线程本地变量，用于保存struct im_thread指针
 #ifdef WIN32
@@ -16,15 +18,60 @@ DWORD thread_key_;
 pthread_key_t thread_key_;
 #endif
 
+struct im_thread_call;
+
 // 线程消息
 typedef struct im_thread_msg {
     int msg_id;
     im_thread_msg_handler handler;
     void *userdata;
-    struct event *pos_ev;
+    // send消息的完成槽, 处理完需要通知发送线程. post消息为NULL
+    struct im_thread_call *call;
+    // 延时, 毫秒. 延时消息先进邮箱, 由所属线程放到时间轮上
+    long delay;
+    // 延时消息的定时器以及链表节点
+    im_timer_t timer;
     struct list_head msg_node;
+    // 邮箱链表节点
+    struct im_thread_msg *volatile next;
 } im_thread_msg_t;
 
+// 无锁多生产者单消费者邮箱(Vyukov MPSC队列)
+// 任意线程都可以push, 只有所属线程pop. 只在邮箱由空变成非空时激活一次wakeup事件
+typedef struct im_thread_mailbox {
+    // 生产者端, 指向最后入队的消息
+    im_thread_msg_t *volatile head;
+    // 消费者端, 只有所属线程访问
+    im_thread_msg_t *tail;
+    // 哨兵节点
+    im_thread_msg_t stub;
+    // wakeup事件是否已经激活, 消费者处理期间保持为1
+    volatile long signaled;
+    // 持久的wakeup事件, 由生产者event_active
+    struct event *wakeup_ev;
+    // 配额用完以后让出循环使用的0超时定时器
+    struct event *yield_ev;
+} im_thread_mailbox_t;
+
+// 同步调用的完成槽, 分配在调用者的栈上
+// 每次调用独立的锁和条件变量, 多个线程同时send给同一个线程也不会互相抢走通知
+typedef struct im_thread_call {
+    // 内嵌消息, 不需要分配内存
+    im_thread_msg_t msg;
+    volatile long done;
+#ifdef WIN32
+    SRWLOCK lock;
+    CONDITION_VARIABLE cond;
+#endif
+#ifdef POSIX
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+} im_thread_call_t;
+
+// 等待完成之前自旋检查的次数, 处理函数很短的时候可以避免进入内核
+#define IM_THREAD_CALL_SPIN 2000
+
 // 线程结构
 struct im_thread {
     bool wraped;
@@ -32,36 +79,229 @@ struct im_thread {
     void *userdata;
 #ifdef POSIX
     pthread_t thread_handle;
-    pthread_cond_t signal;
 #endif
 #ifdef WIN32
     HANDLE thread_handle;
-    HANDLE signal;
 #endif
     // 每个线程拥有一个eventbase
     struct event_base *base;
-    // 待处理的消息列表
+    // 待处理的延时消息列表, 只有所属线程访问
     struct list_head msg_head;
+    // 延时消息的时间轮
+    im_timer_wheel_t *timers;
+    // 无延时消息邮箱
+    im_thread_mailbox_t mailbox;
+    // 每次唤醒最多处理的邮箱消息数, 0表示不限制
+    volatile long quantum;
     // 线程锁
     im_thread_mutex_t *m_lock;
 
 };
 
-static void _im_thread_msg_free(im_thread_t *t)
+static void _im_thread_mailbox_init(im_thread_mailbox_t *mb)
 {
-    im_thread_mutex_lock(t->m_lock);
+    mb->stub.next = NULL;
+    mb->head = &mb->stub;
+    mb->tail = &mb->stub;
+    mb->signaled = 0;
+    mb->wakeup_ev = NULL;
+    mb->yield_ev = NULL;
+}
+
+// 入队, 任意线程调用
+static void _im_thread_mailbox_push(im_thread_mailbox_t *mb, im_thread_msg_t *msg)
+{
+    im_thread_msg_t *prev;
+
+    msg->next = NULL;
+    prev = im_atomic_xchg_ptr((void *volatile *)&mb->head, msg);
+    // prev->next写入之前消费者会看到一个暂时断开的链表, pop会返回NULL
+    im_atomic_store_ptr((void *volatile *)&prev->next, msg);
+}
+
+// 出队, 只有所属线程调用. 返回NULL表示队列为空或者生产者正在入队
+static im_thread_msg_t *_im_thread_mailbox_pop(im_thread_mailbox_t *mb)
+{
+    im_thread_msg_t *tail = mb->tail;
+    im_thread_msg_t *next = im_atomic_load_ptr((void *volatile *)&tail->next);
+
+    // 跳过哨兵
+    if (tail == &mb->stub) {
+        if (!next)
+            return NULL;
+        mb->tail = next;
+        tail = next;
+        next = im_atomic_load_ptr((void *volatile *)&next->next);
+    }
+    if (next) {
+        mb->tail = next;
+        return tail;
+    }
+
+    // tail是最后一个节点, 把哨兵放回队尾以后才能取出
+    if (tail != im_atomic_load_ptr((void *volatile *)&mb->head))
+        return NULL;
+    _im_thread_mailbox_push(mb, &mb->stub);
+    next = im_atomic_load_ptr((void *volatile *)&tail->next);
+    if (next) {
+        mb->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+// 通知所属线程处理邮箱
+static void _im_thread_mailbox_signal(im_thread_mailbox_t *mb)
+{
+    // 只有第一个把signaled从0置1的生产者需要激活事件
+    if (im_atomic_xchg(&mb->signaled, 1) == 0) {
+        event_active(mb->wakeup_ev, EV_READ, 0);
+    }
+}
+
+static void _im_thread_call_init(im_thread_call_t *call)
+{
+    call->done = 0;
+#ifdef WIN32
+    InitializeSRWLock(&call->lock);
+    InitializeConditionVariable(&call->cond);
+#endif
+#ifdef POSIX
+    pthread_mutex_init(&call->lock, NULL);
+    pthread_cond_init(&call->cond, NULL);
+#endif
+}
+
+// 处理线程调用, 解锁以后不能再访问call, 调用者可能已经返回
+static void _im_thread_call_complete(im_thread_call_t *call)
+{
+#ifdef WIN32
+    AcquireSRWLockExclusive(&call->lock);
+    im_atomic_store(&call->done, 1);
+    WakeConditionVariable(&call->cond);
+    ReleaseSRWLockExclusive(&call->lock);
+#endif
+#ifdef POSIX
+    pthread_mutex_lock(&call->lock);
+    im_atomic_store(&call->done, 1);
+    pthread_cond_signal(&call->cond);
+    pthread_mutex_unlock(&call->lock);
+#endif
+}
+
+// 调用线程等待完成
+static void _im_thread_call_wait(im_thread_call_t *call)
+{
+    int spin;
+
+    for (spin = 0; spin < IM_THREAD_CALL_SPIN; spin++) {
+        if (im_atomic_load(&call->done))
+            break;
+    }
+
+    // 即使自旋看到了done也要加锁一次, 保证处理线程已经离开临界区
+#ifdef WIN32
+    AcquireSRWLockExclusive(&call->lock);
+    while (!im_atomic_load(&call->done)) {
+        SleepConditionVariableSRW(&call->cond, &call->lock, INFINITE, 0);
+    }
+    ReleaseSRWLockExclusive(&call->lock);
+#endif
+#ifdef POSIX
+    pthread_mutex_lock(&call->lock);
+    while (!im_atomic_load(&call->done)) {
+        pthread_cond_wait(&call->cond, &call->lock);
+    }
+    pthread_mutex_unlock(&call->lock);
+
+    pthread_cond_destroy(&call->cond);
+    pthread_mutex_destroy(&call->lock);
+#endif
+}
+
+static void _im_thread_msg_run(im_thread_t *t, im_thread_msg_t *msg);
+
+// 延时消息到期
+static void _im_thread_timer_cb(im_timer_t *timer, void *userdata)
+{
+    im_thread_msg_t *msg = userdata;
+
+    list_del(&msg->msg_node);
+    _im_thread_msg_run(im_thread_current(), msg);
+}
+
+// 延时消息放到时间轮上, 只在所属线程调用
+static void _im_thread_msg_schedule(im_thread_t *t, im_thread_msg_t *msg)
+{
+    list_add(&msg->msg_node, &t->msg_head);
+    im_timer_init(&msg->timer, _im_thread_timer_cb, msg);
+    im_timer_add(t->timers, &msg->timer, msg->delay);
+}
+
+static void _im_thread_msg_run(im_thread_t *t, im_thread_msg_t *msg)
+{
+    msg->handler(msg->msg_id, msg->userdata);
+    if (msg->call) {
+        // 完成槽在调用者栈上, 不需要释放
+        _im_thread_call_complete(msg->call);
+    } else {
+        safe_mem_free(msg);
+    }
+}
 
+// wakeup事件回调, 每次最多处理quantum条消息
+static void _im_thread_mailbox_cb(evutil_socket_t fd, short what, void *arg)
+{
+    im_thread_t *t = arg;
+    im_thread_mailbox_t *mb = &t->mailbox;
+    im_thread_msg_t *msg;
+    long quantum = im_atomic_load(&t->quantum);
+    long n = 0;
+
+    // 处理期间signaled保持为1, 生产者不会重复激活事件
+    while (quantum <= 0 || n < quantum) {
+        msg = _im_thread_mailbox_pop(mb);
+        if (!msg) {
+            // 清除标记以后再检查一次, 防止丢失清除之前入队但是没有激活事件的消息
+            im_atomic_xchg(&mb->signaled, 0);
+            msg = _im_thread_mailbox_pop(mb);
+            if (!msg)
+                return;
+            im_atomic_xchg(&mb->signaled, 1);
+        }
+        if (msg->delay > 0)
+            _im_thread_msg_schedule(t, msg);
+        else
+            _im_thread_msg_run(t, msg);
+        n++;
+    }
+
+    // 配额用完, 通过0超时定时器让出, 下一轮循环先处理I/O事件
+    struct timeval ts = {0, 0};
+    event_add(mb->yield_ev, &ts);
+}
+
+static void _im_thread_msg_free(im_thread_t *t)
+{
+    // 线程已经停止, 不需要加锁
     struct list_head *pos, *tmp;
     if (!list_empty(&t->msg_head)) {
         list_for_each_safe(pos, tmp, &t->msg_head) {
             im_thread_msg_t *msg = list_entry(pos, im_thread_msg_t, msg_node);
             list_del(pos);
-            event_free(msg->pos_ev);
+            im_timer_del(t->timers, &msg->timer);
             safe_mem_free(msg);
         }
     }
 
-    im_thread_mutex_unlock(t->m_lock);
+    // 线程已经停止, 邮箱里面没有处理的消息直接丢弃
+    im_thread_msg_t *msg;
+    while ((msg = _im_thread_mailbox_pop(&t->mailbox)) != NULL) {
+        if (msg->call)
+            _im_thread_call_complete(msg->call);
+        else
+            safe_mem_free(msg);
+    }
 }
 
 static void _im_thread_free(im_thread_t *t)
@@ -70,16 +310,11 @@ static void _im_thread_free(im_thread_t *t)
     _im_thread_msg_free(t);
 
     // 释放event_base
+    im_timer_wheel_free(t->timers);
+    event_free(t->mailbox.wakeup_ev);
+    event_free(t->mailbox.yield_ev);
     event_base_free(t->base);
 
-    // 释放信号
-#ifdef WIN32
-    CloseHandle(t->signal);
-#endif
-#ifdef POSIX
-    pthread_cond_destroy(t->signal);
-#endif
-
     // 释放锁
     im_thread_mutex_destroy(t->m_lock);
 
@@ -126,30 +361,24 @@ im_thread_t *im_thread_new()
             return NULL;
         }
 
-        int ret = 0;
-#ifdef WIN32
-        t->signal = CreateEvent(NULL, FALSE, FALSE, NULL);
-        if (!t->signal) {
-            ret = -1;
-        }
-#endif
-#ifdef POSIX
-        ret = pthread_cond_init(t->signal, NULL);
-#endif
-        if (ret != 0) {
-            im_thread_mutex_destroy(t->m_lock);
-            safe_mem_free(t);
-            return NULL;
-        }
-
+        _im_thread_mailbox_init(&t->mailbox);
         t->base = event_base_new();
+        if (t->base) {
+            t->mailbox.wakeup_ev = event_new(t->base, -1, EV_PERSIST, _im_thread_mailbox_cb, t);
+            t->mailbox.yield_ev = evtimer_new(t->base, _im_thread_mailbox_cb, t);
+            t->timers = im_timer_wheel_new(t->base, IM_TIMER_TICK);
+            if (!t->mailbox.wakeup_ev || !t->mailbox.yield_ev || !t->timers) {
+                if (t->mailbox.wakeup_ev)
+                    event_free(t->mailbox.wakeup_ev);
+                if (t->mailbox.yield_ev)
+                    event_free(t->mailbox.yield_ev);
+                if (t->timers)
+                    im_timer_wheel_free(t->timers);
+                event_base_free(t->base);
+                t->base = NULL;
+            }
+        }
         if (t->base == NULL) {
-#ifdef WIN32
-            CloseHandle(t->signal);
-#endif
-#ifdef POSIX
-            pthread_cond_destroy(t->signal);
-#endif
             im_thread_mutex_destroy(t->m_lock);
             safe_mem_free(t);
             return NULL;
@@ -220,7 +449,7 @@ static void _im_thread_set_current(im_thread_t *t)
     TlsSetValue(thread_key_, t);
 #endif
 #ifdef POSIX
-    pthread_setspecific(key_, thread);
+    pthread_setspecific(thread_key_, t);
 #endif
 }
 
@@ -271,7 +500,7 @@ void im_thread_join(im_thread_t *t)
 #endif
 #ifdef POSIX
         void *pv;
-        pthread_join(thread_, &pv);
+        pthread_join(t->thread_handle, &pv);
 #endif
         t->started = false;
     }
@@ -279,7 +508,8 @@ void im_thread_join(im_thread_t *t)
 
 static void _im_thread_loop(im_thread_t *t)
 {
-    event_base_dispatch(t->base);
+    // 没有任何事件的时候也不退出, 等待邮箱的wakeup事件
+    event_base_loop(t->base, EVLOOP_NO_EXIT_ON_EMPTY);
 }
 
 static void *_im_thread_runnable_proxy(im_thread_t *running)
@@ -314,7 +544,8 @@ bool im_thread_start(im_thread_t *t, void *userdata)
     }
 #endif
 #ifdef POSIX
-    int error_code = pthread_create(&thread_handle, NULL, _im_thread_runnable_proxy, t);
+    int error_code = pthread_create(&t->thread_handle, NULL,
+                                    (void *(*)(void *))_im_thread_runnable_proxy, t);
     if (!error_code) {
         t->started = true;
     }
@@ -334,19 +565,15 @@ int im_thread_run(void *userdata)
     return -1;
 }
 
-static void _im_thread_post_proxy(evutil_socket_t fd, short what, void *arg)
+static void _im_thread_msg_init(im_thread_msg_t *msg, int msg_id, im_thread_msg_handler handler,
+                                void *userdata, im_thread_call_t *call)
 {
-    im_thread_msg_t *msg = arg;
-    msg->handler(msg->msg_id, msg->userdata);
-    im_thread_t *current = im_thread_current();
-
-    // 线程安全
-    im_thread_mutex_lock(current->m_lock);
-    list_del(&msg->msg_node);
-    im_thread_mutex_unlock(current->m_lock);
-
-    event_free(msg->pos_ev);
-    safe_mem_free(msg);
+    msg->handler = handler;
+    msg->msg_id = msg_id;
+    msg->userdata = userdata;
+    msg->call = call;
+    msg->delay = 0;
+    msg->next = NULL;
 }
 
 void im_thread_post(im_thread_t *sink, int msg_id, im_thread_msg_handler handler, long milliseconds,
@@ -356,48 +583,15 @@ void im_thread_post(im_thread_t *sink, int msg_id, im_thread_msg_handler handler
         return;
     }
     im_thread_msg_t *msg = safe_mem_malloc(sizeof(im_thread_msg_t), NULL);
-    if (msg) {
-        struct event *pos_ev = event_new(sink->base, -1, EV_TIMEOUT, _im_thread_post_proxy, msg);
-        if (!pos_ev) {
-            safe_mem_free(msg);
-            return;
-        }
-        msg->handler = handler;
-        msg->msg_id = msg_id;
-        msg->userdata = userdata;
-        msg->pos_ev = pos_ev;
-
-        // 线程安全
-        im_thread_mutex_lock(sink->m_lock);
-        list_add(&msg->msg_node, &sink->msg_head);
-        im_thread_mutex_unlock(sink->m_lock);
-
-        struct timeval ts;
-        ts.tv_sec = milliseconds / 1000;
-        ts.tv_usec = (milliseconds % 1000) * 1000;
-
-        event_add(pos_ev, &ts);
+    if (!msg) {
+        return;
     }
-}
+    _im_thread_msg_init(msg, msg_id, handler, userdata, NULL);
 
-static void _im_thread_send_proxy(evutil_socket_t fd, short what, void *arg)
-{
-    im_thread_msg_t *msg = arg;
-    msg->handler(msg->msg_id, msg->userdata);
-    im_thread_t *current = im_thread_current();
-#ifdef WIN32
-    SetEvent(current->signal);
-#endif
-#ifdef POSIX
-    pthread_cond_signal(current->signal);
-#endif
-    // 线程安全只保证消息队列的添加删除是安全的
-    im_thread_mutex_lock(current->m_lock);
-    list_del(&msg->msg_node);
-    im_thread_mutex_unlock(current->m_lock);
-
-    event_free(msg->pos_ev);
-    safe_mem_free(msg);
+    // 所有消息都进邮箱, 延时消息由所属线程放到时间轮上, 不经过libevent的定时器堆
+    msg->delay = milliseconds > 0 ? milliseconds : 0;
+    _im_thread_mailbox_push(&sink->mailbox, msg);
+    _im_thread_mailbox_signal(&sink->mailbox);
 }
 
 void im_thread_send(im_thread_t *sink, int msg_id, im_thread_msg_handler handler, void *userdata)
@@ -408,35 +602,22 @@ void im_thread_send(im_thread_t *sink, int msg_id, im_thread_msg_handler handler
     if (sink == im_thread_current()) {
         handler(msg_id, userdata);
     } else {
-        im_thread_msg_t *msg = safe_mem_malloc(sizeof(im_thread_msg_t), NULL);
-        if (msg) {
-            struct event *pos_ev = event_new(sink->base, -1, 0, _im_thread_send_proxy, msg);
-            if (!pos_ev) {
-                safe_mem_free(msg);
-                return;
-            }
-            msg->handler = handler;
-            msg->msg_id = msg_id;
-            msg->userdata = userdata;
-            msg->pos_ev = pos_ev;
-
-            // 线程安全只保证消息队列的添加删除是安全的
-            im_thread_mutex_lock(sink->m_lock);
-            list_add(&msg->msg_node, &sink->msg_head);
-            im_thread_mutex_unlock(sink->m_lock);
-
-            struct timeval ts;
-            ts.tv_sec = 0;
-            ts.tv_usec = 0;
+        // 完成槽在当前栈上, 等待返回之前sink线程不会再访问它
+        im_thread_call_t call;
+        _im_thread_call_init(&call);
+        _im_thread_msg_init(&call.msg, msg_id, handler, userdata, &call);
+
+        _im_thread_mailbox_push(&sink->mailbox, &call.msg);
+        _im_thread_mailbox_signal(&sink->mailbox);
+        _im_thread_call_wait(&call);
+    }
+}
 
-            event_add(pos_ev, &ts);
-#ifdef WIN32
-            WaitForSingleObject(sink->signal, INFINITE);
-#endif
-#ifdef POSIX
-            pthread_cond_wait(sink->signal, sink->m_lock);
-#endif
-        }
+void im_thread_set_quantum(im_thread_t *t, int quantum)
+{
+    im_thread_t *current = t ? t : im_thread_current();
+    if (current) {
+        im_atomic_store(&current->quantum, quantum > 0 ? quantum : 0);
     }
 }
 
@@ -503,8 +684,10 @@ int im_thread_mutex_destroy(im_thread_mutex_t *mutex)
         ret = CloseHandle(mutex->mutex_handler);
 #endif
 #ifdef POSIX
-    if (mutex->mutex_handler)
+    if (mutex->mutex_handler) {
         ret = pthread_mutex_destroy(mutex->mutex_handler) == 0;
+        safe_mem_free(mutex->mutex_handler);
+    }
 #endif
     safe_mem_free(mutex);
     return ret;
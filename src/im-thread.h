@@ -148,6 +148,8 @@ typedef void(*im_thread_msg_handler)(int msg_id, void *userdata);
 /**
  * @brief POST消息给指定线程
  * @details 等同于window的post消息行为, 可以给指定一个延时.
+ * 消息先进入线程的无锁邮箱, 可以在任意线程调用. 延时消息由线程放到自己的时间轮上,
+ * 精度是IM_TIMER_TICK毫秒, 从线程取出消息开始计时.
  *
  * @param sink 处理线程
  * @param msg_id 消息id
@@ -160,7 +162,9 @@ void im_thread_post(im_thread_t *sink, int msg_id, im_thread_msg_handler handler
 
 /**
  * @brief SEND一个消息给指定线程
- * @details 等同于window的send消息, 调用会阻塞到指定线程执行完消息处理函数返回
+ * @details 等同于window的send消息, 调用会阻塞到指定线程执行完消息处理函数返回.
+ * 每次调用在调用者栈上有独立的完成槽, 多个线程可以同时send给同一个线程.
+ * 指定线程没有运行消息循环的话会一直阻塞, 线程释放时还没处理的send不执行直接返回.
  *
  * @param sink 处理线程
  * @param msg_id 消息id
@@ -169,6 +173,16 @@ void im_thread_post(im_thread_t *sink, int msg_id, im_thread_msg_handler handler
  */
 void im_thread_send(im_thread_t *sink, int msg_id, im_thread_msg_handler handler, void *userdata);
 
+/**
+ * @brief 设置线程每次唤醒最多处理的消息数量
+ * @details 邮箱里积压大量消息时, 每处理quantum条就让出一次事件循环, 先处理socket等I/O事件,
+ * 避免大量post饿死bufferevent的读写. 0表示每次唤醒处理完所有消息(默认).
+ *
+ * @param t 线程指针或者NULL表示当前线程
+ * @param quantum 每次唤醒最多处理的消息数
+ */
+void im_thread_set_quantum(im_thread_t *t, int quantum);
+
 /**
  * @brief 获取线程的even_base
  *
@@ -0,0 +1,311 @@
+#include "im-timer.h"
+
+#include <event2/event.h>
+
+#ifdef WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#endif
+#ifdef POSIX
+#include <time.h>
+#endif
+
+#include "mm.h"
+
+// 第一层256个槽, 之后三层每层64个槽, 一共覆盖2^26个tick
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVN_LEVELS 3
+#define MAX_TVAL ((1ULL << (TVR_BITS + TVN_LEVELS * TVN_BITS)) - 1)
+
+#define TVN_INDEX(wheel, level) \
+    ((int)(((wheel)->current >> (TVR_BITS + (level) * TVN_BITS)) & TVN_MASK))
+
+struct im_timer_wheel {
+    struct event_base *base;
+    // 驱动时间轮的一次性定时事件, 只在有定时器的时候添加, 定在最近的到期tick
+    struct event *tick_ev;
+    bool tick_armed;
+    uint64_t armed_tick;
+    // 正在处理到期的定时器, 回调里面的添加删除等处理完再统一设置tick_ev
+    bool running;
+    int tick_ms;
+    // 创建时间, 毫秒
+    uint64_t start_ms;
+    // 下一个要处理的tick
+    uint64_t current;
+    // 已经启动的定时器数量
+    long count;
+    struct list_head tv1[TVR_SIZE];
+    struct list_head tvn[TVN_LEVELS][TVN_SIZE];
+};
+
+static uint64_t _im_timer_now_ms()
+{
+#ifdef WIN32
+    return GetTickCount64();
+#endif
+#ifdef POSIX
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static uint64_t _im_timer_now_tick(im_timer_wheel_t *wheel)
+{
+    return (_im_timer_now_ms() - wheel->start_ms) / wheel->tick_ms;
+}
+
+// 按照到期时间放进对应的槽
+static void _im_timer_internal_add(im_timer_wheel_t *wheel, im_timer_t *timer)
+{
+    uint64_t expire = timer->expire;
+    struct list_head *vec;
+
+    if (expire < wheel->current) {
+        // 已经过期, 放到下一个要处理的槽
+        vec = &wheel->tv1[wheel->current & TVR_MASK];
+    } else {
+        uint64_t idx = expire - wheel->current;
+        if (idx < TVR_SIZE) {
+            vec = &wheel->tv1[expire & TVR_MASK];
+        } else if (idx < 1ULL << (TVR_BITS + TVN_BITS)) {
+            vec = &wheel->tvn[0][(expire >> TVR_BITS) & TVN_MASK];
+        } else if (idx < 1ULL << (TVR_BITS + 2 * TVN_BITS)) {
+            vec = &wheel->tvn[1][(expire >> (TVR_BITS + TVN_BITS)) & TVN_MASK];
+        } else {
+            if (idx > MAX_TVAL) {
+                // 超出范围的按最大值处理
+                expire = wheel->current + MAX_TVAL;
+                timer->expire = expire;
+            }
+            vec = &wheel->tvn[2][(expire >> (TVR_BITS + 2 * TVN_BITS)) & TVN_MASK];
+        }
+    }
+    list_add_tail(&timer->node, vec);
+}
+
+// 把上层一个槽里面的定时器重新分配到下层
+static int _im_timer_cascade(im_timer_wheel_t *wheel, int level, int index)
+{
+    struct list_head work;
+
+    INIT_LIST_HEAD(&work);
+    list_splice_init(&wheel->tvn[level][index], &work);
+    while (!list_empty(&work)) {
+        im_timer_t *timer = list_first_entry(&work, im_timer_t, node);
+        list_del(&timer->node);
+        _im_timer_internal_add(wheel, timer);
+    }
+    return index;
+}
+
+// 下一个需要处理的tick: 第一层最近的非空槽, 或者上层有定时器要分配下来的时刻.
+// 不会晚于任何定时器的到期时间, 中间的tick都是空的, 可以直接跳过
+static uint64_t _im_timer_next_tick(im_timer_wheel_t *wheel)
+{
+    uint64_t next = wheel->current + TVR_SIZE;
+    uint64_t t;
+
+    for (t = wheel->current; t < wheel->current + TVR_SIZE; t++) {
+        if (!list_empty(&wheel->tv1[t & TVR_MASK])) {
+            next = t;
+            break;
+        }
+    }
+
+    // 第一层转完一圈的时刻, 第二层对应的槽非空或者要继续向上分配就必须停下
+    for (t = (wheel->current + TVR_MASK) & ~(uint64_t)TVR_MASK; t < next; t += TVR_SIZE) {
+        int index = (int)((t >> TVR_BITS) & TVN_MASK);
+        if (!index || !list_empty(&wheel->tvn[0][index]))
+            return t;
+    }
+    return next;
+}
+
+// 处理到now_tick为止所有到期的定时器
+static void _im_timer_run(im_timer_wheel_t *wheel, uint64_t now_tick)
+{
+    struct list_head work;
+
+    INIT_LIST_HEAD(&work);
+    while (wheel->count > 0) {
+        uint64_t next = _im_timer_next_tick(wheel);
+        int index;
+
+        if (next > now_tick) {
+            // 到now_tick为止都是空槽
+            if (wheel->current <= now_tick)
+                wheel->current = now_tick + 1;
+            break;
+        }
+        wheel->current = next;
+        index = (int)(wheel->current & TVR_MASK);
+
+        // 第一层转完一圈, 逐层向下分配
+        if (!index &&
+            !_im_timer_cascade(wheel, 0, TVN_INDEX(wheel, 0)) &&
+            !_im_timer_cascade(wheel, 1, TVN_INDEX(wheel, 1))) {
+            _im_timer_cascade(wheel, 2, TVN_INDEX(wheel, 2));
+        }
+        wheel->current++;
+
+        // 回调里面可能添加或者删除任意定时器, 每次只摘第一个
+        list_splice_init(&wheel->tv1[index], &work);
+        while (!list_empty(&work)) {
+            im_timer_t *timer = list_first_entry(&work, im_timer_t, node);
+            list_del_init(&timer->node);
+            wheel->count--;
+            timer->cb(timer, timer->userdata);
+        }
+    }
+
+    // 没有定时器以后直接追上当前时间
+    if (wheel->count == 0)
+        wheel->current = now_tick + 1;
+}
+
+// 把tick_ev定在tick开始的时刻, 已经过了就马上触发
+static void _im_timer_arm(im_timer_wheel_t *wheel, uint64_t tick)
+{
+    uint64_t elapsed = _im_timer_now_ms() - wheel->start_ms;
+    uint64_t due = tick * wheel->tick_ms;
+    uint64_t ms = due > elapsed ? due - elapsed : 0;
+    struct timeval tv;
+
+    tv.tv_sec = (long)(ms / 1000);
+    tv.tv_usec = (long)(ms % 1000) * 1000;
+    event_add(wheel->tick_ev, &tv);
+    wheel->tick_armed = true;
+    wheel->armed_tick = tick;
+}
+
+static void _im_timer_tick_cb(evutil_socket_t fd, short what, void *arg)
+{
+    im_timer_wheel_t *wheel = arg;
+
+    // 一次性事件, 触发以后已经不在libevent里面
+    wheel->tick_armed = false;
+    wheel->running = true;
+    _im_timer_run(wheel, _im_timer_now_tick(wheel));
+    wheel->running = false;
+
+    // 只在最近的到期时刻唤醒, 没有定时器的时候不占用libevent的定时器堆
+    if (wheel->count > 0)
+        _im_timer_arm(wheel, _im_timer_next_tick(wheel));
+}
+
+im_timer_wheel_t *im_timer_wheel_new(struct event_base *base, int tick_ms)
+{
+    im_timer_wheel_t *wheel;
+    int i, j;
+
+    if (!base)
+        return NULL;
+
+    wheel = safe_mem_calloc(sizeof(im_timer_wheel_t), NULL);
+    if (!wheel)
+        return NULL;
+
+    wheel->base = base;
+    wheel->tick_ms = tick_ms > 0 ? tick_ms : IM_TIMER_TICK;
+    wheel->start_ms = _im_timer_now_ms();
+    wheel->current = 0;
+    wheel->tick_ev = event_new(base, -1, 0, _im_timer_tick_cb, wheel);
+    if (!wheel->tick_ev) {
+        safe_mem_free(wheel);
+        return NULL;
+    }
+
+    for (i = 0; i < TVR_SIZE; i++)
+        INIT_LIST_HEAD(&wheel->tv1[i]);
+    for (i = 0; i < TVN_LEVELS; i++)
+        for (j = 0; j < TVN_SIZE; j++)
+            INIT_LIST_HEAD(&wheel->tvn[i][j]);
+
+    return wheel;
+}
+
+static void _im_timer_list_clear(struct list_head *head)
+{
+    while (!list_empty(head)) {
+        im_timer_t *timer = list_first_entry(head, im_timer_t, node);
+        list_del_init(&timer->node);
+    }
+}
+
+void im_timer_wheel_free(im_timer_wheel_t *wheel)
+{
+    int i, j;
+
+    // 定时器的内存属于使用者, 只需要摘下
+    for (i = 0; i < TVR_SIZE; i++)
+        _im_timer_list_clear(&wheel->tv1[i]);
+    for (i = 0; i < TVN_LEVELS; i++)
+        for (j = 0; j < TVN_SIZE; j++)
+            _im_timer_list_clear(&wheel->tvn[i][j]);
+
+    event_free(wheel->tick_ev);
+    safe_mem_free(wheel);
+}
+
+void im_timer_init(im_timer_t *timer, im_timer_cb cb, void *userdata)
+{
+    INIT_LIST_HEAD(&timer->node);
+    timer->expire = 0;
+    timer->cb = cb;
+    timer->userdata = userdata;
+}
+
+void im_timer_add(im_timer_wheel_t *wheel, im_timer_t *timer, unsigned long milliseconds)
+{
+    uint64_t elapsed = _im_timer_now_ms() - wheel->start_ms;
+    uint64_t now = elapsed / wheel->tick_ms;
+    // 按毫秒向上取整, 保证不会提前到期
+    uint64_t expire = (elapsed + milliseconds + wheel->tick_ms - 1) / wheel->tick_ms;
+
+    if (im_timer_pending(timer)) {
+        list_del(&timer->node);
+    } else {
+        if (wheel->count++ == 0 && now > wheel->current) {
+            // 时间轮空闲期间没有推进, 先同步到当前时间
+            wheel->current = now;
+        }
+    }
+
+    // tick事件延迟的时候current会落后, 已经处理过的tick不能再放. 至少等一个tick
+    if (expire <= wheel->current)
+        expire = wheel->current + 1;
+    timer->expire = expire;
+    _im_timer_internal_add(wheel, timer);
+
+    // 比已经定好的唤醒时刻早才需要重新设置
+    if (!wheel->running && (!wheel->tick_armed || expire < wheel->armed_tick))
+        _im_timer_arm(wheel, expire);
+}
+
+void im_timer_del(im_timer_wheel_t *wheel, im_timer_t *timer)
+{
+    if (im_timer_pending(timer)) {
+        list_del_init(&timer->node);
+        wheel->count--;
+
+        // 提前唤醒一次没有关系, 到时候会按剩下的定时器重新设置. 空了就撤掉
+        if (wheel->count == 0 && wheel->tick_armed) {
+            event_del(wheel->tick_ev);
+            wheel->tick_armed = false;
+        }
+    }
+}
+
+bool im_timer_pending(im_timer_t *timer)
+{
+    return !list_empty(&timer->node);
+}
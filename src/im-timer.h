@@ -0,0 +1,107 @@
+/*
+* im-timer.h
+* 分层时间轮定时器, 挂在一个event_base上, 只有一个libevent定时事件
+* 添加, 取消, 重置都是O(1), 只能在event_base所属的线程里面使用
+*/
+#ifndef _IMCORE_TIMER_H
+#define _IMCORE_TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "list.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct event_base;
+
+// 默认精度, 毫秒
+#define IM_TIMER_TICK 10
+
+/**
+ * @brief 时间轮指针
+ */
+typedef struct im_timer_wheel im_timer_wheel_t;
+
+typedef struct im_timer im_timer_t;
+
+/**
+ * @brief 定时器回调
+ * @details 回调之前定时器已经从时间轮上摘下, 可以在回调里面重新添加或者释放定时器.
+ *
+ * @param timer 到期的定时器
+ * @param userdata 自定义数据
+ */
+typedef void(*im_timer_cb)(im_timer_t *timer, void *userdata);
+
+/**
+ * @brief 定时器
+ * @details 侵入式结构, 嵌入到使用者的结构里面, 时间轮不分配内存.
+ */
+struct im_timer {
+    struct list_head node;
+    uint64_t expire;
+    im_timer_cb cb;
+    void *userdata;
+};
+
+/**
+ * @brief 创建时间轮
+ *
+ * @param base 所属的event_base
+ * @param tick_ms 精度, 毫秒, 小于等于0使用IM_TIMER_TICK
+ * @return im_timer_wheel_t* 或者 NULL
+ */
+im_timer_wheel_t *im_timer_wheel_new(struct event_base *base, int tick_ms);
+
+/**
+ * @brief 释放时间轮
+ * @details 还没到期的定时器直接摘下, 不会回调.
+ *
+ * @param wheel 时间轮指针
+ */
+void im_timer_wheel_free(im_timer_wheel_t *wheel);
+
+/**
+ * @brief 初始化定时器
+ *
+ * @param timer 定时器
+ * @param cb 回调
+ * @param userdata 自定义数据
+ */
+void im_timer_init(im_timer_t *timer, im_timer_cb cb, void *userdata);
+
+/**
+ * @brief 启动定时器
+ * @details 定时器已经启动的话重新开始计时.
+ *
+ * @param wheel 时间轮指针
+ * @param timer 定时器
+ * @param milliseconds 延时, 向上取整到精度
+ */
+void im_timer_add(im_timer_wheel_t *wheel, im_timer_t *timer, unsigned long milliseconds);
+
+/**
+ * @brief 取消定时器
+ * @details 没有启动的定时器也可以取消.
+ *
+ * @param wheel 时间轮指针
+ * @param timer 定时器
+ */
+void im_timer_del(im_timer_wheel_t *wheel, im_timer_t *timer);
+
+/**
+ * @brief 定时器是否已经启动并且还没有到期
+ *
+ * @param timer 定时器
+ * @return true 或者 false
+ */
+bool im_timer_pending(im_timer_t *timer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _IMCORE_TIMER_H
@@ -28,6 +28,14 @@ extern "C" {
  */
 typedef struct im_conn im_conn_t;
 
+/**
+ * @typedef	struct im_conn_group im_conn_group_t
+ *
+ * @brief	IM连接组
+ * 			组内的连接共享工作线程, xmpp上下文以及SSL_CTX, 用于在一个进程里面运行大量连接.
+ */
+typedef struct im_conn_group im_conn_group_t;
+
 /**
  * @typedef	struct im_msg im_msg_t
  *
@@ -145,6 +153,50 @@ IMCORE_API im_conn_t *im_conn_new(const char *host,
  */
 IMCORE_API int im_conn_open(im_conn_t *conn);
 
+/**
+ * @fn	IMCORE_API im_conn_group_t *im_conn_group_new(int nthreads);
+ *
+ * @brief	新建一个连接组, 立即启动组内的工作线程.
+ *
+ * @param	nthreads	工作线程数量, 小于等于0表示使用CPU核数
+ *
+ * @return	null if it fails, else an im_conn_group_t*.
+ */
+IMCORE_API im_conn_group_t *im_conn_group_new(int nthreads);
+
+/**
+ * @fn	IMCORE_API void im_conn_group_free(im_conn_group_t *group);
+ *
+ * @brief	停止并释放连接组, 调用之前必须先释放组内所有的连接.
+ *
+ * @param [in]	group	要释放的连接组
+ */
+IMCORE_API void im_conn_group_free(im_conn_group_t *group);
+
+/**
+ * @fn	IMCORE_API im_conn_t *im_conn_new_in_group(im_conn_group_t *group, const char *host, const char *username, const char *password, im_conn_state_cb statecb, im_conn_recive_cb msgcb, void *userdate);
+ *
+ * @brief	在连接组里面新建一个IM连接, 参数同im_conn_new.
+ * 			连接轮流分配到组内的工作线程上, 不会创建自己的线程, 回调在所属工作线程里面执行.
+ *
+ * @param [in]	group	连接组
+ * @param	host				服务器地址域名或者IP地址
+ * @param	username			用户名
+ * @param	password			登录凭证
+ * @param	statecb				状态回调
+ * @param	msgcb				广播消息回调
+ * @param [in]	userdate		自定义参数
+ *
+ * @return	null if it fails, else an im_conn_t*.
+ */
+IMCORE_API im_conn_t *im_conn_new_in_group(im_conn_group_t *group,
+                                           const char *host,
+                                           const char *username,
+                                           const char *password,
+                                           im_conn_state_cb statecb,
+                                           im_conn_recive_cb msgcb,
+                                           void *userdate);
+
 
 IMCORE_API int im_conn_close(im_conn_t *conn);
 IMCORE_API void im_conn_free(im_conn_t *conn);
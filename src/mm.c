@@ -1,24 +1,247 @@
 #include "mm.h"
 
 #include <stdio.h>
-#include "list.h"
 
+#include "im-atomic.h"
+
+#ifdef WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#endif
+#ifdef POSIX
+#include <pthread.h>
+#endif
+
+// 线性分配器的内存块, 数据紧跟在后面
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+} arena_chunk_t;
+
+struct mem_arena {
+    arena_chunk_t *first;       // 重置的时候保留的块
+    arena_chunk_t *current;     // 当前切分的块
+    arena_chunk_t *extra;       // 之后追加的块, 重置的时候释放
+    size_t chunk_size;
+};
+
+// 按指针大小对齐
+#define ARENA_ALIGN(s) (((s) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+#define ARENA_CHUNK_HEAD ARENA_ALIGN(sizeof(arena_chunk_t))
+
+// 分配记录, p为NULL表示空槽
 typedef struct ring_mem {
     void *p;
     size_t s;
     char *file;
     uint64_t line;
     void *userdata;
-    
-    // 双链表
-    struct list_head ring;
 } ring_mem_t;
 
-static struct list_head ring_head;
+// 以指针为键的开放寻址表(线性探测), 查找和删除都是O(1)
+// 不在分配的内存前面加头, 这样ring_free仍然可以安全的释放不是由safe_mem分配的指针
+typedef struct ring_table {
+    ring_mem_t *slots;
+    size_t capacity;            // 2的幂
+    size_t count;
+} ring_table_t;
+
+#define RING_TABLE_MIN 1024
+
+static ring_table_t ring_table;
+
+// 多个im_thread同时分配释放, 需要加锁
+#ifdef WIN32
+static SRWLOCK ring_lock = SRWLOCK_INIT;
+#define ring_lock_acquire() AcquireSRWLockExclusive(&ring_lock)
+#define ring_lock_release() ReleaseSRWLockExclusive(&ring_lock)
+#endif
+#ifdef POSIX
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+#define ring_lock_acquire() pthread_mutex_lock(&ring_lock)
+#define ring_lock_release() pthread_mutex_unlock(&ring_lock)
+#endif
+
+static arena_chunk_t *_arena_chunk_new(mem_arena_t *arena, size_t size)
+{
+    arena_chunk_t *chunk = safe_mem_malloc(ARENA_CHUNK_HEAD + size, NULL);
+    if (!chunk)
+        return NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->next = arena->extra;
+    arena->extra = chunk;
+    return chunk;
+}
+
+mem_arena_t *arena_new(size_t chunk_size)
+{
+    mem_arena_t *arena = safe_mem_calloc(sizeof(mem_arena_t), NULL);
+    if (!arena)
+        return NULL;
+
+    arena->chunk_size = chunk_size > 0 ? ARENA_ALIGN(chunk_size) : ARENA_CHUNK_SIZE;
+    arena->first = _arena_chunk_new(arena, arena->chunk_size);
+    if (!arena->first) {
+        safe_mem_free(arena);
+        return NULL;
+    }
+    arena->extra = NULL;
+    arena->current = arena->first;
+    return arena;
+}
+
+void arena_free(mem_arena_t *arena)
+{
+    arena_reset(arena);
+    safe_mem_free(arena->first);
+    safe_mem_free(arena);
+}
+
+void *arena_alloc(mem_arena_t *arena, size_t s)
+{
+    arena_chunk_t *chunk = arena->current;
+    void *p;
+
+    s = ARENA_ALIGN(s ? s : 1);
+    if (chunk->size - chunk->used < s) {
+        if (s > arena->chunk_size / 4) {
+            // 大块单独分配, 不丢弃当前块剩余的空间
+            chunk = _arena_chunk_new(arena, s);
+            if (!chunk)
+                return NULL;
+        } else {
+            chunk = _arena_chunk_new(arena, arena->chunk_size);
+            if (!chunk)
+                return NULL;
+            arena->current = chunk;
+        }
+    }
+
+    p = (char *)chunk + ARENA_CHUNK_HEAD + chunk->used;
+    chunk->used += s;
+    return p;
+}
+
+char *arena_strndup(mem_arena_t *arena, const char *s, size_t len)
+{
+    char *p = arena_alloc(arena, len + 1);
+    if (p) {
+        memcpy(p, s, len);
+        p[len] = '\0';
+    }
+    return p;
+}
+
+void arena_reset(mem_arena_t *arena)
+{
+    arena_chunk_t *chunk, *next;
+
+    for (chunk = arena->extra; chunk; chunk = next) {
+        next = chunk->next;
+        safe_mem_free(chunk);
+    }
+    arena->extra = NULL;
+    arena->first->used = 0;
+    arena->current = arena->first;
+}
+
+static size_t _ring_hash(const ring_table_t *table, const void *p)
+{
+    // 斐波那契散列, 指针低位通常是对齐的0
+    uint64_t h = (uint64_t)(uintptr_t)p * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h >> 32) & (table->capacity - 1);
+}
+
+static ring_mem_t *_ring_find(ring_table_t *table, const void *p)
+{
+    size_t i;
+
+    if (!table->capacity)
+        return NULL;
+
+    i = _ring_hash(table, p);
+    while (table->slots[i].p) {
+        if (table->slots[i].p == p)
+            return &table->slots[i];
+        i = (i + 1) & (table->capacity - 1);
+    }
+    return NULL;
+}
+
+static void _ring_insert_slot(ring_table_t *table, const ring_mem_t *mem)
+{
+    size_t i = _ring_hash(table, mem->p);
+    while (table->slots[i].p) {
+        i = (i + 1) & (table->capacity - 1);
+    }
+    table->slots[i] = *mem;
+    table->count++;
+}
+
+static int _ring_grow(ring_table_t *table)
+{
+    ring_table_t grown;
+    size_t i;
+
+    grown.capacity = table->capacity ? table->capacity * 2 : RING_TABLE_MIN;
+    grown.count = 0;
+    grown.slots = calloc(grown.capacity, sizeof(ring_mem_t));
+    if (!grown.slots)
+        return -1;
+
+    for (i = 0; i < table->capacity; i++) {
+        if (table->slots[i].p)
+            _ring_insert_slot(&grown, &table->slots[i]);
+    }
+    free(table->slots);
+    *table = grown;
+    return 0;
+}
+
+static void _ring_insert(ring_table_t *table, const ring_mem_t *mem)
+{
+    // 装载因子超过3/4扩容, 扩容失败只要还有空位就继续记录
+    if ((table->count + 1) * 4 > table->capacity * 3) {
+        if (_ring_grow(table) != 0 && table->count + 1 >= table->capacity)
+            return;
+    }
+    _ring_insert_slot(table, mem);
+}
+
+// 删除以后把后面同一探测链上的记录往前移, 不需要墓碑
+static void _ring_remove(ring_table_t *table, ring_mem_t *mem)
+{
+    size_t mask = table->capacity - 1;
+    size_t hole = (size_t)(mem - table->slots);
+    size_t i = hole;
+
+    for (;;) {
+        size_t home;
+        i = (i + 1) & mask;
+        if (!table->slots[i].p)
+            break;
+        home = _ring_hash(table, table->slots[i].p);
+        // home不在(hole, i]之间的记录可以移到hole
+        if ((i > hole && (home <= hole || home > i)) ||
+            (i < hole && (home <= hole && home > i))) {
+            table->slots[hole] = table->slots[i];
+            hole = i;
+        }
+    }
+    table->slots[hole].p = NULL;
+    table->count--;
+}
 
 void ring_init_check()
 {
-    INIT_LIST_HEAD(&ring_head);
+    ring_lock_acquire();
+    if (!ring_table.capacity)
+        _ring_grow(&ring_table);
+    ring_lock_release();
 }
 
 void *ring_calloc(size_t s, char *file, uint64_t line, void *userdata)
@@ -32,20 +255,19 @@ void *ring_calloc(size_t s, char *file, uint64_t line, void *userdata)
 
 void *ring_malloc(size_t size, char *file, uint64_t line, void *userdata)
 {
-    void *p = NULL;
-    ring_mem_t *mem = malloc(sizeof(ring_mem_t));
-    if (mem != NULL) {
-        p = malloc(size);
-        if (p == NULL) {
-            free(mem);
-            return NULL;
-        }
-        mem->p = p;
-        mem->s = size;
-        mem->file = file;
-        mem->line = line;
-        mem->userdata = userdata;
-        list_add(&mem->ring, &ring_head);
+    ring_mem_t mem;
+    void *p = malloc(size);
+
+    if (p != NULL) {
+        mem.p = p;
+        mem.s = size;
+        mem.file = file;
+        mem.line = line;
+        mem.userdata = userdata;
+
+        ring_lock_acquire();
+        _ring_insert(&ring_table, &mem);
+        ring_lock_release();
     }
     return p;
 }
@@ -57,20 +279,28 @@ void *ring_realloc(void *p, size_t size, char *file, uint64_t line, void *userda
     } else if (size == 0) {
         ring_free(p);
     } else {
-        struct list_head *pos;
-        void *_p = realloc(p, size);
-        if (_p != NULL && !list_empty(&ring_head)) {
-            list_for_each(pos, &ring_head) {
-                ring_mem_t *mem = list_entry(pos, ring_mem_t, ring);
-                if (mem->p == p) {
-                    mem->p = _p;
-                    mem->s = size;
-                    mem->file = file;
-                    mem->line = line;
-                    mem->userdata = userdata;
-                }
+        void *_p;
+        ring_mem_t *mem;
+
+        // realloc也在锁里面, 防止旧地址释放以后被其他线程重新分配再记录
+        ring_lock_acquire();
+        // realloc成功以后p已经释放, 先找到记录
+        mem = _ring_find(&ring_table, p);
+        _p = realloc(p, size);
+        if (_p != NULL) {
+            if (mem) {
+                ring_mem_t updated;
+                updated.p = _p;
+                updated.s = size;
+                updated.file = file;
+                updated.line = line;
+                updated.userdata = userdata;
+                _ring_remove(&ring_table, mem);
+                _ring_insert(&ring_table, &updated);
             }
         }
+        ring_lock_release();
+
         // safe call for non-safe-mem point.
         return _p;
     }
@@ -80,17 +310,14 @@ void *ring_realloc(void *p, size_t size, char *file, uint64_t line, void *userda
 void ring_free(void *p)
 {
     if (p) {
-        struct list_head *pos;
-        if (!list_empty(&ring_head)) {
-            list_for_each(pos, &ring_head) {
-                ring_mem_t *mem = list_entry(pos, ring_mem_t, ring);
-                if (mem->p == p) {
-                    list_del(pos);
-                    free(mem);
-                    break;
-                }
-            }
-        }
+        ring_mem_t *mem;
+
+        ring_lock_acquire();
+        mem = _ring_find(&ring_table, p);
+        if (mem)
+            _ring_remove(&ring_table, mem);
+        ring_lock_release();
+
         // let ring_free safety for non-safe-mem point.
         free(p);
     }
@@ -98,15 +325,351 @@ void ring_free(void *p)
 
 void ring_clean_check(safe_mem_check_cb cb, void *cb_userdata)
 {
-    struct list_head *pos, *tmp;
-    if (!list_empty(&ring_head)) {
-        list_for_each_safe(pos, tmp, &ring_head) {
-            ring_mem_t *mem = list_entry(pos, ring_mem_t, ring);
-            if (cb) {
-                cb(mem->p, mem->s, mem->file, mem->line, mem->userdata, cb_userdata);
-            }
-            list_del(pos);
-            free(mem);
+    ring_table_t table;
+    size_t i;
+
+    // 取出整张表以后再回调, 回调里面可以继续分配释放
+    ring_lock_acquire();
+    table = ring_table;
+    ring_table.slots = NULL;
+    ring_table.capacity = 0;
+    ring_table.count = 0;
+    ring_lock_release();
+
+    for (i = 0; i < table.capacity; i++) {
+        ring_mem_t *mem = &table.slots[i];
+        if (mem->p && cb) {
+            cb(mem->p, mem->s, mem->file, mem->line, mem->userdata, cb_userdata);
+        }
+    }
+    free(table.slots);
+}
+
+#ifdef IMCORE_SLAB
+
+// 每次向系统申请的内存大小, 切成同样大小的块
+#define SLAB_CHUNK_BYTES (16 * 1024)
+#define SLAB_LARGE SLAB_CLASSES
+
+static const size_t slab_class_size[SLAB_CLASSES] = {16, 32, 48, 64, 96, 128, 192, 256};
+
+struct slab_cache;
+
+// 块头, 放在用户指针前面. owner为NULL表示直接malloc的大块, info是请求的大小
+// 否则info是尺寸级别
+typedef struct slab_header {
+    struct slab_cache *owner;
+    size_t info;
+} slab_header_t;
+
+// 空闲块链表节点, 复用用户区域
+typedef struct slab_block {
+    struct slab_block *next;
+} slab_block_t;
+
+typedef struct slab_counter {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t system_allocs;
+} slab_counter_t;
+
+// 线程缓存, 线程退出以后放进孤儿链表给新线程复用, 不会释放
+typedef struct slab_cache {
+    slab_block_t *free_list[SLAB_CLASSES];
+    // 其他线程释放的块, 无锁栈, 所属线程分配不到的时候整个取走
+    slab_block_t *volatile remote_free;
+    slab_counter_t counters[SLAB_CLASSES + 1];
+    // 远程释放计数由其他线程累加
+    volatile long remote_frees[SLAB_CLASSES + 1];
+    // 所有缓存链表, 用于统计
+    struct slab_cache *next_all;
+    // 孤儿链表
+    struct slab_cache *next_orphan;
+} slab_cache_t;
+
+static slab_cache_t *slab_all;
+static slab_cache_t *slab_orphans;
+
+#ifdef WIN32
+static SRWLOCK slab_lock = SRWLOCK_INIT;
+static INIT_ONCE slab_once = INIT_ONCE_STATIC_INIT;
+static DWORD slab_key = FLS_OUT_OF_INDEXES;
+#define slab_lock_acquire() AcquireSRWLockExclusive(&slab_lock)
+#define slab_lock_release() ReleaseSRWLockExclusive(&slab_lock)
+#endif
+#ifdef POSIX
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slab_key;
+#define slab_lock_acquire() pthread_mutex_lock(&slab_lock)
+#define slab_lock_release() pthread_mutex_unlock(&slab_lock)
+#endif
+
+static int _slab_class(size_t s)
+{
+    int cls;
+
+    if (s > SLAB_MAX_SIZE)
+        return SLAB_LARGE;
+    for (cls = 0; cls < SLAB_CLASSES; cls++) {
+        if (s <= slab_class_size[cls])
+            return cls;
+    }
+    return SLAB_LARGE;
+}
+
+// 线程退出, 缓存里面的块还可能被其他线程引用, 只能交给后来的线程
+#ifdef WIN32
+static void WINAPI _slab_thread_exit(void *p)
+#endif
+#ifdef POSIX
+static void _slab_thread_exit(void *p)
+#endif
+{
+    slab_cache_t *cache = p;
+    if (cache) {
+        slab_lock_acquire();
+        cache->next_orphan = slab_orphans;
+        slab_orphans = cache;
+        slab_lock_release();
+    }
+}
+
+#ifdef WIN32
+static BOOL CALLBACK _slab_once_init(PINIT_ONCE once, void *param, void **context)
+{
+    slab_key = FlsAlloc(_slab_thread_exit);
+    return TRUE;
+}
+#endif
+#ifdef POSIX
+static void _slab_once_init()
+{
+    pthread_key_create(&slab_key, _slab_thread_exit);
+}
+#endif
+
+void slab_init()
+{
+#ifdef WIN32
+    InitOnceExecuteOnce(&slab_once, _slab_once_init, NULL, NULL);
+#endif
+#ifdef POSIX
+    pthread_once(&slab_once, _slab_once_init);
+#endif
+}
+
+static slab_cache_t *_slab_cache_current()
+{
+    slab_cache_t *cache;
+
+#ifdef WIN32
+    cache = FlsGetValue(slab_key);
+#endif
+#ifdef POSIX
+    cache = pthread_getspecific(slab_key);
+#endif
+    if (cache)
+        return cache;
+
+    // 优先复用已经退出的线程的缓存
+    slab_lock_acquire();
+    cache = slab_orphans;
+    if (cache) {
+        slab_orphans = cache->next_orphan;
+    } else {
+        cache = calloc(1, sizeof(slab_cache_t));
+        if (cache) {
+            cache->next_all = slab_all;
+            slab_all = cache;
+        }
+    }
+    slab_lock_release();
+
+    if (cache) {
+#ifdef WIN32
+        FlsSetValue(slab_key, cache);
+#endif
+#ifdef POSIX
+        pthread_setspecific(slab_key, cache);
+#endif
+    }
+    return cache;
+}
+
+// 取走其他线程释放的块, 按级别放回本地链表
+static void _slab_drain_remote(slab_cache_t *cache)
+{
+    slab_block_t *block = im_atomic_xchg_ptr((void *volatile *)&cache->remote_free, NULL);
+    while (block) {
+        slab_block_t *next = block->next;
+        slab_header_t *hdr = (slab_header_t *)block - 1;
+        block->next = cache->free_list[hdr->info];
+        cache->free_list[hdr->info] = block;
+        block = next;
+    }
+}
+
+// 向系统申请一块内存切成空闲块
+static int _slab_refill(slab_cache_t *cache, int cls)
+{
+    size_t stride = sizeof(slab_header_t) + slab_class_size[cls];
+    size_t count = SLAB_CHUNK_BYTES / stride;
+    char *chunk = malloc(stride * count);
+    size_t i;
+
+    if (!chunk)
+        return -1;
+    cache->counters[cls].system_allocs++;
+
+    for (i = 0; i < count; i++) {
+        slab_header_t *hdr = (slab_header_t *)(chunk + i * stride);
+        slab_block_t *block = (slab_block_t *)(hdr + 1);
+        hdr->owner = cache;
+        hdr->info = (size_t)cls;
+        block->next = cache->free_list[cls];
+        cache->free_list[cls] = block;
+    }
+    return 0;
+}
+
+static void *_slab_large_malloc(slab_cache_t *cache, size_t s)
+{
+    slab_header_t *hdr = malloc(sizeof(slab_header_t) + s);
+    if (!hdr)
+        return NULL;
+    hdr->owner = NULL;
+    hdr->info = s;
+    if (cache) {
+        cache->counters[SLAB_LARGE].allocs++;
+        cache->counters[SLAB_LARGE].system_allocs++;
+    }
+    return hdr + 1;
+}
+
+void *slab_malloc(size_t s)
+{
+    slab_cache_t *cache;
+    slab_block_t *block;
+    int cls = _slab_class(s);
+
+    slab_init();
+    cache = _slab_cache_current();
+    if (cls == SLAB_LARGE || !cache)
+        return _slab_large_malloc(cache, s);
+
+    block = cache->free_list[cls];
+    if (!block) {
+        _slab_drain_remote(cache);
+        block = cache->free_list[cls];
+        if (!block) {
+            if (_slab_refill(cache, cls) != 0)
+                return NULL;
+            block = cache->free_list[cls];
+        }
+    }
+    cache->free_list[cls] = block->next;
+    cache->counters[cls].allocs++;
+    return block;
+}
+
+void *slab_calloc(size_t s)
+{
+    void *p = slab_malloc(s);
+    if (p != NULL) {
+        memset(p, 0, s);
+    }
+    return p;
+}
+
+void slab_free(void *p)
+{
+    slab_header_t *hdr;
+    slab_cache_t *cache;
+    slab_block_t *block = p;
+
+    if (!p)
+        return;
+
+    hdr = (slab_header_t *)p - 1;
+    if (!hdr->owner) {
+        cache = _slab_cache_current();
+        if (cache)
+            cache->counters[SLAB_LARGE].frees++;
+        free(hdr);
+        return;
+    }
+
+    cache = _slab_cache_current();
+    if (hdr->owner == cache) {
+        block->next = cache->free_list[hdr->info];
+        cache->free_list[hdr->info] = block;
+        cache->counters[hdr->info].frees++;
+    } else {
+        // 跨线程释放, 压到所属缓存的无锁栈上. 消费者一次取走整个栈, 不存在ABA问题
+        slab_cache_t *owner = hdr->owner;
+        slab_block_t *head;
+        do {
+            head = im_atomic_load_ptr((void *volatile *)&owner->remote_free);
+            block->next = head;
+        } while (!im_atomic_cas_ptr((void *volatile *)&owner->remote_free, head, block));
+        im_atomic_inc(&owner->remote_frees[hdr->info]);
+    }
+}
+
+void *slab_realloc(void *p, size_t s)
+{
+    slab_header_t *hdr;
+    size_t old_size;
+    void *_p;
+
+    if (p == NULL)
+        return slab_malloc(s);
+    if (s == 0) {
+        slab_free(p);
+        return NULL;
+    }
+
+    hdr = (slab_header_t *)p - 1;
+    if (hdr->owner) {
+        old_size = slab_class_size[hdr->info];
+        // 还在同一级别里面, 不需要移动
+        if (s <= old_size && _slab_class(s) == (int)hdr->info)
+            return p;
+    } else {
+        old_size = hdr->info;
+    }
+
+    _p = slab_malloc(s);
+    if (_p) {
+        memcpy(_p, p, old_size < s ? old_size : s);
+        slab_free(p);
+    }
+    return _p;
+}
+
+int slab_get_stats(slab_stats_t *stats, int max)
+{
+    slab_cache_t *cache;
+    int i, n = max < SLAB_CLASSES + 1 ? max : SLAB_CLASSES + 1;
+
+    for (i = 0; i < n; i++) {
+        memset(&stats[i], 0, sizeof(slab_stats_t));
+        stats[i].size = i < SLAB_CLASSES ? slab_class_size[i] : 0;
+    }
+
+    slab_lock_acquire();
+    for (cache = slab_all; cache; cache = cache->next_all) {
+        for (i = 0; i < n; i++) {
+            long remote = im_atomic_load(&cache->remote_frees[i]);
+            stats[i].allocs += cache->counters[i].allocs;
+            stats[i].frees += cache->counters[i].frees + remote;
+            stats[i].remote_frees += remote;
+            stats[i].system_allocs += cache->counters[i].system_allocs;
         }
     }
-}
\ No newline at end of file
+    slab_lock_release();
+    return n;
+}
+
+#endif // IMCORE_SLAB
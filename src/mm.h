@@ -24,6 +24,41 @@ void ring_free(void *p);
 void *ring_realloc(void *p, size_t size, char *file, uint64_t line, void *userdata);
 void ring_clean_check(safe_mem_check_cb cb, void *cb_userdata);
 
+// 小块内存的尺寸分级, 最后一级统计直接malloc的大块内存
+#define SLAB_CLASSES 8
+#define SLAB_MAX_SIZE 256
+
+// 每级的分配统计, 所有线程累加, 读取的时候不加锁所以只是近似值
+typedef struct slab_stats {
+    size_t size;                // 块大小, 0表示大块
+    uint64_t allocs;            // safe_mem分配次数
+    uint64_t frees;             // 释放次数
+    uint64_t remote_frees;      // 其中在其他线程释放的次数
+    uint64_t system_allocs;     // 实际调用malloc的次数
+} slab_stats_t;
+
+void slab_init();
+void *slab_malloc(size_t s);
+void *slab_calloc(size_t s);
+void *slab_realloc(void *p, size_t s);
+void slab_free(void *p);
+// 获取统计, 返回写入的级数(最多SLAB_CLASSES + 1)
+int slab_get_stats(slab_stats_t *stats, int max);
+
+// 线性分配器, 从大块内存里面顺序切分, 不能单独释放, 只能整体重置或者释放
+// 用于生命周期相同的一组小对象, 比如解析出来的一整个stanza树
+typedef struct mem_arena mem_arena_t;
+
+// 默认的块大小
+#define ARENA_CHUNK_SIZE 4096
+
+mem_arena_t *arena_new(size_t chunk_size);
+void arena_free(mem_arena_t *arena);
+void *arena_alloc(mem_arena_t *arena, size_t s);
+char *arena_strndup(mem_arena_t *arena, const char *s, size_t len);
+// 回收所有分配, 只保留第一块内存
+void arena_reset(mem_arena_t *arena);
+
 #ifdef _DEBUG
 #define safe_mem_init ring_init_check
 #define safe_mem_malloc(s, d) ring_malloc(s, __FILENAME__, __LINE__, d)
@@ -31,13 +66,21 @@ void ring_clean_check(safe_mem_check_cb cb, void *cb_userdata);
 #define safe_mem_realloc(p, s, d) ring_realloc(p, s, __FILENAME__, __LINE__, d)
 #define safe_mem_free(p) ring_free(p)
 #define safe_mem_check(cb, data) ring_clean_check(cb, data)
+#elif defined(IMCORE_SLAB)
+// 每个线程按尺寸分级缓存小块内存, 所有指针必须由safe_mem分配才能用safe_mem_free释放
+#define safe_mem_init slab_init
+#define safe_mem_malloc(s, d) slab_malloc(s)
+#define safe_mem_calloc(s, d) slab_calloc(s)
+#define safe_mem_realloc(p, s, d) slab_realloc(p, s)
+#define safe_mem_free(p) slab_free(p)
+#define safe_mem_check(cb, data)
 #else
-#define safe_mem_init
+#define safe_mem_init()
 #define safe_mem_malloc(s, d) malloc(s)
-#define safe_mem_calloc(s, d) calloc(s)
+#define safe_mem_calloc(s, d) calloc(1, s)
 #define safe_mem_realloc(p, s, d) realloc(p, s)
 #define safe_mem_free(p) free(p)
-#define safe_mem_check
+#define safe_mem_check(cb, data)
 #endif
 
 #endif // _IMCORE_MM_H
\ No newline at end of file
@@ -24,7 +24,12 @@
 #include <resolv.h>
 #endif
 
+#include <event2/event.h>
+#include <event2/dns.h>
+#include <event2/util.h>
+
 #include "sock.h"
+#include "mm.h"
 
 struct dnsquery_header {
     unsigned short id;
@@ -189,69 +194,53 @@ int netbuf_get_domain_name(unsigned char *buf, int buflen, int *offset,
                            char *namebuf,
                            int namebuflen)
 {
-    unsigned char *start = buf + *offset;
-    unsigned char *p, *p2;
-    int *curroffset = offset;
+    int pos = *offset;
+    int end = -1;
+    int jumps = 0;
     int len = 0;
     
     *namebuf = '\0';
     
-    /* measure length */
-    p = start;
-    while (*p) {
-        if ((*p & 0xC0) == 0xC0) {
-            int newoffset = 0;
-            newoffset |= (*p++ & 0x3F) << 8;
-            newoffset |= *p++;
-            
-            p = buf + newoffset;
-        } else {
-            len += *p;
-            p += *p + 1;
+    /* every label and compression pointer is checked against buflen,
+       the packet may come straight from the network */
+    for (;;) {
+        int c;
+        
+        if (pos < 0 || pos >= buflen) {
+            return -1;
         }
-    }
-    
-    if (namebuflen < len) {
-        return len;
-    }
-    
-    /* actually copy in name */
-    p = start;
-    p2 = (unsigned char *)namebuf;
-    while (*p) {
-        if ((*p & 0xC0) == 0xC0) {
-            int newoffset = 0;
-            newoffset |= (*p++ & 0x3F) << 8;
-            newoffset |= *p++;
-            
-            if (curroffset) {
-                *curroffset += (int)(p - start);
-                curroffset = NULL;
+        
+        c = buf[pos];
+        if ((c & 0xC0) == 0xC0) {
+            if (pos + 1 >= buflen || ++jumps > 64) {
+                return -1;
             }
-            
-            p = buf + newoffset;
+            if (end < 0) {
+                end = pos + 2;
+            }
+            pos = ((c & 0x3F) << 8) | buf[pos + 1];
+        } else if (c & 0xC0) {
+            return -1;
+        } else if (c == 0) {
+            if (end < 0) {
+                end = pos + 1;
+            }
+            break;
         } else {
-            int i, partlen;
-            
-            if (*namebuf != '\0') {
-                *p2++ = '.';
+            if (pos + 1 + c > buflen || len + c + 2 > namebuflen) {
+                return -1;
             }
-            
-            partlen = *p++;
-            
-            for (i = 0; i < partlen; i++) {
-                *p2++ = *p++;
+            if (len) {
+                namebuf[len++] = '.';
             }
+            memcpy(namebuf + len, buf + pos + 1, c);
+            len += c;
+            pos += c + 1;
         }
     }
     
-    if (curroffset) {
-        p++;
-        *curroffset += (int)(p - start);
-        curroffset = NULL;
-    }
-    
-    *p2 = '\0';
+    namebuf[len] = '\0';
+    *offset = end;
     
     return 0;
 }
@@ -660,14 +649,14 @@ int im_srv_lookup(const char *service, const char *proto, const char *domain,
             struct dnsquery_resourcerecord rr;
     
             offset = 0;
-            netbuf_get_dnsquery_header(buf, 65536, &offset, &header);
+            netbuf_get_dnsquery_header(buf, len, &offset, &header);
     
             for (i = 0; i < header.qdcount; i++) {
-                netbuf_get_dnsquery_question(buf, 65536, &offset, &question);
+                netbuf_get_dnsquery_question(buf, len, &offset, &question);
             }
     
             for (i = 0; i < header.ancount; i++) {
-                netbuf_get_dnsquery_resourcerecord(buf, 65536, &offset, &rr);
+                netbuf_get_dnsquery_resourcerecord(buf, len, &offset, &rr);
     
                 if (rr.type == 33) {
                     struct dnsquery_srvrdata *srvrdata = &(rr.rdata);
@@ -680,7 +669,7 @@ int im_srv_lookup(const char *service, const char *proto, const char *domain,
             }
     
             for (i = 0; i < header.ancount; i++) {
-                netbuf_get_dnsquery_resourcerecord(buf, 65536, &offset, &rr);
+                netbuf_get_dnsquery_resourcerecord(buf, len, &offset, &rr);
             }
         }
     }
@@ -694,3 +683,268 @@ int im_srv_lookup(const char *service, const char *proto, const char *domain,
     
     return 1;
 }
+
+/* 异步查询
+ * 查询包用上面的netbuf函数构造, 在event_base上等待应答, 不阻塞调用线程
+ */
+
+// 每个nameserver的等待时间, 秒
+#define IM_SRV_TIMEOUT 2
+// 查询包最大长度
+#define IM_SRV_QUERY_SIZE 512
+// 应答包接收缓冲, 查询里面带EDNS0声明的大小
+#define IM_SRV_PACKET_SIZE 4096
+
+struct im_srv_request {
+    struct event_base *base;
+    struct evdns_base *dns;
+    struct event *ev;
+    evutil_socket_t fd;
+    int server;                 // 正在使用的nameserver序号
+    unsigned short id;
+    int querylen;
+    unsigned char query[IM_SRV_QUERY_SIZE];
+    im_srv_callback cb;
+    void *userdata;
+};
+
+static void _srv_close(im_srv_request_t *req)
+{
+    if (req->ev) {
+        event_free(req->ev);
+        req->ev = NULL;
+    }
+    if (req->fd != EVUTIL_INVALID_SOCKET) {
+        evutil_closesocket(req->fd);
+        req->fd = EVUTIL_INVALID_SOCKET;
+    }
+}
+
+static void _srv_finish(im_srv_request_t *req, int result, const im_srv_record_t *records,
+                        int count)
+{
+    _srv_close(req);
+    req->cb(result, records, count, req->userdata);
+    safe_mem_free(req);
+}
+
+// 解析应答, 返回-1表示不是这个查询的应答或者格式错误, 继续等待, -2表示服务器出错
+static int _srv_parse(unsigned char *buf, int len, unsigned short id,
+                      im_srv_record_t *records, int max)
+{
+    struct dnsquery_header header;
+    char name[1024];
+    unsigned short type, _class, rdlength;
+    unsigned int ttl;
+    int offset = 0;
+    int count = 0;
+    int i, j;
+    
+    if (len < 12)
+        return -1;
+    netbuf_get_dnsquery_header(buf, len, &offset, &header);
+    if (header.id != id || !header.qr)
+        return -1;
+    // NXDOMAIN表示域名不存在, 其他错误换下一个nameserver
+    if (header.rcode == 3)
+        return 0;
+    if (header.rcode != 0)
+        return -2;
+        
+    for (i = 0; i < header.qdcount; i++) {
+        if (netbuf_get_domain_name(buf, len, &offset, name, sizeof(name)) != 0 ||
+            offset + 4 > len)
+            return -1;
+        offset += 4;
+    }
+    
+    for (i = 0; i < header.ancount && count < max; i++) {
+        if (netbuf_get_domain_name(buf, len, &offset, name, sizeof(name)) != 0 ||
+            offset + 10 > len) {
+            // 被截断的应答使用已经完整的记录
+            if (header.tc)
+                break;
+            return -1;
+        }
+        netbuf_get_16bitnum(buf, len, &offset, &type);
+        netbuf_get_16bitnum(buf, len, &offset, &_class);
+        netbuf_get_32bitnum(buf, len, &offset, &ttl);
+        netbuf_get_16bitnum(buf, len, &offset, &rdlength);
+        if (offset + rdlength > len) {
+            if (header.tc)
+                break;
+            return -1;
+        }
+            
+        if (type == 33 && rdlength >= 7) {
+            im_srv_record_t *rec = &records[count];
+            int rdoffset = offset;
+            
+            netbuf_get_16bitnum(buf, len, &rdoffset, &rec->priority);
+            netbuf_get_16bitnum(buf, len, &rdoffset, &rec->weight);
+            netbuf_get_16bitnum(buf, len, &rdoffset, &rec->port);
+            rec->ttl = ttl;
+            // target是"."表示没有这个服务
+            if (netbuf_get_domain_name(buf, len, &rdoffset, rec->target,
+                                       sizeof(rec->target)) == 0 && rec->target[0]) {
+                count++;
+            }
+        }
+        offset += rdlength;
+    }
+    
+    // 按priority排序, 相同priority保持应答里面的顺序
+    for (i = 1; i < count; i++) {
+        im_srv_record_t rec = records[i];
+        for (j = i; j > 0 && records[j - 1].priority > rec.priority; j--)
+            records[j] = records[j - 1];
+        records[j] = rec;
+    }
+    return count;
+}
+
+static int _srv_send(im_srv_request_t *req);
+
+static void _srv_event_cb(evutil_socket_t fd, short what, void *arg)
+{
+    im_srv_request_t *req = arg;
+    im_srv_record_t records[IM_SRV_MAX_RECORDS];
+    unsigned char buf[IM_SRV_PACKET_SIZE];
+    int len, count;
+    
+    if (what & EV_TIMEOUT) {
+        // 换下一个nameserver
+        req->server++;
+        if (_srv_send(req) != 0)
+            _srv_finish(req, -1, NULL, 0);
+        return;
+    }
+    
+    for (;;) {
+        len = recv(fd, (char *)buf, sizeof(buf), 0);
+        if (len < 0) {
+            int err = evutil_socket_geterror(fd);
+#ifdef _WIN32
+            if (err == WSAEWOULDBLOCK || err == WSAEINTR)
+                return;
+#else
+            if (err == EAGAIN || err == EWOULDBLOCK || err == EINTR)
+                return;
+#endif
+            // 端口不可达之类的错误, 换下一个nameserver
+            req->server++;
+            if (_srv_send(req) != 0)
+                _srv_finish(req, -1, NULL, 0);
+            return;
+        }
+        
+        count = _srv_parse(buf, len, req->id, records, IM_SRV_MAX_RECORDS);
+        if (count >= 0) {
+            _srv_finish(req, 0, records, count);
+            return;
+        }
+        if (count == -2) {
+            req->server++;
+            if (_srv_send(req) != 0)
+                _srv_finish(req, -1, NULL, 0);
+            return;
+        }
+    }
+}
+
+// 向当前序号的nameserver发送查询, 没有可用的nameserver返回-1
+static int _srv_send(im_srv_request_t *req)
+{
+    struct sockaddr_storage ss;
+    struct timeval tv = { IM_SRV_TIMEOUT, 0 };
+    int sslen;
+    
+    _srv_close(req);
+    
+    for (; req->server < evdns_base_count_nameservers(req->dns); req->server++) {
+        sslen = evdns_base_get_nameserver_addr(req->dns, req->server,
+                                               (struct sockaddr *)&ss, sizeof(ss));
+        if (sslen <= 0 || sslen > (int)sizeof(ss))
+            continue;
+            
+        req->fd = socket(ss.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+        if (req->fd == EVUTIL_INVALID_SOCKET)
+            continue;
+        evutil_make_socket_nonblocking(req->fd);
+        evutil_make_socket_closeonexec(req->fd);
+        
+        // 连接以后只会收到这个nameserver的应答
+        if (connect(req->fd, (struct sockaddr *)&ss, sslen) != 0 ||
+            send(req->fd, (const char *)req->query, req->querylen, 0) != req->querylen) {
+            _srv_close(req);
+            continue;
+        }
+        
+        req->ev = event_new(req->base, req->fd, EV_READ | EV_PERSIST, _srv_event_cb, req);
+        if (!req->ev || event_add(req->ev, &tv) != 0) {
+            _srv_close(req);
+            return -1;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+im_srv_request_t *im_srv_lookup_async(struct event_base *base, struct evdns_base *dns,
+                                      const char *service, const char *proto,
+                                      const char *domain, im_srv_callback cb,
+                                      void *userdata)
+{
+    im_srv_request_t *req;
+    struct dnsquery_header header;
+    struct dnsquery_question question;
+    int offset = 0;
+    
+    if (!base || !dns || !cb)
+        return NULL;
+    if (strlen(service) + strlen(proto) + strlen(domain) + 4 >= sizeof(question.qname))
+        return NULL;
+        
+    req = safe_mem_calloc(sizeof(im_srv_request_t), NULL);
+    if (!req)
+        return NULL;
+    req->base = base;
+    req->dns = dns;
+    req->fd = EVUTIL_INVALID_SOCKET;
+    req->cb = cb;
+    req->userdata = userdata;
+    evutil_secure_rng_get_bytes(&req->id, sizeof(req->id));
+    
+    memset(&header, 0, sizeof(header));
+    header.id = req->id;
+    header.rd = 1;
+    header.qdcount = 1;
+    header.arcount = 1;
+    netbuf_add_dnsquery_header(req->query, IM_SRV_QUERY_SIZE, &offset, &header);
+    
+    memset(&question, 0, sizeof(question));
+    sprintf(question.qname, "_%s._%s.%s", service, proto, domain);
+    question.qtype = 33; /* SRV */
+    question.qclass = 1;
+    netbuf_add_dnsquery_question(req->query, IM_SRV_QUERY_SIZE, &offset, &question);
+    
+    // EDNS0, 允许超过512字节的UDP应答
+    netbuf_add_domain_name(req->query, IM_SRV_QUERY_SIZE, &offset, "");
+    netbuf_add_16bitnum(req->query, IM_SRV_QUERY_SIZE, &offset, 41);
+    netbuf_add_16bitnum(req->query, IM_SRV_QUERY_SIZE, &offset, IM_SRV_PACKET_SIZE);
+    netbuf_add_32bitnum(req->query, IM_SRV_QUERY_SIZE, &offset, 0);
+    netbuf_add_16bitnum(req->query, IM_SRV_QUERY_SIZE, &offset, 0);
+    req->querylen = offset;
+    
+    if (_srv_send(req) != 0) {
+        safe_mem_free(req);
+        return NULL;
+    }
+    return req;
+}
+
+void im_srv_cancel(im_srv_request_t *req)
+{
+    _srv_close(req);
+    safe_mem_free(req);
+}
@@ -6,8 +6,41 @@
 
 #include "common.h"
 
-// SRV记录查询
+struct event_base;
+struct evdns_base;
+
+// 一次查询最多保留的SRV记录
+#define IM_SRV_MAX_RECORDS 16
+
+// SRV记录
+typedef struct im_srv_record {
+    unsigned short priority;
+    unsigned short weight;
+    unsigned short port;
+    unsigned int ttl;
+    char target[256];
+} im_srv_record_t;
+
+// 异步查询
+typedef struct im_srv_request im_srv_request_t;
+
+// 查询结果回调, 记录按priority从小到大排列
+// result为0表示收到了应答, count为0表示域名没有SRV记录, -1表示所有nameserver都没有给出应答
+typedef void (*im_srv_callback)(int result, const im_srv_record_t *records, int count,
+                                void *userdata);
+
+// SRV记录查询, 阻塞
 int im_srv_lookup(const char *service, const char *proto, const char *domain,
                   char *resulttarget, int resulttargetlength, int *resultport);
 
+// 在base上异步查询SRV记录, 使用dns里面配置的nameserver, 依次尝试每个nameserver
+// 回调不会在调用期间发生, 返回NULL表示没有可用的nameserver或者内存不足
+im_srv_request_t *im_srv_lookup_async(struct event_base *base, struct evdns_base *dns,
+                                      const char *service, const char *proto,
+                                      const char *domain, im_srv_callback cb,
+                                      void *userdata);
+
+// 取消还没有完成的查询, 不会再回调
+void im_srv_cancel(im_srv_request_t *req);
+
 #endif // __IMCORE_SRV_H__ 
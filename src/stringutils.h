@@ -12,7 +12,7 @@
 #define im_strncmp strncmp
 #if defined(_MSC_VER)
 #define im_stricmp _strcmpi
-#define im_strincmp _strnicmp
+#define im_strnicmp _strnicmp
 #else
 #define im_stricmp strcasecmp
 #define im_strnicmp strncasecmp
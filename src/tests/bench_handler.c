@@ -0,0 +1,137 @@
+#include "bench_handler.h"
+#include "xmpp-inl.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+#ifdef POSIX
+#include <time.h>
+#endif
+
+// 每种规模派发的stanza数量
+#define BENCH_HANDLER_STANZAS 200000
+
+static const int bench_handler_counts[] = {1, 4, 16, 64};
+#define BENCH_HANDLER_ROUNDS (sizeof(bench_handler_counts) / sizeof(bench_handler_counts[0]))
+
+static uint64_t _bench_now_us()
+{
+#ifdef WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart * 1000000 / freq.QuadPart);
+#endif
+#ifdef POSIX
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static long bench_handler_calls;
+
+static int _bench_handler_hit(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata)
+{
+    bench_handler_calls++;
+    return 1;
+}
+
+// handler按函数去重, 生成64个不会被调用的函数
+#define BENCH_HANDLER_MISS(n) \
+    static int _bench_handler_miss##n(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata) \
+    { \
+        return 1; \
+    }
+#define BENCH_HANDLER_MISS4(n) \
+    BENCH_HANDLER_MISS(n##0) BENCH_HANDLER_MISS(n##1) BENCH_HANDLER_MISS(n##2) BENCH_HANDLER_MISS(n##3)
+#define BENCH_HANDLER_MISS16(n) \
+    BENCH_HANDLER_MISS4(n##0) BENCH_HANDLER_MISS4(n##1) BENCH_HANDLER_MISS4(n##2) BENCH_HANDLER_MISS4(n##3)
+BENCH_HANDLER_MISS16(0)
+BENCH_HANDLER_MISS16(1)
+BENCH_HANDLER_MISS16(2)
+BENCH_HANDLER_MISS16(3)
+
+#define BENCH_HANDLER_REF4(n) \
+    _bench_handler_miss##n##0, _bench_handler_miss##n##1, _bench_handler_miss##n##2, _bench_handler_miss##n##3
+#define BENCH_HANDLER_REF16(n) \
+    BENCH_HANDLER_REF4(n##0), BENCH_HANDLER_REF4(n##1), BENCH_HANDLER_REF4(n##2), BENCH_HANDLER_REF4(n##3)
+
+static const xmpp_handler bench_handler_misses[] = {
+    BENCH_HANDLER_REF16(0), BENCH_HANDLER_REF16(1), BENCH_HANDLER_REF16(2), BENCH_HANDLER_REF16(3)
+};
+
+static xmpp_stanza_t *_bench_handler_child(xmpp_ctx_t *ctx, xmpp_stanza_t *parent,
+                                           const char *name, const char *ns)
+{
+    xmpp_stanza_t *child = xmpp_stanza_new(ctx);
+
+    xmpp_stanza_set_name(child, name);
+    xmpp_stanza_set_ns(child, ns);
+    xmpp_stanza_add_child(parent, child);
+    xmpp_stanza_release(child);
+    return child;
+}
+
+// 一半handler按name注册, 一半只按ns注册, 只有一个匹配聊天消息
+static bool _bench_handler_run(xmpp_ctx_t *ctx, xmpp_stanza_t *msg, int count)
+{
+    xmpp_conn_t *conn = xmpp_conn_new(ctx);
+    char key[64];
+    uint64_t begin, us;
+    int i;
+
+    assert(conn);
+    conn->authenticated = 1;
+    for (i = 0; i < count - 1; i++) {
+        if (i % 2) {
+            snprintf(key, sizeof(key), "urn:bench:%d", i);
+            xmpp_handler_add(conn, bench_handler_misses[i], key, NULL, NULL, NULL);
+        } else {
+            snprintf(key, sizeof(key), "element%d", i);
+            xmpp_handler_add(conn, bench_handler_misses[i], NULL, key, NULL, NULL);
+        }
+    }
+    xmpp_handler_add(conn, _bench_handler_hit, "urn:xmpp:receipts", "message", "chat", NULL);
+
+    bench_handler_calls = 0;
+    begin = _bench_now_us();
+    for (i = 0; i < BENCH_HANDLER_STANZAS; i++)
+        handler_fire_stanza(conn, msg);
+    us = _bench_now_us() - begin;
+
+    printf("handlers %4d  dispatch %8.1f ns/stanza\n", count,
+           (double)us * 1000.0 / BENCH_HANDLER_STANZAS);
+
+    xmpp_conn_release(conn);
+    return bench_handler_calls == BENCH_HANDLER_STANZAS;
+}
+
+bool bench_handler(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx = xmpp_ctx_new(NULL, NULL);
+    xmpp_stanza_t *msg;
+    bool ok = true;
+    size_t i;
+
+    assert(ctx);
+    msg = xmpp_stanza_new(ctx);
+    xmpp_stanza_set_name(msg, "message");
+    xmpp_stanza_set_type(msg, "chat");
+    xmpp_stanza_set_id(msg, "m1");
+    _bench_handler_child(ctx, msg, "body", XMPP_NS_CLIENT);
+    _bench_handler_child(ctx, msg, "active", "http://jabber.org/protocol/chatstates");
+    _bench_handler_child(ctx, msg, "request", "urn:xmpp:receipts");
+
+    for (i = 0; i < BENCH_HANDLER_ROUNDS; i++) {
+        if (!_bench_handler_run(ctx, msg, bench_handler_counts[i]))
+            ok = false;
+    }
+
+    xmpp_stanza_release(msg);
+    xmpp_ctx_free(ctx);
+    return ok;
+}
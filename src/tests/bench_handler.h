@@ -0,0 +1,3 @@
+#include <stdbool.h>
+
+bool bench_handler(int argc, char **argv);
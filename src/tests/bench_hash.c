@@ -0,0 +1,133 @@
+#include "bench_hash.h"
+#include "hash.h"
+#include "mm.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+#ifdef POSIX
+#include <time.h>
+#endif
+
+// 每种规模查找的总次数
+#define BENCH_HASH_LOOKUPS 1000000
+// 不扩容的对照组, 和原来conn->id_handlers一样固定32个槽
+#define BENCH_HASH_FIXED_SIZE 32
+// 对照组只测到这个规模, 再大每次查找要遍历上千个节点
+#define BENCH_HASH_FIXED_MAX 4096
+#define BENCH_HASH_KEY_LEN 24
+
+static const int bench_hash_counts[] = {16, 256, 4096, 65536};
+#define BENCH_HASH_ROUNDS (sizeof(bench_hash_counts) / sizeof(bench_hash_counts[0]))
+
+static uint64_t _bench_now_us()
+{
+#ifdef WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart * 1000000 / freq.QuadPart);
+#endif
+#ifdef POSIX
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+// 和iq id一样的格式, 前缀相同只有后面几位不同, 前一半插入, 后一半用来测试查不到
+static char (*_bench_hash_keys(int count))[BENCH_HASH_KEY_LEN]
+{
+    char (*keys)[BENCH_HASH_KEY_LEN] = safe_mem_malloc(sizeof(*keys) * count * 2, NULL);
+    int i;
+
+    assert(keys);
+    for (i = 0; i < count * 2; i++)
+        snprintf(keys[i], BENCH_HASH_KEY_LEN, "imcore_iq_%08d", i);
+    return keys;
+}
+
+static bool _bench_hash_run(const char *name, int count, bool fixed)
+{
+    hash_t *table = hash_new(BENCH_HASH_FIXED_SIZE, NULL);
+    char (*keys)[BENCH_HASH_KEY_LEN] = _bench_hash_keys(count);
+    uint64_t begin, insert_us, hit_us, miss_us;
+    hash_iterator_t *iter;
+    const char *k;
+    bool ok = true;
+    int i, n;
+
+    assert(table);
+    if (fixed)
+        hash_set_load_factor(table, INT_MAX);
+
+    begin = _bench_now_us();
+    for (i = 0; i < count; i++) {
+        if (hash_add(table, keys[i], (void *)(intptr_t)(i + 1)))
+            ok = false;
+    }
+    insert_us = _bench_now_us() - begin;
+
+    // 没有释放函数的表不能覆盖
+    if (!hash_add(table, keys[0], NULL))
+        ok = false;
+
+    begin = _bench_now_us();
+    for (n = 0; n < BENCH_HASH_LOOKUPS; n++) {
+        i = n % count;
+        if (hash_get(table, keys[i]) != (void *)(intptr_t)(i + 1))
+            ok = false;
+    }
+    hit_us = _bench_now_us() - begin;
+
+    begin = _bench_now_us();
+    for (n = 0; n < BENCH_HASH_LOOKUPS; n++) {
+        if (hash_get(table, keys[count + n % count]))
+            ok = false;
+    }
+    miss_us = _bench_now_us() - begin;
+
+    // 遍历一遍, 再遍历的时候删除当前key
+    n = 0;
+    iter = hash_iter_new(table);
+    while (hash_iter_next(iter) != NULL)
+        n++;
+    hash_iter_release(iter);
+    if (n != count)
+        ok = false;
+
+    iter = hash_iter_new(table);
+    while ((k = hash_iter_next(iter)) != NULL) {
+        if (hash_drop(table, k))
+            ok = false;
+    }
+    hash_iter_release(iter);
+    if (hash_num_keys(table) != 0)
+        ok = false;
+
+    printf("%-6s %6d keys  insert %7.1f  hit %7.1f  miss %7.1f ns/op\n", name, count,
+           (double)insert_us * 1000.0 / count,
+           (double)hit_us * 1000.0 / BENCH_HASH_LOOKUPS,
+           (double)miss_us * 1000.0 / BENCH_HASH_LOOKUPS);
+
+    hash_release(table);
+    safe_mem_free(keys);
+    return ok;
+}
+
+bool bench_hash(int argc, char **argv)
+{
+    bool ok = true;
+    size_t i;
+
+    for (i = 0; i < BENCH_HASH_ROUNDS; i++) {
+        ok = _bench_hash_run("grow", bench_hash_counts[i], false) && ok;
+        if (bench_hash_counts[i] <= BENCH_HASH_FIXED_MAX)
+            ok = _bench_hash_run("fixed", bench_hash_counts[i], true) && ok;
+    }
+    return ok;
+}
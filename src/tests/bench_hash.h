@@ -0,0 +1,3 @@
+#include <stdbool.h>
+
+bool bench_hash(int argc, char **argv);
@@ -0,0 +1,191 @@
+#include "bench_parser.h"
+#include "xmpp-inl.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+#ifdef POSIX
+#include <time.h>
+#endif
+
+// 解析的stanza数量
+#define BENCH_PARSER_STANZAS 100000
+// 每次喂给解析器的字节数, 和读回调一次读到的数据差不多
+#define BENCH_PARSER_CHUNK 4096
+// 每隔多少个stanza拷贝出来一个, 到下一个stanza的时候检查内容
+#define BENCH_PARSER_COPY_EVERY 1000
+
+static const char bench_parser_open[] =
+    "<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' "
+    "from='example.com' id='s1' version='1.0'>";
+
+static const char bench_parser_stanza[] =
+    "<message from='alice@example.com/res' to='bob@example.com' type='chat' id='m1'>"
+    "<body>hello, this is a short chat message</body>"
+    "<active xmlns='http://jabber.org/protocol/chatstates'/>"
+    "<request xmlns='urn:xmpp:receipts'/>"
+    "</message>";
+
+typedef struct bench_parser_state {
+    int count;
+    int checked;
+    bool ok;
+    // 上一次拷贝出来的stanza, 这时候解析器已经回收过
+    xmpp_stanza_t *copy;
+} bench_parser_state_t;
+
+static uint64_t _bench_now_us()
+{
+#ifdef WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart * 1000000 / freq.QuadPart);
+#endif
+#ifdef POSIX
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static bool _bench_parser_check(xmpp_stanza_t *stanza)
+{
+    xmpp_stanza_t *body;
+    const char *text;
+
+    if (strcmp(xmpp_stanza_get_name_ptr(stanza), "message") ||
+        strcmp(xmpp_stanza_get_attribute(stanza, "to"), "bob@example.com") ||
+        strcmp(xmpp_stanza_get_id_ptr(stanza), "m1"))
+        return false;
+
+    // 文本跨过两次读的时候会被expat拆成几段, 只检查第一段
+    body = xmpp_stanza_get_child_by_name(stanza, "body");
+    if (!body)
+        return false;
+    text = xmpp_stanza_get_text_ptr(body);
+    if (!text || strncmp(text, "hello, this is a short chat message", strlen(text)))
+        return false;
+
+    return xmpp_stanza_get_child_by_ns(stanza, "urn:xmpp:receipts") != NULL;
+}
+
+static void _bench_parser_stanza(xmpp_stanza_t *stanza, void *userdata)
+{
+    bench_parser_state_t *state = userdata;
+
+    state->count++;
+    if (!_bench_parser_check(stanza))
+        state->ok = false;
+
+    if (state->copy) {
+        // 原来的树已经回收, 拷贝必须还是完整的
+        if (!_bench_parser_check(state->copy))
+            state->ok = false;
+        xmpp_stanza_release(state->copy);
+        state->copy = NULL;
+        state->checked++;
+    }
+
+    if (state->count % BENCH_PARSER_COPY_EVERY == 0) {
+        state->copy = xmpp_stanza_clone(stanza);
+        if (!state->copy || state->copy == stanza)
+            state->ok = false;
+    }
+}
+
+// 对比: 用普通stanza接口逐个分配再逐个释放同样的树
+static void _bench_parser_heap(xmpp_ctx_t *ctx)
+{
+    xmpp_stanza_t *msg, *body, *text, *child;
+    uint64_t begin = _bench_now_us(), us;
+    int i;
+
+    for (i = 0; i < BENCH_PARSER_STANZAS; i++) {
+        msg = xmpp_stanza_new(ctx);
+        xmpp_stanza_set_name(msg, "message");
+        xmpp_stanza_set_attribute(msg, "from", "alice@example.com/res");
+        xmpp_stanza_set_attribute(msg, "to", "bob@example.com");
+        xmpp_stanza_set_type(msg, "chat");
+        xmpp_stanza_set_id(msg, "m1");
+        xmpp_stanza_set_ns(msg, "jabber:client");
+
+        body = xmpp_stanza_new(ctx);
+        xmpp_stanza_set_name(body, "body");
+        xmpp_stanza_set_ns(body, "jabber:client");
+        text = xmpp_stanza_new(ctx);
+        xmpp_stanza_set_text(text, "hello, this is a short chat message");
+        xmpp_stanza_add_child(body, text);
+        xmpp_stanza_release(text);
+        xmpp_stanza_add_child(msg, body);
+        xmpp_stanza_release(body);
+
+        child = xmpp_stanza_new(ctx);
+        xmpp_stanza_set_name(child, "active");
+        xmpp_stanza_set_ns(child, "http://jabber.org/protocol/chatstates");
+        xmpp_stanza_add_child(msg, child);
+        xmpp_stanza_release(child);
+
+        child = xmpp_stanza_new(ctx);
+        xmpp_stanza_set_name(child, "request");
+        xmpp_stanza_set_ns(child, "urn:xmpp:receipts");
+        xmpp_stanza_add_child(msg, child);
+        xmpp_stanza_release(child);
+
+        xmpp_stanza_release(msg);
+    }
+    us = _bench_now_us() - begin;
+    printf("heap   build+free %8.1f ns/stanza\n", (double)us * 1000.0 / BENCH_PARSER_STANZAS);
+}
+
+bool bench_parser(int argc, char **argv)
+{
+    bench_parser_state_t state = { 0, 0, true, NULL };
+    size_t stanza_len = sizeof(bench_parser_stanza) - 1;
+    size_t total = stanza_len * BENCH_PARSER_STANZAS, off;
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    parser_t *parser;
+    char *stream;
+    uint64_t begin, us;
+    int i;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    conn = xmpp_conn_new(ctx);
+    assert(ctx && conn);
+    parser = parser_new(conn, NULL, NULL, _bench_parser_stanza, &state);
+    assert(parser);
+
+    stream = safe_mem_malloc(total, NULL);
+    assert(stream);
+    for (i = 0; i < BENCH_PARSER_STANZAS; i++)
+        memcpy(stream + stanza_len * i, bench_parser_stanza, stanza_len);
+
+    parser_feed(parser, (char *)bench_parser_open, sizeof(bench_parser_open) - 1);
+
+    begin = _bench_now_us();
+    for (off = 0; off < total; off += BENCH_PARSER_CHUNK) {
+        int len = (int)(total - off < BENCH_PARSER_CHUNK ? total - off : BENCH_PARSER_CHUNK);
+        if (!parser_feed(parser, stream + off, len)) {
+            state.ok = false;
+            break;
+        }
+    }
+    us = _bench_now_us() - begin;
+    printf("arena  parse      %8.1f ns/stanza\n", (double)us * 1000.0 / BENCH_PARSER_STANZAS);
+
+    _bench_parser_heap(ctx);
+
+    if (state.copy)
+        xmpp_stanza_release(state.copy);
+    safe_mem_free(stream);
+    parser_free(parser);
+    xmpp_conn_release(conn);
+    xmpp_ctx_free(ctx);
+
+    printf("parsed %d stanzas, checked %d copies\n", state.count, state.checked);
+    return state.ok && state.count == BENCH_PARSER_STANZAS;
+}
@@ -0,0 +1,3 @@
+#include <stdbool.h>
+
+bool bench_parser(int argc, char **argv);
@@ -0,0 +1,395 @@
+#include "bench_serializer.h"
+#include "xmpp-inl.h"
+#include "stringutils.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+#ifdef POSIX
+#include <time.h>
+#endif
+
+// 每种stanza序列化的次数
+#define BENCH_SERIALIZER_ROUNDS 100000
+// 每写多少个stanza清空一次输出缓冲区, 相当于一次socket写
+#define BENCH_SERIALIZER_FLUSH 64
+// 花名册条目数
+#define BENCH_SERIALIZER_ROSTER_ITEMS 50
+
+static uint64_t _bench_now_us()
+{
+#ifdef WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart * 1000000 / freq.QuadPart);
+#endif
+#ifdef POSIX
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+// 对照组: 原来的序列化, 每个文本和属性值单独分配转义, snprintf写到固定缓冲区, 不够大再整棵树写一遍
+static char *_legacy_escape(xmpp_ctx_t *ctx, const char *text)
+{
+    size_t len = 0;
+    const char *src;
+    char *dst, *buf;
+
+    for (src = text; *src; src++) {
+        switch (*src) {
+        case '<':
+        case '>':
+            len += 4;
+            break;
+        case '&':
+            len += 5;
+            break;
+        case '"':
+            len += 6;
+            break;
+        default:
+            len++;
+        }
+    }
+    if ((buf = xmpp_alloc(ctx, len + 1)) == NULL)
+        return NULL;
+    for (src = text, dst = buf; *src; src++) {
+        switch (*src) {
+        case '<':
+            strcpy(dst, "&lt;");
+            dst += 4;
+            break;
+        case '>':
+            strcpy(dst, "&gt;");
+            dst += 4;
+            break;
+        case '&':
+            strcpy(dst, "&amp;");
+            dst += 5;
+            break;
+        case '"':
+            strcpy(dst, "&quot;");
+            dst += 6;
+            break;
+        default:
+            *dst++ = *src;
+        }
+    }
+    *dst = '\0';
+    return buf;
+}
+
+static inline void _legacy_update(int *written, int length, int lastwrite, size_t *left, char **ptr)
+{
+    *written += lastwrite;
+    if (*written > length) {
+        *left = 0;
+        *ptr = NULL;
+    } else {
+        *left -= lastwrite;
+        *ptr = &(*ptr)[lastwrite];
+    }
+}
+
+static int _legacy_render(xmpp_stanza_t *stanza, char *buf, size_t buflen)
+{
+    char *ptr = buf, *tmp;
+    size_t left = buflen;
+    xmpp_stanza_t *child;
+    const char *parent_ns;
+    int ret, written = 0, i;
+
+    if (stanza->type == XMPP_STANZA_UNKNOWN || !stanza->data)
+        return XMPP_EINVOP;
+
+    if (stanza->type == XMPP_STANZA_TEXT) {
+        tmp = _legacy_escape(stanza->ctx, stanza->data);
+        if (tmp == NULL)
+            return XMPP_EMEM;
+        ret = im_snprintf(ptr, left, "%s", tmp);
+        xmpp_free(stanza->ctx, tmp);
+        _legacy_update(&written, buflen, ret, &left, &ptr);
+        return written;
+    }
+
+    ret = im_snprintf(ptr, left, "<%s", stanza->data);
+    _legacy_update(&written, buflen, ret, &left, &ptr);
+    for (i = 0; i < stanza->attr_count; i++) {
+        if (!strcmp(stanza->attrs[i].key, "xmlns")) {
+            if (stanza->parent) {
+                parent_ns = xmpp_stanza_get_ns(stanza->parent);
+                if (parent_ns && !strcmp(stanza->attrs[i].value, parent_ns))
+                    continue;
+            } else if (!strcmp(stanza->attrs[i].value, XMPP_NS_CLIENT)) {
+                continue;
+            }
+        }
+        tmp = _legacy_escape(stanza->ctx, stanza->attrs[i].value);
+        if (tmp == NULL)
+            return XMPP_EMEM;
+        ret = im_snprintf(ptr, left, " %s='%s'", stanza->attrs[i].key, tmp);
+        xmpp_free(stanza->ctx, tmp);
+        _legacy_update(&written, buflen, ret, &left, &ptr);
+    }
+
+    if (!stanza->children) {
+        ret = im_snprintf(ptr, left, "/>");
+        _legacy_update(&written, buflen, ret, &left, &ptr);
+        return written;
+    }
+
+    ret = im_snprintf(ptr, left, ">");
+    _legacy_update(&written, buflen, ret, &left, &ptr);
+    for (child = stanza->children; child; child = child->next) {
+        ret = _legacy_render(child, ptr, left);
+        if (ret < 0)
+            return ret;
+        _legacy_update(&written, buflen, ret, &left, &ptr);
+    }
+    ret = im_snprintf(ptr, left, "</%s>", stanza->data);
+    _legacy_update(&written, buflen, ret, &left, &ptr);
+    return written;
+}
+
+static int _legacy_to_text(xmpp_stanza_t *stanza, char **buf, size_t *buflen)
+{
+    size_t length = 128;
+    char *buffer = xmpp_alloc(stanza->ctx, length), *tmp;
+    int ret;
+
+    if (!buffer)
+        return XMPP_EMEM;
+    ret = _legacy_render(stanza, buffer, length);
+    if (ret < 0) {
+        xmpp_free(stanza->ctx, buffer);
+        return ret;
+    }
+    if ((size_t)ret > length - 1) {
+        tmp = xmpp_realloc(stanza->ctx, buffer, ret + 1);
+        if (!tmp) {
+            xmpp_free(stanza->ctx, buffer);
+            return XMPP_EMEM;
+        }
+        length = ret + 1;
+        buffer = tmp;
+        ret = _legacy_render(stanza, buffer, length);
+    }
+    buffer[length - 1] = 0;
+    *buf = buffer;
+    *buflen = ret;
+    return XMPP_EOK;
+}
+
+static xmpp_stanza_t *_bench_tag(xmpp_ctx_t *ctx, xmpp_stanza_t *parent, const char *name,
+                                 const char *ns)
+{
+    xmpp_stanza_t *stanza = xmpp_stanza_new(ctx);
+
+    xmpp_stanza_set_name(stanza, name);
+    if (ns)
+        xmpp_stanza_set_ns(stanza, ns);
+    if (parent) {
+        xmpp_stanza_add_child(parent, stanza);
+        xmpp_stanza_release(stanza);
+    }
+    return stanza;
+}
+
+static void _bench_text(xmpp_ctx_t *ctx, xmpp_stanza_t *parent, const char *text)
+{
+    xmpp_stanza_t *stanza = xmpp_stanza_new(ctx);
+
+    xmpp_stanza_set_text(stanza, text);
+    xmpp_stanza_add_child(parent, stanza);
+    xmpp_stanza_release(stanza);
+}
+
+static xmpp_stanza_t *_bench_message(xmpp_ctx_t *ctx)
+{
+    xmpp_stanza_t *msg = _bench_tag(ctx, NULL, "message", XMPP_NS_CLIENT);
+
+    xmpp_stanza_set_attribute(msg, "from", "alice@example.com/res");
+    xmpp_stanza_set_attribute(msg, "to", "bob@example.com");
+    xmpp_stanza_set_type(msg, "chat");
+    xmpp_stanza_set_id(msg, "m1");
+    _bench_text(ctx, _bench_tag(ctx, msg, "body", NULL),
+                "hello, this is a short chat message with <markup> & entities");
+    _bench_tag(ctx, msg, "active", "http://jabber.org/protocol/chatstates");
+    _bench_tag(ctx, msg, "request", "urn:xmpp:receipts");
+    return msg;
+}
+
+static xmpp_stanza_t *_bench_roster(xmpp_ctx_t *ctx)
+{
+    xmpp_stanza_t *iq = _bench_tag(ctx, NULL, "iq", XMPP_NS_CLIENT);
+    xmpp_stanza_t *query, *item;
+    char jid[64], name[32];
+    int i;
+
+    xmpp_stanza_set_type(iq, "result");
+    xmpp_stanza_set_id(iq, "roster_1");
+    xmpp_stanza_set_attribute(iq, "to", "alice@example.com/res");
+    query = _bench_tag(ctx, iq, "query", "jabber:iq:roster");
+    xmpp_stanza_set_attribute(query, "ver", "ver14");
+    for (i = 0; i < BENCH_SERIALIZER_ROSTER_ITEMS; i++) {
+        im_snprintf(jid, sizeof(jid), "contact%03d@example.com", i);
+        im_snprintf(name, sizeof(name), "Contact %d & co", i);
+        item = _bench_tag(ctx, query, "item", NULL);
+        xmpp_stanza_set_attribute(item, "jid", jid);
+        xmpp_stanza_set_attribute(item, "name", name);
+        xmpp_stanza_set_attribute(item, "subscription", "both");
+        _bench_text(ctx, _bench_tag(ctx, item, "group", NULL), "Friends");
+    }
+    return iq;
+}
+
+static xmpp_stanza_t *_bench_disco(xmpp_ctx_t *ctx)
+{
+    static const char *features[] = {
+        "http://jabber.org/protocol/disco#info", "http://jabber.org/protocol/caps",
+        "http://jabber.org/protocol/chatstates", "urn:xmpp:receipts", "urn:xmpp:ping",
+        "jabber:iq:version", "urn:xmpp:time"
+    };
+    xmpp_stanza_t *iq = _bench_tag(ctx, NULL, "iq", XMPP_NS_CLIENT);
+    xmpp_stanza_t *query, *identity, *feature;
+    size_t i;
+
+    xmpp_stanza_set_type(iq, "result");
+    xmpp_stanza_set_id(iq, "disco_1");
+    xmpp_stanza_set_attribute(iq, "to", "bob@example.com/res");
+    query = _bench_tag(ctx, iq, "query", "http://jabber.org/protocol/disco#info");
+    identity = _bench_tag(ctx, query, "identity", NULL);
+    xmpp_stanza_set_attribute(identity, "category", "client");
+    xmpp_stanza_set_attribute(identity, "type", "pc");
+    xmpp_stanza_set_attribute(identity, "name", "imcore");
+    for (i = 0; i < sizeof(features) / sizeof(features[0]); i++) {
+        feature = _bench_tag(ctx, query, "feature", NULL);
+        xmpp_stanza_set_attribute(feature, "var", features[i]);
+    }
+    return iq;
+}
+
+// 两种方式的输出必须完全相同
+static bool _bench_serializer_verify(xmpp_stanza_t *stanza, struct evbuffer *out)
+{
+    char *old_buf, *new_buf;
+    size_t old_len, new_len;
+    bool ok;
+
+    if (_legacy_to_text(stanza, &old_buf, &old_len) != XMPP_EOK)
+        return false;
+    if (xmpp_stanza_to_text(stanza, &new_buf, &new_len) != XMPP_EOK) {
+        xmpp_free(stanza->ctx, old_buf);
+        return false;
+    }
+
+    evbuffer_drain(out, evbuffer_get_length(out));
+    ok = old_len == new_len && !memcmp(old_buf, new_buf, old_len) &&
+         stanza_render(stanza, out) == XMPP_EOK && evbuffer_get_length(out) == old_len &&
+         !memcmp(evbuffer_pullup(out, -1), old_buf, old_len);
+    evbuffer_drain(out, evbuffer_get_length(out));
+
+    xmpp_free(stanza->ctx, old_buf);
+    xmpp_free(stanza->ctx, new_buf);
+    return ok;
+}
+
+static bool _bench_serializer_run(const char *name, xmpp_stanza_t *stanza, struct evbuffer *out)
+{
+    uint64_t begin, old_us, new_us;
+    size_t bytes = 0, len;
+    char *buf;
+    int i;
+
+    if (!_bench_serializer_verify(stanza, out)) {
+        printf("%-8s output mismatch\n", name);
+        return false;
+    }
+
+    // 原来的路径: 生成字符串再拷贝进bufferevent
+    begin = _bench_now_us();
+    for (i = 0; i < BENCH_SERIALIZER_ROUNDS; i++) {
+        if (_legacy_to_text(stanza, &buf, &len) != XMPP_EOK)
+            return false;
+        evbuffer_add(out, buf, len);
+        xmpp_free(stanza->ctx, buf);
+        bytes += len;
+        if (i % BENCH_SERIALIZER_FLUSH == BENCH_SERIALIZER_FLUSH - 1)
+            evbuffer_drain(out, evbuffer_get_length(out));
+    }
+    old_us = _bench_now_us() - begin;
+    evbuffer_drain(out, evbuffer_get_length(out));
+
+    // 直接写到evbuffer预留的空间
+    begin = _bench_now_us();
+    for (i = 0; i < BENCH_SERIALIZER_ROUNDS; i++) {
+        if (stanza_render(stanza, out) != XMPP_EOK)
+            return false;
+        if (i % BENCH_SERIALIZER_FLUSH == BENCH_SERIALIZER_FLUSH - 1)
+            evbuffer_drain(out, evbuffer_get_length(out));
+    }
+    new_us = _bench_now_us() - begin;
+    evbuffer_drain(out, evbuffer_get_length(out));
+
+    printf("%-8s %6u bytes  to_text+copy %8.1f MB/s  evbuffer %8.1f MB/s\n", name,
+           (unsigned)(bytes / BENCH_SERIALIZER_ROUNDS),
+           (double)bytes / (old_us ? old_us : 1),
+           (double)bytes / (new_us ? new_us : 1));
+    return true;
+}
+
+// 属性值用单引号, 里面的单引号必须转义
+static bool _bench_serializer_escape(xmpp_ctx_t *ctx)
+{
+    static const char expect[] =
+        "<presence to='a@b' status='it&apos;s &quot;5&quot; &lt; 6 &amp; 7'>"
+        "<status>it's \"5\" &lt; 6 &amp; 7 &gt; 4</status></presence>";
+    xmpp_stanza_t *presence = _bench_tag(ctx, NULL, "presence", NULL);
+    char *buf = NULL;
+    size_t len;
+    bool ok;
+
+    xmpp_stanza_set_attribute(presence, "to", "a@b");
+    xmpp_stanza_set_attribute(presence, "status", "it's \"5\" < 6 & 7");
+    _bench_text(ctx, _bench_tag(ctx, presence, "status", NULL), "it's \"5\" < 6 & 7 > 4");
+
+    ok = xmpp_stanza_to_text(presence, &buf, &len) == XMPP_EOK &&
+         len == sizeof(expect) - 1 && !strcmp(buf, expect);
+    if (!ok)
+        printf("escape mismatch: %s\n", buf ? buf : "(null)");
+    if (buf)
+        xmpp_free(ctx, buf);
+    xmpp_stanza_release(presence);
+    return ok;
+}
+
+bool bench_serializer(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx = xmpp_ctx_new(NULL, NULL);
+    struct evbuffer *out = evbuffer_new();
+    xmpp_stanza_t *message, *roster, *disco;
+    bool ok;
+
+    assert(ctx && out);
+    message = _bench_message(ctx);
+    roster = _bench_roster(ctx);
+    disco = _bench_disco(ctx);
+
+    ok = _bench_serializer_escape(ctx);
+    ok = _bench_serializer_run("message", message, out) && ok;
+    ok = _bench_serializer_run("roster", roster, out) && ok;
+    ok = _bench_serializer_run("disco", disco, out) && ok;
+
+    xmpp_stanza_release(message);
+    xmpp_stanza_release(roster);
+    xmpp_stanza_release(disco);
+    evbuffer_free(out);
+    xmpp_ctx_free(ctx);
+    return ok;
+}
@@ -0,0 +1,3 @@
+#include <stdbool.h>
+
+bool bench_serializer(int argc, char **argv);
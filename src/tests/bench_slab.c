@@ -0,0 +1,80 @@
+#include "bench_slab.h"
+#include "im-thread.h"
+#include "im-atomic.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+#ifdef IMCORE_SLAB
+// 模拟收到的stanza数量, 每个stanza分配结构体, hash表项以及几个短字符串
+#define BENCH_SLAB_STANZAS 200000
+// 每个stanza的分配大小, 对应xmpp_stanza_t, hashentry_t, 名字和属性值
+static const size_t bench_slab_sizes[] = {88, 32, 8, 16, 24, 40};
+#define BENCH_SLAB_ALLOCS (sizeof(bench_slab_sizes) / sizeof(bench_slab_sizes[0]))
+
+static volatile long bench_slab_done = 0;
+
+// 在另一个线程里面释放, 走跨线程释放队列
+static void _bench_slab_release(int msg_id, void *userdata)
+{
+    void **ptrs = userdata;
+    for (size_t i = 0; i < BENCH_SLAB_ALLOCS; i++)
+        safe_mem_free(ptrs[i]);
+    safe_mem_free(ptrs);
+    im_atomic_inc(&bench_slab_done);
+}
+#endif
+
+bool bench_slab(int argc, char **argv)
+{
+#ifdef IMCORE_SLAB
+    slab_stats_t before[SLAB_CLASSES + 1], stats[SLAB_CLASSES + 1];
+    uint64_t allocs = 0, system_allocs = 0;
+    im_thread_t *sink = im_thread_new();
+    int n, i;
+
+    assert(sink);
+    im_thread_start(sink, NULL);
+    safe_mem_init();
+
+    // 统计是进程累计的, 只看本次的增量
+    slab_get_stats(before, SLAB_CLASSES + 1);
+
+    for (i = 0; i < BENCH_SLAB_STANZAS; i++) {
+        void **ptrs = safe_mem_malloc(sizeof(void *) * BENCH_SLAB_ALLOCS, NULL);
+        assert(ptrs);
+        for (size_t j = 0; j < BENCH_SLAB_ALLOCS; j++) {
+            ptrs[j] = safe_mem_malloc(bench_slab_sizes[j], NULL);
+            assert(ptrs[j]);
+        }
+        // 一半在本线程释放, 一半交给其他线程释放
+        if (i % 2) {
+            _bench_slab_release(0, ptrs);
+        } else {
+            im_thread_post(sink, 0, _bench_slab_release, 0, ptrs);
+        }
+    }
+    while (im_atomic_load(&bench_slab_done) < BENCH_SLAB_STANZAS)
+        im_thread_sleep(10);
+    im_thread_free(sink);
+
+    n = slab_get_stats(stats, SLAB_CLASSES + 1);
+    for (i = 0; i < n; i++) {
+        stats[i].allocs -= before[i].allocs;
+        stats[i].frees -= before[i].frees;
+        stats[i].remote_frees -= before[i].remote_frees;
+        stats[i].system_allocs -= before[i].system_allocs;
+        printf("slab %4u: allocs %10llu frees %10llu remote %10llu malloc %8llu\n",
+               (unsigned)stats[i].size,
+               (unsigned long long)stats[i].allocs, (unsigned long long)stats[i].frees,
+               (unsigned long long)stats[i].remote_frees,
+               (unsigned long long)stats[i].system_allocs);
+        allocs += stats[i].allocs;
+        system_allocs += stats[i].system_allocs;
+    }
+    printf("slab: %.3f malloc calls per stanza (%.1f without slab)\n",
+           (double)system_allocs / BENCH_SLAB_STANZAS,
+           (double)allocs / BENCH_SLAB_STANZAS);
+#endif
+    return true;
+}
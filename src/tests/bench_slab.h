@@ -0,0 +1,5 @@
+#include "mm.h"
+
+#include <stdbool.h>
+
+bool bench_slab(int argc, char **argv);
@@ -0,0 +1,109 @@
+#include "bench_thread.h"
+#include "im-atomic.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+#ifdef POSIX
+#include <time.h>
+#endif
+
+// 每个调用线程send的次数
+#define BENCH_SEND_ROUNDS 20000
+
+typedef struct bench_caller {
+    im_thread_t *thread;
+    im_thread_t *sink;
+    int rounds;
+    uint64_t elapsed_us;
+} bench_caller_t;
+
+static volatile long finished_callers = 0;
+
+static uint64_t _bench_now_us()
+{
+#ifdef WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart * 1000000 / freq.QuadPart);
+#endif
+#ifdef POSIX
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static void _bench_echo(int msg_id, void *userdata)
+{
+    volatile long *counter = userdata;
+    (*counter)++;
+}
+
+// 在调用线程里面循环send
+static void _bench_caller_run(int msg_id, void *userdata)
+{
+    bench_caller_t *caller = userdata;
+    long counter = 0;
+    uint64_t begin = _bench_now_us();
+
+    for (int i = 0; i < caller->rounds; i++) {
+        im_thread_send(caller->sink, i, _bench_echo, &counter);
+    }
+    caller->elapsed_us = _bench_now_us() - begin;
+
+    // 每次send返回时处理函数必须已经执行完
+    assert(counter == caller->rounds);
+    im_atomic_inc(&finished_callers);
+}
+
+static void _bench_send_concurrency(im_thread_t *sink, int ncallers)
+{
+    bench_caller_t callers[16];
+    uint64_t total_us = 0, max_us = 0;
+
+    assert(ncallers <= 16);
+    im_atomic_store(&finished_callers, 0);
+
+    for (int i = 0; i < ncallers; i++) {
+        callers[i].thread = im_thread_new();
+        callers[i].sink = sink;
+        callers[i].rounds = BENCH_SEND_ROUNDS;
+        callers[i].elapsed_us = 0;
+        assert(callers[i].thread);
+    }
+    for (int i = 0; i < ncallers; i++) {
+        im_thread_start(callers[i].thread, NULL);
+        im_thread_post(callers[i].thread, 0, _bench_caller_run, 0, &callers[i]);
+    }
+    while (im_atomic_load(&finished_callers) < ncallers) {
+        im_thread_sleep(10);
+    }
+
+    for (int i = 0; i < ncallers; i++) {
+        total_us += callers[i].elapsed_us;
+        if (callers[i].elapsed_us > max_us)
+            max_us = callers[i].elapsed_us;
+        im_thread_free(callers[i].thread);
+    }
+
+    printf("send %2d callers: %8.2f us/round-trip, %10.0f calls/s\n",
+           ncallers,
+           (double)total_us / ((double)ncallers * BENCH_SEND_ROUNDS),
+           (double)ncallers * BENCH_SEND_ROUNDS * 1000000.0 / (double)(max_us ? max_us : 1));
+}
+
+bool bench_thread_send(int argc, char **argv)
+{
+    im_thread_t *sink = im_thread_new();
+    assert(sink);
+    im_thread_start(sink, NULL);
+
+    _bench_send_concurrency(sink, 1);
+    _bench_send_concurrency(sink, 4);
+    _bench_send_concurrency(sink, 16);
+
+    im_thread_free(sink);
+    return true;
+}
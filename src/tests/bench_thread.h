@@ -0,0 +1,3 @@
+#include "im-thread.h"
+
+bool bench_thread_send(int argc, char **argv);
@@ -0,0 +1,227 @@
+#include "bench_timer.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <event2/event.h>
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+#ifdef POSIX
+#include <time.h>
+#endif
+
+#include "mm.h"
+
+// 模拟的定时器数量, 每个连接有keepalive, 认证超时, 断开清理几个定时器
+#define BENCH_TIMERS 100000
+// 每个定时器重置的次数, 对应handler_reset_timed
+#define BENCH_RESETS 10
+// 到期测试的定时器数量
+#define BENCH_FIRE_TIMERS 200
+
+static uint64_t _bench_now_us()
+{
+#ifdef WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart * 1000000 / freq.QuadPart);
+#endif
+#ifdef POSIX
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static void _bench_event_cb(evutil_socket_t fd, short what, void *arg)
+{
+}
+
+static void _bench_timer_cb(im_timer_t *timer, void *userdata)
+{
+}
+
+static void _bench_report(const char *name, const char *op, uint64_t us, int count)
+{
+    printf("%-8s %-6s %8.1f ns/op\n", name, op, (double)us * 1000.0 / count);
+}
+
+// 当前的做法: 每个handler一个持久的libevent事件
+static void _bench_events(struct event_base *base)
+{
+    struct event **evs = safe_mem_malloc(sizeof(struct event *) * BENCH_TIMERS, NULL);
+    struct timeval tv;
+    uint64_t begin;
+    int i, r;
+
+    assert(evs);
+
+    begin = _bench_now_us();
+    for (i = 0; i < BENCH_TIMERS; i++) {
+        tv.tv_sec = 30 + i % 60;
+        tv.tv_usec = 0;
+        evs[i] = event_new(base, -1, EV_TIMEOUT | EV_PERSIST, _bench_event_cb, NULL);
+        evtimer_add(evs[i], &tv);
+    }
+    _bench_report("event", "arm", _bench_now_us() - begin, BENCH_TIMERS);
+
+    begin = _bench_now_us();
+    for (r = 0; r < BENCH_RESETS; r++) {
+        for (i = 0; i < BENCH_TIMERS; i++) {
+            tv.tv_sec = 30 + (i + r) % 60;
+            tv.tv_usec = 0;
+            evtimer_del(evs[i]);
+            evtimer_add(evs[i], &tv);
+        }
+    }
+    _bench_report("event", "reset", _bench_now_us() - begin, BENCH_TIMERS * BENCH_RESETS);
+
+    begin = _bench_now_us();
+    for (i = 0; i < BENCH_TIMERS; i++) {
+        evtimer_del(evs[i]);
+        event_free(evs[i]);
+    }
+    _bench_report("event", "cancel", _bench_now_us() - begin, BENCH_TIMERS);
+
+    safe_mem_free(evs);
+}
+
+// 时间轮
+static void _bench_wheel(struct event_base *base)
+{
+    im_timer_wheel_t *wheel = im_timer_wheel_new(base, IM_TIMER_TICK);
+    im_timer_t *timers = safe_mem_malloc(sizeof(im_timer_t) * BENCH_TIMERS, NULL);
+    uint64_t begin;
+    int i, r;
+
+    assert(wheel && timers);
+
+    begin = _bench_now_us();
+    for (i = 0; i < BENCH_TIMERS; i++) {
+        im_timer_init(&timers[i], _bench_timer_cb, NULL);
+        im_timer_add(wheel, &timers[i], (30 + i % 60) * 1000);
+    }
+    _bench_report("wheel", "arm", _bench_now_us() - begin, BENCH_TIMERS);
+
+    begin = _bench_now_us();
+    for (r = 0; r < BENCH_RESETS; r++) {
+        for (i = 0; i < BENCH_TIMERS; i++) {
+            im_timer_add(wheel, &timers[i], (30 + (i + r) % 60) * 1000);
+        }
+    }
+    _bench_report("wheel", "reset", _bench_now_us() - begin, BENCH_TIMERS * BENCH_RESETS);
+
+    begin = _bench_now_us();
+    for (i = 0; i < BENCH_TIMERS; i++) {
+        im_timer_del(wheel, &timers[i]);
+    }
+    _bench_report("wheel", "cancel", _bench_now_us() - begin, BENCH_TIMERS);
+
+    safe_mem_free(timers);
+    im_timer_wheel_free(wheel);
+}
+
+typedef struct bench_fire {
+    im_timer_t timer;
+    uint64_t armed_us;
+    unsigned long delay;
+    bool fired;
+    bool early;
+} bench_fire_t;
+
+static int fired_count = 0;
+
+static void _bench_fire_cb(im_timer_t *timer, void *userdata)
+{
+    bench_fire_t *fire = userdata;
+
+    fire->fired = true;
+    // 时间轮按毫秒计时, 允许1毫秒的误差
+    fire->early = _bench_now_us() - fire->armed_us + 1000 < fire->delay * 1000;
+    fired_count++;
+}
+
+// 检查到期: 所有定时器都触发并且不会提前
+static bool _bench_wheel_fire(struct event_base *base)
+{
+    im_timer_wheel_t *wheel = im_timer_wheel_new(base, IM_TIMER_TICK);
+    bench_fire_t fires[BENCH_FIRE_TIMERS];
+    int i;
+
+    assert(wheel);
+    fired_count = 0;
+    for (i = 0; i < BENCH_FIRE_TIMERS; i++) {
+        fires[i].delay = (unsigned long)(i * 7 % 3000);
+        fires[i].fired = false;
+        fires[i].early = false;
+        fires[i].armed_us = _bench_now_us();
+        im_timer_init(&fires[i].timer, _bench_fire_cb, &fires[i]);
+        im_timer_add(wheel, &fires[i].timer, fires[i].delay);
+    }
+    // 取消一半以后重新添加
+    for (i = 0; i < BENCH_FIRE_TIMERS; i += 2) {
+        im_timer_del(wheel, &fires[i].timer);
+        im_timer_add(wheel, &fires[i].timer, fires[i].delay);
+    }
+
+    // 所有定时器到期以后时间轮删除tick事件, 循环自动退出
+    event_base_dispatch(base);
+
+    im_timer_wheel_free(wheel);
+
+    if (fired_count != BENCH_FIRE_TIMERS)
+        return false;
+    for (i = 0; i < BENCH_FIRE_TIMERS; i++) {
+        if (!fires[i].fired || fires[i].early)
+            return false;
+    }
+    return true;
+}
+
+// 检查唤醒次数: 没有到期的定时器的时候事件循环不会按tick空转
+static bool _bench_wheel_idle(struct event_base *base)
+{
+    im_timer_wheel_t *wheel = im_timer_wheel_new(base, IM_TIMER_TICK);
+    bench_fire_t fires[2];
+    int i, loops = 0;
+
+    assert(wheel);
+    fired_count = 0;
+    for (i = 0; i < 2; i++) {
+        // 第二个超出第一层的范围, 中间要从上层分配下来一次
+        fires[i].delay = i ? 2900 : 300;
+        fires[i].fired = false;
+        fires[i].early = false;
+        fires[i].armed_us = _bench_now_us();
+        im_timer_init(&fires[i].timer, _bench_fire_cb, &fires[i]);
+        im_timer_add(wheel, &fires[i].timer, fires[i].delay);
+    }
+
+    while (fired_count < 2 && loops < 1000) {
+        event_base_loop(base, EVLOOP_ONCE);
+        loops++;
+    }
+    printf("wheel idle: %d wakeups for 2 timers\n", loops);
+
+    im_timer_wheel_free(wheel);
+
+    return fired_count == 2 && !fires[0].early && !fires[1].early && loops <= 4;
+}
+
+bool bench_timer(int argc, char **argv)
+{
+    struct event_base *base = event_base_new();
+    bool ok;
+
+    assert(base);
+
+    _bench_events(base);
+    _bench_wheel(base);
+    ok = _bench_wheel_fire(base);
+    ok = _bench_wheel_idle(base) && ok;
+
+    event_base_free(base);
+    return ok;
+}
@@ -0,0 +1,3 @@
+#include "im-timer.h"
+
+bool bench_timer(int argc, char **argv);
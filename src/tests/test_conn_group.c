@@ -0,0 +1,142 @@
+#include "test_conn_group.h"
+#include "im-inl.h"
+#include "xmpp-inl.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+// 组内的工作线程数量
+#define TEST_GROUP_THREADS 2
+// 组内的连接数量, 每个线程分到几个
+#define TEST_GROUP_CONNS 6
+
+static void _test_group_state(im_conn_t *conn, im_conn_state state, int error, void *userdata)
+{
+}
+
+static void _test_group_recive(im_conn_t *conn, im_msg_t *msg, void *userdata)
+{
+}
+
+static im_conn_t *_test_group_conn(im_conn_group_t *group)
+{
+    return im_conn_new_in_group(group, NULL, "user@example.test", "secret",
+                                _test_group_state, _test_group_recive, NULL);
+}
+
+// 连接是不是用的组里面的上下文
+static bool _test_group_owns(im_conn_group_t *group, im_conn_t *conn)
+{
+    for (int i = 0; i < group->size; i++) {
+        if (conn->xmpp_ctx == group->xmpp_ctxs[i])
+            return true;
+    }
+    return false;
+}
+
+// 组自己持有一个引用, 每个连接和它的xmpp连接各持有一个
+static bool _test_group_refs(im_conn_group_t *group, im_conn_t **conns, int count)
+{
+    for (int i = 0; i < group->size; i++) {
+        long expected = 1;
+        for (int j = 0; j < count; j++) {
+            if (conns[j] && conns[j]->xmpp_ctx == group->xmpp_ctxs[i])
+                expected += 2;
+        }
+        if (im_atomic_load(&group->xmpp_ctxs[i]->ref) != expected)
+            return false;
+    }
+    return true;
+}
+
+bool test_conn_group(int argc, char **argv)
+{
+    // 乱序释放, 释放一半以后再新建
+    static const int order[TEST_GROUP_CONNS] = { 3, 0, 5, 1, 4, 2 };
+    im_conn_t *conns[TEST_GROUP_CONNS];
+    im_conn_group_t *group;
+    bool ok = true;
+    int i;
+#ifdef IMCORE_SLAB
+    slab_stats_t before[SLAB_CLASSES + 1], after[SLAB_CLASSES + 1];
+    long long live = 0;
+    int n;
+
+    // 进程级的锁第一次用到的时候创建, 一直保留, 先建一个组让它们创建出来
+    group = im_conn_group_new(1);
+    if (group)
+        im_conn_group_free(group);
+    // 统计是进程累计的, 只看本次的增量
+    slab_get_stats(before, SLAB_CLASSES + 1);
+#endif
+
+    group = im_conn_group_new(TEST_GROUP_THREADS);
+    if (!group)
+        return false;
+    if (group->size != TEST_GROUP_THREADS)
+        ok = false;
+    // 所有上下文共享一个SSL_CTX
+    for (i = 1; i < group->size; i++) {
+        if (group->xmpp_ctxs[i]->ssl_ctx != group->xmpp_ctxs[0]->ssl_ctx)
+            ok = false;
+    }
+
+    // 轮流分配到工作线程, 不创建自己的线程和上下文
+    for (i = 0; i < TEST_GROUP_CONNS; i++) {
+        conns[i] = _test_group_conn(group);
+        if (!conns[i]) {
+            ok = false;
+            continue;
+        }
+        if (conns[i]->group != group || !_test_group_owns(group, conns[i]))
+            ok = false;
+    }
+    for (i = TEST_GROUP_THREADS; i < TEST_GROUP_CONNS; i++) {
+        if (conns[i] && conns[i - TEST_GROUP_THREADS] &&
+            conns[i]->xmpp_ctx != conns[i - TEST_GROUP_THREADS]->xmpp_ctx)
+            ok = false;
+    }
+    if (!_test_group_refs(group, conns, TEST_GROUP_CONNS))
+        ok = false;
+
+    // 释放一半, 新建的连接继续用组里面的上下文
+    for (i = 0; i < TEST_GROUP_CONNS / 2; i++) {
+        if (conns[order[i]])
+            im_conn_free(conns[order[i]]);
+        conns[order[i]] = NULL;
+    }
+    if (!_test_group_refs(group, conns, TEST_GROUP_CONNS))
+        ok = false;
+    for (i = 0; i < TEST_GROUP_CONNS / 2; i++) {
+        conns[order[i]] = _test_group_conn(group);
+        if (!conns[order[i]] || !_test_group_owns(group, conns[order[i]]))
+            ok = false;
+    }
+    if (!_test_group_refs(group, conns, TEST_GROUP_CONNS))
+        ok = false;
+
+    // 全部释放以后只剩组自己的引用
+    for (i = TEST_GROUP_CONNS - 1; i >= 0; i--) {
+        if (conns[order[i]])
+            im_conn_free(conns[order[i]]);
+        conns[order[i]] = NULL;
+    }
+    if (!_test_group_refs(group, conns, TEST_GROUP_CONNS))
+        ok = false;
+
+    im_conn_group_free(group);
+
+#ifdef IMCORE_SLAB
+    // 组和连接分配的内存全部还回去了
+    n = slab_get_stats(after, SLAB_CLASSES + 1);
+    for (i = 0; i < n; i++)
+        live += (long long)(after[i].allocs - before[i].allocs) -
+                (long long)(after[i].frees - before[i].frees);
+    printf("conn group: %lld blocks still allocated\n", live);
+    if (live != 0)
+        ok = false;
+#endif
+
+    printf("conn group: %d threads, %d connections\n", TEST_GROUP_THREADS, TEST_GROUP_CONNS);
+    return ok;
+}
@@ -9,9 +9,28 @@
 #include "mm.h"
 #include "pthread-win32.h"
 #include "imcore-thread.h"
+#include "im-thread.h"
 
 #include "tests/test_message.h"
 #include "tests/test_thread.h"
+#include "tests/bench_handler.h"
+#include "tests/test_handler.h"
+#include "tests/bench_hash.h"
+#include "tests/bench_parser.h"
+#include "tests/bench_serializer.h"
+#include "tests/bench_slab.h"
+#include "tests/bench_thread.h"
+#include "tests/bench_timer.h"
+#include "tests/test_escape.h"
+#include "tests/test_iq.h"
+#include "tests/test_dns.h"
+#include "tests/test_tls.h"
+#include "tests/test_sm.h"
+#include "tests/test_zlib.h"
+#include "tests/test_scram.h"
+#include "tests/test_sasl2.h"
+#include "tests/test_executor.h"
+#include "tests/test_conn_group.h"
 
 pthread_t console_thread;
 pthread_t xmpp_thread;
@@ -289,6 +308,109 @@ int main(int argc, char **argv)
         printf("test thread fail.\n");
     }
 
+    // test_threadim_thread_destroy, ĲҪ³ʼ߳̿
+    im_thread_init();
+
+    bench_thread_send(argc, argv);
+
+    if (test_executor(argc, argv)) {
+        printf("test executor ok.\n");
+    } else {
+        printf("test executor fail.\n");
+    }
+
+    if (test_conn_group(argc, argv)) {
+        printf("test conn group ok.\n");
+    } else {
+        printf("test conn group fail.\n");
+    }
+
+    if (bench_timer(argc, argv)) {
+        printf("bench timer ok.\n");
+    } else {
+        printf("bench timer fail.\n");
+    }
+
+    bench_slab(argc, argv);
+
+    if (bench_parser(argc, argv)) {
+        printf("bench parser ok.\n");
+    } else {
+        printf("bench parser fail.\n");
+    }
+
+    if (bench_hash(argc, argv)) {
+        printf("bench hash ok.\n");
+    } else {
+        printf("bench hash fail.\n");
+    }
+
+    if (bench_serializer(argc, argv)) {
+        printf("bench serializer ok.\n");
+    } else {
+        printf("bench serializer fail.\n");
+    }
+
+    if (test_escape(argc, argv)) {
+        printf("test escape ok.\n");
+    } else {
+        printf("test escape fail.\n");
+    }
+
+    if (bench_handler(argc, argv)) {
+        printf("bench handler ok.\n");
+    } else {
+        printf("bench handler fail.\n");
+    }
+
+    if (test_handler(argc, argv)) {
+        printf("test handler ok.\n");
+    } else {
+        printf("test handler fail.\n");
+    }
+
+    if (test_iq(argc, argv)) {
+        printf("test iq ok.\n");
+    } else {
+        printf("test iq fail.\n");
+    }
+
+    if (test_dns(argc, argv)) {
+        printf("test dns ok.\n");
+    } else {
+        printf("test dns fail.\n");
+    }
+
+    if (test_tls(argc, argv)) {
+        printf("test tls ok.\n");
+    } else {
+        printf("test tls fail.\n");
+    }
+
+    if (test_sm(argc, argv)) {
+        printf("test sm ok.\n");
+    } else {
+        printf("test sm fail.\n");
+    }
+
+    if (test_zlib(argc, argv)) {
+        printf("test zlib ok.\n");
+    } else {
+        printf("test zlib fail.\n");
+    }
+
+    if (test_scram(argc, argv)) {
+        printf("test scram ok.\n");
+    } else {
+        printf("test scram fail.\n");
+    }
+
+    if (test_sasl2(argc, argv)) {
+        printf("test sasl2 ok.\n");
+    } else {
+        printf("test sasl2 fail.\n");
+    }
+
 
     log = xmpp_get_default_logger(XMPP_LEVEL_DEBUG);
     ctx = xmpp_ctx_new(NULL, log);
@@ -313,6 +435,7 @@ int main(int argc, char **argv)
     xmpp_conn_release(conn);
     xmpp_ctx_free(ctx);
     xmpp_shutdown();
+    im_thread_destroy();
 
     safe_mem_free(jid);
     safe_mem_free(pass);
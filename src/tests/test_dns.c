@@ -0,0 +1,683 @@
+#include "test_dns.h"
+#include "xmpp-inl.h"
+#include "srv.h"
+#include "im-dns.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+#include <event2/listener.h>
+
+#ifdef POSIX
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+// 本地的DNS桩服务器, 只认识下面几个名字
+#define TEST_DNS_DOMAIN "example.test"
+#define TEST_DNS_SRV "_xmpp-client._tcp." TEST_DNS_DOMAIN
+#define TEST_DNS_HOST "a." TEST_DNS_DOMAIN
+#define TEST_DNS_HOST2 "c." TEST_DNS_DOMAIN
+#define TEST_DNS_TTL 300
+// TTL只有1秒的SRV记录, 测试缓存过期
+#define TEST_DNS_SHORT "short.test"
+// 第一个SRV目标的端口没有人监听, 第二个目标有ipv6和ipv4两个地址, 只有ipv4能连上
+#define TEST_DNS_HE "he.test"
+#define TEST_DNS_HE_DEAD "dead." TEST_DNS_HE
+#define TEST_DNS_HE_DUAL "dual." TEST_DNS_HE
+// 优先的SRV目标应答得慢, 后面的目标先解析出来
+#define TEST_DNS_PRIO "prio.test"
+#define TEST_DNS_PRIO_SLOW "slow." TEST_DNS_PRIO
+#define TEST_DNS_PRIO_FAST "fast." TEST_DNS_PRIO
+// 慢的应答延迟的时间, 毫秒
+#define TEST_DNS_SLOW_DELAY 200
+// nameserver对这两个名字返回SERVFAIL
+#define TEST_DNS_SERVFAIL "servfail.test"
+#define TEST_DNS_SERVFAIL_RAW "raw." TEST_DNS_SERVFAIL
+
+typedef struct test_dns_stub {
+    evutil_socket_t fd;
+    struct event *ev;
+    unsigned short port;
+    unsigned short xmpp_port;     // SRV记录里面的端口
+    unsigned short closed_port;   // 没有人监听的TCP端口
+    int queries;
+    int delayed;                  // 还没有发出去的延迟应答
+} test_dns_stub_t;
+
+static int _test_dns_put16(unsigned char *p, int off, unsigned short v)
+{
+    p[off] = v >> 8;
+    p[off + 1] = v & 0xff;
+    return off + 2;
+}
+
+static int _test_dns_put32(unsigned char *p, int off, unsigned int v)
+{
+    off = _test_dns_put16(p, off, (unsigned short)(v >> 16));
+    return _test_dns_put16(p, off, (unsigned short)v);
+}
+
+static int _test_dns_put_name(unsigned char *p, int off, const char *name)
+{
+    const char *dot;
+    size_t len;
+
+    while (*name) {
+        dot = strchr(name, '.');
+        len = dot ? (size_t)(dot - name) : strlen(name);
+        p[off++] = (unsigned char)len;
+        memcpy(p + off, name, len);
+        off += (int)len;
+        name += dot ? len + 1 : len;
+    }
+    p[off++] = 0;
+    return off;
+}
+
+// 应答的公共部分, 名字用指向问题的压缩指针
+static int _test_dns_put_rr(unsigned char *p, int off, unsigned short type, unsigned int ttl)
+{
+    off = _test_dns_put16(p, off, 0xC00C);
+    off = _test_dns_put16(p, off, type);
+    off = _test_dns_put16(p, off, 1);
+    return _test_dns_put32(p, off, ttl);
+}
+
+static int _test_dns_put_srv(unsigned char *p, int off, unsigned int ttl, unsigned short priority,
+                             unsigned short weight, unsigned short port, const char *target)
+{
+    int rdlen;
+
+    off = _test_dns_put_rr(p, off, 33, ttl);
+    rdlen = off;
+    off = _test_dns_put16(p, off + 2, priority);
+    off = _test_dns_put16(p, off, weight);
+    off = _test_dns_put16(p, off, port);
+    off = _test_dns_put_name(p, off, target);
+    _test_dns_put16(p, rdlen, (unsigned short)(off - rdlen - 2));
+    return off;
+}
+
+// 延迟发送的应答
+typedef struct test_dns_delayed {
+    test_dns_stub_t *stub;
+    evutil_socket_t fd;
+    struct sockaddr_storage from;
+    ev_socklen_t fromlen;
+    int len;
+    unsigned char out[1500];
+} test_dns_delayed_t;
+
+static void _test_dns_delayed_cb(evutil_socket_t fd, short what, void *arg)
+{
+    test_dns_delayed_t *d = arg;
+
+    sendto(d->fd, (const char *)d->out, d->len, 0, (struct sockaddr *)&d->from, d->fromlen);
+    d->stub->delayed--;
+    free(d);
+}
+
+static void _test_dns_stub_cb(evutil_socket_t fd, short what, void *arg)
+{
+    test_dns_stub_t *stub = arg;
+    unsigned char buf[1500], out[1500];
+    struct sockaddr_storage from;
+    ev_socklen_t fromlen = sizeof(from);
+    char name[256];
+    int len, off, qend, n = 0, ancount = 0;
+    unsigned short qtype;
+    test_dns_delayed_t *delayed;
+    struct timeval tv;
+
+    len = recvfrom(fd, (char *)buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromlen);
+    if (len < 12)
+        return;
+    stub->queries++;
+
+    // 问题里面的名字, evdns会随机改变大小写
+    off = 12;
+    while (off < len && buf[off] && n + buf[off] + 1 < (int)sizeof(name)) {
+        if (n)
+            name[n++] = '.';
+        memcpy(name + n, buf + off + 1, buf[off]);
+        n += buf[off];
+        off += buf[off] + 1;
+    }
+    name[n] = '\0';
+    qend = off + 5;
+    if (qend > len)
+        return;
+    qtype = (buf[off + 1] << 8) | buf[off + 2];
+
+    memcpy(out, buf, qend);
+    off = qend;
+    if (evutil_ascii_strcasecmp(name, TEST_DNS_SRV) == 0 && qtype == 33) {
+        off = _test_dns_put_srv(out, off, TEST_DNS_TTL, 20, 0, stub->xmpp_port,
+                                "b." TEST_DNS_DOMAIN);
+        off = _test_dns_put_srv(out, off, TEST_DNS_TTL, 10, 5, stub->xmpp_port, TEST_DNS_HOST);
+        off = _test_dns_put_srv(out, off, TEST_DNS_TTL, 10, 15, stub->xmpp_port, TEST_DNS_HOST2);
+        ancount = 3;
+    } else if (evutil_ascii_strcasecmp(name, "_xmpp-client._tcp." TEST_DNS_SHORT) == 0 &&
+               qtype == 33) {
+        off = _test_dns_put_srv(out, off, 1, 0, 0, stub->xmpp_port, TEST_DNS_HOST);
+        ancount = 1;
+    } else if (evutil_ascii_strcasecmp(name, "_xmpp-client._tcp." TEST_DNS_HE) == 0 &&
+               qtype == 33) {
+        off = _test_dns_put_srv(out, off, TEST_DNS_TTL, 10, 0, stub->closed_port, TEST_DNS_HE_DEAD);
+        off = _test_dns_put_srv(out, off, TEST_DNS_TTL, 20, 0, stub->xmpp_port, TEST_DNS_HE_DUAL);
+        ancount = 2;
+    } else if (evutil_ascii_strcasecmp(name, "_xmpp-client._tcp." TEST_DNS_PRIO) == 0 &&
+               qtype == 33) {
+        off = _test_dns_put_srv(out, off, TEST_DNS_TTL, 10, 0, stub->xmpp_port, TEST_DNS_PRIO_SLOW);
+        off = _test_dns_put_srv(out, off, TEST_DNS_TTL, 20, 0, stub->xmpp_port, TEST_DNS_PRIO_FAST);
+        ancount = 2;
+    } else if (evutil_ascii_strcasecmp(name, TEST_DNS_HE_DUAL) == 0 && qtype == 28) {
+        // ::1, 监听只在ipv4上
+        off = _test_dns_put_rr(out, off, 28, 60);
+        off = _test_dns_put16(out, off, 16);
+        memset(out + off, 0, 15);
+        out[off + 15] = 1;
+        off += 16;
+        ancount = 1;
+    } else if ((evutil_ascii_strcasecmp(name, TEST_DNS_HOST) == 0 ||
+                evutil_ascii_strcasecmp(name, TEST_DNS_HOST2) == 0 ||
+                evutil_ascii_strcasecmp(name, TEST_DNS_HE_DEAD) == 0 ||
+                evutil_ascii_strcasecmp(name, TEST_DNS_HE_DUAL) == 0 ||
+                evutil_ascii_strcasecmp(name, TEST_DNS_PRIO_SLOW) == 0 ||
+                evutil_ascii_strcasecmp(name, TEST_DNS_PRIO_FAST) == 0) && qtype == 1) {
+        off = _test_dns_put_rr(out, off, 1, 60);
+        off = _test_dns_put16(out, off, 4);
+        off = _test_dns_put32(out, off, 0x7f000001);
+        ancount = 1;
+    }
+
+    // QR RD RA, 没有记录的名字返回NXDOMAIN
+    if (evutil_ascii_strcasecmp(name, TEST_DNS_SERVFAIL) == 0 ||
+        evutil_ascii_strcasecmp(name, TEST_DNS_SERVFAIL_RAW) == 0)
+        _test_dns_put16(out, 2, 0x8182);
+    else
+        _test_dns_put16(out, 2, ancount ? 0x8180 : 0x8183);
+    _test_dns_put16(out, 4, 1);
+    _test_dns_put16(out, 6, (unsigned short)ancount);
+    _test_dns_put16(out, 8, 0);
+    _test_dns_put16(out, 10, 0);
+
+    if (evutil_ascii_strcasecmp(name, TEST_DNS_PRIO_SLOW) == 0) {
+        delayed = malloc(sizeof(test_dns_delayed_t));
+        if (delayed) {
+            delayed->stub = stub;
+            delayed->fd = fd;
+            memcpy(&delayed->from, &from, fromlen);
+            delayed->fromlen = fromlen;
+            delayed->len = off;
+            memcpy(delayed->out, out, off);
+            tv.tv_sec = 0;
+            tv.tv_usec = TEST_DNS_SLOW_DELAY * 1000;
+            event_base_once(event_get_base(stub->ev), -1, EV_TIMEOUT, _test_dns_delayed_cb,
+                            delayed, &tv);
+            stub->delayed++;
+            return;
+        }
+    }
+    sendto(fd, (const char *)out, off, 0, (struct sockaddr *)&from, fromlen);
+}
+
+// 绑定本地UDP端口
+static evutil_socket_t _test_dns_bind(unsigned short *port)
+{
+    struct sockaddr_in sin;
+    ev_socklen_t slen = sizeof(sin);
+    evutil_socket_t fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(0x7f000001);
+    if (fd == EVUTIL_INVALID_SOCKET || bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+        getsockname(fd, (struct sockaddr *)&sin, &slen) != 0)
+        return EVUTIL_INVALID_SOCKET;
+    *port = ntohs(sin.sin_port);
+    return fd;
+}
+
+// 绑定以后马上关闭, 得到一个没有人监听的TCP端口
+static unsigned short _test_dns_closed_port()
+{
+    struct sockaddr_in sin;
+    ev_socklen_t slen = sizeof(sin);
+    evutil_socket_t fd = socket(AF_INET, SOCK_STREAM, 0);
+    unsigned short port = 0;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(0x7f000001);
+    if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0 &&
+        getsockname(fd, (struct sockaddr *)&sin, &slen) == 0)
+        port = ntohs(sin.sin_port);
+    evutil_closesocket(fd);
+    return port;
+}
+
+static struct evdns_base *_test_dns_base(struct event_base *base, unsigned short port)
+{
+    struct evdns_base *dns = evdns_base_new(base, 0);
+    char addr[32];
+
+    sprintf(addr, "127.0.0.1:%d", port);
+    evdns_base_nameserver_ip_add(dns, addr);
+    return dns;
+}
+
+typedef struct test_dns_result {
+    int calls;
+    int result;
+    int count;
+    im_srv_record_t records[IM_SRV_MAX_RECORDS];
+    im_dns_addr_t addrs[IM_DNS_MAX_ADDRS];
+} test_dns_result_t;
+
+static void _test_dns_srv_cb(int result, const im_srv_record_t *records, int count,
+                             void *userdata)
+{
+    test_dns_result_t *r = userdata;
+
+    r->calls++;
+    r->result = result;
+    r->count = count;
+    if (count > 0)
+        memcpy(r->records, records, sizeof(im_srv_record_t) * count);
+}
+
+static bool _test_dns_srv(struct event_base *base, struct evdns_base *dns, const char *domain,
+                          test_dns_result_t *r)
+{
+    memset(r, 0, sizeof(*r));
+    if (!im_srv_lookup_async(base, dns, "xmpp-client", "tcp", domain, _test_dns_srv_cb, r))
+        return false;
+    // 不会在调用期间回调
+    if (r->calls)
+        return false;
+    while (!r->calls)
+        event_base_loop(base, EVLOOP_ONCE);
+    return r->calls == 1;
+}
+
+// 通过缓存查询, 返回发给桩服务器的查询数量, 出错返回-1
+static int _test_dns_cached_srv(struct event_base *base, struct evdns_base *dns,
+                                test_dns_stub_t *stub, const char *domain, test_dns_result_t *r)
+{
+    int queries = stub->queries;
+
+    memset(r, 0, sizeof(*r));
+    if (im_dns_srv_lookup(base, dns, "xmpp-client", "tcp", domain, _test_dns_srv_cb, r)) {
+        if (r->calls)
+            return -1;
+        while (!r->calls)
+            event_base_loop(base, EVLOOP_ONCE);
+    }
+    return r->calls == 1 ? stub->queries - queries : -1;
+}
+
+static void _test_dns_host_cb(int result, const im_dns_addr_t *addrs, int count, void *userdata)
+{
+    test_dns_result_t *r = userdata;
+
+    r->calls++;
+    r->result = result;
+    r->count = count;
+    if (count > 0)
+        memcpy(r->addrs, addrs, sizeof(im_dns_addr_t) * count);
+}
+
+static void _test_dns_raw_cb(int result, char type, int count, int ttl, void *addresses,
+                             void *arg)
+{
+    (*(int *)arg)++;
+}
+
+static int _test_dns_cached_host(struct event_base *base, struct evdns_base *dns,
+                                 test_dns_stub_t *stub, const char *host, test_dns_result_t *r)
+{
+    int queries = stub->queries;
+
+    memset(r, 0, sizeof(*r));
+    if (im_dns_host_lookup(base, dns, host, AF_INET, _test_dns_host_cb, r)) {
+        if (r->calls)
+            return -1;
+        while (!r->calls)
+            event_base_loop(base, EVLOOP_ONCE);
+    }
+    return r->calls == 1 ? stub->queries - queries : -1;
+}
+
+// 缓存和RFC 2782排序
+static bool _test_dns_cache(struct event_base *base, struct evdns_base *dns,
+                            test_dns_stub_t *stub)
+{
+    static const unsigned char loopback[4] = { 127, 0, 0, 1 };
+    test_dns_result_t r;
+    struct timeval tv;
+    int i, first_c = 0, n, raw;
+    bool ok = true;
+
+    im_dns_cache_clear();
+
+    // 第一次查询, 第二次直接从缓存回调
+    if (_test_dns_cached_srv(base, dns, stub, TEST_DNS_DOMAIN, &r) != 1 ||
+        r.result != IM_DNS_OK || r.count != 3)
+        ok = false;
+    if (_test_dns_cached_srv(base, dns, stub, TEST_DNS_DOMAIN, &r) != 0 ||
+        r.result != IM_DNS_OK || r.count != 3)
+        ok = false;
+
+    // 同一个priority按weight随机, a是5, c是15, c排在第一个的概率是3/4
+    for (i = 0; i < 1000; i++) {
+        n = _test_dns_cached_srv(base, dns, stub, TEST_DNS_DOMAIN, &r);
+        if (n != 0 || r.count != 3 || r.records[0].priority != 10 ||
+            r.records[1].priority != 10 || r.records[2].priority != 20) {
+            ok = false;
+            break;
+        }
+        if (strcmp(r.records[0].target, TEST_DNS_HOST2) == 0)
+            first_c++;
+    }
+    printf("dns: %s first in %d of 1000 lookups\n", TEST_DNS_HOST2, first_c);
+    if (first_c < 650 || first_c > 850)
+        ok = false;
+
+    // 没有记录的结果也缓存
+    if (_test_dns_cached_srv(base, dns, stub, "missing.test", &r) != 1 ||
+        r.result != IM_DNS_NOTFOUND || r.count != 0)
+        ok = false;
+    if (_test_dns_cached_srv(base, dns, stub, "MISSING.test", &r) != 0 ||
+        r.result != IM_DNS_NOTFOUND)
+        ok = false;
+
+    // TTL到期以后重新查询
+    if (_test_dns_cached_srv(base, dns, stub, TEST_DNS_SHORT, &r) != 1 || r.count != 1)
+        ok = false;
+    if (_test_dns_cached_srv(base, dns, stub, TEST_DNS_SHORT, &r) != 0)
+        ok = false;
+    tv.tv_sec = 1;
+    tv.tv_usec = 100000;
+    event_base_loopexit(base, &tv);
+    event_base_dispatch(base);
+    if (_test_dns_cached_srv(base, dns, stub, TEST_DNS_SHORT, &r) != 1 || r.count != 1)
+        ok = false;
+
+    // 地址查询
+    if (_test_dns_cached_host(base, dns, stub, TEST_DNS_HOST, &r) != 1 ||
+        r.result != IM_DNS_OK || r.count != 1 || r.addrs[0].family != AF_INET ||
+        memcmp(r.addrs[0].addr, loopback, 4) != 0)
+        ok = false;
+    if (_test_dns_cached_host(base, dns, stub, TEST_DNS_HOST, &r) != 0 ||
+        r.result != IM_DNS_OK || memcmp(r.addrs[0].addr, loopback, 4) != 0)
+        ok = false;
+
+    // nameserver出错的时候不再用getaddrinfo问一遍, 查询数量和直接用evdns一样
+    n = stub->queries;
+    raw = 0;
+    evdns_base_resolve_ipv4(dns, TEST_DNS_SERVFAIL_RAW, 0, _test_dns_raw_cb, &raw);
+    while (!raw)
+        event_base_loop(base, EVLOOP_ONCE);
+    n = stub->queries - n;
+    if (_test_dns_cached_host(base, dns, stub, TEST_DNS_SERVFAIL, &r) != n ||
+        r.result != IM_DNS_FAIL || r.count != 0)
+        ok = false;
+    if (_test_dns_cached_host(base, dns, stub, TEST_DNS_SERVFAIL, &r) != 0 ||
+        r.result != IM_DNS_FAIL)
+        ok = false;
+    printf("dns: servfail answered after %d queries\n", n);
+
+    // 数字地址不查询也不缓存
+    n = im_dns_cache_size();
+    if (_test_dns_cached_host(base, dns, stub, "127.0.0.1", &r) != 0 ||
+        r.result != IM_DNS_OK || memcmp(r.addrs[0].addr, loopback, 4) != 0 ||
+        im_dns_cache_size() != n)
+        ok = false;
+
+    // 取消以后不再回调
+    memset(&r, 0, sizeof(r));
+    im_dns_cancel(im_dns_host_lookup(base, dns, "b." TEST_DNS_DOMAIN, AF_INET,
+                                     _test_dns_host_cb, &r));
+    event_base_loop(base, EVLOOP_NONBLOCK);
+    if (r.calls)
+        ok = false;
+
+    printf("dns: %d cache entries\n", im_dns_cache_size());
+    return ok;
+}
+
+static int test_dns_accepted;
+static evutil_socket_t test_dns_accepted_fd = EVUTIL_INVALID_SOCKET;
+static int test_dns_events[3];
+
+static void _test_dns_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+                                struct sockaddr *addr, int socklen, void *userdata)
+{
+    test_dns_accepted++;
+    test_dns_accepted_fd = fd;
+}
+
+static void _test_dns_conn_handler(xmpp_conn_t *conn, xmpp_conn_event_t status, const int error,
+                                   xmpp_stream_error_t *stream_error, void *userdata)
+{
+    test_dns_events[status]++;
+}
+
+static xmpp_conn_t *_test_dns_conn(xmpp_ctx_t *ctx, const char *jid)
+{
+    xmpp_conn_t *conn = xmpp_conn_new(ctx);
+
+    xmpp_conn_set_jid(conn, jid);
+    memset(test_dns_events, 0, sizeof(test_dns_events));
+    if (xmpp_connect_client(conn, NULL, 0, _test_dns_conn_handler, NULL) != 0) {
+        xmpp_conn_release(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+bool test_dns(int argc, char **argv)
+{
+    struct event_base *base = event_base_new();
+    struct evdns_base *dns, *failover;
+    struct evconnlistener *listener;
+    struct sockaddr_in sin;
+    ev_socklen_t slen = sizeof(sin);
+    test_dns_stub_t stub;
+    test_dns_result_t r;
+    unsigned short closed;
+    int queries;
+    evutil_socket_t fd;
+    char addr[32];
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    bool ok = true;
+
+    assert(base);
+
+    // xmpp服务器
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(0x7f000001);
+    listener = evconnlistener_new_bind(base, _test_dns_accept_cb, NULL,
+                                       LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, 16,
+                                       (struct sockaddr *)&sin, sizeof(sin));
+    assert(listener);
+    getsockname(evconnlistener_get_fd(listener), (struct sockaddr *)&sin, &slen);
+
+    // DNS桩服务器
+    memset(&stub, 0, sizeof(stub));
+    stub.xmpp_port = ntohs(sin.sin_port);
+    stub.closed_port = _test_dns_closed_port();
+    stub.fd = _test_dns_bind(&stub.port);
+    assert(stub.fd != EVUTIL_INVALID_SOCKET);
+    evutil_make_socket_nonblocking(stub.fd);
+    stub.ev = event_new(base, stub.fd, EV_READ | EV_PERSIST, _test_dns_stub_cb, &stub);
+    event_add(stub.ev, NULL);
+
+    // 第一个nameserver的端口没有人监听, 查询要切换到第二个
+    fd = _test_dns_bind(&closed);
+    evutil_closesocket(fd);
+    failover = _test_dns_base(base, closed);
+    sprintf(addr, "127.0.0.1:%d", stub.port);
+    evdns_base_nameserver_ip_add(failover, addr);
+    dns = _test_dns_base(base, stub.port);
+
+    // SRV记录按priority排序
+    if (!_test_dns_srv(base, failover, TEST_DNS_DOMAIN, &r) || r.result != 0 || r.count != 3 ||
+        strcmp(r.records[0].target, TEST_DNS_HOST) != 0 || r.records[0].priority != 10 ||
+        r.records[0].weight != 5 || r.records[0].port != stub.xmpp_port ||
+        r.records[0].ttl != TEST_DNS_TTL || r.records[1].priority != 10 ||
+        r.records[2].priority != 20)
+        ok = false;
+    printf("dns: srv %d records, first %s:%d\n", r.count, r.count ? r.records[0].target : "-",
+           r.count ? r.records[0].port : 0);
+
+    // 没有记录
+    if (!_test_dns_srv(base, dns, "missing.test", &r) || r.result != 0 || r.count != 0)
+        ok = false;
+
+    // 取消以后不再回调
+    memset(&r, 0, sizeof(r));
+    im_srv_cancel(im_srv_lookup_async(base, dns, "xmpp-client", "tcp", TEST_DNS_DOMAIN,
+                                      _test_dns_srv_cb, &r));
+    event_base_loop(base, EVLOOP_NONBLOCK);
+    if (r.calls)
+        ok = false;
+
+    if (!_test_dns_cache(base, dns, &stub))
+        ok = false;
+
+    // 整个连接过程: SRV, A记录, TCP连接, 都不阻塞调用的线程
+    ctx = xmpp_ctx_new(NULL, NULL);
+    ctx->base = base;
+    if (ctx->dns)
+        evdns_base_free(ctx->dns, 0);
+    ctx->dns = dns;
+    if (ctx->timers)
+        im_timer_wheel_free(ctx->timers);
+    ctx->timers = im_timer_wheel_new(base, IM_TIMER_TICK);
+
+    conn = _test_dns_conn(ctx, "user@" TEST_DNS_DOMAIN);
+    if (!conn || test_dns_accepted || conn->state != XMPP_STATE_CONNECTING)
+        ok = false;
+    while (conn && conn->state == XMPP_STATE_CONNECTING)
+        event_base_loop(base, EVLOOP_ONCE);
+    if (!conn || conn->state != XMPP_STATE_CONNECTED ||
+        (strcmp(conn->connectdomain, TEST_DNS_HOST) && strcmp(conn->connectdomain, TEST_DNS_HOST2)))
+        ok = false;
+    while (!test_dns_accepted)
+        event_base_loop(base, EVLOOP_ONCE);
+    printf("dns: connected to %s:%s\n", conn ? conn->connectdomain : "-",
+           conn ? conn->connectport : "-");
+    if (conn) {
+        conn_do_disconnect(conn);
+        if (test_dns_events[XMPP_CONN_DISCONNECT] != 1)
+            ok = false;
+        xmpp_conn_release(conn);
+    }
+    evutil_closesocket(test_dns_accepted_fd);
+
+    // 第一个目标连不上, ipv6地址连不上, 最后连到第二个目标的ipv4地址
+    conn = _test_dns_conn(ctx, "user@" TEST_DNS_HE);
+    while (conn && conn->state == XMPP_STATE_CONNECTING)
+        event_base_loop(base, EVLOOP_ONCE);
+    if (!conn || conn->state != XMPP_STATE_CONNECTED || conn->connector ||
+        strcmp(conn->connectdomain, TEST_DNS_HE_DUAL) != 0 ||
+        atoi(conn->connectport) != stub.xmpp_port)
+        ok = false;
+    while (test_dns_accepted < 2)
+        event_base_loop(base, EVLOOP_ONCE);
+    printf("dns: happy eyeballs connected to %s:%s\n", conn ? conn->connectdomain : "-",
+           conn ? conn->connectport : "-");
+    if (conn) {
+        conn_do_disconnect(conn);
+        xmpp_conn_release(conn);
+    }
+    evutil_closesocket(test_dns_accepted_fd);
+
+    // 解析结果都在缓存里面, 调用期间就开始连接, 断开以后取消所有尝试
+    conn = _test_dns_conn(ctx, "user@" TEST_DNS_HE);
+    if (!conn || connect_attempt_count(conn) != 1)
+        ok = false;
+    if (conn) {
+        xmpp_disconnect(conn);
+        if (conn->state != XMPP_STATE_DISCONNECTED || conn->connector)
+            ok = false;
+        xmpp_conn_release(conn);
+    }
+    event_base_loop(base, EVLOOP_NONBLOCK);
+    if (test_dns_accepted != 2)
+        ok = false;
+
+    // 域名不存在, 异步报告失败
+    conn = _test_dns_conn(ctx, "user@missing.test");
+    while (conn && conn->state == XMPP_STATE_CONNECTING)
+        event_base_loop(base, EVLOOP_ONCE);
+    if (!conn || test_dns_events[XMPP_CONN_FAIL] != 1 || test_dns_accepted != 2)
+        ok = false;
+    if (conn)
+        xmpp_conn_release(conn);
+
+    // 解析期间断开, 清空缓存保证解析是异步的
+    im_dns_cache_clear();
+    conn = _test_dns_conn(ctx, "user@" TEST_DNS_DOMAIN);
+    if (conn) {
+        xmpp_disconnect(conn);
+        if (conn->state != XMPP_STATE_DISCONNECTED || test_dns_events[XMPP_CONN_DISCONNECT] != 1)
+            ok = false;
+        event_base_loop(base, EVLOOP_NONBLOCK);
+        xmpp_conn_release(conn);
+    }
+    event_base_loop(base, EVLOOP_NONBLOCK);
+    if (test_dns_accepted != 2)
+        ok = false;
+
+    // 数字地址不查询另一个地址族, 调用期间就开始连接
+    queries = stub.queries;
+    conn = xmpp_conn_new(ctx);
+    xmpp_conn_set_jid(conn, "user@" TEST_DNS_DOMAIN);
+    if (xmpp_connect_client(conn, "127.0.0.1", stub.xmpp_port, _test_dns_conn_handler, NULL) != 0 ||
+        connect_attempt_count(conn) != 1)
+        ok = false;
+    while (conn->state == XMPP_STATE_CONNECTING)
+        event_base_loop(base, EVLOOP_ONCE);
+    if (conn->state != XMPP_STATE_CONNECTED || stub.queries != queries)
+        ok = false;
+    while (test_dns_accepted < 3)
+        event_base_loop(base, EVLOOP_ONCE);
+    conn_do_disconnect(conn);
+    xmpp_conn_release(conn);
+    evutil_closesocket(test_dns_accepted_fd);
+
+    // 优先的目标还在解析的时候不能先连后面已经解析出来的目标
+    conn = _test_dns_conn(ctx, "user@" TEST_DNS_PRIO);
+    while (conn && conn->state == XMPP_STATE_CONNECTING)
+        event_base_loop(base, EVLOOP_ONCE);
+    if (!conn || conn->state != XMPP_STATE_CONNECTED ||
+        strcmp(conn->connectdomain, TEST_DNS_PRIO_SLOW) != 0)
+        ok = false;
+    while (test_dns_accepted < 4)
+        event_base_loop(base, EVLOOP_ONCE);
+    printf("dns: priority order connected to %s\n", conn ? conn->connectdomain : "-");
+    if (conn) {
+        conn_do_disconnect(conn);
+        xmpp_conn_release(conn);
+    }
+    evutil_closesocket(test_dns_accepted_fd);
+    while (stub.delayed)
+        event_base_loop(base, EVLOOP_ONCE);
+
+    printf("dns: %d queries answered by stub\n", stub.queries);
+
+    // 上下文释放dns
+    xmpp_ctx_free(ctx);
+    evdns_base_free(failover, 0);
+    evconnlistener_free(listener);
+    event_free(stub.ev);
+    evutil_closesocket(stub.fd);
+    event_base_free(base);
+    return ok;
+}
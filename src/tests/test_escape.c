@@ -0,0 +1,174 @@
+#include "test_escape.h"
+#include "xmpp-escape.h"
+#include "mm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+#ifdef POSIX
+#include <time.h>
+#endif
+
+// 随机输入的数量和最大长度
+#define TEST_ESCAPE_RANDOM 20000
+#define TEST_ESCAPE_RANDOM_LEN 300
+// 特殊字符放在每个位置上测试的最大长度, 覆盖两次32字节以及剩余的部分
+#define TEST_ESCAPE_POS_LEN 100
+// 性能测试用的消息长度和次数
+#define TEST_ESCAPE_BENCH_LEN 4096
+#define TEST_ESCAPE_BENCH_ROUNDS 50000
+
+static const char *test_escape_names[] = { "scalar", "sse2", "avx2" };
+
+static uint64_t _bench_now_us()
+{
+#ifdef WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart * 1000000 / freq.QuadPart);
+#endif
+#ifdef POSIX
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+// 和scalar比较, 每个起始位置都比较一遍. 缓冲区按实际长度分配, 越界读可以被检查出来
+static bool _test_escape_check(xml_escape_span_fn fn, const char *data, size_t len)
+{
+    xml_escape_span_fn scalar = xml_escape_span_impl(XML_ESCAPE_SCALAR);
+    char *buf = safe_mem_malloc(len ? len : 1, NULL);
+    size_t off;
+    int attr;
+    bool ok = true;
+
+    memcpy(buf, data, len);
+    for (attr = 0; attr < 2 && ok; attr++) {
+        for (off = 0; off <= len; off++) {
+            if (fn(buf + off, len - off, attr) != scalar(buf + off, len - off, attr)) {
+                printf("escape span mismatch: len %u off %u attr %d\n",
+                       (unsigned)len, (unsigned)off, attr);
+                ok = false;
+                break;
+            }
+        }
+    }
+    safe_mem_free(buf);
+    return ok;
+}
+
+static bool _test_escape_verify(xml_escape_span_fn fn)
+{
+    // 包括高位字节, 防止有符号比较出错, 0xbc/0xa6这些低7位和特殊字符相同
+    static const char specials[] = "<>&\"'";
+    static const char lookalike[] = "=?%!(\xbc\xbe\xa6\xa2\xa7\x80\xff";
+    char buf[TEST_ESCAPE_RANDOM_LEN];
+    size_t len, pos, i;
+    int n;
+
+    // 随机输入, 特殊字符的比例也随机
+    srand(20170301);
+    for (n = 0; n < TEST_ESCAPE_RANDOM; n++) {
+        int density = rand() % 64 + 1;
+        len = rand() % TEST_ESCAPE_RANDOM_LEN;
+        for (i = 0; i < len; i++) {
+            if (rand() % 256 < density)
+                buf[i] = specials[rand() % 5];
+            else
+                buf[i] = (char)(rand() % 255 + 1);
+        }
+        if (!_test_escape_check(fn, buf, len))
+            return false;
+    }
+
+    // 每种特殊字符放在每个位置上, 其他位置放相似的字符
+    for (len = 0; len <= TEST_ESCAPE_POS_LEN; len++) {
+        for (i = 0; i < len; i++)
+            buf[i] = lookalike[i % (sizeof(lookalike) - 1)];
+        if (!_test_escape_check(fn, buf, len))
+            return false;
+        for (pos = 0; pos < len; pos++) {
+            for (i = 0; i < 5; i++) {
+                char save = buf[pos];
+                buf[pos] = specials[i];
+                if (!_test_escape_check(fn, buf, len))
+                    return false;
+                buf[pos] = save;
+            }
+        }
+    }
+
+    // 全部是特殊字符
+    for (len = 0; len < 80; len++) {
+        for (i = 0; i < len; i++)
+            buf[i] = specials[i % 5];
+        if (!_test_escape_check(fn, buf, len))
+            return false;
+    }
+    return true;
+}
+
+// 模拟几KB的聊天消息, 隔一段有一个需要转义的字符
+static void _test_escape_bench(xml_escape_span_fn fn, const char *name, const char *msg)
+{
+    uint64_t begin, us;
+    size_t total = 0, len, n;
+    const char *s;
+    int i;
+
+    begin = _bench_now_us();
+    for (i = 0; i < TEST_ESCAPE_BENCH_ROUNDS; i++) {
+        s = msg;
+        len = TEST_ESCAPE_BENCH_LEN;
+        while (len) {
+            n = fn(s, len, 0);
+            if (n == len)
+                break;
+            s += n + 1;
+            len -= n + 1;
+        }
+        total += TEST_ESCAPE_BENCH_LEN;
+    }
+    us = _bench_now_us() - begin;
+    printf("escape %-6s %8.1f MB/s\n", name, (double)total / (us ? us : 1));
+}
+
+bool test_escape(int argc, char **argv)
+{
+    static const char words[] = "the quick brown fox jumps over the lazy dog, ";
+    char *msg = safe_mem_malloc(TEST_ESCAPE_BENCH_LEN, NULL);
+    xml_escape_span_fn fn;
+    bool ok = true;
+    int kind, i;
+
+    for (i = 0; i < TEST_ESCAPE_BENCH_LEN; i++)
+        msg[i] = (i % 200 == 199) ? '&' : words[i % (sizeof(words) - 1)];
+
+    printf("escape selected %s\n", test_escape_names[xml_escape_kind()]);
+    for (kind = XML_ESCAPE_SCALAR; kind <= XML_ESCAPE_AVX2; kind++) {
+        fn = xml_escape_span_impl((xml_escape_kind_t)kind);
+        if (!fn) {
+            printf("escape %-6s not supported\n", test_escape_names[kind]);
+            continue;
+        }
+        if (!_test_escape_verify(fn)) {
+            printf("escape %-6s fail\n", test_escape_names[kind]);
+            ok = false;
+            continue;
+        }
+        _test_escape_bench(fn, test_escape_names[kind], msg);
+    }
+
+    // 分派的入口和选择的实现结果一致
+    if (xml_escape_span(msg, TEST_ESCAPE_BENCH_LEN, 0) != 199)
+        ok = false;
+
+    safe_mem_free(msg);
+    return ok;
+}
@@ -0,0 +1,3 @@
+#include <stdbool.h>
+
+bool test_escape(int argc, char **argv);
@@ -0,0 +1,93 @@
+#include "test_executor.h"
+#include "im-atomic.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+// 外部提交的任务数量
+#define TEST_EXECUTOR_TASKS 100000
+// 递归任务的深度, 每层拆成两个子任务
+#define TEST_EXECUTOR_DEPTH 14
+
+static volatile long executed = 0;
+static volatile long spawned = 0;
+// 工作线程里面提交失败的次数
+static volatile long submit_failed = 0;
+
+static void _test_executor_count(int msg_id, void *userdata)
+{
+    im_atomic_inc(&executed);
+}
+
+// 在工作线程里面拆分子任务, 子任务进本地队列, 由空闲线程窃取
+static void _test_executor_split(int msg_id, void *userdata)
+{
+    im_executor_t *ex = userdata;
+
+    im_atomic_inc(&executed);
+    if (msg_id > 0) {
+        im_atomic_add(&spawned, 2);
+        if (!im_executor_submit(ex, msg_id - 1, _test_executor_split, ex))
+            im_atomic_inc(&submit_failed);
+        if (!im_executor_submit(ex, msg_id - 1, _test_executor_split, ex))
+            im_atomic_inc(&submit_failed);
+    }
+}
+
+static bool _test_executor_wait(long expected)
+{
+    // 最多等待10秒
+    for (int i = 0; i < 1000; i++) {
+        if (im_atomic_load(&submit_failed) > 0)
+            return false;
+        if (im_atomic_load(&executed) == expected)
+            return true;
+        im_thread_sleep(10);
+    }
+    return false;
+}
+
+bool test_executor(int argc, char **argv)
+{
+    im_executor_t *ex = im_executor_new(4);
+    bool submitted;
+
+    if (!ex)
+        return false;
+    assert(im_executor_get_size(ex) == 4);
+    assert(im_executor_get_thread(ex, 4) == NULL);
+
+    im_atomic_store(&executed, 0);
+    im_atomic_store(&submit_failed, 0);
+    for (int i = 0; i < TEST_EXECUTOR_TASKS; i++) {
+        submitted = im_executor_submit(ex, i, _test_executor_count, NULL);
+        if (!submitted) {
+            printf("executor: submit %d failed\n", i);
+            im_executor_free(ex);
+            return false;
+        }
+    }
+    if (!_test_executor_wait(TEST_EXECUTOR_TASKS)) {
+        printf("executor: %ld/%d tasks executed\n", im_atomic_load(&executed), TEST_EXECUTOR_TASKS);
+        im_executor_free(ex);
+        return false;
+    }
+
+    im_atomic_store(&executed, 0);
+    im_atomic_store(&spawned, 1);
+    submitted = im_executor_submit(ex, TEST_EXECUTOR_DEPTH, _test_executor_split, ex);
+    if (!submitted) {
+        printf("executor: submit split root failed\n");
+        im_executor_free(ex);
+        return false;
+    }
+    if (!_test_executor_wait((1L << (TEST_EXECUTOR_DEPTH + 1)) - 1)) {
+        printf("executor: %ld/%ld split tasks executed, %ld submits failed\n",
+               im_atomic_load(&executed), im_atomic_load(&spawned), im_atomic_load(&submit_failed));
+        im_executor_free(ex);
+        return false;
+    }
+
+    im_executor_free(ex);
+    return true;
+}
@@ -0,0 +1,3 @@
+#include "im-executor.h"
+
+bool test_executor(int argc, char **argv);
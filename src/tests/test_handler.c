@@ -0,0 +1,107 @@
+#include "test_handler.h"
+#include "xmpp-inl.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+// 子元素的数量, 超过派发时收集命名空间的上限
+#define TEST_HANDLER_CHILDREN 24
+
+static int test_handler_hits;
+static int test_handler_misses;
+
+static int _test_handler_hit(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata)
+{
+    test_handler_hits++;
+    return 1;
+}
+
+// handler按函数去重, 不该触发的几个handler各用一个函数
+static int _test_handler_miss1(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata)
+{
+    test_handler_misses++;
+    return 1;
+}
+
+static int _test_handler_miss2(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata)
+{
+    test_handler_misses++;
+    return 1;
+}
+
+static int _test_handler_miss3(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata)
+{
+    test_handler_misses++;
+    return 1;
+}
+
+static void _test_handler_child(xmpp_ctx_t *ctx, xmpp_stanza_t *parent, const char *name,
+                                const char *ns)
+{
+    xmpp_stanza_t *child = xmpp_stanza_new(ctx);
+
+    xmpp_stanza_set_name(child, name);
+    xmpp_stanza_set_ns(child, ns);
+    xmpp_stanza_add_child(parent, child);
+    xmpp_stanza_release(child);
+}
+
+// 子元素命名空间超过派发时收集的上限, 排在后面的命名空间的handler也要触发, 而且只触发一次
+static bool _test_handler_many_ns(xmpp_ctx_t *ctx)
+{
+    xmpp_conn_t *conn = xmpp_conn_new(ctx);
+    xmpp_stanza_t *msg = xmpp_stanza_new(ctx);
+    char key[64];
+    bool ok = true;
+    int i;
+
+    assert(conn && msg);
+    conn->authenticated = 1;
+    xmpp_stanza_set_name(msg, "message");
+    for (i = 0; i < TEST_HANDLER_CHILDREN; i++) {
+        snprintf(key, sizeof(key), "urn:test:child:%d", i);
+        _test_handler_child(ctx, msg, "x", key);
+    }
+    xmpp_handler_add(conn, _test_handler_hit, "urn:test:child:1", NULL, NULL, NULL);
+    xmpp_handler_add(conn, _test_handler_miss1, "urn:test:child:20", "presence", NULL, NULL);
+    xmpp_handler_add(conn, _test_handler_miss2, "urn:test:child:23", "message", "chat", NULL);
+    xmpp_handler_add(conn, _test_handler_miss3, "urn:test:child:30", NULL, NULL, NULL);
+
+    test_handler_hits = 0;
+    test_handler_misses = 0;
+    handler_fire_stanza(conn, msg);
+    if (test_handler_hits != 1 || test_handler_misses != 0)
+        ok = false;
+
+    // 不在stanza里面的命名空间不能匹配
+    xmpp_handler_delete(conn, _test_handler_hit);
+    xmpp_handler_add(conn, _test_handler_hit, "urn:test:child:30", NULL, NULL, NULL);
+    handler_fire_stanza(conn, msg);
+    if (test_handler_hits != 1)
+        ok = false;
+
+    // 最后一个子元素的命名空间
+    xmpp_handler_delete(conn, _test_handler_hit);
+    xmpp_handler_add(conn, _test_handler_hit, "urn:test:child:23", NULL, NULL, NULL);
+    handler_fire_stanza(conn, msg);
+    if (test_handler_hits != 2 || test_handler_misses != 0)
+        ok = false;
+
+    printf("handler: %d child namespaces, %d hits\n", TEST_HANDLER_CHILDREN, test_handler_hits);
+    xmpp_stanza_release(msg);
+    xmpp_conn_release(conn);
+    return ok;
+}
+
+bool test_handler(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx = xmpp_ctx_new(NULL, NULL);
+    bool ok = true;
+
+    assert(ctx);
+    if (!_test_handler_many_ns(ctx))
+        ok = false;
+
+    xmpp_ctx_free(ctx);
+    return ok;
+}
@@ -0,0 +1,218 @@
+#include "test_iq.h"
+#include "xmpp-inl.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+// 连续发出的请求数量
+#define TEST_IQ_COUNT 100
+// 超时的请求, 毫秒
+#define TEST_IQ_TIMEOUT 50
+
+typedef struct test_iq_result {
+    int calls;
+    int status;
+    char id[16];
+} test_iq_result_t;
+
+static test_iq_result_t test_iq_results[TEST_IQ_COUNT + 4];
+
+static void _test_iq_handler(xmpp_conn_t *conn, int status, xmpp_stanza_t *stanza, void *userdata)
+{
+    test_iq_result_t *r = userdata;
+
+    r->calls++;
+    r->status = status;
+    // 应答一定带着请求的id
+    if (stanza && strcmp(xmpp_stanza_get_id_ptr(stanza), r->id) != 0)
+        r->calls += 100;
+}
+
+static int test_iq_stray;
+
+// 不是应答的stanza继续交给普通handler
+static int _test_iq_stray(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata)
+{
+    test_iq_stray++;
+    return XMPP_HANDLER_AGAIN;
+}
+
+static void _test_iq_open(xmpp_conn_t *const conn)
+{
+}
+
+static void _test_iq_feed(xmpp_conn_t *conn, const char *fmt, const char *id)
+{
+    char buf[256];
+
+    sprintf(buf, fmt, id);
+    parser_feed(conn->parser, buf, (int)strlen(buf));
+}
+
+static xmpp_stanza_t *_test_iq_new(xmpp_ctx_t *ctx)
+{
+    xmpp_stanza_t *iq = xmpp_stanza_new(ctx);
+    xmpp_stanza_t *query = xmpp_stanza_new(ctx);
+
+    xmpp_stanza_set_name(iq, "iq");
+    xmpp_stanza_set_type(iq, "get");
+    xmpp_stanza_set_name(query, "query");
+    xmpp_stanza_set_ns(query, XMPP_NS_ROSTER);
+    xmpp_stanza_add_child(iq, query);
+    xmpp_stanza_release(query);
+    return iq;
+}
+
+static bool _test_iq_send_to(xmpp_conn_t *conn, int index, unsigned long timeout, const char *to)
+{
+    xmpp_stanza_t *iq = _test_iq_new(conn->ctx);
+    test_iq_result_t *r = &test_iq_results[index];
+    int ret;
+
+    if (to)
+        xmpp_stanza_set_attribute(iq, "to", to);
+    ret = xmpp_iq_send_async(conn, iq, timeout, _test_iq_handler, r);
+
+    if (ret == XMPP_EOK)
+        strcpy(r->id, xmpp_stanza_get_id_ptr(iq));
+    xmpp_stanza_release(iq);
+    return ret == XMPP_EOK;
+}
+
+static bool _test_iq_send(xmpp_conn_t *conn, int index, unsigned long timeout)
+{
+    return _test_iq_send_to(conn, index, timeout, NULL);
+}
+
+bool test_iq(int argc, char **argv)
+{
+    const char *header = "<stream:stream xmlns='jabber:client' "
+                         "xmlns:stream='http://etherx.jabber.org/streams' id='s1'>";
+    struct event_base *base = event_base_new();
+    struct bufferevent *pair[2];
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    xmpp_stanza_t *iq;
+    bool ok = true;
+    size_t sent;
+    int i, calls, stray;
+
+    assert(base);
+    bufferevent_pair_new(base, 0, pair);
+    bufferevent_enable(pair[1], EV_READ);
+
+    // 上下文的时间轮放在测试自己的event_base上
+    ctx = xmpp_ctx_new(NULL, NULL);
+    ctx->base = base;
+    if (ctx->timers)
+        im_timer_wheel_free(ctx->timers);
+    ctx->timers = im_timer_wheel_new(base, IM_TIMER_TICK);
+
+    conn = xmpp_conn_new(ctx);
+    conn->evbuffer = pair[0];
+    conn->state = XMPP_STATE_CONNECTED;
+    conn->authenticated = 1;
+    conn->open_handler = _test_iq_open;
+    parser_feed(conn->parser, (char *)header, (int)strlen(header));
+    xmpp_handler_add(conn, _test_iq_stray, NULL, "iq", NULL, NULL);
+    memset(test_iq_results, 0, sizeof(test_iq_results));
+
+    // 连续发出去, 不等应答
+    for (i = 0; i < TEST_IQ_COUNT; i++) {
+        if (!_test_iq_send(conn, i, 0))
+            ok = false;
+    }
+    if (xmpp_iq_pending_count(conn) != TEST_IQ_COUNT)
+        ok = false;
+
+    // 已经在等待的id不能再发
+    iq = _test_iq_new(ctx);
+    xmpp_stanza_set_id(iq, test_iq_results[0].id);
+    if (xmpp_iq_send_async(conn, iq, 0, _test_iq_handler, NULL) == XMPP_EOK)
+        ok = false;
+    xmpp_stanza_release(iq);
+
+    // 同样id的请求不是应答
+    _test_iq_feed(conn, "<iq type='get' id='%s'/>", test_iq_results[0].id);
+    if (test_iq_stray != 1 || test_iq_results[0].calls != 0)
+        ok = false;
+
+    // 倒序应答, 第一个请求返回错误, 最后一个主动取消
+    if (xmpp_iq_cancel(conn, test_iq_results[TEST_IQ_COUNT - 1].id) != XMPP_EOK)
+        ok = false;
+    for (i = TEST_IQ_COUNT - 2; i > 0; i--)
+        _test_iq_feed(conn, "<iq type='result' id='%s'><query xmlns='jabber:iq:roster'/></iq>",
+                      test_iq_results[i].id);
+    _test_iq_feed(conn, "<iq type='error' id='%s'/>", test_iq_results[0].id);
+
+    // 应答不会交给普通handler
+    if (test_iq_stray != 1 || xmpp_iq_pending_count(conn) != 0)
+        ok = false;
+    for (i = 0; i < TEST_IQ_COUNT - 1; i++) {
+        if (test_iq_results[i].calls != 1 ||
+            test_iq_results[i].status != (i ? XMPP_IQ_RESULT : XMPP_IQ_ERROR))
+            ok = false;
+    }
+    if (test_iq_results[TEST_IQ_COUNT - 1].calls != 0)
+        ok = false;
+
+    // 所有请求都写到了输出缓冲区
+    event_base_loop(base, EVLOOP_NONBLOCK);
+    sent = evbuffer_get_length(bufferevent_get_input(pair[1]));
+    if (sent == 0)
+        ok = false;
+
+    // 超时
+    _test_iq_send(conn, TEST_IQ_COUNT, TEST_IQ_TIMEOUT);
+    while (test_iq_results[TEST_IQ_COUNT].calls == 0)
+        event_base_loop(base, EVLOOP_ONCE);
+    if (test_iq_results[TEST_IQ_COUNT].status != XMPP_IQ_TIMEOUT)
+        ok = false;
+
+    // 超时以后再来的应答按普通stanza处理
+    _test_iq_feed(conn, "<iq type='result' id='%s'/>", test_iq_results[TEST_IQ_COUNT].id);
+    if (test_iq_stray != 2 || test_iq_results[TEST_IQ_COUNT].calls != 1)
+        ok = false;
+
+    // 应答要来自请求的to, 发给服务器的请求只接受没有from或者自己账号的应答
+    conn->jid = xmpp_strdup(ctx, "user@example.com");
+    conn->bound_jid = xmpp_strdup(ctx, "user@example.com/res");
+    conn->domain = xmpp_strdup(ctx, "example.com");
+    stray = test_iq_stray;
+    _test_iq_send_to(conn, TEST_IQ_COUNT + 2, 0, "peer@example.com/r");
+    _test_iq_send(conn, TEST_IQ_COUNT + 3, 0);
+    _test_iq_feed(conn, "<iq type='result' from='mallory@example.com' id='%s'/>",
+                  test_iq_results[TEST_IQ_COUNT + 2].id);
+    _test_iq_feed(conn, "<iq type='result' id='%s'/>", test_iq_results[TEST_IQ_COUNT + 2].id);
+    _test_iq_feed(conn, "<iq type='result' from='example.org' id='%s'/>",
+                  test_iq_results[TEST_IQ_COUNT + 3].id);
+    if (test_iq_stray != stray + 3 || test_iq_results[TEST_IQ_COUNT + 2].calls != 0 ||
+        test_iq_results[TEST_IQ_COUNT + 3].calls != 0)
+        ok = false;
+    _test_iq_feed(conn, "<iq type='result' from='Peer@Example.com/r' id='%s'/>",
+                  test_iq_results[TEST_IQ_COUNT + 2].id);
+    _test_iq_feed(conn, "<iq type='result' from='user@example.com' id='%s'/>",
+                  test_iq_results[TEST_IQ_COUNT + 3].id);
+    if (test_iq_stray != stray + 3 || test_iq_results[TEST_IQ_COUNT + 2].calls != 1 ||
+        test_iq_results[TEST_IQ_COUNT + 3].calls != 1)
+        ok = false;
+
+    // 释放连接的时候还在等待的请求都会通知
+    _test_iq_send(conn, TEST_IQ_COUNT + 1, 0);
+    xmpp_conn_release(conn);
+    if (test_iq_results[TEST_IQ_COUNT + 1].calls != 1 ||
+        test_iq_results[TEST_IQ_COUNT + 1].status != XMPP_IQ_CANCELED)
+        ok = false;
+
+    calls = 0;
+    for (i = 0; i < TEST_IQ_COUNT + 4; i++)
+        calls += test_iq_results[i].calls;
+    printf("iq: %d requests, %d callbacks, %lu bytes sent\n",
+           TEST_IQ_COUNT + 4, calls, (unsigned long)sent);
+
+    bufferevent_free(pair[0]);
+    bufferevent_free(pair[1]);
+    xmpp_ctx_free(ctx);
+    event_base_free(base);
+    return ok;
+}
@@ -0,0 +1,189 @@
+#include "test_sasl2.h"
+#include "xmpp-inl.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+static const char *test_sasl2_header = "<stream:stream xmlns='jabber:client' "
+                                       "xmlns:stream='http://etherx.jabber.org/streams' id='s1'>";
+// 支持SASL2, Bind2和流管理
+static const char *test_sasl2_features = "<stream:features>"
+    "<mechanisms xmlns='urn:ietf:params:xml:ns:xmpp-sasl'><mechanism>PLAIN</mechanism></mechanisms>"
+    "<authentication xmlns='urn:xmpp:sasl:2'><mechanism>PLAIN</mechanism><inline>"
+    "<sm xmlns='urn:xmpp:sm:3'/><bind xmlns='urn:xmpp:bind:0'><inline>"
+    "<feature var='urn:xmpp:sm:3'/></inline></bind></inline></authentication>"
+    "</stream:features>";
+// 支持SASL2但是不支持Bind2
+static const char *test_sasl2_features_nobind = "<stream:features>"
+    "<authentication xmlns='urn:xmpp:sasl:2'><mechanism>PLAIN</mechanism></authentication>"
+    "</stream:features>";
+static int test_sasl2_connects;
+static char test_sasl2_out[8192];
+
+static void _test_sasl2_conn_handler(xmpp_conn_t *const conn, const xmpp_conn_event_t event,
+                                     const int error, xmpp_stream_error_t *const stream_error,
+                                     void *const userdata)
+{
+    if (event == XMPP_CONN_CONNECT)
+        test_sasl2_connects++;
+}
+
+static void _test_sasl2_feed(xmpp_conn_t *conn, const char *data)
+{
+    parser_feed(conn->parser, (char *)data, (int)strlen(data));
+}
+
+// 取出对端收到的所有数据
+static const char *_test_sasl2_output(struct event_base *base, struct bufferevent *peer)
+{
+    struct evbuffer *input = bufferevent_get_input(peer);
+    size_t len;
+
+    event_base_loop(base, EVLOOP_NONBLOCK);
+    len = evbuffer_get_length(input);
+    if (len >= sizeof(test_sasl2_out))
+        len = sizeof(test_sasl2_out) - 1;
+    evbuffer_remove(input, test_sasl2_out, len);
+    test_sasl2_out[len] = '\0';
+    return test_sasl2_out;
+}
+
+// 模拟断线以后在新的连接上重新登录, 收到features以后发出认证请求
+static const char *_test_sasl2_login(xmpp_conn_t *conn, struct event_base *base,
+                                     struct bufferevent **pair, const char *features)
+{
+    if (conn->evbuffer) {
+        conn_do_disconnect(conn);
+        bufferevent_free(pair[1]);
+        event_base_loop(base, EVLOOP_NONBLOCK);
+    }
+
+    bufferevent_pair_new(base, 0, pair);
+    bufferevent_enable(pair[1], EV_READ);
+    conn->evbuffer = pair[0];
+    conn->state = XMPP_STATE_CONNECTED;
+    conn->authenticated = 0;
+    conn_reset_stream(conn, auth_handle_open);
+    _test_sasl2_feed(conn, test_sasl2_header);
+    _test_sasl2_feed(conn, features);
+    return _test_sasl2_output(base, pair[1]);
+}
+
+bool test_sasl2(int argc, char **argv)
+{
+    struct event_base *base = event_base_new();
+    struct bufferevent *pair[2];
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    xmpp_stanza_t *msg;
+    const char *out;
+    char id[16];
+    bool ok = true;
+    int i;
+
+    assert(base);
+    ctx = xmpp_ctx_new(NULL, NULL);
+    ctx->base = base;
+    if (ctx->timers)
+        im_timer_wheel_free(ctx->timers);
+    ctx->timers = im_timer_wheel_new(base, IM_TIMER_TICK);
+
+    conn = xmpp_conn_new(ctx);
+    xmpp_conn_set_jid(conn, "user@example.test/phone");
+    xmpp_conn_set_pass(conn, "pencil");
+    conn->conn_handler = _test_sasl2_conn_handler;
+
+    // 认证, 绑定和启用流管理在一个请求里面
+    out = _test_sasl2_login(conn, base, pair, test_sasl2_features);
+    if (!strstr(out, "<authenticate xmlns='urn:xmpp:sasl:2' mechanism='PLAIN'>"
+                "<initial-response>AHVzZXIAcGVuY2ls</initial-response>"
+                "<bind xmlns='urn:xmpp:bind:0'><tag>phone</tag>"
+                "<enable xmlns='urn:xmpp:sm:3' resume='true'/></bind></authenticate>"))
+        ok = false;
+    _test_sasl2_feed(conn, "<success xmlns='urn:xmpp:sasl:2'><authorization-identifier>"
+                     "user@example.test/phone.a1</authorization-identifier>"
+                     "<bound xmlns='urn:xmpp:bind:0'><enabled xmlns='urn:xmpp:sm:3' id='sm1' "
+                     "resume='true'/></bound></success>");
+    // 不用重启流, 不用再绑定和启用
+    out = _test_sasl2_output(base, pair[1]);
+    if (strstr(out, "<stream:stream") || strstr(out, "<iq") || strstr(out, "<enable"))
+        ok = false;
+    if (test_sasl2_connects != 1 || !conn->authenticated || !conn->bound_jid ||
+        strcmp(conn->bound_jid, "user@example.test/phone.a1") != 0 ||
+        !conn->sm_id || strcmp(conn->sm_id, "sm1") != 0)
+        ok = false;
+
+    for (i = 0; i < 3; i++) {
+        msg = xmpp_stanza_new(ctx);
+        xmpp_stanza_set_name(msg, "message");
+        sprintf(id, "m%d", i);
+        xmpp_stanza_set_id(msg, id);
+        xmpp_send(conn, msg);
+        xmpp_stanza_release(msg);
+    }
+    _test_sasl2_feed(conn, "<message from='peer@example.test'><body>a</body></message>");
+    _test_sasl2_feed(conn, "<a xmlns='urn:xmpp:sm:3' h='1'/>");
+    if (xmpp_conn_sm_unacked(conn) != 2)
+        ok = false;
+
+    // 断线以后认证的时候一起恢复流
+    out = _test_sasl2_login(conn, base, pair, test_sasl2_features);
+    if (!strstr(out, "<resume xmlns='urn:xmpp:sm:3' h='1' previd='sm1'/><bind "))
+        ok = false;
+    _test_sasl2_feed(conn, "<success xmlns='urn:xmpp:sasl:2'><authorization-identifier>"
+                     "user@example.test/phone.a1</authorization-identifier>"
+                     "<resumed xmlns='urn:xmpp:sm:3' h='2' previd='sm1'/></success>");
+    out = _test_sasl2_output(base, pair[1]);
+    if (!strstr(out, "m2") || strstr(out, "m1") || strstr(out, "<enable"))
+        ok = false;
+    if (test_sasl2_connects != 2 || !xmpp_conn_is_resumed(conn) || xmpp_conn_sm_unacked(conn) != 1)
+        ok = false;
+
+    // 恢复失败的话服务器接着绑定, 没有确认的在新会话里面重发
+    out = _test_sasl2_login(conn, base, pair, test_sasl2_features);
+    _test_sasl2_feed(conn, "<success xmlns='urn:xmpp:sasl:2'><authorization-identifier>"
+                     "user@example.test/phone.b2</authorization-identifier>"
+                     "<failed xmlns='urn:xmpp:sm:3' h='2'/><bound xmlns='urn:xmpp:bind:0'>"
+                     "<enabled xmlns='urn:xmpp:sm:3' id='sm2' resume='true'/></bound></success>");
+    out = _test_sasl2_output(base, pair[1]);
+    if (!strstr(out, "m2") || strstr(out, "<iq") || strstr(out, "<enable"))
+        ok = false;
+    if (test_sasl2_connects != 3 || xmpp_conn_is_resumed(conn) || xmpp_conn_sm_unacked(conn) != 1 ||
+        !conn->sm_id || strcmp(conn->sm_id, "sm2") != 0 ||
+        strcmp(conn->bound_jid, "user@example.test/phone.b2") != 0)
+        ok = false;
+
+    // 服务器不支持Bind2的话认证以后用iq绑定, 也不用重启流
+    out = _test_sasl2_login(conn, base, pair, test_sasl2_features_nobind);
+    if (!strstr(out, "<authenticate ") || strstr(out, "<bind") || strstr(out, "<resume"))
+        ok = false;
+    _test_sasl2_feed(conn, "<success xmlns='urn:xmpp:sasl:2'><authorization-identifier>"
+                     "user@example.test</authorization-identifier></success>");
+    out = _test_sasl2_output(base, pair[1]);
+    if (strstr(out, "<stream:stream") ||
+        !strstr(out, "<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'><resource>phone</resource>"))
+        ok = false;
+    _test_sasl2_feed(conn, "<iq type='result' id='imcore_xmpp_bind'><bind "
+                     "xmlns='urn:ietf:params:xml:ns:xmpp-bind'><jid>user@example.test/phone</jid>"
+                     "</bind></iq>");
+    if (test_sasl2_connects != 4)
+        ok = false;
+
+    // 认证失败, 没有其他方式了
+    out = _test_sasl2_login(conn, base, pair, test_sasl2_features_nobind);
+    _test_sasl2_feed(conn, "<failure xmlns='urn:xmpp:sasl:2'><not-authorized "
+                     "xmlns='urn:ietf:params:xml:ns:xmpp-sasl'/></failure>");
+    out = _test_sasl2_output(base, pair[1]);
+    if (!strstr(out, "</stream:stream>") || test_sasl2_connects != 4)
+        ok = false;
+
+    printf("sasl2: %d connects\n", test_sasl2_connects);
+
+    conn_do_disconnect(conn);
+    xmpp_conn_release(conn);
+    bufferevent_free(pair[1]);
+    event_base_loop(base, EVLOOP_NONBLOCK);
+    xmpp_ctx_free(ctx);
+    event_base_free(base);
+    return ok;
+}
@@ -0,0 +1,263 @@
+#include "test_scram.h"
+#include "xmpp-inl.h"
+#include "base64.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+typedef struct {
+    const char *mech;
+    const char *nonce;
+    const char *server_first;
+    const char *client_final;
+    const char *server_final;
+} test_scram_vector_t;
+
+// RFC 5802和RFC 7677里面的例子, 用户user, 密码pencil
+static const test_scram_vector_t test_scram_vectors[] = {
+    {
+        "SCRAM-SHA-1", "fyko+d2lbbFgONRv9qkxdawL",
+        "r=fyko+d2lbbFgONRv9qkxdawL3rfcNHYJY1ZVvWVs7j,s=QSXCR+Q6sek8bf92,i=4096",
+        "c=biws,r=fyko+d2lbbFgONRv9qkxdawL3rfcNHYJY1ZVvWVs7j,p=v0X8v3Bz2T0CJGbJQyF0X+HI4Ts=",
+        "v=rmF9pqV8S7suAoZWja4dJRkFsKQ="
+    },
+    {
+        "SCRAM-SHA-256", "rOprNGfwEbeRWgbNEkqO",
+        "r=rOprNGfwEbeRWgbNEkqO%hvYDpWUa2RaTCAfuxFIlj)hNlF$k0,s=W22ZaJ0SNY7soEsUEjb6gQ==,i=4096",
+        "c=biws,r=rOprNGfwEbeRWgbNEkqO%hvYDpWUa2RaTCAfuxFIlj)hNlF$k0,"
+        "p=dHzbZapWIk4jUhN+Ute9ytag9zjfMHgsqmmiz7AndVQ=",
+        "v=6rriTRBi23WpRR/wtup+mMhUZUn/dB5nLTJRsjl95G4="
+    },
+};
+
+static char *_test_scram_encode(const char *text)
+{
+    return base64_encode(text, strlen(text));
+}
+
+static bool _test_scram_decoded_eq(const char *b64, const char *expect)
+{
+    unsigned char *text = b64 ? base64_decode(b64, strlen(b64)) : NULL;
+    bool eq = text && strcmp((char *)text, expect) == 0;
+
+    if (text)
+        safe_mem_free(text);
+    return eq;
+}
+
+// 跑一遍完整的交换, 返回是否和例子一致
+static bool _test_scram_run(xmpp_ctx_t *ctx, const test_scram_vector_t *v, const char *password)
+{
+    sasl_scram_t *scram = sasl_scram_new(ctx, v->mech, "example.test", "user", NULL, NULL, 0, 0,
+                                         v->nonce);
+    char *first, *server_first, *final_msg, *server_final;
+    char expect[128];
+    bool ok = true;
+
+    assert(scram);
+    first = sasl_scram_client_first(scram);
+    sprintf(expect, "n,,n=user,r=%s", v->nonce);
+    if (!_test_scram_decoded_eq(first, expect))
+        ok = false;
+
+    server_first = _test_scram_encode(v->server_first);
+    final_msg = sasl_scram_client_final(scram, server_first, "user", password);
+    if (!_test_scram_decoded_eq(final_msg, v->client_final))
+        ok = false;
+    server_final = _test_scram_encode(v->server_final);
+    if (!sasl_scram_verify(scram, server_final))
+        ok = false;
+
+    safe_mem_free(first);
+    safe_mem_free(server_first);
+    safe_mem_free(server_final);
+    if (final_msg)
+        safe_mem_free(final_msg);
+    sasl_scram_free(scram);
+    return ok;
+}
+
+static const char *test_scram_header = "<stream:stream xmlns='jabber:client' "
+                                      "xmlns:stream='http://etherx.jabber.org/streams' id='s1'>";
+
+static void _test_scram_open(xmpp_conn_t *const conn)
+{
+}
+
+static void _test_scram_conn_handler(xmpp_conn_t *const conn, const xmpp_conn_event_t event,
+                                     const int error, xmpp_stream_error_t *const stream_error,
+                                     void *const userdata)
+{
+}
+
+// 服务器同时提供几种方式的时候选SCRAM-SHA-256
+static bool _test_scram_select(xmpp_ctx_t *ctx)
+{
+    struct event_base *base = event_base_new();
+    struct bufferevent *pair[2];
+    struct evbuffer *input;
+    xmpp_conn_t *conn;
+    const char *features = "<stream:features><mechanisms xmlns='urn:ietf:params:xml:ns:xmpp-sasl'>"
+                           "<mechanism>PLAIN</mechanism><mechanism>DIGEST-MD5</mechanism>"
+                           "<mechanism>SCRAM-SHA-1</mechanism><mechanism>SCRAM-SHA-256</mechanism>"
+                           "<mechanism>SCRAM-SHA-256-PLUS</mechanism></mechanisms>"
+                           "</stream:features>";
+    // r=bad,s=QSXCR+Q6sek8bf92,i=4096
+    const char *challenge = "<challenge xmlns='urn:ietf:params:xml:ns:xmpp-sasl'>"
+                            "cj1iYWQscz1RU1hDUitRNnNlazhiZjkyLGk9NDA5Ng==</challenge>";
+    struct event_base *saved = ctx->base;
+    char out[1024];
+    size_t len;
+    bool ok = true;
+
+    ctx->base = base;
+    bufferevent_pair_new(base, 0, pair);
+    bufferevent_enable(pair[1], EV_READ);
+    conn = xmpp_conn_new(ctx);
+    xmpp_conn_set_jid(conn, "user@example.test");
+    xmpp_conn_set_pass(conn, "pencil");
+    conn->conn_handler = _test_scram_conn_handler;
+    conn->evbuffer = pair[0];
+    conn->state = XMPP_STATE_CONNECTED;
+    conn->open_handler = _test_scram_open;
+    parser_feed(conn->parser, (char *)test_scram_header, (int)strlen(test_scram_header));
+    auth_handle_open(conn);
+    parser_feed(conn->parser, (char *)features, (int)strlen(features));
+
+    // 没有tls不能用-PLUS
+    event_base_loop(base, EVLOOP_NONBLOCK);
+    input = bufferevent_get_input(pair[1]);
+    len = evbuffer_remove(input, out, sizeof(out) - 1);
+    out[len] = '\0';
+    if (!strstr(out, "mechanism='SCRAM-SHA-256'>") || !conn->scram)
+        ok = false;
+
+    // 不对的challenge断开连接
+    parser_feed(conn->parser, (char *)challenge, (int)strlen(challenge));
+    event_base_loop(base, EVLOOP_NONBLOCK);
+    len = evbuffer_remove(input, out, sizeof(out) - 1);
+    out[len] = '\0';
+    if (!strstr(out, "</stream:stream>"))
+        ok = false;
+    conn_do_disconnect(conn);
+    if (conn->scram)
+        ok = false;
+
+    xmpp_conn_release(conn);
+    bufferevent_free(pair[1]);
+    event_base_loop(base, EVLOOP_NONBLOCK);
+    ctx->base = saved;
+    event_base_free(base);
+    return ok;
+}
+
+bool test_scram(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx = xmpp_ctx_new(NULL, NULL);
+    const test_scram_vector_t *v = &test_scram_vectors[0];
+    sasl_scram_t *scram;
+    unsigned char cbdata[12] = "tls-unique!";
+    char *msg, *first;
+    long hits, misses;
+    int i, entries;
+    bool ok = true;
+
+    assert(ctx);
+    xmpp_scram_cache_clear();
+
+    // 第一次算PBKDF2, 第二次用缓存
+    for (i = 0; i < 2; i++) {
+        if (!_test_scram_run(ctx, &test_scram_vectors[0], "pencil") ||
+            !_test_scram_run(ctx, &test_scram_vectors[1], "pencil"))
+            ok = false;
+    }
+    xmpp_scram_cache_stats(&hits, &misses, &entries);
+    if (hits != 2 || misses != 2 || entries != 2)
+        ok = false;
+
+    // 密码变了不能用缓存
+    if (_test_scram_run(ctx, v, "pencil2"))
+        ok = false;
+    xmpp_scram_cache_stats(&hits, &misses, &entries);
+    if (hits != 2 || misses != 3)
+        ok = false;
+
+    // 服务器签名不对
+    scram = sasl_scram_new(ctx, v->mech, "example.test", "user", NULL, NULL, 0, 0, v->nonce);
+    first = _test_scram_encode(v->server_first);
+    msg = sasl_scram_client_final(scram, first, "user", "pencil");
+    safe_mem_free(msg);
+    safe_mem_free(first);
+    first = _test_scram_encode("v=rmF9pqV8S7suAoZWja4dJRkFsKA=");
+    if (sasl_scram_verify(scram, first))
+        ok = false;
+    safe_mem_free(first);
+    sasl_scram_free(scram);
+
+    // 服务器nonce不是以客户端nonce开头
+    scram = sasl_scram_new(ctx, v->mech, "example.test", "user", NULL, NULL, 0, 0, v->nonce);
+    first = _test_scram_encode("r=XXXX+d2lbbFgONRv9qkxdawL3rfcNHYJY1ZVvWVs7j,s=QSXCR+Q6sek8bf92,i=4096");
+    if ((msg = sasl_scram_client_final(scram, first, "user", "pencil")) != NULL) {
+        ok = false;
+        safe_mem_free(msg);
+    }
+    safe_mem_free(first);
+    sasl_scram_free(scram);
+
+    // 迭代次数太大
+    scram = sasl_scram_new(ctx, v->mech, "example.test", "user", NULL, NULL, 0, 0, v->nonce);
+    first = _test_scram_encode("r=fyko+d2lbbFgONRv9qkxdawLxx,s=QSXCR+Q6sek8bf92,i=2000000000");
+    if ((msg = sasl_scram_client_final(scram, first, "user", "pencil")) != NULL) {
+        ok = false;
+        safe_mem_free(msg);
+    }
+    safe_mem_free(first);
+    sasl_scram_free(scram);
+
+    // 通道绑定数据放在c=里面, 用户名里面的','和'='转义
+    scram = sasl_scram_new(ctx, "SCRAM-SHA-256-PLUS", "example.test", "a,b=c", "tls-unique",
+                           cbdata, sizeof(cbdata) - 1, 1, "nonce");
+    first = sasl_scram_client_first(scram);
+    if (!_test_scram_decoded_eq(first, "p=tls-unique,,n=a=2Cb=3Dc,r=nonce"))
+        ok = false;
+    safe_mem_free(first);
+    first = _test_scram_encode("r=nonceSERVER,s=QSXCR+Q6sek8bf92,i=16");
+    msg = sasl_scram_client_final(scram, first, "a,b=c", "pencil");
+    safe_mem_free(first);
+    first = _test_scram_encode("p=tls-unique,,tls-unique!");
+    if (msg) {
+        unsigned char *text = base64_decode(msg, strlen(msg));
+        char expect[64];
+
+        sprintf(expect, "c=%s,r=nonceSERVER,p=", first);
+        if (!text || strncmp((char *)text, expect, strlen(expect)) != 0)
+            ok = false;
+        if (text)
+            safe_mem_free(text);
+        safe_mem_free(msg);
+    } else {
+        ok = false;
+    }
+    safe_mem_free(first);
+    sasl_scram_free(scram);
+
+    // 客户端支持通道绑定但是服务器没有提供-PLUS
+    scram = sasl_scram_new(ctx, "SCRAM-SHA-1", "example.test", "user", NULL, NULL, 0, 1, NULL);
+    first = sasl_scram_client_first(scram);
+    msg = (char *)base64_decode(first, strlen(first));
+    if (strncmp(msg, "y,,n=user,r=", 12) != 0 || strlen(msg) != 12 + 32)
+        ok = false;
+    safe_mem_free(msg);
+    safe_mem_free(first);
+    sasl_scram_free(scram);
+
+    if (!_test_scram_select(ctx))
+        ok = false;
+
+    xmpp_scram_cache_stats(&hits, &misses, &entries);
+    printf("scram: %ld hits, %ld misses, %d entries\n", hits, misses, entries);
+
+    xmpp_scram_cache_clear();
+    xmpp_ctx_free(ctx);
+    return ok;
+}
@@ -0,0 +1,251 @@
+#include "test_sm.h"
+#include "xmpp-inl.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+// 断线之前发出的消息数量
+#define TEST_SM_COUNT 7
+
+static const char *test_sm_header = "<stream:stream xmlns='jabber:client' "
+                                    "xmlns:stream='http://etherx.jabber.org/streams' id='s1'>";
+static int test_sm_connects;
+static int test_sm_disconnects;
+static char test_sm_out[8192];
+
+static void _test_sm_conn_handler(xmpp_conn_t *const conn, const xmpp_conn_event_t event,
+                                  const int error, xmpp_stream_error_t *const stream_error,
+                                  void *const userdata)
+{
+    if (event == XMPP_CONN_CONNECT)
+        test_sm_connects++;
+    else if (event == XMPP_CONN_DISCONNECT)
+        test_sm_disconnects++;
+}
+
+static void _test_sm_open(xmpp_conn_t *const conn)
+{
+}
+
+static int test_sm_iq_status = -1;
+
+static void _test_sm_iq_handler(xmpp_conn_t *conn, int status, xmpp_stanza_t *stanza, void *userdata)
+{
+    test_sm_iq_status = status;
+}
+
+static void _test_sm_feed(xmpp_conn_t *conn, const char *data)
+{
+    parser_feed(conn->parser, (char *)data, (int)strlen(data));
+}
+
+// 取出对端收到的所有数据
+static const char *_test_sm_output(struct event_base *base, struct bufferevent *peer)
+{
+    struct evbuffer *input = bufferevent_get_input(peer);
+    size_t len;
+
+    event_base_loop(base, EVLOOP_NONBLOCK);
+    len = evbuffer_get_length(input);
+    if (len >= sizeof(test_sm_out))
+        len = sizeof(test_sm_out) - 1;
+    evbuffer_remove(input, test_sm_out, len);
+    test_sm_out[len] = '\0';
+    return test_sm_out;
+}
+
+static void _test_sm_send(xmpp_conn_t *conn, int index)
+{
+    xmpp_stanza_t *msg = xmpp_stanza_new(conn->ctx);
+    xmpp_stanza_t *body = xmpp_stanza_new(conn->ctx);
+    xmpp_stanza_t *text = xmpp_stanza_new(conn->ctx);
+    char buf[16];
+
+    sprintf(buf, "m%d", index);
+    xmpp_stanza_set_name(msg, "message");
+    xmpp_stanza_set_attribute(msg, "to", "peer@example.test");
+    xmpp_stanza_set_name(body, "body");
+    xmpp_stanza_set_text(text, buf);
+    xmpp_stanza_add_child(body, text);
+    xmpp_stanza_add_child(msg, body);
+    xmpp_stanza_release(text);
+    xmpp_stanza_release(body);
+    xmpp_send(conn, msg);
+    // 发送以后修改不影响重发的内容
+    xmpp_stanza_set_attribute(msg, "to", "changed@example.test");
+    xmpp_stanza_release(msg);
+}
+
+// 模拟断线以后在新的连接上重新打开流
+static void _test_sm_reconnect(xmpp_conn_t *conn, struct event_base *base,
+                               struct bufferevent **pair)
+{
+    conn_do_disconnect(conn);
+    bufferevent_free(pair[1]);
+    event_base_loop(base, EVLOOP_NONBLOCK);
+
+    bufferevent_pair_new(base, 0, pair);
+    bufferevent_enable(pair[1], EV_READ);
+    conn->evbuffer = pair[0];
+    conn->state = XMPP_STATE_CONNECTED;
+    conn->authenticated = 0;
+    conn_reset_stream(conn, _test_sm_open);
+    _test_sm_feed(conn, test_sm_header);
+    // sasl以后的features里面有<sm/>
+    conn->sm_support = 1;
+}
+
+bool test_sm(int argc, char **argv)
+{
+    struct event_base *base = event_base_new();
+    struct bufferevent *pair[2];
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    xmpp_stanza_t *iq;
+    const char *out;
+    bool ok = true;
+    int i;
+
+    assert(base);
+    bufferevent_pair_new(base, 0, pair);
+    bufferevent_enable(pair[1], EV_READ);
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    ctx->base = base;
+    if (ctx->timers)
+        im_timer_wheel_free(ctx->timers);
+    ctx->timers = im_timer_wheel_new(base, IM_TIMER_TICK);
+
+    conn = xmpp_conn_new(ctx);
+    xmpp_conn_set_jid(conn, "user@example.test/res");
+    conn->conn_handler = _test_sm_conn_handler;
+    conn->evbuffer = pair[0];
+    conn->state = XMPP_STATE_CONNECTED;
+    conn->authenticated = 1;
+    conn->open_handler = _test_sm_open;
+    _test_sm_feed(conn, test_sm_header);
+
+    // 绑定以后启用
+    conn->sm_support = 1;
+    sm_established(conn);
+    out = _test_sm_output(base, pair[1]);
+    if (!strstr(out, "<enable xmlns='urn:xmpp:sm:3' resume='true'/>"))
+        ok = false;
+    _test_sm_feed(conn, "<enabled xmlns='urn:xmpp:sm:3' id='sm1' resume='true'/>");
+    if (!conn->sm_id || strcmp(conn->sm_id, "sm1") != 0)
+        ok = false;
+
+    // 攒够一批请求一次确认
+    for (i = 0; i < TEST_SM_COUNT; i++)
+        _test_sm_send(conn, i);
+    out = _test_sm_output(base, pair[1]);
+    if (!strstr(out, "m6") || !strstr(out, "<r xmlns='urn:xmpp:sm:3'/>") ||
+        strstr(strstr(out, "<r ") + 1, "<r "))
+        ok = false;
+    if (xmpp_conn_sm_unacked(conn) != TEST_SM_COUNT)
+        ok = false;
+
+    // 收到的stanza计数, 流管理的元素不计数
+    _test_sm_feed(conn, "<message from='peer@example.test'><body>a</body></message>");
+    _test_sm_feed(conn, "<presence from='peer@example.test'/>");
+    _test_sm_feed(conn, "<iq type='get' id='q1' from='peer@example.test'/>");
+    _test_sm_feed(conn, "<r xmlns='urn:xmpp:sm:3'/>");
+    out = _test_sm_output(base, pair[1]);
+    if (!strstr(out, "<a xmlns='urn:xmpp:sm:3' h='3'/>"))
+        ok = false;
+
+    _test_sm_feed(conn, "<a xmlns='urn:xmpp:sm:3' h='5'/>");
+    if (xmpp_conn_sm_unacked(conn) != TEST_SM_COUNT - 5)
+        ok = false;
+
+    // 不够一批的过一会儿再请求确认
+    while (!strstr(_test_sm_output(base, pair[1]), "<r xmlns='urn:xmpp:sm:3'/>"))
+        event_base_loop(base, EVLOOP_ONCE);
+
+    // 断线以后恢复, 服务器只收到了6个
+    _test_sm_reconnect(conn, base, pair);
+    if (test_sm_disconnects != 1 || xmpp_conn_sm_unacked(conn) != TEST_SM_COUNT - 5)
+        ok = false;
+    if (!sm_resume(conn))
+        ok = false;
+    out = _test_sm_output(base, pair[1]);
+    if (!strstr(out, "<resume xmlns='urn:xmpp:sm:3' h='3' previd='sm1'/>"))
+        ok = false;
+    _test_sm_feed(conn, "<resumed xmlns='urn:xmpp:sm:3' h='6' previd='sm1'/>");
+    out = _test_sm_output(base, pair[1]);
+    if (!strstr(out, "m6") || strstr(out, "m5") || strstr(out, "changed") ||
+        !strstr(out, "<r xmlns='urn:xmpp:sm:3'/>"))
+        ok = false;
+    if (test_sm_connects != 1 || !xmpp_conn_is_resumed(conn) || !conn->authenticated ||
+        xmpp_conn_sm_unacked(conn) != 1)
+        ok = false;
+
+    // 计数接着上一个流
+    _test_sm_feed(conn, "<message from='peer@example.test'><body>b</body></message>");
+    _test_sm_feed(conn, "<r xmlns='urn:xmpp:sm:3'/>");
+    out = _test_sm_output(base, pair[1]);
+    if (!strstr(out, "h='4'"))
+        ok = false;
+
+    // 恢复失败的话重新绑定, 没有确认的在新会话里面重发
+    _test_sm_reconnect(conn, base, pair);
+    sm_resume(conn);
+    _test_sm_feed(conn, "<failed xmlns='urn:xmpp:sm:3'/>");
+    out = _test_sm_output(base, pair[1]);
+    if (!strstr(out, "<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'><resource>res</resource>") ||
+        conn->sm_id || xmpp_conn_sm_unacked(conn) != 1)
+        ok = false;
+    _test_sm_feed(conn, "<iq type='result' id='imcore_xmpp_bind'><bind "
+                  "xmlns='urn:ietf:params:xml:ns:xmpp-bind'><jid>user@example.test/res</jid>"
+                  "</bind></iq>");
+    out = _test_sm_output(base, pair[1]);
+    if (!strstr(out, "<enable ") || !strstr(out, "m6") ||
+        strstr(out, "<enable ") > strstr(out, "m6"))
+        ok = false;
+    if (test_sm_connects != 2 || xmpp_conn_is_resumed(conn) || xmpp_conn_sm_unacked(conn) != 1)
+        ok = false;
+    // 服务器给的流id里面有xml特殊字符
+    _test_sm_feed(conn, "<enabled xmlns='urn:xmpp:sm:3' id='sm&apos;2&lt;' resume='true'/>");
+    _test_sm_feed(conn, "<a xmlns='urn:xmpp:sm:3' h='1'/>");
+    if (xmpp_conn_sm_unacked(conn) != 0)
+        ok = false;
+
+    // 可以恢复的流断线的时候异步IQ继续等待, 恢复以后重发, 应答照常回调
+    iq = xmpp_stanza_new(ctx);
+    xmpp_stanza_set_name(iq, "iq");
+    xmpp_stanza_set_type(iq, "get");
+    xmpp_stanza_set_id(iq, "sm-iq");
+    xmpp_stanza_set_attribute(iq, "to", "peer@example.test/r");
+    xmpp_iq_send_async(conn, iq, 0, _test_sm_iq_handler, NULL);
+    xmpp_stanza_release(iq);
+    _test_sm_reconnect(conn, base, pair);
+    if (test_sm_iq_status != -1 || xmpp_iq_pending_count(conn) != 1)
+        ok = false;
+    sm_resume(conn);
+    out = _test_sm_output(base, pair[1]);
+    if (!strstr(out, "previd='sm&apos;2&lt;'"))
+        ok = false;
+    _test_sm_feed(conn, "<resumed xmlns='urn:xmpp:sm:3' h='1' previd='sm&apos;2&lt;'/>");
+    out = _test_sm_output(base, pair[1]);
+    if (!strstr(out, "sm-iq"))
+        ok = false;
+    _test_sm_feed(conn, "<iq type='result' id='sm-iq' from='peer@example.test/r'/>");
+    if (test_sm_iq_status != XMPP_IQ_RESULT || xmpp_iq_pending_count(conn) != 0)
+        ok = false;
+
+    // 主动断开的流不再恢复
+    _test_sm_send(conn, TEST_SM_COUNT);
+    xmpp_disconnect(conn);
+    if (conn->sm_id || xmpp_conn_sm_unacked(conn) != 0)
+        ok = false;
+
+    printf("sm: %d connects, %d disconnects\n", test_sm_connects, test_sm_disconnects);
+
+    xmpp_conn_release(conn);
+    bufferevent_free(pair[0]);
+    bufferevent_free(pair[1]);
+    event_base_loop(base, EVLOOP_NONBLOCK);
+    xmpp_ctx_free(ctx);
+    event_base_free(base);
+    return ok;
+}
@@ -25,6 +25,38 @@ void messagehandle3(int msg_id, void *userdata)
     
 }
 
+static volatile long mailbox_count = 0;
+
+void messagehandle_count(int msg_id, void *userdata)
+{
+    mailbox_count++;
+}
+
+// 大量无延时消息走邮箱
+bool test_thread_mailbox()
+{
+    const int total = 100000;
+    im_thread_t *t = im_thread_new();
+    int waited = 0;
+
+    if (!t)
+        return false;
+
+    mailbox_count = 0;
+    im_thread_start(t, NULL);
+    for (int i = 0; i < total; i++) {
+        im_thread_post(t, i, messagehandle_count, 0, NULL);
+    }
+    // 最多等待10秒, 丢了消息的时候不能一直卡住
+    while (mailbox_count < total && waited++ < 1000) {
+        im_thread_sleep(10);
+    }
+    im_thread_free(t);
+
+    printf("mailbox %ld/%d messages\n", mailbox_count, total);
+    return mailbox_count == total;
+}
+
 bool test_thread(int argc, char **argv)
 {
     im_thread_init();
@@ -57,6 +89,11 @@ bool test_thread(int argc, char **argv)
     im_thread_free(t1);
     im_thread_free(t2);
     
+    if (!test_thread_mailbox()) {
+        im_thread_destroy();
+        return false;
+    }
+    
     im_thread_destroy();
     return true;
 }
\ No newline at end of file
@@ -0,0 +1,173 @@
+#include "test_tls.h"
+#include "xmpp-inl.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+
+#define TEST_TLS_DOMAIN "example.test"
+
+// 自签名证书的服务器上下文, max_version为0表示不限制版本
+static SSL_CTX *_test_tls_server_ctx(int max_version)
+{
+    SSL_CTX *ssl_ctx = SSL_CTX_new(TLS_server_method());
+    EVP_PKEY_CTX *kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    EVP_PKEY *pkey = NULL;
+    X509 *x509 = X509_new();
+    X509_NAME *name;
+
+    EVP_PKEY_keygen_init(kctx);
+    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx, NID_X9_62_prime256v1);
+    EVP_PKEY_keygen(kctx, &pkey);
+    EVP_PKEY_CTX_free(kctx);
+
+    X509_set_version(x509, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+    X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+    X509_gmtime_adj(X509_getm_notAfter(x509), 3600);
+    X509_set_pubkey(x509, pkey);
+    name = X509_get_subject_name(x509);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)TEST_TLS_DOMAIN,
+                               -1, -1, 0);
+    X509_set_issuer_name(x509, name);
+    X509_sign(x509, pkey, EVP_sha256());
+
+    SSL_CTX_use_certificate(ssl_ctx, x509);
+    SSL_CTX_use_PrivateKey(ssl_ctx, pkey);
+    if (max_version)
+        SSL_CTX_set_max_proto_version(ssl_ctx, max_version);
+    X509_free(x509);
+    EVP_PKEY_free(pkey);
+    return ssl_ctx;
+}
+
+static int test_tls_server_connected;
+
+static void _test_tls_server_event_cb(struct bufferevent *bev, short what, void *ptr)
+{
+    if (what & BEV_EVENT_CONNECTED)
+        test_tls_server_connected = 1;
+}
+
+static void _test_tls_server_read_cb(struct bufferevent *bev, void *ptr)
+{
+    evbuffer_drain(bufferevent_get_input(bev), evbuffer_get_length(bufferevent_get_input(bev)));
+}
+
+static void _test_tls_conn_handler(xmpp_conn_t *conn, xmpp_conn_event_t status, const int error,
+                                   xmpp_stream_error_t *stream_error, void *userdata)
+{
+}
+
+// 通过conn_start_ssl握手一次, 返回是否复用了会话, 出错返回-1
+static int _test_tls_handshake(struct event_base *base, xmpp_ctx_t *ctx, SSL_CTX *server_ctx,
+                               const char *port, char *sni)
+{
+    struct bufferevent *pair[2], *server;
+    SSL *server_ssl, *ssl;
+    xmpp_conn_t *conn;
+    int before, sessions, i, reused = -1;
+    const char *name;
+
+    xmpp_tls_cache_stats(NULL, NULL, &before);
+    bufferevent_pair_new(base, 0, pair);
+    server_ssl = SSL_new(server_ctx);
+    server = bufferevent_openssl_filter_new(base, pair[1], server_ssl, BUFFEREVENT_SSL_ACCEPTING,
+                                            BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+    bufferevent_setcb(server, _test_tls_server_read_cb, NULL, _test_tls_server_event_cb, NULL);
+    bufferevent_enable(server, EV_READ | EV_WRITE);
+    test_tls_server_connected = 0;
+
+    conn = xmpp_conn_new(ctx);
+    conn->domain = xmpp_strdup(ctx, TEST_TLS_DOMAIN);
+    conn->connectport = xmpp_strdup(ctx, port);
+    conn->conn_handler = _test_tls_conn_handler;
+    conn->evbuffer = pair[0];
+    conn->state = XMPP_STATE_CONNECTED;
+    conn_start_ssl(conn);
+
+    for (i = 0; i < 1000 && !(conn->secured && test_tls_server_connected); i++)
+        event_base_loop(base, EVLOOP_ONCE | EVLOOP_NONBLOCK);
+
+    // 新的会话在握手之后才到, TLS 1.3的ticket要等客户端读到
+    for (i = 0; i < 1000; i++) {
+        xmpp_tls_cache_stats(NULL, NULL, &sessions);
+        if (sessions > before && conn->secured)
+            break;
+        event_base_loop(base, EVLOOP_ONCE | EVLOOP_NONBLOCK);
+    }
+
+    if (conn->secured && test_tls_server_connected) {
+        ssl = bufferevent_openssl_get_ssl(conn->evbuffer);
+        reused = SSL_session_reused(ssl);
+        name = SSL_get_servername(server_ssl, TLSEXT_NAMETYPE_host_name);
+        strcpy(sni, name ? name : "");
+    }
+
+    conn_do_disconnect(conn);
+    xmpp_conn_release(conn);
+    bufferevent_free(server);
+    // 延迟的回调持有bufferevent的引用, 跑一次才真正释放
+    event_base_loop(base, EVLOOP_NONBLOCK);
+    return reused;
+}
+
+bool test_tls(int argc, char **argv)
+{
+    struct event_base *base = event_base_new();
+    SSL_CTX *server_ctx = _test_tls_server_ctx(0);
+    SSL_CTX *server12_ctx = _test_tls_server_ctx(TLS1_2_VERSION);
+    xmpp_ctx_t *ctx;
+    long hits, misses;
+    int sessions;
+    char sni[256];
+    bool ok = true;
+
+    assert(base && server_ctx && server12_ctx);
+    ctx = xmpp_ctx_new(NULL, NULL);
+    ctx->base = base;
+    xmpp_tls_cache_clear();
+
+    // 第一次完整握手, 带上SNI, 收到的ticket放进缓存
+    sni[0] = '\0';
+    if (_test_tls_handshake(base, ctx, server_ctx, "5222", sni) != 0 ||
+        strcmp(sni, TEST_TLS_DOMAIN) != 0)
+        ok = false;
+    xmpp_tls_cache_stats(&hits, &misses, &sessions);
+    if (hits != 0 || misses != 1 || sessions < 1)
+        ok = false;
+
+    // 同一个服务器重连, 简短握手
+    if (_test_tls_handshake(base, ctx, server_ctx, "5222", sni) != 1)
+        ok = false;
+
+    // 端口不同是另一个服务器
+    if (_test_tls_handshake(base, ctx, server_ctx, "5223", sni) != 0)
+        ok = false;
+
+    // TLS 1.2的会话可以反复使用
+    if (_test_tls_handshake(base, ctx, server12_ctx, "5300", sni) != 0 ||
+        _test_tls_handshake(base, ctx, server12_ctx, "5300", sni) != 1 ||
+        _test_tls_handshake(base, ctx, server12_ctx, "5300", sni) != 1)
+        ok = false;
+
+    xmpp_tls_cache_stats(&hits, &misses, &sessions);
+    printf("tls: %ld resumed, %ld full handshakes, %d cached sessions\n", hits, misses, sessions);
+    if (hits != 3 || misses != 3)
+        ok = false;
+
+    // 清空以后重新完整握手
+    xmpp_tls_cache_clear();
+    if (_test_tls_handshake(base, ctx, server_ctx, "5222", sni) != 0)
+        ok = false;
+
+    xmpp_tls_cache_clear();
+    xmpp_ctx_free(ctx);
+    SSL_CTX_free(server_ctx);
+    SSL_CTX_free(server12_ctx);
+    event_base_free(base);
+    return ok;
+}
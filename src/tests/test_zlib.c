@@ -0,0 +1,270 @@
+#include "test_zlib.h"
+#include "xmpp-inl.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <zlib.h>
+
+// 名册条目数量
+#define TEST_ZLIB_ITEMS 200
+// 批量模式的flush延迟, 毫秒
+#define TEST_ZLIB_DELAY 50
+// 一次写入的消息数量, 解压以后超过过滤器单次的输出上限
+#define TEST_ZLIB_BURST 3000
+
+static const char *test_zlib_header = "<stream:stream xmlns='jabber:client' "
+                                      "xmlns:stream='http://etherx.jabber.org/streams' id='s1'>";
+static int test_zlib_messages;
+
+static int _test_zlib_message(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata)
+{
+    xmpp_stanza_t *body = xmpp_stanza_get_child_by_name(stanza, "body");
+    xmpp_stanza_t *child;
+    char text[32];
+    size_t len = 0, n;
+
+    if (!body)
+        return XMPP_HANDLER_AGAIN;
+    // 解压分几次交给解析器的时候文本可能分成几个节点
+    for (child = body->children; child; child = child->next) {
+        if (!xmpp_stanza_is_text(child))
+            continue;
+        n = strlen(child->data);
+        if (len + n >= sizeof(text))
+            return XMPP_HANDLER_AGAIN;
+        memcpy(text + len, child->data, n);
+        len += n;
+    }
+    text[len] = '\0';
+    if (strcmp(text, "compressed hello") == 0)
+        test_zlib_messages++;
+    return XMPP_HANDLER_AGAIN;
+}
+
+static void _test_zlib_open(xmpp_conn_t *const conn)
+{
+}
+
+static void _test_zlib_conn_handler(xmpp_conn_t *const conn, const xmpp_conn_event_t event,
+                                    const int error, xmpp_stream_error_t *const stream_error,
+                                    void *const userdata)
+{
+}
+
+// 对端解压收到的所有数据
+static size_t _test_zlib_peer_read(struct event_base *base, struct bufferevent *peer,
+                                   z_stream *zs, struct evbuffer *plain)
+{
+    struct evbuffer *input = bufferevent_get_input(peer);
+    unsigned char in[16384], out[16384];
+    size_t len, total = 0;
+
+    event_base_loop(base, EVLOOP_NONBLOCK);
+    while ((len = evbuffer_remove(input, in, sizeof(in))) > 0) {
+        total += len;
+        zs->next_in = in;
+        zs->avail_in = (uInt)len;
+        do {
+            zs->next_out = out;
+            zs->avail_out = sizeof(out);
+            inflate(zs, Z_SYNC_FLUSH);
+            evbuffer_add(plain, out, sizeof(out) - zs->avail_out);
+        } while (zs->avail_in > 0 || zs->avail_out == 0);
+    }
+    return total;
+}
+
+static void _test_zlib_peer_write(struct bufferevent *peer, z_stream *zs, const char *data)
+{
+    unsigned char out[1024];
+
+    zs->next_in = (unsigned char *)data;
+    zs->avail_in = (uInt)strlen(data);
+    do {
+        zs->next_out = out;
+        zs->avail_out = sizeof(out);
+        deflate(zs, Z_SYNC_FLUSH);
+        bufferevent_write(peer, out, sizeof(out) - zs->avail_out);
+    } while (zs->avail_out == 0);
+}
+
+static xmpp_stanza_t *_test_zlib_roster(xmpp_ctx_t *ctx)
+{
+    xmpp_stanza_t *iq = xmpp_stanza_new(ctx);
+    xmpp_stanza_t *query = xmpp_stanza_new(ctx);
+    xmpp_stanza_t *item;
+    char jid[64];
+    int i;
+
+    xmpp_stanza_set_name(iq, "iq");
+    xmpp_stanza_set_type(iq, "result");
+    xmpp_stanza_set_id(iq, "roster1");
+    xmpp_stanza_set_name(query, "query");
+    xmpp_stanza_set_ns(query, XMPP_NS_ROSTER);
+    for (i = 0; i < TEST_ZLIB_ITEMS; i++) {
+        item = xmpp_stanza_new(ctx);
+        sprintf(jid, "contact%d@example.test", i);
+        xmpp_stanza_set_name(item, "item");
+        xmpp_stanza_set_attribute(item, "jid", jid);
+        xmpp_stanza_set_attribute(item, "subscription", "both");
+        xmpp_stanza_add_child(query, item);
+        xmpp_stanza_release(item);
+    }
+    xmpp_stanza_add_child(iq, query);
+    xmpp_stanza_release(query);
+    return iq;
+}
+
+static xmpp_conn_t *_test_zlib_conn(xmpp_ctx_t *ctx, struct bufferevent *bev,
+                                    unsigned long flush_delay)
+{
+    xmpp_conn_t *conn = xmpp_conn_new(ctx);
+
+    conn->conn_handler = _test_zlib_conn_handler;
+    conn->evbuffer = bev;
+    conn->state = XMPP_STATE_CONNECTED;
+    conn->authenticated = 1;
+    conn->open_handler = _test_zlib_open;
+    parser_feed(conn->parser, (char *)test_zlib_header, (int)strlen(test_zlib_header));
+    xmpp_conn_set_compression(conn, 6, flush_delay);
+    return conn;
+}
+
+bool test_zlib(int argc, char **argv)
+{
+    struct event_base *base = event_base_new();
+    struct bufferevent *pair[2], *batch[2];
+    struct evbuffer *expect = evbuffer_new();
+    struct evbuffer *plain = evbuffer_new();
+    z_stream zin, zout, zbatch;
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn, *bconn;
+    xmpp_stanza_t *iq;
+    size_t raw, wire;
+    char *bomb;
+    bool ok = true;
+    int i;
+
+    assert(base && expect && plain);
+    memset(&zin, 0, sizeof(zin));
+    memset(&zout, 0, sizeof(zout));
+    memset(&zbatch, 0, sizeof(zbatch));
+    inflateInit(&zin);
+    deflateInit(&zout, Z_DEFAULT_COMPRESSION);
+    inflateInit(&zbatch);
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    ctx->base = base;
+    if (ctx->timers)
+        im_timer_wheel_free(ctx->timers);
+    ctx->timers = im_timer_wheel_new(base, IM_TIMER_TICK);
+
+    // 每次写都flush
+    bufferevent_pair_new(base, 0, pair);
+    bufferevent_enable(pair[1], EV_READ);
+    conn = _test_zlib_conn(ctx, pair[0], 0);
+    xmpp_handler_add(conn, _test_zlib_message, NULL, "message", NULL, NULL);
+    if (conn_start_compression(conn) != 0 || !conn->compressed)
+        ok = false;
+    // 已经压缩了不能再叠一层
+    if (conn_start_compression(conn) == 0)
+        ok = false;
+
+    iq = _test_zlib_roster(ctx);
+    stanza_render(iq, expect);
+    raw = evbuffer_get_length(expect);
+    xmpp_send(conn, iq);
+    xmpp_stanza_release(iq);
+    wire = _test_zlib_peer_read(base, pair[1], &zin, plain);
+    if (evbuffer_get_length(plain) != raw ||
+        memcmp(evbuffer_pullup(plain, -1), evbuffer_pullup(expect, -1), raw) != 0)
+        ok = false;
+    // 名册这样重复的xml至少能压到三分之一
+    if (wire == 0 || wire * 3 > raw)
+        ok = false;
+
+    // 收到的数据解压以后交给解析器
+    _test_zlib_peer_write(pair[1], &zout, "<message from='peer@example.test'>"
+                          "<body>compressed hello</body></message>");
+    _test_zlib_peer_write(pair[1], &zout, "<message from='peer@example.test'>"
+                          "<body>compressed hello</body></message>");
+    event_base_loop(base, EVLOOP_NONBLOCK);
+    event_base_loop(base, EVLOOP_NONBLOCK);
+    if (test_zlib_messages != 2 || conn->state != XMPP_STATE_CONNECTED)
+        ok = false;
+
+    // 一次收到很多stanza, 分几次解压, 全部交给解析器
+    evbuffer_drain(plain, evbuffer_get_length(plain));
+    for (i = 0; i < TEST_ZLIB_BURST; i++)
+        evbuffer_add_printf(plain, "<message from='peer@example.test'>"
+                            "<body>compressed hello</body></message>");
+    evbuffer_add(plain, "", 1);
+    _test_zlib_peer_write(pair[1], &zout, (const char *)evbuffer_pullup(plain, -1));
+    for (i = 0; i < 100 && test_zlib_messages < TEST_ZLIB_BURST + 2; i++)
+        event_base_loop(base, EVLOOP_NONBLOCK);
+    if (test_zlib_messages != TEST_ZLIB_BURST + 2 || conn->state != XMPP_STATE_CONNECTED)
+        ok = false;
+
+    // 批量模式, 小的stanza攒到定时器到了才发出去
+    bufferevent_pair_new(base, 0, batch);
+    bufferevent_enable(batch[1], EV_READ);
+    bconn = _test_zlib_conn(ctx, batch[0], TEST_ZLIB_DELAY);
+    conn_start_compression(bconn);
+    evbuffer_drain(plain, evbuffer_get_length(plain));
+    xmpp_send_raw_string(bconn, "<presence/>");
+    xmpp_send_raw_string(bconn, "<presence type='unavailable'/>");
+    _test_zlib_peer_read(base, batch[1], &zbatch, plain);
+    if (evbuffer_get_length(plain) != 0)
+        ok = false;
+    while (evbuffer_get_length(plain) == 0) {
+        event_base_loop(base, EVLOOP_ONCE);
+        _test_zlib_peer_read(base, batch[1], &zbatch, plain);
+    }
+    if (evbuffer_get_length(plain) != strlen("<presence/><presence type='unavailable'/>"))
+        ok = false;
+
+    // 坏数据断开连接
+    bufferevent_write(pair[1], "not zlib at all", 15);
+    event_base_loop(base, EVLOOP_NONBLOCK);
+    event_base_loop(base, EVLOOP_NONBLOCK);
+    if (conn->state != XMPP_STATE_DISCONNECTED)
+        ok = false;
+
+    // 压缩炸弹: 很小的数据解压出超过上限的stanza, 断开连接
+    bufferevent_free(pair[1]);
+    bufferevent_pair_new(base, 0, pair);
+    bufferevent_enable(pair[1], EV_READ);
+    xmpp_conn_release(conn);
+    conn = _test_zlib_conn(ctx, pair[0], 0);
+    conn_start_compression(conn);
+    deflateEnd(&zout);
+    deflateInit(&zout, Z_DEFAULT_COMPRESSION);
+    bomb = safe_mem_malloc(XMPP_ZLIB_STANZA_MAX + 64, NULL);
+    assert(bomb);
+    strcpy(bomb, "<message><body>");
+    memset(bomb + 15, 'a', XMPP_ZLIB_STANZA_MAX);
+    bomb[15 + XMPP_ZLIB_STANZA_MAX] = '\0';
+    _test_zlib_peer_write(pair[1], &zout, bomb);
+    safe_mem_free(bomb);
+    for (i = 0; i < 100 && conn->state == XMPP_STATE_CONNECTED; i++)
+        event_base_loop(base, EVLOOP_NONBLOCK);
+    if (conn->state != XMPP_STATE_DISCONNECTED)
+        ok = false;
+
+    printf("zlib: %lu bytes roster sent as %lu bytes\n", (unsigned long)raw, (unsigned long)wire);
+
+    conn_do_disconnect(bconn);
+    xmpp_conn_release(conn);
+    xmpp_conn_release(bconn);
+    bufferevent_free(pair[1]);
+    bufferevent_free(batch[1]);
+    event_base_loop(base, EVLOOP_NONBLOCK);
+    xmpp_ctx_free(ctx);
+    inflateEnd(&zin);
+    deflateEnd(&zout);
+    inflateEnd(&zbatch);
+    evbuffer_free(expect);
+    evbuffer_free(plain);
+    event_base_free(base);
+    return ok;
+}
@@ -0,0 +1,108 @@
+/* atom.c
+ * 原子字符串表
+ * 解析器每个元素都会遇到同样的几个名字和命名空间, 做成原子以后不用每次拷贝,
+ * handler匹配的时候也只需要比较指针
+ */
+#include "xmpp-inl.h"
+
+// 预先放进表里的常用字符串, 前三个保存在表里直接使用
+static const char *xmpp_atoms_builtin[] = {
+    "xmlns", "type", "id",
+    // 属性名
+    "to", "from", "lang", "version", "jid", "name", "node", "var", "ver",
+    "subscription", "ask", "category", "code", "by", "hash",
+    // 元素名
+    "message", "presence", "iq", "body", "subject", "thread", "query", "item", "error",
+    "show", "status", "priority", "x", "c", "delay", "feature", "identity", "group",
+    "features", "bind", "session", "starttls", "proceed", "mechanisms", "mechanism",
+    "challenge", "success", "failure", "resource", "text",
+    "active", "composing", "paused", "inactive", "gone", "request", "received",
+    // type属性的值
+    "chat", "normal", "groupchat", "headline", "get", "set", "result",
+    "unavailable", "subscribe", "subscribed", "unsubscribe", "unsubscribed", "probe",
+    // 命名空间
+    XMPP_NS_CLIENT,
+    "urn:ietf:params:xml:ns:xmpp-stanzas",
+    "urn:ietf:params:xml:ns:xmpp-streams",
+    "urn:ietf:params:xml:ns:xmpp-tls",
+    "urn:ietf:params:xml:ns:xmpp-sasl",
+    "urn:ietf:params:xml:ns:xmpp-bind",
+    "urn:ietf:params:xml:ns:xmpp-session",
+    "http://etherx.jabber.org/streams",
+    "jabber:iq:roster",
+    "jabber:x:data",
+    "http://jabber.org/protocol/disco#info",
+    "http://jabber.org/protocol/disco#items",
+    "http://jabber.org/protocol/caps",
+    "http://jabber.org/protocol/chatstates",
+    "urn:xmpp:receipts",
+    "urn:xmpp:delay",
+    "urn:xmpp:ping",
+};
+
+xmpp_atoms_t *atoms_new(void)
+{
+    xmpp_atoms_t *atoms;
+    xmpp_ctx_t tmp;
+    size_t i;
+    
+    atoms = safe_mem_calloc(sizeof(xmpp_atoms_t), NULL);
+    if (!atoms)
+        return NULL;
+    atoms->space = safe_mem_malloc(XMPP_ATOM_SPACE, NULL);
+    if (!atoms->space) {
+        safe_mem_free(atoms);
+        return NULL;
+    }
+    
+    // atom_intern只需要上下文里面的表
+    tmp.atoms = atoms;
+    for (i = 0; i < sizeof(xmpp_atoms_builtin) / sizeof(xmpp_atoms_builtin[0]); i++)
+        atom_intern(&tmp, xmpp_atoms_builtin[i], strlen(xmpp_atoms_builtin[i]));
+    atoms->xmlns = atom_intern(&tmp, "xmlns", 5);
+    atoms->type = atom_intern(&tmp, "type", 4);
+    atoms->id = atom_intern(&tmp, "id", 2);
+    return atoms;
+}
+
+void atoms_free(xmpp_atoms_t *atoms)
+{
+    safe_mem_free(atoms->space);
+    safe_mem_free(atoms);
+}
+
+const char *atom_intern(xmpp_ctx_t *ctx, const char *s, size_t len)
+{
+    xmpp_atoms_t *atoms = ctx->atoms;
+    xmpp_atom_slot_t *slot;
+    uint32_t hash, i;
+    char *str;
+    
+    if (!atoms || len > XMPP_ATOM_MAX_LEN)
+        return NULL;
+        
+    // 线性探测, 最多一半的槽有值, 一定能找到空槽
+    hash = (uint32_t)hash_bytes(s, len);
+    for (i = hash & (XMPP_ATOM_SLOTS - 1); ; i = (i + 1) & (XMPP_ATOM_SLOTS - 1)) {
+        slot = &atoms->slots[i];
+        if (!slot->str)
+            break;
+        if (slot->hash == hash && slot->len == len && !memcmp(slot->str, s, len))
+            return slot->str;
+    }
+    
+    // 表满了以后保持不变, 对端发送大量不同的名字也只会占用固定的内存
+    if (atoms->count >= XMPP_ATOM_MAX || atoms->used + len + 1 > XMPP_ATOM_SPACE)
+        return NULL;
+        
+    str = atoms->space + atoms->used;
+    memcpy(str, s, len);
+    str[len] = '\0';
+    atoms->used += len + 1;
+    atoms->count++;
+    
+    slot->str = str;
+    slot->len = (uint32_t)len;
+    slot->hash = hash;
+    return str;
+}
@@ -30,7 +30,11 @@ static int _handle_digestmd5_challenge(xmpp_conn_t *conn, xmpp_stanza_t *stanza,
                                        void *userdata);
 static int _handle_digestmd5_rspauth(xmpp_conn_t *conn, xmpp_stanza_t *stanza,
                                      void *userdata);
+static int _handle_scram_challenge(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata);
+static void _handle_sasl2_success(xmpp_conn_t *conn, xmpp_stanza_t *stanza);
 static int _handle_bind(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata);
+static int _handle_compress_result(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata);
+static void _resume_or_bind(xmpp_conn_t *conn);
 static int _handle_session(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata);
 static int _handle_proceedtls(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata);
 
@@ -70,6 +74,128 @@ static xmpp_stanza_t *_make_sasl_auth(xmpp_conn_t *conn, const char *mechanism)
     return auth;
 }
 
+// 给节加上文本, name不为NULL的话包在这个名字的子节点里面
+static int _add_text_child(xmpp_conn_t *conn, xmpp_stanza_t *parent, const char *name,
+                           const char *data)
+{
+    xmpp_stanza_t *child, *text;
+    
+    text = xmpp_stanza_new(conn->ctx);
+    if (!text)
+        return 0;
+    xmpp_stanza_set_text(text, data);
+    if (!name) {
+        xmpp_stanza_add_child(parent, text);
+        xmpp_stanza_release(text);
+        return 1;
+    }
+    
+    child = xmpp_stanza_new(conn->ctx);
+    if (!child) {
+        xmpp_stanza_release(text);
+        return 0;
+    }
+    xmpp_stanza_set_name(child, name);
+    xmpp_stanza_add_child(child, text);
+    xmpp_stanza_release(text);
+    xmpp_stanza_add_child(parent, child);
+    xmpp_stanza_release(child);
+    return 1;
+}
+
+// 创建SASL2认证节, 后面带上流恢复和Bind2, 认证成功的应答里面就有结果
+static xmpp_stanza_t *_make_sasl2_authenticate(xmpp_conn_t *conn, const char *mechanism,
+                                               const char *initial)
+{
+    xmpp_stanza_t *auth, *resume, *bind, *enable;
+    char *resource;
+    int ok = 1;
+    
+    auth = xmpp_stanza_new(conn->ctx);
+    if (!auth)
+        return NULL;
+    xmpp_stanza_set_name(auth, "authenticate");
+    xmpp_stanza_set_ns(auth, XMPP_NS_SASL2);
+    xmpp_stanza_set_attribute(auth, "mechanism", mechanism);
+    if (initial && !_add_text_child(conn, auth, "initial-response", initial)) {
+        xmpp_stanza_release(auth);
+        return NULL;
+    }
+    
+    // 有断开的流的话先恢复, 恢复失败服务器接着处理后面的<bind/>
+    resume = sm_make_resume(conn);
+    if (resume) {
+        xmpp_stanza_add_child(auth, resume);
+        xmpp_stanza_release(resume);
+    }
+    
+    if (conn->bind2_support) {
+        bind = xmpp_stanza_new(conn->ctx);
+        if (!bind) {
+            xmpp_stanza_release(auth);
+            return NULL;
+        }
+        xmpp_stanza_set_name(bind, "bind");
+        xmpp_stanza_set_ns(bind, XMPP_NS_BIND2);
+        
+        // Bind2不能指定资源, 把资源名作为tag, 服务器生成的资源以它开头
+        resource = xmpp_jid_resource(conn->ctx, conn->jid);
+        if (resource && strlen(resource) > 0)
+            ok = _add_text_child(conn, bind, "tag", resource);
+        if (resource)
+            xmpp_free(conn->ctx, resource);
+        
+        // 绑定的同时启用流管理
+        if (ok && conn->bind2_sm && conn->sm_support) {
+            enable = xmpp_stanza_new(conn->ctx);
+            if (enable) {
+                xmpp_stanza_set_name(enable, "enable");
+                xmpp_stanza_set_ns(enable, XMPP_NS_SM);
+                xmpp_stanza_set_attribute(enable, "resume", "true");
+                xmpp_stanza_add_child(bind, enable);
+                xmpp_stanza_release(enable);
+            } else {
+                ok = 0;
+            }
+        }
+        xmpp_stanza_add_child(auth, bind);
+        xmpp_stanza_release(bind);
+        if (!ok) {
+            xmpp_stanza_release(auth);
+            return NULL;
+        }
+    }
+    
+    return auth;
+}
+
+// 发送认证请求并设置结果处理, SASL2的结果在另一个名字空间
+static void _send_sasl_auth(xmpp_conn_t *conn, const char *mechanism, const char *initial,
+                            xmpp_handler handler, void *userdata)
+{
+    xmpp_stanza_t *auth;
+    
+    if (conn->sasl2) {
+        auth = _make_sasl2_authenticate(conn, mechanism, initial);
+    } else {
+        auth = _make_sasl_auth(conn, mechanism);
+        if (auth && initial && !_add_text_child(conn, auth, NULL, initial)) {
+            xmpp_stanza_release(auth);
+            auth = NULL;
+        }
+    }
+    if (!auth) {
+        disconnect_mem_error(conn);
+        return;
+    }
+    
+    handler_add(conn, handler, conn->sasl2 ? XMPP_NS_SASL2 : XMPP_NS_SASL, NULL, NULL,
+                userdata);
+    
+    xmpp_send(conn, auth);
+    xmpp_stanza_release(auth);
+}
+
 // 处理stream中出现的错误
 static int _handle_stream_error(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata)
 {
@@ -78,16 +204,20 @@ static int _handle_stream_error(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *
     
     // 释放之前的错误
     if (conn->stream_error) {
-        xmpp_stanza_release(conn->stream_error->stanza);
+        if (conn->stream_error->stanza)
+            xmpp_stanza_release(conn->stream_error->stanza);
+        if (conn->stream_error->text)
+            xmpp_free(conn->ctx, conn->stream_error->text);
         xmpp_free(conn->ctx, conn->stream_error);
     }
     
     // 生成当前错误
     conn->stream_error = (xmpp_stream_error_t *)xmpp_alloc(conn->ctx, sizeof(xmpp_stream_error_t));
-    conn->stream_error->text = NULL;
-    conn->stream_error->type = XMPP_SE_UNDEFINED_CONDITION;
     
     if (conn->stream_error) {
+        conn->stream_error->text = NULL;
+        conn->stream_error->type = XMPP_SE_UNDEFINED_CONDITION;
+
         child = xmpp_stanza_get_children(stanza);
         do {
             const char *ns = NULL;
@@ -99,7 +229,10 @@ static int _handle_stream_error(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *
             if (ns && strcmp(ns, XMPP_NS_STREAMS_IETF) == 0) {
                 name = xmpp_stanza_get_name_ptr(child);
                 if (strcmp(name, "text") == 0) {
-                    conn->stream_error->text = xmpp_stanza_get_text_ptr(child);
+                    // stanza处理完就会回收, 文本要拷贝出来
+                    const char *text = xmpp_stanza_get_text_ptr(child);
+                    if (text && !conn->stream_error->text)
+                        conn->stream_error->text = xmpp_strdup(conn->ctx, text);
                 } else if (strcmp(name, "bad-format") == 0)
                     conn->stream_error->type = XMPP_SE_BAD_FORMAT;
                 else if (strcmp(name, "bad-namespace-prefix") == 0)
@@ -151,23 +284,115 @@ static int _handle_stream_error(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *
             }
         } while ((child = xmpp_stanza_get_next(child)));
         
-        // 增加引用
-        conn->stream_error->stanza = xmpp_stanza_clone(stanza);
+        // 拷贝一份保留到连接释放
+        conn->stream_error->stanza = xmpp_stanza_copy(stanza);
     }
     
     return XMPP_HANDLER_AGAIN;;
 }
 
+// 检查压缩支持
+static void _parse_compression(xmpp_conn_t *conn, xmpp_stanza_t *stanza)
+{
+    xmpp_stanza_t *child, *method;
+    char *text;
+    
+    conn->zlib_support = 0;
+    child = xmpp_stanza_get_child_by_name(stanza, "compression");
+    if (child && (strcmp(xmpp_stanza_get_ns(child), XMPP_NS_COMPRESSION) == 0)) {
+        for (method = xmpp_stanza_get_children(child); method;
+             method = xmpp_stanza_get_next(method)) {
+            if (strcmp(xmpp_stanza_get_name_ptr(method), "method") == 0) {
+                text = xmpp_stanza_get_text_ptr(method);
+                if (text && im_stricmp(text, "zlib") == 0)
+                    conn->zlib_support = 1;
+            }
+        }
+    }
+}
+
+// 服务器支持的认证方式
+static int _parse_mechanisms(xmpp_stanza_t *list)
+{
+    xmpp_stanza_t *mech;
+    char *text;
+    int mask = 0;
+    
+    for (mech = xmpp_stanza_get_children(list); mech;
+         mech = xmpp_stanza_get_next(mech)) {
+        if (!xmpp_stanza_get_name_ptr(mech) ||
+            strcmp(xmpp_stanza_get_name_ptr(mech), "mechanism") != 0 ||
+            !(text = xmpp_stanza_get_text_ptr(mech)))
+            continue;
+        if (im_stricmp(text, "PLAIN") == 0)
+            mask |= SASL_MASK_PLAIN;
+        else if (im_stricmp(text, "DIGEST-MD5") == 0)
+            mask |= SASL_MASK_DIGESTMD5;
+        else if (im_stricmp(text, "SCRAM-SHA-1") == 0)
+            mask |= SASL_MASK_SCRAMSHA1;
+        else if (im_stricmp(text, "SCRAM-SHA-256") == 0)
+            mask |= SASL_MASK_SCRAMSHA256;
+        else if (im_stricmp(text, "SCRAM-SHA-1-PLUS") == 0)
+            mask |= SASL_MASK_SCRAMSHA1_PLUS;
+        else if (im_stricmp(text, "SCRAM-SHA-256-PLUS") == 0)
+            mask |= SASL_MASK_SCRAMSHA256_PLUS;
+    }
+    return mask;
+}
+
+// XEP-0388 SASL2, 认证成功以后不用重启流, 资源绑定和流恢复放在同一个请求里面
+static void _parse_sasl2(xmpp_conn_t *conn, xmpp_stanza_t *stanza)
+{
+    xmpp_stanza_t *auth, *inl, *bind, *feature;
+    const char *var;
+    int mask;
+    
+    conn->sasl2_support = 0;
+    conn->bind2_support = 0;
+    conn->bind2_sm = 0;
+    
+    // 要压缩的话还是用原来的流程, 压缩要在sasl以后重启流的时候协商
+    auth = xmpp_stanza_get_child_by_name(stanza, "authentication");
+    if (!auth || !xmpp_stanza_get_ns(auth) ||
+        strcmp(xmpp_stanza_get_ns(auth), XMPP_NS_SASL2) != 0 || conn->compress_level > 0)
+        return;
+    
+    // DIGEST-MD5没有初始响应, 也已经不推荐使用, SASL2里面不用
+    mask = _parse_mechanisms(auth) & ~SASL_MASK_DIGESTMD5;
+    if (!mask)
+        return;
+    conn->sasl_support = mask;
+    conn->sasl2_support = 1;
+    
+    inl = xmpp_stanza_get_child_by_name(auth, "inline");
+    if (!inl)
+        return;
+    if (xmpp_stanza_get_child_by_ns(inl, XMPP_NS_SM))
+        conn->sm_support = 1;
+    bind = xmpp_stanza_get_child_by_ns(inl, XMPP_NS_BIND2);
+    if (!bind)
+        return;
+    conn->bind2_support = 1;
+    
+    // Bind2里面能一起处理的扩展
+    inl = xmpp_stanza_get_child_by_name(bind, "inline");
+    for (feature = inl ? xmpp_stanza_get_children(inl) : NULL; feature;
+         feature = xmpp_stanza_get_next(feature)) {
+        var = xmpp_stanza_get_attribute(feature, "var");
+        if (var && strcmp(var, XMPP_NS_SM) == 0)
+            conn->bind2_sm = 1;
+    }
+}
+
 // 处理服务器返回的stream:features
 static int _handle_features(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata)
 {
     xmpp_stanza_t *child, *mech;
-    char *text;
+    const char *cbtype;
     
     // 超时计时器关闭
     conn->tls_support = 0;
     conn->sasl_support = 0;
-    conn->zlib_support = 0;
     
     // 检查是否启用tls
     if (!conn->secured) {
@@ -183,32 +408,33 @@ static int _handle_features(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *user
     
     // 检查sasl支持
     child = xmpp_stanza_get_child_by_name(stanza, "mechanisms");
-    if (child && (strcmp(xmpp_stanza_get_ns(child), XMPP_NS_SASL) == 0)) {
+    if (child && (strcmp(xmpp_stanza_get_ns(child), XMPP_NS_SASL) == 0))
+        conn->sasl_support = _parse_mechanisms(child);
+    
+    // 检查SASL2支持
+    _parse_sasl2(conn, stanza);
+    
+    // XEP-0440服务器支持的通道绑定类型, 没有声明的话按tls版本选
+    conn->sasl_cb_types = 0;
+    child = xmpp_stanza_get_child_by_name(stanza, "sasl-channel-binding");
+    if (child && xmpp_stanza_get_ns(child) &&
+        strcmp(xmpp_stanza_get_ns(child), XMPP_NS_SASL_CB) == 0) {
         for (mech = xmpp_stanza_get_children(child); mech;
              mech = xmpp_stanza_get_next(mech)) {
-            if (strcmp(xmpp_stanza_get_name_ptr(mech), "mechanism") == 0) {
-                text = xmpp_stanza_get_text_ptr(mech);
-                if (im_stricmp(text, "PLAIN") == 0)
-                    conn->sasl_support |= SASL_MASK_PLAIN;
-                else if (im_stricmp(text, "DIGEST-MD5") == 0)
-                    conn->sasl_support |= SASL_MASK_DIGESTMD5;
-                    
-            }
+            if (strcmp(xmpp_stanza_get_name_ptr(mech), "channel-binding") != 0 ||
+                !(cbtype = xmpp_stanza_get_attribute(mech, "type")))
+                continue;
+            if (strcmp(cbtype, "tls-unique") == 0)
+                conn->sasl_cb_types |= SASL_CB_TLS_UNIQUE;
+            else if (strcmp(cbtype, "tls-exporter") == 0)
+                conn->sasl_cb_types |= SASL_CB_TLS_EXPORTER;
+            else if (strcmp(cbtype, "tls-server-end-point") == 0)
+                conn->sasl_cb_types |= SASL_CB_TLS_SERVER_END_POINT;
         }
     }
     
     //检查压缩支持
-    child = xmpp_stanza_get_child_by_name(stanza, "compression");
-    if (child && (strcmp(xmpp_stanza_get_ns(child), XMPP_NS_COMPRESSION) == 0)) {
-        for (mech = xmpp_stanza_get_children(child); mech;
-             mech = xmpp_stanza_get_next(mech)) {
-            if (strcmp(xmpp_stanza_get_name_ptr(mech), "method") == 0) {
-                text = xmpp_stanza_get_text_ptr(mech);
-                if (im_stricmp(text, "zlib") == 0)
-                    conn->zlib_support = 1;
-            }
-        }
-    }
+    _parse_compression(conn, stanza);
     
     // GO
     _do_auth(conn);
@@ -232,6 +458,15 @@ static int _handle_proceedtls(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *us
     return XMPP_HANDLER_END;
 }
 
+// SCRAM认证结束, userdata里面的机制名字在这以后不能再用
+static void _scram_done(xmpp_conn_t *conn)
+{
+    if (conn->scram) {
+        sasl_scram_free(conn->scram);
+        conn->scram = NULL;
+    }
+}
+
 // 接受到SASL结果
 static int _handle_sasl_result(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata)
 {
@@ -241,12 +476,19 @@ static int _handle_sasl_result(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *u
     if (strcmp(name, "failure") == 0) {
         // 服务器返回认证失败
         xmpp_debug(conn->ctx, "xmpp", "SASL %s auth failed", (char*)userdata);
+        _scram_done(conn);
         // 尝试其他可以用的方式(服务器对重试次数可能会有限制，连接可能被关闭)
         _do_auth(conn);
         
     } else if (strcmp(name, "success") == 0) {
         // 服务器返回认证成功！！！
         xmpp_debug(conn->ctx, "xmpp", "SASL %s auth successful", (char *)userdata);
+        _scram_done(conn);
+        
+        if (conn->sasl2) {
+            _handle_sasl2_success(conn, stanza);
+            return 0;
+        }
         
         // 再重启stream
         conn_reset_stream(conn, _auth_handle_open_sasl);
@@ -344,6 +586,145 @@ static int _handle_digestmd5_rspauth(xmpp_conn_t *conn, xmpp_stanza_t *stanza,
     return 1;
 }
 
+// 发送SASL的<response/>, data为NULL的话是空的响应
+static void _send_sasl_response(xmpp_conn_t *conn, const char *data)
+{
+    xmpp_stanza_t *auth, *authdata;
+    
+    auth = xmpp_stanza_new(conn->ctx);
+    if (!auth) {
+        disconnect_mem_error(conn);
+        return;
+    }
+    xmpp_stanza_set_name(auth, "response");
+    xmpp_stanza_set_ns(auth, conn->sasl2 ? XMPP_NS_SASL2 : XMPP_NS_SASL);
+    
+    if (data) {
+        authdata = xmpp_stanza_new(conn->ctx);
+        if (!authdata) {
+            xmpp_stanza_release(auth);
+            disconnect_mem_error(conn);
+            return;
+        }
+        xmpp_stanza_set_text(authdata, data);
+        xmpp_stanza_add_child(auth, authdata);
+        xmpp_stanza_release(authdata);
+    }
+    
+    xmpp_send(conn, auth);
+    xmpp_stanza_release(auth);
+}
+
+// SCRAM的server-first-message, 最后的<success/>里面带着服务器签名
+static int _handle_scram_challenge(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata)
+{
+    xmpp_stanza_t *stanza_data;
+    char *name, *text, *authid, *response;
+    const char *mech;
+    
+    name = xmpp_stanza_get_name_ptr(stanza);
+    mech = conn->scram ? sasl_scram_mech(conn->scram) : "SCRAM";
+    xmpp_debug(conn->ctx, "xmpp", "handle %s (challenge) called for %s", mech, name);
+    if (!conn->scram)
+        return _handle_sasl_result(conn, stanza, "SCRAM");
+    
+    text = xmpp_stanza_get_text_ptr(stanza);
+    if (strcmp(name, "challenge") == 0) {
+        if (sasl_scram_final_sent(conn->scram)) {
+            // server-final-message放在challenge里面发的, 校验以后回一个空的响应
+            if (!text || !sasl_scram_verify(conn->scram, text)) {
+                xmpp_error(conn->ctx, "xmpp", "%s server signature mismatch.", mech);
+                xmpp_disconnect(conn);
+                return 0;
+            }
+            _send_sasl_response(conn, NULL);
+            return XMPP_HANDLER_AGAIN;
+        }
+        
+        authid = xmpp_jid_node(conn->ctx, conn->jid);
+        response = (text && authid) ?
+            sasl_scram_client_final(conn->scram, text, authid, conn->pass) : NULL;
+        if (authid)
+            xmpp_free(conn->ctx, authid);
+        if (!response) {
+            xmpp_error(conn->ctx, "xmpp", "%s challenge rejected.", mech);
+            xmpp_disconnect(conn);
+            return 0;
+        }
+        _send_sasl_response(conn, response);
+        xmpp_free(conn->ctx, response);
+        return XMPP_HANDLER_AGAIN;
+    }
+    
+    // 服务器签名不对说明服务器不知道密码, 可能是中间人. SASL2的签名在<additional-data/>里面
+    if (strcmp(name, "success") == 0) {
+        if (conn->sasl2) {
+            stanza_data = xmpp_stanza_get_child_by_name(stanza, "additional-data");
+            text = stanza_data ? xmpp_stanza_get_text_ptr(stanza_data) : NULL;
+        }
+        if (text ? !sasl_scram_verify(conn->scram, text) : !sasl_scram_verified(conn->scram)) {
+            xmpp_error(conn->ctx, "xmpp", "%s server signature mismatch.", mech);
+            xmpp_disconnect(conn);
+            return 0;
+        }
+    }
+    return _handle_sasl_result(conn, stanza, (void *)mech);
+}
+
+// 开始SCRAM认证, 优先用SHA-256和通道绑定. 没有可用的方式返回0
+static int _do_auth_scram(xmpp_conn_t *conn)
+{
+    static const struct {
+        int mask;
+        const char *mech;
+        int plus;
+    } mechs[] = {
+        { SASL_MASK_SCRAMSHA256_PLUS, "SCRAM-SHA-256-PLUS", 1 },
+        { SASL_MASK_SCRAMSHA1_PLUS, "SCRAM-SHA-1-PLUS", 1 },
+        { SASL_MASK_SCRAMSHA256, "SCRAM-SHA-256", 0 },
+        { SASL_MASK_SCRAMSHA1, "SCRAM-SHA-1", 0 },
+    };
+    unsigned char cbdata[64];
+    size_t cblen = 0;
+    const char *cbtype = NULL;
+    char *authid, *str;
+    int i;
+    
+    if (conn->secured)
+        cbtype = tls_channel_binding(conn, conn->sasl_cb_types, cbdata, &cblen);
+    
+    for (i = 0; i < (int)(sizeof(mechs) / sizeof(mechs[0])); i++) {
+        if (!(conn->sasl_support & mechs[i].mask))
+            continue;
+        // 取消标记, 失败了尝试下一种
+        conn->sasl_support &= ~mechs[i].mask;
+        if (mechs[i].plus && !cbtype)
+            continue;
+        
+        authid = xmpp_jid_node(conn->ctx, conn->jid);
+        if (!authid) {
+            disconnect_mem_error(conn);
+            return 1;
+        }
+        // 服务器没有提供-PLUS但是客户端能绑定的话告诉服务器, 防止被中间人降级
+        if (conn->scram)
+            sasl_scram_free(conn->scram);
+        conn->scram = sasl_scram_new(conn->ctx, mechs[i].mech, conn->domain, authid,
+                                     mechs[i].plus ? cbtype : NULL, cbdata, cblen,
+                                     cbtype != NULL, NULL);
+        xmpp_free(conn->ctx, authid);
+        str = conn->scram ? sasl_scram_client_first(conn->scram) : NULL;
+        if (!str) {
+            disconnect_mem_error(conn);
+            return 1;
+        }
+        _send_sasl_auth(conn, mechs[i].mech, str, _handle_scram_challenge, NULL);
+        xmpp_free(conn->ctx, str);
+        return 1;
+    }
+    return 0;
+}
+
 // 接受sasl完成以后的stream
 static void _auth_handle_open_sasl(xmpp_conn_t *conn)
 {
@@ -354,8 +735,7 @@ static void _auth_handle_open_sasl(xmpp_conn_t *conn)
 // sasl以后要绑定资源或者session
 static int _handle_features_sasl(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata)
 {
-    xmpp_stanza_t *bind, *session, *iq, *res, *text;
-    char *resource;
+    xmpp_stanza_t *bind, *session, *sm;
     
     // 检查服务器是否需要bind
     bind = xmpp_stanza_get_child_by_name(stanza, "bind");
@@ -369,72 +749,183 @@ static int _handle_features_sasl(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void
         conn->session_required = 1;
     }
     
+    // 检查服务器是否支持流管理
+    sm = xmpp_stanza_get_child_by_name(stanza, "sm");
+    if (sm && xmpp_stanza_get_ns(sm) && strcmp(xmpp_stanza_get_ns(sm), XMPP_NS_SM) == 0) {
+        conn->sm_support = 1;
+    }
+    
+    // 压缩在sasl以后绑定之前协商, 压缩以后流重新开始, 新的features里面不会再有压缩
+    _parse_compression(conn, stanza);
+    if (conn->zlib_support && !conn->compressed && conn->compress_level > 0) {
+        handler_add(conn, _handle_compress_result, XMPP_NS_COMPRESS, NULL, NULL, NULL);
+        xmpp_send_raw_string(conn, "<compress xmlns='%s'><method>zlib</method></compress>",
+                             XMPP_NS_COMPRESS);
+        return 0;
+    }
+    
+    _resume_or_bind(conn);
+    return 0;
+}
+
+static void _resume_or_bind(xmpp_conn_t *conn)
+{
+    // 有断开的流的话先恢复, 恢复成功不用再绑定资源
+    if (sm_resume(conn))
+        return;
+    
     if (conn->bind_required) {
-        // 绑定资源
-        handler_add_id(conn, _handle_bind, XMPP_BIND_ID, NULL);
-        
-        iq = xmpp_stanza_new(conn->ctx);
-        if (!iq) {
-            disconnect_mem_error(conn);
+        auth_bind(conn);
+    } else {
+        xmpp_error(conn->ctx, "xmpp", "Stream features does not allow "\
+                   "resource bind.");
+        xmpp_disconnect(conn);
+    }
+}
+
+// 压缩协商结果
+static int _handle_compress_result(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata)
+{
+    char *name = xmpp_stanza_get_name_ptr(stanza);
+    
+    if (name && strcmp(name, "compressed") == 0) {
+        if (conn_start_compression(conn) != 0) {
+            // 服务器已经开始压缩了, 只能直接断开
+            xmpp_error(conn->ctx, "xmpp", "Failed to start stream compression.");
+            conn_do_disconnect(conn);
             return 0;
         }
+        // 压缩以后重启stream
+        conn_reset_stream(conn, _auth_handle_open_sasl);
+        conn_init_stream(conn);
         
-        xmpp_stanza_set_name(iq, "iq");
-        xmpp_stanza_set_type(iq, "set");
-        xmpp_stanza_set_id(iq, XMPP_BIND_ID);
-        
-        bind = xmpp_stanza_copy(bind);
-        if (!bind) {
+    } else {
+        // 服务器不同意的话不压缩继续
+        xmpp_info(conn->ctx, "xmpp", "Stream compression refused by server.");
+        conn->zlib_support = 0;
+        _resume_or_bind(conn);
+    }
+    
+    return 0;
+}
+
+void auth_bind(xmpp_conn_t *conn)
+{
+    xmpp_stanza_t *bind, *iq, *res, *text;
+    char *resource;
+    
+    // 绑定资源
+    handler_add_id(conn, _handle_bind, XMPP_BIND_ID, NULL);
+    
+    iq = xmpp_stanza_new(conn->ctx);
+    if (!iq) {
+        disconnect_mem_error(conn);
+        return;
+    }
+    
+    xmpp_stanza_set_name(iq, "iq");
+    xmpp_stanza_set_type(iq, "set");
+    xmpp_stanza_set_id(iq, XMPP_BIND_ID);
+    
+    bind = xmpp_stanza_new(conn->ctx);
+    if (!bind) {
+        xmpp_stanza_release(iq);
+        disconnect_mem_error(conn);
+        return;
+    }
+    xmpp_stanza_set_name(bind, "bind");
+    xmpp_stanza_set_ns(bind, XMPP_NS_BIND);
+    
+    // 要绑定的资源
+    resource = xmpp_jid_resource(conn->ctx, conn->jid);
+    if ((resource != NULL) && (strlen(resource) == 0)) {
+        xmpp_free(conn->ctx, resource);
+        resource = NULL;
+    }
+    
+    if (resource) {
+        res = xmpp_stanza_new(conn->ctx);
+        if (!res) {
+            xmpp_free(conn->ctx, resource);
+            xmpp_stanza_release(bind);
             xmpp_stanza_release(iq);
             disconnect_mem_error(conn);
-            return 0;
+            return;
         }
-        
-        // 要绑定的资源
-        resource = xmpp_jid_resource(conn->ctx, conn->jid);
-        if ((resource != NULL) && (strlen(resource) == 0)) {
+        xmpp_stanza_set_name(res, "resource");
+        text = xmpp_stanza_new(conn->ctx);
+        if (!text) {
             xmpp_free(conn->ctx, resource);
-            resource = NULL;
-        }
-        
-        if (resource) {
-            res = xmpp_stanza_new(conn->ctx);
-            if (!res) {
-                xmpp_stanza_release(bind);
-                xmpp_stanza_release(iq);
-                disconnect_mem_error(conn);
-                return 0;
-            }
-            xmpp_stanza_set_name(res, "resource");
-            text = xmpp_stanza_new(conn->ctx);
-            if (!text) {
-                xmpp_stanza_release(res);
-                xmpp_stanza_release(bind);
-                xmpp_stanza_release(iq);
-                disconnect_mem_error(conn);
-                return 0;
-            }
-            xmpp_stanza_set_text(text, resource);
-            xmpp_stanza_add_child(res, text);
-            xmpp_stanza_release(text);
-            xmpp_stanza_add_child(bind, res);
             xmpp_stanza_release(res);
-            xmpp_free(conn->ctx, resource);
+            xmpp_stanza_release(bind);
+            xmpp_stanza_release(iq);
+            disconnect_mem_error(conn);
+            return;
         }
-        
-        xmpp_stanza_add_child(iq, bind);
-        xmpp_stanza_release(bind);
-        // 发送
-        xmpp_send(conn, iq);
-        xmpp_stanza_release(iq);
-        
-    } else {
-        xmpp_error(conn->ctx, "xmpp", "Stream features does not allow "\
-                   "resource bind.");
-        xmpp_disconnect(conn);
+        xmpp_stanza_set_text(text, resource);
+        xmpp_stanza_add_child(res, text);
+        xmpp_stanza_release(text);
+        xmpp_stanza_add_child(bind, res);
+        xmpp_stanza_release(res);
+        xmpp_free(conn->ctx, resource);
     }
     
-    return 0;
+    xmpp_stanza_add_child(iq, bind);
+    xmpp_stanza_release(bind);
+    // 发送
+    xmpp_send(conn, iq);
+    xmpp_stanza_release(iq);
+}
+
+// 绑定完成, 通知外部. sm_result是Bind2同时启用流管理的结果
+static void _auth_established(xmpp_conn_t *conn, xmpp_stanza_t *sm_result)
+{
+    conn->authenticated = 1;
+    
+    // 先启用流管理, 外部在回调里面发出的stanza都要等确认
+    sm_established_inline(conn, sm_result);
+    if (conn->state != XMPP_STATE_CONNECTED)
+        return;
+    
+    conn->conn_handler(conn, XMPP_CONN_CONNECT, 0, NULL, conn->userdata);
+}
+
+// SASL2认证成功, 不用重启流, 应答里面带着流恢复和Bind2的结果
+static void _handle_sasl2_success(xmpp_conn_t *conn, xmpp_stanza_t *stanza)
+{
+    xmpp_stanza_t *child, *bound;
+    const char *ns;
+    char *jid;
+    
+    child = xmpp_stanza_get_child_by_name(stanza, "authorization-identifier");
+    jid = child ? xmpp_stanza_get_text_ptr(child) : NULL;
+    if (jid) {
+        if (conn->bound_jid)
+            xmpp_free(conn->ctx, conn->bound_jid);
+        conn->bound_jid = xmpp_strdup(conn->ctx, jid);
+    }
+    
+    // 恢复成功是<resumed/>, 直接算握手完成; 失败是<failed/>, 服务器接着处理<bind/>
+    for (child = xmpp_stanza_get_children(stanza); child; child = xmpp_stanza_get_next(child)) {
+        ns = xmpp_stanza_get_ns(child);
+        if (ns && strcmp(ns, XMPP_NS_SM) == 0)
+            sm_fire_stanza(conn, child);
+    }
+    conn->sasl2 = 0;
+    if (conn->authenticated || conn->state != XMPP_STATE_CONNECTED)
+        return;
+    
+    bound = xmpp_stanza_get_child_by_name(stanza, "bound");
+    if (bound && xmpp_stanza_get_ns(bound) &&
+        strcmp(xmpp_stanza_get_ns(bound), XMPP_NS_BIND2) == 0) {
+        xmpp_debug(conn->ctx, "xmpp", "Bound to %s by Bind2.",
+                   conn->bound_jid ? conn->bound_jid : "unknown");
+        _auth_established(conn, xmpp_stanza_get_child_by_ns(bound, XMPP_NS_SM));
+    } else {
+        // 服务器没有处理Bind2, 流已经认证过了, 直接用iq绑定资源
+        conn->bind_required = 1;
+        auth_bind(conn);
+    }
 }
 
 // 资源绑定结果
@@ -460,6 +951,8 @@ static int _handle_bind(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata
             if (jid_stanza) {
                 bound_jid = xmpp_stanza_get_text_ptr(jid_stanza);
                 if (bound_jid) {
+                    if (conn->bound_jid)
+                        xmpp_free(conn->ctx, conn->bound_jid);
                     conn->bound_jid = xmpp_strdup(conn->ctx, bound_jid);
                 }
             }
@@ -495,11 +988,7 @@ static int _handle_bind(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata
             xmpp_send(conn, iq);
             xmpp_stanza_release(iq);
         } else {
-            conn->authenticated = 1;
-            
-            // 通知外部
-            conn->conn_handler(conn, XMPP_CONN_CONNECT, 0, NULL,
-                               conn->userdata);
+            _auth_established(conn, NULL);
         }
     } else {
         xmpp_error(conn->ctx, "xmpp", "Server sent error bind reply.");
@@ -522,9 +1011,7 @@ static int _handle_session(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userd
         xmpp_debug(conn->ctx, "xmpp", "Session establishment successful.");
         
         // 认证流程成功
-        conn->authenticated = 1;
-        // 通知外部
-        conn->conn_handler(conn, XMPP_CONN_CONNECT, 0, NULL, conn->userdata);
+        _auth_established(conn, NULL);
         
     } else {
         xmpp_error(conn->ctx, "xmpp", "Server sent error session reply.");
@@ -538,7 +1025,7 @@ static int _handle_session(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userd
 */
 static void _do_auth(xmpp_conn_t *conn)
 {
-    xmpp_stanza_t *auth, *authdata;
+    xmpp_stanza_t *auth;
     char *str, *authid;
     
     if (conn->tls_support && !conn->secured) {
@@ -555,9 +1042,13 @@ static void _do_auth(xmpp_conn_t *conn)
         xmpp_stanza_release(auth);
         
     } else if (!conn->authenticated) {
-        // 进行sasl握手流程
+        // 进行sasl握手流程, 服务器支持的话用SASL2
+        conn->sasl2 = conn->sasl2_support;
         
-        if (conn->sasl_support & SASL_MASK_DIGESTMD5) {
+        if ((conn->sasl_support & SASL_MASK_SCRAM) && _do_auth_scram(conn)) {
+            // SCRAM已经开始
+            
+        } else if (conn->sasl_support & SASL_MASK_DIGESTMD5) {
             // 尝试DEGESTMD5
             auth = _make_sasl_auth(conn, "DIGEST-MD5");
             if (!auth) {
@@ -574,37 +1065,19 @@ static void _do_auth(xmpp_conn_t *conn)
             
         } else if (conn->sasl_support & SASL_MASK_PLAIN) {
             // 尝试明文认证
-            auth = _make_sasl_auth(conn, "PLAIN");
-            if (!auth) {
-                disconnect_mem_error(conn);
-                return;
-            }
-            authdata = xmpp_stanza_new(conn->ctx);
-            if (!authdata) {
-                disconnect_mem_error(conn);
-                return;
-            }
             authid = xmpp_jid_node(conn->ctx, conn->jid);
             if (!authid) {
                 disconnect_mem_error(conn);
                 return;
             }
             str = sasl_plain(conn->ctx, authid, conn->pass);
+            xmpp_free(conn->ctx, authid);
             if (!str) {
                 disconnect_mem_error(conn);
                 return;
             }
-            xmpp_stanza_set_text(authdata, str);
+            _send_sasl_auth(conn, "PLAIN", str, _handle_sasl_result, "PLAIN");
             xmpp_free(conn->ctx, str);
-            xmpp_free(conn->ctx, authid);
-            
-            xmpp_stanza_add_child(auth, authdata);
-            xmpp_stanza_release(authdata);
-            
-            handler_add(conn, _handle_sasl_result, XMPP_NS_SASL, NULL, NULL, "PLAIN");
-            
-            xmpp_send(conn, auth);
-            xmpp_stanza_release(auth);
             
             // 取消标记
             conn->sasl_support &= ~SASL_MASK_PLAIN;
@@ -2,14 +2,16 @@
  * 连接管理
  */
 #include "xmpp-inl.h"
-#include "srv.h"
 
 #define RESPOND_TIMEOUT 5                    //默认5秒超时
+#define XMPP_READ_IOVECS 16                  //每次取出的连续内存段数
 
 
 // 流结束请求Timer callback
 static int _disconnect_cleanup(xmpp_conn_t *conn, void *userdata);
 
+// 取消正在进行的域名解析
+
 // Parser 回调
 static void _handle_stream_start(char *name, char **attrs, void *userdata);
 static void _handle_stream_end(char *name, void *userdata);
@@ -18,18 +20,35 @@ static void _handle_stream_stanza(xmpp_stanza_t *stanza, void *userdata);
 // 读取数据回调
 static void _evb_read_cb(struct bufferevent *bev, void *ptr)
 {
-    char buff[4096];
     xmpp_conn_t *conn = ptr;
-    int ret = 0;
-    size_t len = 0;
+    struct evbuffer *input = conn->input;
+    struct evbuffer_iovec vec[XMPP_READ_IOVECS];
+    int n, i;
     
-    if ((len = bufferevent_read(conn->evbuffer, buff, sizeof(buff))) > 0) {
-        // 给解析器填充数据
-        ret = parser_feed(conn->parser, buff, len);
-        if (!ret) {
-            // xml流解析错误
-            xmpp_debug(conn->ctx, "xmpp", "XML parse error.");
-            conn_do_disconnect(conn);
+    // 先把读到的数据全部移到连接自己的缓冲区, 只移动链表节点不拷贝
+    // 处理stanza的时候可能启动tls或者断开连接, bufferevent上不能留下已经解析过的数据
+    evbuffer_add_buffer(input, bufferevent_get_input(bev));
+    
+    // 每段连续内存直接交给解析器, 一次处理完所有数据
+    while ((n = evbuffer_peek(input, -1, NULL, vec, XMPP_READ_IOVECS)) > 0) {
+        if (n > XMPP_READ_IOVECS)
+            n = XMPP_READ_IOVECS;
+            
+        for (i = 0; i < n; i++) {
+            if (!parser_feed(conn->parser, vec[i].iov_base, (int)vec[i].iov_len)) {
+                // xml流解析错误
+                evbuffer_drain(input, evbuffer_get_length(input));
+                xmpp_debug(conn->ctx, "xmpp", "XML parse error.");
+                conn_do_disconnect(conn);
+                return;
+            }
+            evbuffer_drain(input, vec[i].iov_len);
+            
+            if (conn->state != XMPP_STATE_CONNECTED || conn->evbuffer != bev) {
+                // 连接已经断开或者切换到了tls, 剩下的数据不属于当前的流
+                evbuffer_drain(input, evbuffer_get_length(input));
+                return;
+            }
         }
     }
 }
@@ -38,6 +57,8 @@ static void _evb_read_cb(struct bufferevent *bev, void *ptr)
 static void _evb_event_cb(struct bufferevent *bev, short what, void *ptr)
 {
     xmpp_conn_t *conn = ptr;
+    SSL *ssl;
+    
     if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
         // 错误以及断开连接
         conn->error = ECONNRESET;
@@ -54,8 +75,9 @@ static void _evb_event_cb(struct bufferevent *bev, short what, void *ptr)
         if (conn->state == XMPP_STATE_CONNECTING) {
             conn->state = XMPP_STATE_CONNECTED;
             xmpp_debug(conn->ctx, "xmpp", "Connection successful");
-            if (bufferevent_openssl_get_ssl(bev) != NULL) {
+            if ((ssl = bufferevent_openssl_get_ssl(bev)) != NULL) {
                 conn->secured = 1;
+                tls_handshake_done(conn, ssl);
             }
             
             // 设置buff回调
@@ -79,7 +101,8 @@ xmpp_conn_t *xmpp_conn_new(xmpp_ctx_t *ctx)
     // 分配结构内存
     conn = xmpp_alloc(ctx, sizeof(xmpp_conn_t));
     if (conn != NULL) {
-        conn->ctx = ctx;
+        // 连接持有上下文的一个引用, 释放连接的时候归还
+        conn->ctx = xmpp_ctx_clone(ctx);
         conn->type = XMPP_UNKNOWN;
         conn->state = XMPP_STATE_DISCONNECTED;
         conn->error = 0;
@@ -87,11 +110,24 @@ xmpp_conn_t *xmpp_conn_new(xmpp_ctx_t *ctx)
         conn->respond_timeout = RESPOND_TIMEOUT;
         conn->userdata = NULL;
         conn->evbuffer = NULL;
+        conn->connector = NULL;
+        conn->connectdomain = NULL;
+        conn->connectport = NULL;
         
         // 连接信息
         conn->lang = xmpp_strdup(conn->ctx, "zh-cn");
         if (!conn->lang) {
             xmpp_free(conn->ctx, conn);
+            xmpp_ctx_free(ctx);
+            return NULL;
+        }
+        
+        // 接收缓冲区
+        conn->input = evbuffer_new();
+        if (!conn->input) {
+            xmpp_free(conn->ctx, conn->lang);
+            xmpp_free(conn->ctx, conn);
+            xmpp_ctx_free(ctx);
             return NULL;
         }
         conn->domain = NULL;
@@ -103,9 +139,20 @@ xmpp_conn_t *xmpp_conn_new(xmpp_ctx_t *ctx)
         conn->tls_disabled = 0;
         conn->tls_failed = 0;
         conn->sasl_support = 0;
+        conn->sasl_cb_types = 0;
+        conn->scram = NULL;
+        conn->sasl2_support = 0;
+        conn->bind2_support = 0;
+        conn->bind2_sm = 0;
+        conn->sasl2 = 0;
         conn->secured = 0;
         conn->bind_required = 0;
         conn->session_required = 0;
+        conn->zlib_support = 0;
+        conn->compressed = 0;
+        conn->compress_level = 0;
+        conn->compress_flush_delay = 0;
+        conn->zlib = NULL;
         
         // 解析器
         conn->parser = parser_new(conn,
@@ -128,6 +175,22 @@ xmpp_conn_t *xmpp_conn_new(xmpp_ctx_t *ctx)
         INIT_LIST_HEAD(&conn->timed_handlers.dlist);
         INIT_LIST_HEAD(&conn->handlers.dlist);
         
+        // handler派发索引, 桶在删空的时候释放
+        conn->handlers_by_name = hash_new(16, xmpp_hash_free);
+        conn->handlers_by_ns = hash_new(16, xmpp_hash_free);
+        INIT_LIST_HEAD(&conn->handlers_any);
+        INIT_LIST_HEAD(&conn->handlers_deleted);
+        conn->handler_seq = 0;
+        conn->dispatching = 0;
+        
+        // 异步IQ, 请求在发送的时候分配, 表里面不负责释放
+        conn->iq_pending = hash_new(32, NULL);
+        INIT_LIST_HEAD(&conn->iq_list);
+        conn->iq_seq = 0;
+        
+        // 流管理
+        sm_init(conn);
+        
         // 引用计数
         conn->ref = 1;
         
@@ -152,11 +215,21 @@ int xmpp_conn_release(xmpp_conn_t *conn)
     } else {
         ctx = conn->ctx;
         
+        // 正在进行的解析和连接尝试不再回调
+        connect_cancel(conn);
+        
+        // 还在等待应答的请求先通知出去
+        iq_cancel_all(conn);
+        hash_release(conn->iq_pending);
+        sm_free(conn);
+        if (conn->scram)
+            sasl_scram_free(conn->scram);
         handler_clear_all(conn);
         
         // 释放错误stanza
         if (conn->stream_error) {
-            xmpp_stanza_release(conn->stream_error->stanza);
+            if (conn->stream_error->stanza)
+                xmpp_stanza_release(conn->stream_error->stanza);
             if (conn->stream_error->text)
                 xmpp_free(ctx, conn->stream_error->text);
             xmpp_free(ctx, conn->stream_error);
@@ -164,9 +237,12 @@ int xmpp_conn_release(xmpp_conn_t *conn)
         
         // 释放解析器
         parser_free(conn->parser);
+        evbuffer_free(conn->input);
         
         // 释放复制字符串
         if (conn->domain) xmpp_free(ctx, conn->domain);
+        if (conn->connectdomain) xmpp_free(ctx, conn->connectdomain);
+        if (conn->connectport) xmpp_free(ctx, conn->connectport);
         if (conn->jid) xmpp_free(ctx, conn->jid);
         if (conn->bound_jid) xmpp_free(ctx, conn->bound_jid);
         if (conn->pass) xmpp_free(ctx, conn->pass);
@@ -175,100 +251,60 @@ int xmpp_conn_release(xmpp_conn_t *conn)
         
         // 干净了
         xmpp_free(ctx, conn);
+        xmpp_ctx_free(ctx);
         released = 1;
     }
     return released;
 }
 
+// 解析或者连接没有开始就失败了, 连接回到断开状态
+void conn_connect_failed(xmpp_conn_t *conn, int error)
+{
+    conn->error = error;
+    conn->state = XMPP_STATE_DISCONNECTED;
+    conn->conn_handler(conn, XMPP_CONN_FAIL, error, NULL, conn->userdata);
+}
+
+void conn_established(xmpp_conn_t *conn, struct bufferevent *bev)
+{
+    conn->evbuffer = bev;
+    bufferevent_setcb(bev, NULL, NULL, _evb_event_cb, conn);
+    _evb_event_cb(bev, BEV_EVENT_CONNECTED, conn);
+}
+
 int xmpp_connect_client(xmpp_conn_t *conn, const char *altdomain, unsigned short altport,
                         xmpp_conn_handler callback, void *userdata)
 {
-    char connectdomain[2048];
-    int connectport;
-    const char *domain;
+    if (conn->state != XMPP_STATE_DISCONNECTED || !conn->ctx->dns || !conn->ctx->timers)
+        return -1;
     conn->type = XMPP_CLIENT;
     
     // 获取jid里面的域名, jid的域名还需要查询SRV记录获得实际的服务器域名
+    if (conn->domain) xmpp_free(conn->ctx, conn->domain);
     conn->domain = xmpp_jid_domain(conn->ctx, conn->jid);
     if (!conn->domain)
         return -1;
         
-    // 直接指定了服务器域名，还是对jid的域名进行SRV解析
-    if (altdomain) {
-        xmpp_debug(conn->ctx, "xmpp", "Connecting via altdomain.");
-        strcpy(connectdomain, altdomain);
-        connectport = altport ? altport : 5222;
-    } else if (!im_srv_lookup("xmpp-client", "tcp", conn->domain,
-                              connectdomain, 2048, &connectport)) {
-        xmpp_debug(conn->ctx, "xmpp", "SRV lookup failed.");
-        if (!altdomain)
-            domain = conn->domain;
-        else
-            domain = altdomain;
-        xmpp_debug(conn->ctx, "xmpp", "Using alternate domain %s, port %d",
-                   altdomain, altport);
-        strcpy(connectdomain, domain);
-        connectport = altport ? altport : 5222;
-    }
-    
-    // 开始域名解释
-    // 端口字符串缓冲
-    int err;
-    char port_buf[6];
-    struct evutil_addrinfo hints;
-    struct evutil_addrinfo *answer = NULL;
-    
-    // 把端口转换成十进制格式的字符串
-    evutil_snprintf(port_buf, sizeof(port_buf), "%d", (int)connectport);
-    memset(&hints, 0, sizeof(hints));
-    
-    // 设置协议参数
-    hints.ai_family = AF_INET; // 协议族
-    hints.ai_socktype = SOCK_STREAM; // 流socket
-    hints.ai_protocol = IPPROTO_TCP; // TCP协议
-    hints.ai_flags = EVUTIL_AI_ADDRCONFIG; // 只接受ipv4的地址
-    
-    // 解析地址
-    err = evutil_getaddrinfo(connectdomain, port_buf, &hints, &answer);
-    if (err != 0) {
-        xmpp_error(conn->ctx, "xmpp", "getaddrinfo returned %d", gai_strerror(err));
-        return -1;
-    }
-    
-    // 开始连接
-    // 分配bufferevent
-    conn->evbuffer = bufferevent_socket_new(conn->ctx->base, -1,
-                                            BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE | BEV_OPT_DEFER_CALLBACKS);
-    if (!conn->evbuffer) {
-        xmpp_error(conn->ctx, "xmpp", "bufferevent_socket_new returned NULL");
-        return -1;
-    }
-    
-    // 设置回调
-    bufferevent_setcb(conn->evbuffer, NULL, NULL, _evb_event_cb, conn);
-    
-    /* char ipstr[16];
-     for (curr = answer; curr != NULL; curr = curr->ai_next) {
-         inet_ntop(AF_INET, &((struct sockaddr_in*)(curr->ai_addr))->sin_addr, ipstr, sizeof(ipstr));
-         printf("#### %s\n", ipstr);
-     }*/
-    
-    // 发起异步连接
-    if (bufferevent_socket_connect(conn->evbuffer, (struct sockaddr*)answer->ai_addr,
-                                   answer->ai_addrlen) < 0) {
-        xmpp_error(conn->ctx, "xmpp", "bufferevent_socket_connect error");
-        bufferevent_free(conn->evbuffer);
-        return -1;
-    }
-    
-    // 设置连接回调
+    // 设置连接回调, 解析和连接都是异步的, 失败的时候回调XMPP_CONN_FAIL
     conn->conn_handler = callback;              // 外部接口
     conn->userdata = userdata;
-    
+    conn->error = 0;
     conn->state = XMPP_STATE_CONNECTING;
-    xmpp_debug(conn->ctx, "xmpp", "attempting to connect to %s", connectdomain);
     
-    evutil_freeaddrinfo(answer);
+    // 上一次连接的握手状态, 流管理的队列和流id留着恢复
+    conn->secured = 0;
+    conn->compressed = 0;
+    conn->tls_failed = 0;
+    conn->bind_required = 0;
+    conn->session_required = 0;
+    conn->sasl2 = 0;
+    conn->authenticated = 0;
+    
+    // 解析和连接都在connect_start里面异步进行
+    if (connect_start(conn, altdomain, altport) != 0) {
+        conn->state = XMPP_STATE_DISCONNECTED;
+        return -1;
+    }
     return 0;
 }
 
@@ -284,7 +320,13 @@ void conn_start_ssl(xmpp_conn_t *conn)
         || (ssl = bufferevent_openssl_get_ssl(conn->evbuffer)))
         return;
         
-    ssl = SSL_new(conn->ctx->ssl_ctx);
+    // 同一个服务器有缓存的会话的话做简短握手
+    ssl = tls_new(conn);
+    if (!ssl) {
+        xmpp_error(conn->ctx, "conn", "SSL_new failed.");
+        conn_do_disconnect(conn);
+        return;
+    }
     ssl_bev = bufferevent_openssl_filter_new(base, conn->evbuffer,
               ssl, BUFFEREVENT_SSL_CONNECTING,
               BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
@@ -298,6 +340,8 @@ void conn_start_ssl(xmpp_conn_t *conn)
         conn->state = XMPP_STATE_CONNECTING;
         conn->evbuffer = ssl_bev;
         bufferevent_setcb(conn->evbuffer, NULL, NULL, _evb_event_cb, conn);
+        // 过滤器不会自己开始握手, 启用读写以后才发出ClientHello
+        bufferevent_enable(conn->evbuffer, EV_READ | EV_WRITE);
     }
     
 }
@@ -305,11 +349,32 @@ void conn_start_ssl(xmpp_conn_t *conn)
 // 启用压缩传输
 int conn_start_compression(xmpp_conn_t *conn)
 {
-    return -1;
+    struct bufferevent *zlib_bev;
+    
+    if (conn->state != XMPP_STATE_CONNECTED || conn->compressed || conn->compress_level <= 0)
+        return -1;
+        
+    // 和tls一样叠一层过滤器, 之后读写的都是压缩前的数据
+    zlib_bev = zlib_filter_new(conn, conn->evbuffer);
+    if (!zlib_bev) {
+        xmpp_error(conn->ctx, "conn", "Open zlib bufferevent failed.");
+        return -1;
+    }
+    
+    conn->compressed = 1;
+    conn->evbuffer = zlib_bev;
+    bufferevent_setcb(conn->evbuffer, _evb_read_cb, NULL, _evb_event_cb, conn);
+    bufferevent_enable(conn->evbuffer, EV_READ | EV_WRITE);
+    xmpp_debug(conn->ctx, "xmpp", "Stream compression started, level %d.",
+               conn->compress_level);
+    return 0;
 }
 
 void conn_do_disconnect(xmpp_conn_t *conn)
 {
+    struct bufferevent *bev;
+    SSL *ssl;
+    
     xmpp_debug(conn->ctx, "xmpp", "Closing socket.");
     
     // 删除计时器
@@ -318,8 +383,29 @@ void conn_do_disconnect(xmpp_conn_t *conn)
     // 设置状态
     conn->state = XMPP_STATE_DISCONNECTED;
     
-    // 释放连接
-    bufferevent_free(conn->evbuffer);
+    // 可能还在解析或者尝试连接, 这时候还没有bufferevent
+    connect_cancel(conn);
+    
+    // 释放连接. 握手完成的TLS连接先发出close_notify, 否则OpenSSL认为会话不能再复用
+    if (conn->evbuffer) {
+        zlib_filter_detach(conn);
+        // 压缩的话tls在下面一层
+        for (bev = conn->evbuffer, ssl = NULL; bev && !ssl; bev = bufferevent_get_underlying(bev))
+            ssl = bufferevent_openssl_get_ssl(bev);
+        if (ssl && SSL_is_init_finished(ssl))
+            SSL_shutdown(ssl);
+        bufferevent_free(conn->evbuffer);
+        conn->evbuffer = NULL;
+    }
+    
+    // 断开以后不会再有应答. 流还能恢复的话请求会重发, 应答服务器也会补发, 留着等应答或者超时
+    if (!conn->sm_id)
+        iq_cancel_all(conn);
+    sm_disconnected(conn);
+    if (conn->scram) {
+        sasl_scram_free(conn->scram);
+        conn->scram = NULL;
+    }
     
     // 通知外部应用程序
     conn->conn_handler(conn, XMPP_CONN_DISCONNECT, conn->error,
@@ -347,6 +433,15 @@ void xmpp_disconnect(xmpp_conn_t *conn)
         conn->state != XMPP_STATE_CONNECTED)
         return;
         
+    // 主动关闭的流服务器不会再保留
+    sm_reset(conn);
+    
+    // 还在解析服务器地址, 直接断开
+    if (!conn->evbuffer) {
+        conn_do_disconnect(conn);
+        return;
+    }
+    
     // 发送流关闭stanza
     xmpp_send_raw_string(conn, "</stream:stream>");
     
@@ -402,15 +497,31 @@ void xmpp_send_raw(xmpp_conn_t *conn, const char *data, size_t len)
 
 void xmpp_send(xmpp_conn_t *conn, xmpp_stanza_t *stanza)
 {
+    int ret;
+#ifdef _DEBUG
     char *buf;
     size_t len;
-    int ret;
+#endif
     if (conn->state == XMPP_STATE_CONNECTED) {
-        if ((ret = xmpp_stanza_to_text(stanza, &buf, &len)) == 0) {
-            xmpp_send_raw(conn, buf, len);
+#ifdef _DEBUG
+        if (xmpp_stanza_to_text(stanza, &buf, &len) == 0) {
             xmpp_debug(conn->ctx, "conn", "SENT: %s", buf);
             xmpp_free(conn->ctx, buf);
         }
+#endif // DEBUG
+        // 启用了流管理的话留一份等服务器确认
+        if ((ret = sm_send(conn, stanza)) != 0) {
+            if (ret < 0)
+                xmpp_error(conn->ctx, "conn", "Failed to serialize stanza.");
+            return;
+        }
+        
+        // 直接序列化到输出缓冲区, 不生成中间字符串
+        if (stanza_render(stanza, bufferevent_get_output(conn->evbuffer)) != XMPP_EOK) {
+            // 可能已经写出去一部分, 流已经不完整了
+            xmpp_error(conn->ctx, "conn", "Failed to serialize stanza.");
+            conn_do_disconnect(conn);
+        }
     }
 }
 
@@ -537,4 +648,14 @@ void xmpp_conn_set_pass(xmpp_conn_t *conn, const char *pass)
 void xmpp_conn_disable_tls(xmpp_conn_t *conn)
 {
     conn->tls_disabled = 1;
+}
+
+void xmpp_conn_set_compression(xmpp_conn_t *conn, int level, unsigned long flush_delay)
+{
+    if (level < 0)
+        level = 0;
+    if (level > 9)
+        level = 9;
+    conn->compress_level = level;
+    conn->compress_flush_delay = flush_delay;
 }
\ No newline at end of file
@@ -0,0 +1,447 @@
+/* xmpp-connect.c
+ * RFC 8305 happy eyeballs: 所有SRV目标的ipv6和ipv4地址交替发起连接, 每次间隔一小段时间,
+ * 前一个失败了马上尝试下一个, 第一个连上的socket交给连接, 其余的全部取消
+ */
+#include "xmpp-inl.h"
+#include "im-dns.h"
+
+#ifdef WIN32
+#include <ws2tcpip.h>
+#endif
+#ifdef POSIX
+#include <netinet/in.h>
+#endif
+
+// 两次连接尝试之间的间隔, 毫秒
+#define XMPP_CONNECT_ATTEMPT_DELAY 250
+// ipv4地址先解析出来的时候等待ipv6的时间, 毫秒
+#define XMPP_RESOLUTION_DELAY 50
+// 没有SRV记录时使用的端口
+#define XMPP_DEFAULT_PORT 5222
+
+// 地址族下标, ipv6优先
+#define FAMILY_V6 0
+#define FAMILY_V4 1
+
+typedef struct _xmpp_connector_t xmpp_connector_t;
+
+// 一个SRV目标, 两个地址族同时解析
+typedef struct _xmpp_connect_target_t {
+    xmpp_connector_t *connector;
+    char host[256];
+    unsigned short port;
+    im_dns_request_t *request[2];
+    int resolved[2];
+    int count[2];
+    int next[2];                          // 下一个要尝试的地址
+    im_dns_addr_t addrs[2][IM_DNS_MAX_ADDRS];
+    im_timer_t delay;                     // 等待ipv6解析的计时
+    int delay_expired;
+} xmpp_connect_target_t;
+
+// 一次连接尝试
+typedef struct _xmpp_connect_attempt_t {
+    xmpp_connector_t *connector;
+    xmpp_connect_target_t *target;
+    struct bufferevent *bev;
+    struct list_head node;
+} xmpp_connect_attempt_t;
+
+struct _xmpp_connector_t {
+    xmpp_conn_t *conn;
+    im_dns_request_t *srv;
+    xmpp_connect_target_t *targets;
+    int target_count;
+    struct list_head attempts;            // 还在进行的连接尝试
+    im_timer_t timer;                     // 下一次尝试的计时
+    int last_family;                      // 上一次尝试的地址族, 下一次换一个
+    int starting;                         // 正在发起解析, 这期间不开始连接
+    int error;                            // 最后一次连接失败的错误
+};
+
+static void _connector_kick(xmpp_connector_t *c);
+
+static void _attempt_free(xmpp_connect_attempt_t *attempt)
+{
+    list_del(&attempt->node);
+    if (attempt->bev)
+        bufferevent_free(attempt->bev);
+    xmpp_free(attempt->connector->conn->ctx, attempt);
+}
+
+// 取消所有解析和连接尝试并且释放
+static void _connector_free(xmpp_connector_t *c)
+{
+    xmpp_conn_t *conn = c->conn;
+    xmpp_connect_target_t *target;
+    int i, f;
+
+    conn->connector = NULL;
+    if (c->srv)
+        im_dns_cancel(c->srv);
+    for (i = 0; i < c->target_count; i++) {
+        target = &c->targets[i];
+        for (f = 0; f < 2; f++) {
+            if (target->request[f])
+                im_dns_cancel(target->request[f]);
+        }
+        im_timer_del(conn->ctx->timers, &target->delay);
+    }
+    while (!list_empty(&c->attempts))
+        _attempt_free(list_first_entry(&c->attempts, xmpp_connect_attempt_t, node));
+    im_timer_del(conn->ctx->timers, &c->timer);
+
+    if (c->targets)
+        xmpp_free(conn->ctx, c->targets);
+    xmpp_free(conn->ctx, c);
+}
+
+static void _connector_fail(xmpp_connector_t *c)
+{
+    xmpp_conn_t *conn = c->conn;
+    int error = c->error ? c->error : EHOSTUNREACH;
+
+    xmpp_error(conn->ctx, "xmpp", "all connection attempts to %s failed", conn->domain);
+    _connector_free(c);
+    conn_connect_failed(conn, error);
+}
+
+// 连上了, 其余的尝试全部取消
+static void _connector_succeed(xmpp_connector_t *c, xmpp_connect_attempt_t *attempt)
+{
+    xmpp_conn_t *conn = c->conn;
+    struct bufferevent *bev = attempt->bev;
+    char port[8];
+
+    sprintf(port, "%d", attempt->target->port);
+    if (conn->connectdomain) xmpp_free(conn->ctx, conn->connectdomain);
+    if (conn->connectport) xmpp_free(conn->ctx, conn->connectport);
+    conn->connectdomain = xmpp_strdup(conn->ctx, attempt->target->host);
+    conn->connectport = xmpp_strdup(conn->ctx, port);
+
+    attempt->bev = NULL;
+    _connector_free(c);
+
+    // 连接过程的超时只用于尝试阶段
+    bufferevent_set_timeouts(bev, NULL, NULL);
+    conn_established(conn, bev);
+}
+
+static void _attempt_event_cb(struct bufferevent *bev, short what, void *ptr)
+{
+    xmpp_connect_attempt_t *attempt = ptr;
+    xmpp_connector_t *c = attempt->connector;
+    int error;
+
+    if (what & BEV_EVENT_CONNECTED) {
+        xmpp_debug(c->conn->ctx, "xmpp", "connected to %s:%d", attempt->target->host,
+                   attempt->target->port);
+        _connector_succeed(c, attempt);
+        return;
+    }
+
+    error = EVUTIL_SOCKET_ERROR();
+    c->error = (what & BEV_EVENT_TIMEOUT) ? ETIMEDOUT : (error ? error : ECONNREFUSED);
+    xmpp_debug(c->conn->ctx, "xmpp", "connection attempt to %s:%d failed: %d",
+               attempt->target->host, attempt->target->port, c->error);
+    _attempt_free(attempt);
+
+    // 失败了不用等间隔, 马上尝试下一个
+    im_timer_del(c->conn->ctx->timers, &c->timer);
+    _connector_kick(c);
+}
+
+// 发起一次连接, 失败返回-1
+static int _connector_attempt(xmpp_connector_t *c, xmpp_connect_target_t *target,
+                              const im_dns_addr_t *addr)
+{
+    xmpp_conn_t *conn = c->conn;
+    xmpp_connect_attempt_t *attempt;
+    struct sockaddr_storage ss;
+    struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+    struct timeval tv;
+    int len;
+
+    memset(&ss, 0, sizeof(ss));
+    if (addr->family == AF_INET6) {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(target->port);
+        memcpy(&sin6->sin6_addr, addr->addr, 16);
+        len = sizeof(struct sockaddr_in6);
+    } else {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(target->port);
+        memcpy(&sin->sin_addr, addr->addr, 4);
+        len = sizeof(struct sockaddr_in);
+    }
+
+    attempt = xmpp_alloc(conn->ctx, sizeof(xmpp_connect_attempt_t));
+    if (!attempt)
+        return -1;
+    attempt->connector = c;
+    attempt->target = target;
+    attempt->bev = bufferevent_socket_new(conn->ctx->base, -1,
+                                          BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE | BEV_OPT_DEFER_CALLBACKS);
+    list_add_tail(&attempt->node, &c->attempts);
+    if (!attempt->bev) {
+        c->error = ENOMEM;
+        _attempt_free(attempt);
+        return -1;
+    }
+    bufferevent_setcb(attempt->bev, NULL, NULL, _attempt_event_cb, attempt);
+
+    // 连接阶段用写超时限制单个尝试的时间
+    tv.tv_sec = conn->respond_timeout;
+    tv.tv_usec = 0;
+    bufferevent_set_timeouts(attempt->bev, NULL, &tv);
+
+    // 没有ipv6路由这类错误会直接失败
+    if (bufferevent_socket_connect(attempt->bev, (struct sockaddr *)&ss, len) < 0) {
+        c->error = EVUTIL_SOCKET_ERROR();
+        if (!c->error)
+            c->error = ECONNREFUSED;
+        _attempt_free(attempt);
+        return -1;
+    }
+
+    xmpp_debug(conn->ctx, "xmpp", "attempting to connect to %s:%d over %s", target->host,
+               target->port, addr->family == AF_INET6 ? "ipv6" : "ipv4");
+    return 0;
+}
+
+// 按SRV顺序找第一个还有地址没有尝试的目标, 地址族只在同一个目标里面交替.
+// 前面的目标还在解析的话等它, 不能先连后面解析得快的目标, 保持RFC 2782的优先顺序
+static int _connector_next_addr(xmpp_connector_t *c, xmpp_connect_target_t **target,
+                                const im_dns_addr_t **addr)
+{
+    xmpp_connect_target_t *t;
+    int i, v6, v4, f;
+
+    for (i = 0; i < c->target_count; i++) {
+        t = &c->targets[i];
+        v6 = t->next[FAMILY_V6] < t->count[FAMILY_V6];
+        // ipv4先解析出来的时候等一下ipv6
+        v4 = t->next[FAMILY_V4] < t->count[FAMILY_V4] &&
+             (t->resolved[FAMILY_V6] || t->delay_expired);
+        if (!v6 && !v4) {
+            // 还有地址族没有解析完, 包括ipv4在等ipv6的情况
+            if (!t->resolved[FAMILY_V6] || !t->resolved[FAMILY_V4])
+                return 0;
+            continue;
+        }
+
+        if (v6 && v4)
+            f = c->last_family == FAMILY_V6 ? FAMILY_V4 : FAMILY_V6;
+        else
+            f = v6 ? FAMILY_V6 : FAMILY_V4;
+        c->last_family = f;
+        *target = t;
+        *addr = &t->addrs[f][t->next[f]++];
+        return 1;
+    }
+    return 0;
+}
+
+// 所有的解析都已经结束
+static int _connector_resolved(xmpp_connector_t *c)
+{
+    int i;
+
+    if (c->srv || !c->targets)
+        return 0;
+    for (i = 0; i < c->target_count; i++) {
+        if (!c->targets[i].resolved[FAMILY_V6] || !c->targets[i].resolved[FAMILY_V4])
+            return 0;
+    }
+    return 1;
+}
+
+// 间隔已经过去的话发起下一次尝试, 没有地址也没有尝试在进行的时候失败
+static void _connector_kick(xmpp_connector_t *c)
+{
+    xmpp_connect_target_t *target;
+    const im_dns_addr_t *addr;
+
+    if (c->starting || im_timer_pending(&c->timer))
+        return;
+
+    while (_connector_next_addr(c, &target, &addr)) {
+        if (_connector_attempt(c, target, addr) == 0) {
+            im_timer_add(c->conn->ctx->timers, &c->timer, XMPP_CONNECT_ATTEMPT_DELAY);
+            return;
+        }
+    }
+
+    if (list_empty(&c->attempts) && _connector_resolved(c))
+        _connector_fail(c);
+}
+
+static void _connector_timer_cb(im_timer_t *timer, void *userdata)
+{
+    _connector_kick(userdata);
+}
+
+static void _target_delay_cb(im_timer_t *timer, void *userdata)
+{
+    xmpp_connect_target_t *target = userdata;
+
+    target->delay_expired = 1;
+    _connector_kick(target->connector);
+}
+
+static void _target_resolved(xmpp_connect_target_t *target, int f, int result,
+                             const im_dns_addr_t *addrs, int count)
+{
+    xmpp_connector_t *c = target->connector;
+
+    target->request[f] = NULL;
+    target->resolved[f] = 1;
+    if (result == IM_DNS_OK) {
+        memcpy(target->addrs[f], addrs, sizeof(im_dns_addr_t) * count);
+        target->count[f] = count;
+    }
+
+    if (f == FAMILY_V6) {
+        im_timer_del(c->conn->ctx->timers, &target->delay);
+    } else if (count > 0 && !target->resolved[FAMILY_V6]) {
+        im_timer_add(c->conn->ctx->timers, &target->delay, XMPP_RESOLUTION_DELAY);
+    }
+    _connector_kick(c);
+}
+
+static void _target_v6_cb(int result, const im_dns_addr_t *addrs, int count, void *userdata)
+{
+    _target_resolved(userdata, FAMILY_V6, result, addrs, count);
+}
+
+static void _target_v4_cb(int result, const im_dns_addr_t *addrs, int count, void *userdata)
+{
+    _target_resolved(userdata, FAMILY_V4, result, addrs, count);
+}
+
+// 记录目标, 所有目标的两个地址族同时开始解析
+static void _connector_resolve(xmpp_connector_t *c, const im_srv_record_t *records, int count)
+{
+    xmpp_conn_t *conn = c->conn;
+    xmpp_connect_target_t *target;
+    im_dns_request_t *req;
+    unsigned char literal[16];
+    int i, skip;
+
+    c->targets = xmpp_alloc(conn->ctx, sizeof(xmpp_connect_target_t) * count);
+    if (!c->targets) {
+        c->error = ENOMEM;
+        _connector_fail(c);
+        return;
+    }
+    memset(c->targets, 0, sizeof(xmpp_connect_target_t) * count);
+    c->target_count = count;
+
+    // 缓存命中的时候会同步回调, 全部发起以后再开始连接
+    c->starting = 1;
+    for (i = 0; i < count; i++) {
+        target = &c->targets[i];
+        target->connector = c;
+        strcpy(target->host, records[i].target);
+        target->port = records[i].port;
+        im_timer_init(&target->delay, _target_delay_cb, target);
+
+        // 数字地址只有一个地址族, 另一个直接算解析完没有地址, 不用查询也不用等待
+        skip = -1;
+        if (evutil_inet_pton(AF_INET6, target->host, literal) == 1)
+            skip = FAMILY_V4;
+        else if (evutil_inet_pton(AF_INET, target->host, literal) == 1)
+            skip = FAMILY_V6;
+        if (skip >= 0)
+            target->resolved[skip] = 1;
+
+        if (skip != FAMILY_V6) {
+            req = im_dns_host_lookup(conn->ctx->base, conn->ctx->dns, target->host, AF_INET6,
+                                     _target_v6_cb, target);
+            if (req)
+                target->request[FAMILY_V6] = req;
+        }
+        if (skip != FAMILY_V4) {
+            req = im_dns_host_lookup(conn->ctx->base, conn->ctx->dns, target->host, AF_INET,
+                                     _target_v4_cb, target);
+            if (req)
+                target->request[FAMILY_V4] = req;
+        }
+    }
+    c->starting = 0;
+    _connector_kick(c);
+}
+
+static void _connector_srv_cb(int result, const im_srv_record_t *records, int count,
+                              void *userdata)
+{
+    xmpp_connector_t *c = userdata;
+    xmpp_conn_t *conn = c->conn;
+    im_srv_record_t record;
+
+    c->srv = NULL;
+    if (result == IM_DNS_OK && count > 0) {
+        // 已经按priority和weight排好顺序, 依次作为候选
+        _connector_resolve(c, records, count);
+        return;
+    }
+
+    xmpp_debug(conn->ctx, "xmpp", "SRV lookup failed, using domain %s", conn->domain);
+    memset(&record, 0, sizeof(record));
+    strncpy(record.target, conn->domain, sizeof(record.target) - 1);
+    record.port = XMPP_DEFAULT_PORT;
+    _connector_resolve(c, &record, 1);
+}
+
+int connect_start(xmpp_conn_t *conn, const char *altdomain, unsigned short altport)
+{
+    xmpp_connector_t *c;
+    im_srv_record_t record;
+    im_dns_request_t *req;
+
+    c = xmpp_alloc(conn->ctx, sizeof(xmpp_connector_t));
+    if (!c)
+        return -1;
+    memset(c, 0, sizeof(xmpp_connector_t));
+    c->conn = conn;
+    c->last_family = FAMILY_V4;
+    INIT_LIST_HEAD(&c->attempts);
+    im_timer_init(&c->timer, _connector_timer_cb, c);
+    conn->connector = c;
+
+    // 直接指定了服务器域名，还是对jid的域名进行SRV解析
+    if (altdomain) {
+        xmpp_debug(conn->ctx, "xmpp", "Connecting via altdomain.");
+        memset(&record, 0, sizeof(record));
+        strncpy(record.target, altdomain, sizeof(record.target) - 1);
+        record.port = altport ? altport : XMPP_DEFAULT_PORT;
+        _connector_resolve(c, &record, 1);
+        return 0;
+    }
+
+    // 缓存里面有结果的时候直接回调并且返回NULL
+    req = im_dns_srv_lookup(conn->ctx->base, conn->ctx->dns, "xmpp-client", "tcp",
+                            conn->domain, _connector_srv_cb, c);
+    if (req)
+        c->srv = req;
+    return 0;
+}
+
+void connect_cancel(xmpp_conn_t *conn)
+{
+    if (conn->connector)
+        _connector_free(conn->connector);
+}
+
+int connect_attempt_count(xmpp_conn_t *conn)
+{
+    struct list_head *pos;
+    int n = 0;
+
+    if (!conn->connector)
+        return 0;
+    list_for_each(pos, &conn->connector->attempts)
+        n++;
+    return n;
+}
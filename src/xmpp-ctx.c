@@ -2,6 +2,7 @@
  * 上下文实现
  */
 #include "xmpp-inl.h"
+#include "im-atomic.h"
 
 void xmpp_initialize(void)
 {
@@ -117,6 +118,19 @@ void xmpp_debug(const xmpp_ctx_t *ctx, const char *area, const char *fmt, ...)
     va_end(ap);
 }
 
+// 释放上下文持有的资源, 创建失败的时候也用它清理, 成员可能为NULL
+static void _xmpp_ctx_destroy(xmpp_ctx_t *ctx)
+{
+    if (ctx->timers)
+        im_timer_wheel_free(ctx->timers);
+    if (ctx->dns)
+        evdns_base_free(ctx->dns, 1);
+    if (ctx->atoms)
+        atoms_free(ctx->atoms);
+    if (ctx->ssl_ctx)
+        SSL_CTX_free(ctx->ssl_ctx);
+    xmpp_free(ctx, ctx);
+}
 
 xmpp_ctx_t *xmpp_ctx_new(im_thread_t *work_thread, const xmpp_log_t *log)
 {
@@ -133,16 +147,69 @@ xmpp_ctx_t *xmpp_ctx_new(im_thread_t *work_thread, const xmpp_log_t *log)
         
         // 初始化SSL上下文
         ctx->ssl_ctx = SSL_CTX_new(TLS_client_method());
+        tls_ctx_init(ctx->ssl_ctx);
         ctx->loop_status = XMPP_LOOP_NOTSTARTED;
+        ctx->timers = im_timer_wheel_new(ctx->base, IM_TIMER_TICK);
+        // 系统配置的nameserver, 没有请求的时候不占用事件循环
+        ctx->dns = ctx->base ? evdns_base_new(ctx->base, EVDNS_BASE_INITIALIZE_NAMESERVERS |
+                                              EVDNS_BASE_DISABLE_WHEN_INACTIVE) : NULL;
+        ctx->atoms = atoms_new();
+        ctx->ref = 1;
+
+        // 有事件循环的时候时间轮和dns必须创建成功
+        if (!ctx->ssl_ctx || !ctx->atoms ||
+            (ctx->base && (!ctx->timers || !ctx->dns))) {
+            _xmpp_ctx_destroy(ctx);
+            return NULL;
+        }
     }
     
     return ctx;
 }
 
+xmpp_ctx_t *xmpp_ctx_clone(xmpp_ctx_t *ctx)
+{
+    im_atomic_inc(&ctx->ref);
+    return ctx;
+}
+
+xmpp_ctx_t *xmpp_ctx_fork(xmpp_ctx_t *ctx, im_thread_t *work_thread)
+{
+    xmpp_ctx_t *fork = NULL;
+    fork = safe_mem_malloc(sizeof(xmpp_ctx_t), NULL);
+    
+    if (fork != NULL) {
+        fork->log = ctx->log;
+        fork->base = im_thread_get_eventbase(work_thread);
+        
+        // SSL_CTX本身带引用计数, 创建SSL对象是线程安全的
+        SSL_CTX_up_ref(ctx->ssl_ctx);
+        fork->ssl_ctx = ctx->ssl_ctx;
+        fork->loop_status = XMPP_LOOP_NOTSTARTED;
+        fork->timers = im_timer_wheel_new(fork->base, IM_TIMER_TICK);
+        fork->dns = fork->base ? evdns_base_new(fork->base, EVDNS_BASE_INITIALIZE_NAMESERVERS |
+                                                EVDNS_BASE_DISABLE_WHEN_INACTIVE) : NULL;
+        // 原子表不加锁, 每个线程各自一份
+        fork->atoms = atoms_new();
+        fork->ref = 1;
+
+        // 创建失败的时候放掉已经持有的SSL_CTX引用
+        if (!fork->atoms || (fork->base && (!fork->timers || !fork->dns))) {
+            _xmpp_ctx_destroy(fork);
+            return NULL;
+        }
+    }
+    
+    return fork;
+}
+
 void xmpp_ctx_free(xmpp_ctx_t *ctx)
 {
-    SSL_CTX_free(ctx->ssl_ctx);
-    xmpp_free(ctx, ctx);
+    // 还有连接在使用
+    if (im_atomic_dec(&ctx->ref) > 0)
+        return;
+
+    _xmpp_ctx_destroy(ctx);
 }
 
 /**
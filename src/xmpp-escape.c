@@ -0,0 +1,206 @@
+/* escape.c
+ * xml转义字符查找
+ * 文本需要转义 < > &, 属性值还要转义 " ', 没有这些字符的连续片段直接整段拷贝
+ */
+#include "xmpp-escape.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define XML_ESCAPE_X86
+#endif
+
+#ifdef XML_ESCAPE_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+
+// gcc/clang需要单独给函数打开avx2, msvc直接可以用
+#if defined(__GNUC__)
+#define XML_ESCAPE_TARGET_AVX2 __attribute__((target("avx2")))
+#define XML_ESCAPE_TARGET_SSE2 __attribute__((target("sse2")))
+#else
+#define XML_ESCAPE_TARGET_AVX2
+#define XML_ESCAPE_TARGET_SSE2
+#endif
+#endif // XML_ESCAPE_X86
+
+// 1表示文本和属性都要转义, 2表示只在属性里面转义
+static const unsigned char _xml_escape_table[256] = {
+    ['<'] = 1, ['>'] = 1, ['&'] = 1, ['"'] = 2, ['\''] = 2
+};
+
+static size_t _xml_escape_span_scalar(const char *s, size_t len, int attr)
+{
+    const unsigned char *p = (const unsigned char *)s;
+    int mask = attr ? 3 : 1;
+    size_t i;
+    
+    for (i = 0; i < len; i++) {
+        if (_xml_escape_table[p[i]] & mask)
+            break;
+    }
+    return i;
+}
+
+#ifdef XML_ESCAPE_X86
+
+static inline int _xml_escape_ctz(unsigned int bits)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, bits);
+    return (int)index;
+#else
+    return __builtin_ctz(bits);
+#endif
+}
+
+// 每次比较16个字节, 剩下不足16个的逐字节处理
+XML_ESCAPE_TARGET_SSE2
+static size_t _xml_escape_span_sse2(const char *s, size_t len, int attr)
+{
+    const __m128i lt = _mm_set1_epi8('<');
+    const __m128i gt = _mm_set1_epi8('>');
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i quot = _mm_set1_epi8('"');
+    const __m128i apos = _mm_set1_epi8('\'');
+    __m128i v, hit;
+    unsigned int bits;
+    size_t i = 0;
+    
+    for (; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(s + i));
+        hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)),
+                           _mm_cmpeq_epi8(v, amp));
+        if (attr)
+            hit = _mm_or_si128(hit, _mm_or_si128(_mm_cmpeq_epi8(v, quot),
+                                                 _mm_cmpeq_epi8(v, apos)));
+        bits = (unsigned int)_mm_movemask_epi8(hit);
+        if (bits)
+            return i + _xml_escape_ctz(bits);
+    }
+    return i + _xml_escape_span_scalar(s + i, len - i, attr);
+}
+
+// 每次比较32个字节, 剩下的交给sse2
+XML_ESCAPE_TARGET_AVX2
+static size_t _xml_escape_span_avx2(const char *s, size_t len, int attr)
+{
+    __m256i lt, gt, amp, quot, apos, v, hit;
+    unsigned int bits;
+    size_t i = 0;
+    
+    // 属性值一般很短, 不够32个字节就不碰ymm寄存器
+    if (len < 32)
+        return _xml_escape_span_sse2(s, len, attr);
+        
+    lt = _mm256_set1_epi8('<');
+    gt = _mm256_set1_epi8('>');
+    amp = _mm256_set1_epi8('&');
+    quot = _mm256_set1_epi8('"');
+    apos = _mm256_set1_epi8('\'');
+    for (; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *)(s + i));
+        hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, lt),
+                                              _mm256_cmpeq_epi8(v, gt)),
+                              _mm256_cmpeq_epi8(v, amp));
+        if (attr)
+            hit = _mm256_or_si256(hit, _mm256_or_si256(_mm256_cmpeq_epi8(v, quot),
+                                                       _mm256_cmpeq_epi8(v, apos)));
+        bits = (unsigned int)_mm256_movemask_epi8(hit);
+        if (bits) {
+            _mm256_zeroupper();
+            return i + _xml_escape_ctz(bits);
+        }
+    }
+    
+    // 调用非vex编码的代码之前必须清掉ymm高位, 否则每条sse指令都有切换开销
+    _mm256_zeroupper();
+    return i + _xml_escape_span_sse2(s + i, len - i, attr);
+}
+
+static int _xml_escape_has_sse2()
+{
+#if defined(_M_X64) || defined(__x86_64__)
+    // x64一定支持
+    return 1;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] >> 26) & 1;
+#else
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+
+static int _xml_escape_has_avx2()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    
+    // 还要确认操作系统保存ymm寄存器
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return 0;
+    __cpuid(info, 1);
+    if (!((info[2] >> 27) & 1) || !((info[2] >> 28) & 1))
+        return 0;
+    if ((_xgetbv(0) & 6) != 6)
+        return 0;
+    __cpuidex(info, 7, 0);
+    return (info[1] >> 5) & 1;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // XML_ESCAPE_X86
+
+xml_escape_span_fn xml_escape_span_impl(xml_escape_kind_t kind)
+{
+    switch (kind) {
+    case XML_ESCAPE_SCALAR:
+        return _xml_escape_span_scalar;
+#ifdef XML_ESCAPE_X86
+    case XML_ESCAPE_SSE2:
+        return _xml_escape_has_sse2() ? _xml_escape_span_sse2 : NULL;
+    case XML_ESCAPE_AVX2:
+        return _xml_escape_has_avx2() ? _xml_escape_span_avx2 : NULL;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+static xml_escape_kind_t _xml_escape_select()
+{
+    if (xml_escape_span_impl(XML_ESCAPE_AVX2))
+        return XML_ESCAPE_AVX2;
+    if (xml_escape_span_impl(XML_ESCAPE_SSE2))
+        return XML_ESCAPE_SSE2;
+    return XML_ESCAPE_SCALAR;
+}
+
+static size_t _xml_escape_span_init(const char *s, size_t len, int attr);
+
+// 第一次调用的时候检测cpu, 多个线程同时检测结果也一样, 不需要加锁
+static volatile xml_escape_span_fn _xml_escape_span = _xml_escape_span_init;
+
+static size_t _xml_escape_span_init(const char *s, size_t len, int attr)
+{
+    xml_escape_span_fn fn = xml_escape_span_impl(_xml_escape_select());
+    
+    _xml_escape_span = fn;
+    return fn(s, len, attr);
+}
+
+size_t xml_escape_span(const char *s, size_t len, int attr)
+{
+    return _xml_escape_span(s, len, attr);
+}
+
+xml_escape_kind_t xml_escape_kind(void)
+{
+    return _xml_escape_select();
+}
@@ -0,0 +1,30 @@
+/* escape.h
+ * xml转义字符查找, 按照cpu支持的指令集在运行时选择sse2/avx2或者逐字节的实现
+ */
+
+#ifndef __IMCORE_XMPP_ESCAPE_H__
+#define __IMCORE_XMPP_ESCAPE_H__
+
+#include <stddef.h>
+
+// 实现种类
+typedef enum {
+    XML_ESCAPE_SCALAR,
+    XML_ESCAPE_SSE2,
+    XML_ESCAPE_AVX2
+} xml_escape_kind_t;
+
+// 返回s开头不需要转义的字节数, 最多len
+// attr不为0表示属性值, 还需要转义引号
+typedef size_t (*xml_escape_span_fn)(const char *s, size_t len, int attr);
+
+// 使用当前cpu最快的实现
+size_t xml_escape_span(const char *s, size_t len, int attr);
+
+// 获取指定的实现, 编译器或者cpu不支持的返回NULL
+xml_escape_span_fn xml_escape_span_impl(xml_escape_kind_t kind);
+
+// 当前选择的实现
+xml_escape_kind_t xml_escape_kind(void);
+
+#endif /* __IMCORE_XMPP_ESCAPE_H__ */
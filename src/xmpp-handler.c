@@ -22,26 +22,180 @@ static inline bool _check_handler_exist(xmpp_handlist_t *list, void *handler)
 static void _handler_timed_free(xmpp_handlist_t *target);
 static void _handler_id_free(xmpp_handlist_t *head, xmpp_handlist_t *item, const char *id);
 static void _handler_free(xmpp_handlist_t *target);
+static void _handler_free_deleted(xmpp_conn_t *conn);
 
 
 // 计时器回调代理
-static void _handler_timer_proxy(evutil_socket_t fd, short what, void *arg)
+static void _handler_timer_proxy(im_timer_t *timer, void *arg)
 {
     // 获取代理的句柄
     xmpp_handlist_t *item = arg;
+    xmpp_ctx_t *ctx = item->conn->ctx;
 
-    if (item->user_handler && !item->conn->authenticated) {
-        if (!((xmpp_timed_handler)(item->user_handler))(item->conn, item->userdata)) {
-            _handler_timed_free(item);
+    // 周期触发, 先重新计时. handler里面可能会删除自己
+    im_timer_add(ctx->timers, &item->timer, item->period * 1000);
+
+    // 没有登录的话不调用用户的handler
+    if (item->user_handler && !item->conn->authenticated)
+        return;
+
+    if (!((xmpp_timed_handler)(item->handler))(item->conn, item->userdata)) {
+        _handler_timed_free(item);
+    }
+}
+
+// 派发的时候候选handler数组的初始大小, 放在栈上
+#define HANDLER_DISPATCH_INLINE 32
+// stanza自己和直接子元素的命名空间, 超过这个数量的时候收集所有命名空间的桶
+#define HANDLER_DISPATCH_NS 16
+
+// 索引桶, handler按添加顺序链在list上
+typedef struct _xmpp_handler_bucket_t {
+    struct list_head list;
+} xmpp_handler_bucket_t;
+
+// 派发时收集的候选handler
+typedef struct _handler_dispatch_t {
+    xmpp_ctx_t *ctx;
+    xmpp_handlist_t **items;
+    int count;
+    int capacity;
+    xmpp_handlist_t *inline_items[HANDLER_DISPATCH_INLINE];
+    // stanza自己的命名空间和子元素的命名空间, 去掉重复的
+    const char *ns[HANDLER_DISPATCH_NS];
+    int ns_count;
+    // 命名空间没有收集全
+    bool ns_overflow;
+    // 候选数组扩容失败
+    bool failed;
+} handler_dispatch_t;
+
+static void _dispatch_add_ns(handler_dispatch_t *d, const char *ns)
+{
+    int i;
+
+    if (!ns)
+        return;
+    for (i = 0; i < d->ns_count; i++) {
+        if (atom_equal(d->ctx, d->ns[i], ns))
+            return;
+    }
+    if (d->ns_count == HANDLER_DISPATCH_NS)
+        d->ns_overflow = true;
+    else
+        d->ns[d->ns_count++] = ns;
+}
+
+static bool _dispatch_has_ns(handler_dispatch_t *d, xmpp_stanza_t *stanza, const char *ns)
+{
+    int i;
+
+    for (i = 0; i < d->ns_count; i++) {
+        if (atom_equal(d->ctx, d->ns[i], ns))
+            return true;
+    }
+    // 子元素命名空间太多的时候没有全部收集
+    if (d->ns_overflow)
+        return xmpp_stanza_get_child_by_ns(stanza, ns) != NULL;
+    return false;
+}
+
+// 把一个桶里面的handler加入候选
+static void _dispatch_collect(handler_dispatch_t *d, struct list_head *bucket)
+{
+    xmpp_handlist_t **items;
+    struct list_head *pos;
+
+    list_for_each(pos, bucket) {
+        if (d->count == d->capacity) {
+            items = xmpp_alloc(d->ctx, sizeof(xmpp_handlist_t *) * d->capacity * 2);
+            if (!items) {
+                d->failed = true;
+                return;
+            }
+            memcpy(items, d->items, sizeof(xmpp_handlist_t *) * d->count);
+            if (d->items != d->inline_items)
+                xmpp_free(d->ctx, d->items);
+            d->items = items;
+            d->capacity *= 2;
         }
+        d->items[d->count++] = list_entry(pos, xmpp_handlist_t, index);
     }
 }
 
+// 几个桶合在一起以后按添加顺序排序, 每个桶本身已经有序, 插入排序基本是线性的
+static void _dispatch_sort(handler_dispatch_t *d)
+{
+    xmpp_handlist_t *item;
+    int i, j;
+
+    for (i = 1; i < d->count; i++) {
+        item = d->items[i];
+        for (j = i; j > 0 && d->items[j - 1]->seq > item->seq; j--)
+            d->items[j] = d->items[j - 1];
+        d->items[j] = item;
+    }
+}
+
+static struct list_head *_handler_bucket_get(xmpp_conn_t *conn, xmpp_handlist_t *item,
+                                             int create)
+{
+    xmpp_handler_bucket_t *bucket;
+    hash_t *table;
+    const char *key;
+
+    if (item->name) {
+        table = conn->handlers_by_name;
+        key = item->name;
+    } else if (item->ns) {
+        table = conn->handlers_by_ns;
+        key = item->ns;
+    } else {
+        return &conn->handlers_any;
+    }
+
+    bucket = hash_get(table, key);
+    if (!bucket && create) {
+        bucket = xmpp_alloc(conn->ctx, sizeof(xmpp_handler_bucket_t));
+        if (!bucket)
+            return NULL;
+        INIT_LIST_HEAD(&bucket->list);
+        if (hash_add(table, key, bucket)) {
+            xmpp_free(conn->ctx, bucket);
+            return NULL;
+        }
+    }
+    return bucket ? &bucket->list : NULL;
+}
+
+// 桶空了就从索引里面删掉
+static void _handler_bucket_put(xmpp_conn_t *conn, xmpp_handlist_t *item)
+{
+    struct list_head *bucket = _handler_bucket_get(conn, item, 0);
+
+    if (bucket && bucket != &conn->handlers_any && list_empty(bucket))
+        hash_drop(item->name ? conn->handlers_by_name : conn->handlers_by_ns,
+                  item->name ? item->name : item->ns);
+}
+
 void handler_fire_stanza(xmpp_conn_t *conn, xmpp_stanza_t *stanza)
 {
     xmpp_handlist_t *item = NULL, *pos_item = NULL;
-    const char *id, *ns, *name, *type;
+    xmpp_handler_bucket_t *bucket;
+    xmpp_stanza_t *child;
+    handler_dispatch_t d;
+    hash_iterator_t *iter;
+    const char *id, *ns, *name, *type, *key;
     struct list_head *pos, *tmp;
+    int i;
+
+    // 流管理的元素不是stanza, 不交给handler
+    if (sm_fire_stanza(conn, stanza))
+        return;
+
+    // 异步IQ的应答只交给发起请求的回调
+    if (iq_fire_stanza(conn, stanza))
+        return;
 
     // 先处理id
     id = xmpp_stanza_get_id_ptr(stanza);
@@ -56,45 +210,89 @@ void handler_fire_stanza(xmpp_conn_t *conn, xmpp_stanza_t *stanza)
                     continue;
                 }
                 if (!((xmpp_handler)(pos_item->handler))(conn, stanza, pos_item->userdata)) {
+                    // 删除最后一个handler的时候表头也一起释放了
+                    if (list_is_singular(&item->dlist)) {
+                        xmpp_id_handler_delete(conn, pos_item->handler, id);
+                        break;
+                    }
                     xmpp_id_handler_delete(conn, pos_item->handler, id);
                 }
             }
         }
     }
 
-    // handler派发信息
+    // 普通handler, 从索引里面收集候选: 同名的, 命名空间相同的, 以及没有name和ns的
+    // 收集的是派发开始时候的快照, 派发期间加入的handler下一次才处理
+    memset(&d, 0, sizeof(d));
+    d.ctx = conn->ctx;
+    d.items = d.inline_items;
+    d.capacity = HANDLER_DISPATCH_INLINE;
+
     ns = xmpp_stanza_get_ns(stanza);
     name = xmpp_stanza_get_name_ptr(stanza);
     type = xmpp_stanza_get_type_ptr(stanza);
 
-    // 普通handler
-    item = &conn->handlers;
-    if (!list_empty(&item->dlist)) {
-        // 激活本次要运行的handler，之后加入的下一次事件激活的时候才处理
-        list_for_each(pos, &item->dlist) {
-            pos_item = list_entry(pos, xmpp_handlist_t, dlist);
-            pos_item->enabled = 1;
-        }
-
-        // 激活回调
-        list_for_each_safe(pos, tmp, &item->dlist) {
-            pos_item = list_entry(pos, xmpp_handlist_t, dlist);
+    _dispatch_add_ns(&d, ns);
+    for (child = stanza->children; child; child = child->next) {
+        if (child->type == XMPP_STANZA_TAG)
+            _dispatch_add_ns(&d, xmpp_stanza_get_ns(child));
+    }
 
-            // 没有登录的话不调用用户的handler
-            if (!pos_item->enabled || (pos_item->user_handler && !conn->authenticated)) {
-                continue;
-            }
-            // handler匹配条件: ns name type 如果有都要匹配
-            if ((!pos_item->ns || (ns && strcmp(ns, pos_item->ns) == 0)
-                 || xmpp_stanza_get_child_by_ns(stanza, pos_item->ns)) &&
-                (!pos_item->name || (name && strcmp(name, pos_item->name) == 0)) &&
-                (!pos_item->type || (type && strcmp(type, pos_item->type) == 0))) {
-                if (!((xmpp_handler)(pos_item->handler))(conn, stanza, pos_item->userdata)) {
-                    _handler_free(pos_item);
-                }
+    if (name && (bucket = hash_get(conn->handlers_by_name, name)))
+        _dispatch_collect(&d, &bucket->list);
+    if (d.ns_overflow) {
+        // 子元素命名空间很多, 直接收集所有的命名空间桶, 匹配的时候再逐个检查
+        iter = hash_iter_new(conn->handlers_by_ns);
+        if (!iter)
+            d.failed = true;
+        while (iter && (key = hash_iter_next(iter))) {
+            bucket = hash_get(conn->handlers_by_ns, key);
+            _dispatch_collect(&d, &bucket->list);
+        }
+        if (iter)
+            hash_iter_release(iter);
+    } else {
+        for (i = 0; i < d.ns_count; i++) {
+            if ((bucket = hash_get(conn->handlers_by_ns, d.ns[i])))
+                _dispatch_collect(&d, &bucket->list);
+        }
+    }
+    _dispatch_collect(&d, &conn->handlers_any);
+
+    // 候选不全的话只派发一部分handler会丢消息, 按内存错误断开
+    if (d.failed) {
+        if (d.items != d.inline_items)
+            xmpp_free(conn->ctx, d.items);
+        xmpp_error(conn->ctx, "xmpp", "Memory allocation error");
+        xmpp_disconnect(conn);
+        return;
+    }
+    _dispatch_sort(&d);
+
+    // 派发期间删除的handler都延迟释放, 候选数组里面的指针一直有效
+    conn->dispatching++;
+    for (i = 0; i < d.count; i++) {
+        pos_item = d.items[i];
+
+        // 已经被删除, 或者没有登录的话不调用用户的handler
+        if (pos_item->deleted || (pos_item->user_handler && !conn->authenticated))
+            continue;
+
+        // handler匹配条件: ns name type 如果有都要匹配
+        if ((!pos_item->ns || _dispatch_has_ns(&d, stanza, pos_item->ns)) &&
+            (!pos_item->name || (name && atom_equal(conn->ctx, name, pos_item->name))) &&
+            (!pos_item->type || (type && atom_equal(conn->ctx, type, pos_item->type)))) {
+            if (!((xmpp_handler)(pos_item->handler))(conn, stanza, pos_item->userdata)) {
+                _handler_free(pos_item);
             }
-        } // end list_for_each_safe
-    } // end if(list_empty?)
+        }
+    }
+    conn->dispatching--;
+
+    if (!conn->dispatching)
+        _handler_free_deleted(conn);
+    if (d.items != d.inline_items)
+        xmpp_free(conn->ctx, d.items);
 }
 
 void handler_reset_timed(xmpp_conn_t *conn, int user_only)
@@ -106,10 +304,9 @@ void handler_reset_timed(xmpp_conn_t *conn, int user_only)
     list_for_each(pos, &item->dlist) {
         pos_item = list_entry(pos, xmpp_handlist_t, dlist);
 
-        // 如果设置了user_only，则只重置外部的计时器
+        // 如果设置了user_only，则只重置外部的计时器. 时间轮重置是O(1)的
         if ((user_only && pos_item->user_handler) || !user_only) {
-            evtimer_del(pos_item->evtimeout);
-            evtimer_add(pos_item->evtimeout, &pos_item->period);
+            im_timer_add(conn->ctx->timers, &pos_item->timer, pos_item->period * 1000);
         }
     }
 }
@@ -128,6 +325,10 @@ static void _timed_handler_add(xmpp_conn_t *conn,
         return;
     }
 
+    // 上下文没有事件循环
+    if (!conn->ctx->timers)
+        return;
+
     // 分配
     new_item = xmpp_alloc(conn->ctx, sizeof(xmpp_handlist_t));
     if (!new_item)
@@ -140,15 +341,9 @@ static void _timed_handler_add(xmpp_conn_t *conn,
     new_item->enabled = 0;
 
     // 设置定时器
-    memset(&new_item->period, 0, sizeof(new_item->period));
-    new_item->period.tv_sec = period;
-    new_item->evtimeout = event_new(conn->ctx->base, -1, EV_TIMEOUT | EV_PERSIST, _handler_timer_proxy,
-                                    new_item);
-    if (!new_item->evtimeout) {
-        xmpp_free(conn->ctx, new_item);
-        return;
-    }
-    evtimer_add(new_item->evtimeout, &new_item->period);
+    new_item->period = period;
+    im_timer_init(&new_item->timer, _handler_timer_proxy, new_item);
+    im_timer_add(conn->ctx->timers, &new_item->timer, period * 1000);
 
     // 加入链表
     INIT_LIST_HEAD(&(new_item->dlist));
@@ -175,8 +370,7 @@ static void _handler_timed_free(xmpp_handlist_t *target)
     list_del(&target->dlist);
 
     // 释放定时器
-    evtimer_del(target->evtimeout);
-    event_free(target->evtimeout);
+    im_timer_del(target->conn->ctx->timers, &target->timer);
     xmpp_free(target->conn->ctx, target);
 }
 
@@ -256,6 +450,11 @@ static void _handler_id_free(xmpp_handlist_t *head, xmpp_handlist_t *item, const
     if (item == NULL) {
         list_for_each_safe(pos, tmp, &head->dlist) {
             pos_item = list_entry(pos, xmpp_handlist_t, dlist);
+            // 最后一个释放以后表头也释放了, 不能再访问
+            if (tmp == &head->dlist) {
+                _handler_id_free(head, pos_item, id);
+                break;
+            }
             _handler_id_free(head, pos_item, id);
         }
     } else {
@@ -271,12 +470,27 @@ static void _handler_id_free(xmpp_handlist_t *head, xmpp_handlist_t *item, const
     }
 }
 
+// 匹配条件用原子保存, 和解析出来的stanza比较的时候只需要比较指针
+static char *_handler_strdup(xmpp_ctx_t *ctx, const char *s)
+{
+    const char *atom = atom_intern(ctx, s, strlen(s));
+    if (atom)
+        return (char *)atom;
+    return xmpp_strdup(ctx, s);
+}
+
+static void _handler_strfree(xmpp_ctx_t *ctx, char *s)
+{
+    if (s && !atom_is(ctx, s))
+        xmpp_free(ctx, s);
+}
+
 static void _handler_add(xmpp_conn_t *conn, xmpp_handler handler, const char *ns,
                          const char *name,
                          const char *type, void *userdata, int user_handler)
 {
-    xmpp_handlist_t *new_item = NULL, *head_item = NULL, *pos_item = NULL;
-    struct list_head *pos = NULL;
+    xmpp_handlist_t *new_item = NULL, *head_item = NULL;
+    struct list_head *bucket;
 
     // handler唯一性
     head_item = &conn->handlers;
@@ -299,7 +513,7 @@ static void _handler_add(xmpp_conn_t *conn, xmpp_handler handler, const char *ns
     new_item->type = NULL;
 
     if (ns) {
-        new_item->ns = xmpp_strdup(conn->ctx, ns);
+        new_item->ns = _handler_strdup(conn->ctx, ns);
         if (!new_item->ns) {
             xmpp_free(conn->ctx, new_item);
             return;
@@ -307,24 +521,37 @@ static void _handler_add(xmpp_conn_t *conn, xmpp_handler handler, const char *ns
     }
 
     if (name) {
-        new_item->name = xmpp_strdup(conn->ctx, name);
+        new_item->name = _handler_strdup(conn->ctx, name);
         if (!new_item->name) {
-            if (new_item->ns) xmpp_free(conn->ctx, new_item->ns);
+            _handler_strfree(conn->ctx, new_item->ns);
             xmpp_free(conn->ctx, new_item);
             return;
         }
     }
 
     if (type) {
-        new_item->type = xmpp_strdup(conn->ctx, type);
+        new_item->type = _handler_strdup(conn->ctx, type);
         if (!new_item->type) {
-            if (new_item->ns) xmpp_free(conn->ctx, new_item->ns);
-            if (new_item->name) xmpp_free(conn->ctx, new_item->name);
+            _handler_strfree(conn->ctx, new_item->ns);
+            _handler_strfree(conn->ctx, new_item->name);
             xmpp_free(conn->ctx, new_item);
             return;
         }
     }
 
+    // 加入派发索引
+    bucket = _handler_bucket_get(conn, new_item, 1);
+    if (!bucket) {
+        _handler_strfree(conn->ctx, new_item->ns);
+        _handler_strfree(conn->ctx, new_item->name);
+        _handler_strfree(conn->ctx, new_item->type);
+        xmpp_free(conn->ctx, new_item);
+        return;
+    }
+    new_item->seq = conn->handler_seq++;
+    new_item->deleted = 0;
+    list_add_tail(&new_item->index, bucket);
+
     // 入表
     head_item = &conn->handlers;
     INIT_LIST_HEAD(&new_item->dlist);
@@ -347,25 +574,49 @@ void xmpp_handler_delete(xmpp_conn_t *conn, xmpp_handler handler)
     }
 }
 
-static void _handler_free(xmpp_handlist_t *target)
+static void _handler_release(xmpp_handlist_t *target)
 {
     xmpp_ctx_t *ctx = target->conn->ctx;
-    list_del(&target->dlist);
 
     // 释放分配的值
-    if (target->ns)
-        xmpp_free(ctx, target->ns);
-    if (target->name)
-        xmpp_free(ctx, target->name);
-    if (target->type)
-        xmpp_free(ctx, target->type);
+    _handler_strfree(ctx, target->ns);
+    _handler_strfree(ctx, target->name);
+    _handler_strfree(ctx, target->type);
     xmpp_free(ctx, target);
 }
 
+static void _handler_free(xmpp_handlist_t *target)
+{
+    xmpp_conn_t *conn = target->conn;
+
+    list_del(&target->dlist);
+    list_del(&target->index);
+    _handler_bucket_put(conn, target);
+
+    if (conn->dispatching) {
+        // 候选数组里面可能还有这个handler, 派发结束以后再释放
+        target->deleted = 1;
+        list_add_tail(&target->dlist, &conn->handlers_deleted);
+        return;
+    }
+    _handler_release(target);
+}
+
+static void _handler_free_deleted(xmpp_conn_t *conn)
+{
+    xmpp_handlist_t *pos_item;
+    struct list_head *pos, *tmp;
+
+    list_for_each_safe(pos, tmp, &conn->handlers_deleted) {
+        pos_item = list_entry(pos, xmpp_handlist_t, dlist);
+        list_del(&pos_item->dlist);
+        _handler_release(pos_item);
+    }
+}
+
 
 void handler_clear_all(xmpp_conn_t *conn)
 {
-    xmpp_ctx_t *ctx = NULL;
     xmpp_handlist_t *head_item = NULL, *pos_item = NULL;
     struct list_head *pos = NULL, *tmp = NULL;
     hash_iterator_t *iter = NULL;
@@ -393,6 +644,9 @@ void handler_clear_all(xmpp_conn_t *conn)
         pos_item = list_entry(pos, xmpp_handlist_t, dlist);
         _handler_free(pos_item);
     }
+    _handler_free_deleted(conn);
+    hash_release(conn->handlers_by_name);
+    hash_release(conn->handlers_by_ns);
 }
 
 void xmpp_timed_handler_add(xmpp_conn_t *conn, xmpp_timed_handler handler,
@@ -6,8 +6,10 @@
 
 #include <event2/event.h>
 #include <event2/util.h>
+#include <event2/buffer.h>
 #include <event2/bufferevent.h>
 #include <event2/bufferevent_ssl.h>
+#include <event2/dns.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -19,6 +21,7 @@
 #include "mm.h"
 #include "hash.h"
 #include "stringutils.h"
+#include "im-timer.h"
 
 #include "xmpp.h"
 #include "xmpp-parser.h"
@@ -36,14 +39,72 @@ typedef enum {
     XMPP_LOOP_QUIT
 } xmpp_loop_status_t;
 
+// 原子字符串表, 每个上下文一份
+// 元素名, 命名空间, 属性名这些反复出现的字符串只保存一份, 都放在space这一块内存里面,
+// 所以判断一个指针是不是原子只需要比较地址范围. 表满了以后不再添加, 调用者自己拷贝
+#define XMPP_ATOM_SLOTS 1024                // 开放寻址的槽数, 2的幂
+#define XMPP_ATOM_MAX 512                   // 最多的原子数量
+#define XMPP_ATOM_SPACE 16384               // 字符串总长度
+#define XMPP_ATOM_MAX_LEN 128               // 超过这个长度的字符串不做成原子
+
+typedef struct _xmpp_atom_slot_t {
+    const char *str;
+    uint32_t len;
+    uint32_t hash;
+} xmpp_atom_slot_t;
+
+typedef struct _xmpp_atoms_t {
+    char *space;
+    size_t used;
+    int count;
+    // 解析器和stanza直接使用的原子
+    const char *xmlns;
+    const char *type;
+    const char *id;
+    xmpp_atom_slot_t slots[XMPP_ATOM_SLOTS];
+} xmpp_atoms_t;
+
 // xmpp运行上下文对象
+// 可以被多个连接共享, 所有连接都在base所属的线程上运行. log创建以后只读,
+// ssl_ctx在fork出来的上下文之间共享, 只用来创建SSL对象
 struct _xmpp_ctx_t {
     xmpp_loop_status_t loop_status;    // 事件循环状态
     struct event_base *base;           // 事件循环
     SSL_CTX *ssl_ctx;                  // ssl上下文环境
     const xmpp_log_t *log;             // 日志管理
+    im_timer_wheel_t *timers;          // 定时handler的时间轮, 所有连接共用
+    struct evdns_base *dns;            // 异步域名解析, 和base在同一个线程
+    xmpp_atoms_t *atoms;               // 原子字符串表, 只在base所属的线程上使用
+    volatile long ref;                 // 引用计数, 每个连接持有一个引用
 };
 
+// 原子表
+xmpp_atoms_t *atoms_new(void);
+void atoms_free(xmpp_atoms_t *atoms);
+// 返回s对应的原子, 不存在的话添加, 表满了或者太长返回NULL
+const char *atom_intern(xmpp_ctx_t *ctx, const char *s, size_t len);
+
+// p是不是这个上下文的原子
+static inline int atom_is(const xmpp_ctx_t *ctx, const char *p)
+{
+    const xmpp_atoms_t *atoms = ctx->atoms;
+    return atoms && (uintptr_t)p >= (uintptr_t)atoms->space &&
+           (uintptr_t)p < (uintptr_t)atoms->space + XMPP_ATOM_SPACE;
+}
+
+// 比较两个字符串, 两个都是原子的时候只比较指针
+static inline int atom_equal(const xmpp_ctx_t *ctx, const char *a, const char *b)
+{
+    if (a == b)
+        return 1;
+    if (atom_is(ctx, a) && atom_is(ctx, b))
+        return 0;
+    return strcmp(a, b) == 0;
+}
+
+// 上下文的原子, 没有原子表的时候用字符串本身
+#define XMPP_ATOM(ctx, field) ((ctx)->atoms ? (ctx)->atoms->field : #field)
+
 //日志管理helper
 void xmpp_log(const xmpp_ctx_t *ctx, xmpp_log_level_t level, const char *area,
               const char *fmt, va_list ap);
@@ -86,8 +147,8 @@ struct _xmpp_handlist_t {
     union {
         /* timed handlers */
         struct {
-            struct timeval period;           // 触发间隔
-            struct event *evtimeout;
+            unsigned long period;            // 触发间隔, 秒
+            im_timer_t timer;                // 挂在上下文的时间轮上
         };
         /* id handlers */
         struct {
@@ -98,6 +159,9 @@ struct _xmpp_handlist_t {
             char *ns;
             char *name;
             char *type;
+            unsigned long seq;               // 添加的顺序, 派发的时候按这个顺序调用
+            int deleted;                     // 派发期间删除, 派发结束以后释放
+            struct list_head index;          // 所在的派发索引桶
         };
     };
 };
@@ -105,6 +169,17 @@ struct _xmpp_handlist_t {
 // 支持的SASL认证方式
 #define SASL_MASK_PLAIN 0x01
 #define SASL_MASK_DIGESTMD5 0x02
+#define SASL_MASK_SCRAMSHA1 0x04
+#define SASL_MASK_SCRAMSHA256 0x08
+#define SASL_MASK_SCRAMSHA1_PLUS 0x10
+#define SASL_MASK_SCRAMSHA256_PLUS 0x20
+#define SASL_MASK_SCRAM (SASL_MASK_SCRAMSHA1 | SASL_MASK_SCRAMSHA256 | \
+                         SASL_MASK_SCRAMSHA1_PLUS | SASL_MASK_SCRAMSHA256_PLUS)
+
+// XEP-0440服务器声明支持的通道绑定类型
+#define SASL_CB_TLS_UNIQUE 0x01
+#define SASL_CB_TLS_EXPORTER 0x02
+#define SASL_CB_TLS_SERVER_END_POINT 0x04
 
 // stream流开启的回调函数签名
 typedef void(*xmpp_open_handler)(xmpp_conn_t *const conn);
@@ -120,11 +195,23 @@ struct _xmpp_conn_t {
     unsigned long respond_timeout;         // 超时限制
     xmpp_stream_error_t *stream_error;     // 最后的错误对象
     struct bufferevent *evbuffer;
+    struct evbuffer *input;                // 从bufferevent移过来等待解析的数据
+    struct _xmpp_connector_t *connector;  // 正在解析和尝试连接, 连上以后释放
 
     int tls_disabled;                     // 客户端是否允许tls
     int tls_support;                      // 是否支持tls
     int sasl_support;                     // 支持什么sasl
+    int sasl_cb_types;                    // 服务器声明的通道绑定类型, 0表示没有声明
+    struct _sasl_scram_t *scram;          // 正在进行的SCRAM认证
+    int sasl2_support;                    // 服务器支持XEP-0388 SASL2
+    int bind2_support;                    // SASL2里面可以带XEP-0386 Bind2
+    int bind2_sm;                         // Bind2里面可以启用流管理
+    int sasl2;                            // 正在用SASL2认证
     int zlib_support;                     // 支持zlib压缩否
+    int compressed;                       // 已经启用了压缩
+    int compress_level;                   // zlib压缩等级1-9, 0表示不压缩
+    unsigned long compress_flush_delay;   // 压缩输出延迟flush的毫秒数, 0表示每次写都flush
+    struct _xmpp_zlib_t *zlib;            // 压缩过滤器的状态, 过滤器释放的时候释放
     int secured;                          // 是否是安全连接
     int tls_failed;                       // 建立tls失败了
     int bind_required;                    // 服务器强制要求绑定资源
@@ -152,6 +239,33 @@ struct _xmpp_conn_t {
     xmpp_handlist_t handlers;
     hash_t *id_handlers;
 
+    // 普通handler的派发索引, 有name的按name分桶, 只有ns的按ns分桶, 都没有的放在一起
+    hash_t *handlers_by_name;
+    hash_t *handlers_by_ns;
+    struct list_head handlers_any;
+    unsigned long handler_seq;
+    int dispatching;                      // 正在派发的层数
+    struct list_head handlers_deleted;    // 派发期间删除的handler
+
+    // 等待应答的异步IQ, 按id索引, 同时按发送顺序链起来
+    hash_t *iq_pending;
+    struct list_head iq_list;
+    unsigned long iq_seq;                 // 自动生成id的序号
+
+    // XEP-0198流管理, 队列和流id断线以后保留, 用来恢复流
+    int sm_support;                       // 服务器支持流管理
+    int sm_enabled;                       // 从发出<enable/>开始发出的stanza要等确认
+    int sm_inbound;                       // 从收到<enabled/>开始给收到的stanza计数
+    int sm_resuming;                      // 已经发出<resume/>等待结果
+    int sm_resumed;                       // 最近一次握手是恢复的流
+    char *sm_id;                          // 可以恢复的流id
+    uint32_t sm_handled;                  // 收到的stanza数量
+    uint32_t sm_acked;                    // 服务器确认的stanza数量
+    struct list_head sm_queue;            // 还没有确认的stanza, 按发送顺序
+    int sm_queue_len;
+    int sm_unrequested;                   // 上一次<r/>以后发出的stanza数量
+    im_timer_t sm_timer;                  // 不够一批的时候延迟请求确认
+    struct evbuffer *sm_buf;              // 序列化用的暂存缓冲区
 
     // 连接回调函数（外部接口）
     xmpp_conn_handler conn_handler;
@@ -169,9 +283,45 @@ void conn_start_ssl(xmpp_conn_t *conn);
 // 启用zlib压缩
 int conn_start_compression(xmpp_conn_t *conn);
 
+// 压缩流里面单个stanza解压以后的最大长度, 超过的按解析错误断开, 防止压缩炸弹
+#define XMPP_ZLIB_STANZA_MAX (4 * 1024 * 1024)
+
+// xmpp-zlib.c, 在underlying上面叠一层zlib过滤器
+struct bufferevent *zlib_filter_new(xmpp_conn_t *conn, struct bufferevent *underlying);
+// 连接断开以后过滤器不再访问连接
+void zlib_filter_detach(xmpp_conn_t *conn);
+
 // 设置xmpp_open_handler并且重置解析器
 void conn_reset_stream(xmpp_conn_t *conn, xmpp_open_handler handler);
 
+// 解析或者所有连接尝试都失败了
+void conn_connect_failed(xmpp_conn_t *conn, int error);
+
+// 连接尝试成功, 接管bufferevent
+void conn_established(xmpp_conn_t *conn, struct bufferevent *bev);
+
+// 开始解析SRV和地址, 然后按happy eyeballs并行尝试连接, 结果通过上面两个函数报告
+int connect_start(xmpp_conn_t *conn, const char *altdomain, unsigned short altport);
+
+// 取消正在进行的解析和连接尝试, 不会回调
+void connect_cancel(xmpp_conn_t *conn);
+
+// 正在进行的连接尝试数量
+int connect_attempt_count(xmpp_conn_t *conn);
+
+// 打开SSL_CTX的客户端会话缓存, 新的会话和ticket放进进程共享的缓存
+void tls_ctx_init(SSL_CTX *ssl_ctx);
+
+// 创建SSL对象, 设置SNI, 有缓存的会话的话带上做简短握手
+SSL *tls_new(xmpp_conn_t *conn);
+
+// 握手完成, 统计是否复用了会话
+void tls_handshake_done(xmpp_conn_t *conn, SSL *ssl);
+
+// 取连接的TLS通道绑定数据, TLS 1.3用tls-exporter, 以前的版本用tls-unique
+// types是服务器声明的类型, 0表示不限制. 成功返回类型名, buf至少要有64字节
+const char *tls_channel_binding(xmpp_conn_t *conn, int types, unsigned char *buf, size_t *len);
+
 // xmpp stanza类型
 typedef enum {
     XMPP_STANZA_UNKNOWN,
@@ -179,6 +329,17 @@ typedef enum {
     XMPP_STANZA_TAG
 } xmpp_stanza_type_t;
 
+// 属性, key和value在同一块内存里面
+typedef struct _xmpp_attr_t {
+    char *key;
+    char *value;
+} xmpp_attr_t;
+
+// 大部分元素只有0到4个属性, 直接放在stanza里面
+#define XMPP_STANZA_INLINE_ATTRS 4
+// 属性超过这个数量以后建立hash索引, 之前线性查找
+#define XMPP_STANZA_ATTR_INDEX 16
+
 // xmpp stanza对象
 struct _xmpp_stanza_t {
     int ref;
@@ -191,12 +352,68 @@ struct _xmpp_stanza_t {
     xmpp_stanza_t *parent;
 
     char *data;
-    hash_t *attributes;
+
+    // 属性按添加顺序保存, 序列化的结果是确定的
+    xmpp_attr_t *attrs;
+    int attr_count;
+    int attr_capacity;
+    xmpp_attr_t inline_attrs[XMPP_STANZA_INLINE_ATTRS];
+    hash_t *attr_index;                   // key -> 下标+1
+
+    // 解析器生成的stanza整个树都从线性分配器分配, 处理完以后一次回收
+    // 这种stanza释放不做任何事, 需要保留的话用xmpp_stanza_clone或者xmpp_stanza_copy拷贝出来
+    mem_arena_t *arena;
 };
 
+// 从线性分配器新建stanza, 之后设置的名字、属性和文本都从同一个分配器分配
+xmpp_stanza_t *stanza_new_arena(xmpp_ctx_t *ctx, mem_arena_t *arena);
+
+// 回收线性分配器之前调用, 释放处理过程中挂到树上的普通stanza
+void stanza_arena_release(xmpp_stanza_t *stanza);
+
+// 只用于线性分配器上的stanza, 直接引用name, key, value, 不拷贝
+// 调用者保证字符串比分配器活得长, 比如原子或者同一个分配器分配的字符串
+int stanza_set_name_nocopy(xmpp_stanza_t *stanza, const char *name);
+int stanza_set_attribute_nocopy(xmpp_stanza_t *stanza, const char *key, const char *value);
+
+// 一次遍历直接序列化到evbuffer, 出错的时候可能已经写入了一部分
+int stanza_render(xmpp_stanza_t *stanza, struct evbuffer *out);
+
 // 触发stanza回调
 void handler_fire_stanza(xmpp_conn_t *conn, xmpp_stanza_t *stanza);
 
+// 异步IQ的应答, 返回1表示已经交给等待的请求处理
+int iq_fire_stanza(xmpp_conn_t *conn, xmpp_stanza_t *stanza);
+
+// 连接断开或者释放的时候结束所有等待应答的异步IQ
+void iq_cancel_all(xmpp_conn_t *conn);
+
+// 流管理的<r/> <a/> <enabled/> <resumed/> <failed/>返回1, 其他stanza计数以后返回0
+int sm_fire_stanza(xmpp_conn_t *conn, xmpp_stanza_t *stanza);
+
+// 启用了流管理的话序列化进队列再发送, 返回1; 不需要确认的返回0, 出错返回XMPP_EMEM等
+int sm_send(xmpp_conn_t *conn, xmpp_stanza_t *stanza);
+
+// sasl以后有可以恢复的流而且服务器支持, 发出<resume/>返回1, 否则返回0
+int sm_resume(xmpp_conn_t *conn);
+
+// 资源绑定完成, 服务器支持的话启用流管理, 再重发上一个流没有确认的stanza
+void sm_established(xmpp_conn_t *conn);
+
+// SASL2认证的时候一起发的<resume/>, 没有可以恢复的流返回NULL
+xmpp_stanza_t *sm_make_resume(xmpp_conn_t *conn);
+
+// Bind2绑定完成, result是<bound/>里面的<enabled/>或者<failed/>, 没有的话单独启用流管理
+void sm_established_inline(xmpp_conn_t *conn, xmpp_stanza_t *result);
+
+// 连接断开, 保留队列和流id
+void sm_disconnected(xmpp_conn_t *conn);
+
+// 主动断开以后流不再恢复, 丢掉队列和流id
+void sm_reset(xmpp_conn_t *conn);
+void sm_init(xmpp_conn_t *conn);
+void sm_free(xmpp_conn_t *conn);
+
 // 所有定时器handler重新开始计事件
 void handler_reset_timed(xmpp_conn_t *conn, int user_only);
 
@@ -214,6 +431,9 @@ void handler_clear_all(xmpp_conn_t *conn);
 // 连接建立，处理stanza流入口
 void auth_handle_open(xmpp_conn_t *conn);
 
+// 绑定资源, 流恢复失败的时候从这里继续
+void auth_bind(xmpp_conn_t *conn);
+
 // hash释放回调
 void xmpp_hash_free(void* p);
 
@@ -0,0 +1,204 @@
+/* xmpp-iq.c
+ * 异步IQ请求, 自动生成id, 同时可以有任意多个请求在等待应答
+ * 等待应答的请求按id放在连接的hash表里面, 超时挂在上下文的时间轮上
+ */
+#include "xmpp-inl.h"
+
+// 自动生成的id前缀, 后面跟连接内递增的序号
+#define XMPP_IQ_ID_PREFIX "aiq"
+
+// 等待应答的请求
+typedef struct _xmpp_iq_pending_t {
+    xmpp_conn_t *conn;
+    xmpp_iq_handler handler;
+    void *userdata;
+    im_timer_t timer;
+    struct list_head node;   // 按发送顺序挂在conn->iq_list上
+    char *to;                // 请求的to, 没有的话是NULL, 放在id后面
+    char id[1];              // id字符串, 和结构一起分配
+} xmpp_iq_pending_t;
+
+// 两个jid是否相同, 资源以前的部分不区分大小写
+static int _iq_jid_equal(const char *a, const char *b)
+{
+    size_t la = strcspn(a, "/"), lb = strcspn(b, "/");
+
+    return la == lb && im_strnicmp(a, b, la) == 0 && strcmp(a + la, b + lb) == 0;
+}
+
+// jid是不是自己的账号或者服务器: 空, 绑定的完整jid, bare jid或者域名
+static int _iq_jid_is_self(xmpp_conn_t *conn, const char *jid)
+{
+    const char *account = conn->bound_jid ? conn->bound_jid : conn->jid;
+
+    if (!jid || !*jid)
+        return 1;
+    if (conn->bound_jid && _iq_jid_equal(jid, conn->bound_jid))
+        return 1;
+    if (account && !strchr(jid, '/') && strcspn(account, "/") == strlen(jid) &&
+        im_strnicmp(jid, account, strlen(jid)) == 0)
+        return 1;
+    return conn->domain && im_stricmp(jid, conn->domain) == 0;
+}
+
+// 应答必须来自请求发往的地址, 防止别人按猜到的id伪造应答.
+// 发给服务器或者自己账号的请求由服务器代答, from可以没有或者是自己的账号
+static int _iq_from_matches(xmpp_conn_t *conn, xmpp_iq_pending_t *pending, const char *from)
+{
+    if (!pending->to || _iq_jid_is_self(conn, pending->to))
+        return _iq_jid_is_self(conn, from);
+    return from && _iq_jid_equal(from, pending->to);
+}
+
+// 从hash表和链表上摘下, 之后只能调用一次handler
+static void _iq_unlink(xmpp_iq_pending_t *pending)
+{
+    xmpp_conn_t *conn = pending->conn;
+
+    hash_drop(conn->iq_pending, pending->id);
+    list_del(&pending->node);
+    if (conn->ctx->timers)
+        im_timer_del(conn->ctx->timers, &pending->timer);
+}
+
+// 摘下以后回调, handler里面可以继续发送新的请求
+static void _iq_complete(xmpp_iq_pending_t *pending, int status, xmpp_stanza_t *stanza)
+{
+    _iq_unlink(pending);
+    pending->handler(pending->conn, status, stanza, pending->userdata);
+    xmpp_free(pending->conn->ctx, pending);
+}
+
+static void _iq_timeout(im_timer_t *timer, void *userdata)
+{
+    xmpp_iq_pending_t *pending = userdata;
+
+    xmpp_debug(pending->conn->ctx, "xmpp", "IQ %s timed out.", pending->id);
+    _iq_complete(pending, XMPP_IQ_TIMEOUT, NULL);
+}
+
+int xmpp_iq_send_async(xmpp_conn_t *conn, xmpp_stanza_t *iq, unsigned long timeout,
+                       xmpp_iq_handler handler, void *userdata)
+{
+    xmpp_iq_pending_t *pending;
+    const char *name, *type, *id, *to;
+    char genid[32];
+    size_t len, to_len;
+
+    if (!iq || !handler || conn->state != XMPP_STATE_CONNECTED)
+        return XMPP_EINVOP;
+
+    // 只有get和set需要应答
+    name = xmpp_stanza_get_name_ptr(iq);
+    type = xmpp_stanza_get_type_ptr(iq);
+    if (!name || strcmp(name, "iq") != 0 ||
+        !type || (strcmp(type, "get") != 0 && strcmp(type, "set") != 0))
+        return XMPP_EINVOP;
+
+    // 没有id的话生成一个
+    id = xmpp_stanza_get_id_ptr(iq);
+    if (!id) {
+        sprintf(genid, XMPP_IQ_ID_PREFIX "%lu", ++conn->iq_seq);
+        if (xmpp_stanza_set_id(iq, genid) != XMPP_EOK)
+            return XMPP_EMEM;
+        id = genid;
+    }
+
+    len = strlen(id);
+    to = xmpp_stanza_get_attribute(iq, "to");
+    to_len = to ? strlen(to) + 1 : 0;
+    pending = xmpp_alloc(conn->ctx, sizeof(xmpp_iq_pending_t) + len + to_len);
+    if (!pending)
+        return XMPP_EMEM;
+    pending->conn = conn;
+    pending->handler = handler;
+    pending->userdata = userdata;
+    memcpy(pending->id, id, len + 1);
+    pending->to = NULL;
+    if (to) {
+        pending->to = pending->id + len + 1;
+        memcpy(pending->to, to, to_len);
+    }
+
+    // 同一个id已经在等待应答
+    if (hash_add(conn->iq_pending, pending->id, pending) != 0) {
+        xmpp_free(conn->ctx, pending);
+        return XMPP_EINVOP;
+    }
+    list_add_tail(&pending->node, &conn->iq_list);
+
+    // 上下文没有事件循环的话不会超时
+    im_timer_init(&pending->timer, _iq_timeout, pending);
+    if (conn->ctx->timers)
+        im_timer_add(conn->ctx->timers, &pending->timer,
+                     timeout ? timeout : conn->respond_timeout * 1000);
+
+    // 先登记再发送, 发送失败断开连接的时候handler已经以XMPP_IQ_CANCELED调用过了
+    xmpp_send(conn, iq);
+    return XMPP_EOK;
+}
+
+int xmpp_iq_cancel(xmpp_conn_t *conn, const char *id)
+{
+    xmpp_iq_pending_t *pending = hash_get(conn->iq_pending, id);
+
+    if (!pending)
+        return XMPP_EINVOP;
+
+    // 主动取消不回调
+    _iq_unlink(pending);
+    xmpp_free(conn->ctx, pending);
+    return XMPP_EOK;
+}
+
+int xmpp_iq_pending_count(xmpp_conn_t *conn)
+{
+    return hash_num_keys(conn->iq_pending);
+}
+
+int iq_fire_stanza(xmpp_conn_t *conn, xmpp_stanza_t *stanza)
+{
+    xmpp_iq_pending_t *pending;
+    const char *id, *name, *type, *from;
+
+    if (list_empty(&conn->iq_list))
+        return 0;
+
+    id = xmpp_stanza_get_id_ptr(stanza);
+    if (!id || !(pending = hash_get(conn->iq_pending, id)))
+        return 0;
+
+    // 同样id的请求或者其他stanza不算应答
+    name = xmpp_stanza_get_name_ptr(stanza);
+    type = xmpp_stanza_get_type_ptr(stanza);
+    if (!name || strcmp(name, "iq") != 0 || !type)
+        return 0;
+
+    // 发送方不对的当作普通stanza交给handler
+    from = xmpp_stanza_get_attribute(stanza, "from");
+    if (!_iq_from_matches(conn, pending, from)) {
+        xmpp_warn(conn->ctx, "xmpp", "IQ %s answered from unexpected address %s.", id,
+                  from ? from : "(none)");
+        return 0;
+    }
+
+    if (strcmp(type, "result") == 0) {
+        _iq_complete(pending, XMPP_IQ_RESULT, stanza);
+    } else if (strcmp(type, "error") == 0) {
+        _iq_complete(pending, XMPP_IQ_ERROR, stanza);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+void iq_cancel_all(xmpp_conn_t *conn)
+{
+    xmpp_iq_pending_t *pending;
+
+    // handler里面发送的新请求在断开的连接上会失败, 不会再挂上来
+    while (!list_empty(&conn->iq_list)) {
+        pending = list_first_entry(&conn->iq_list, xmpp_iq_pending_t, node);
+        _iq_complete(pending, XMPP_IQ_CANCELED, NULL);
+    }
+}
@@ -19,6 +19,13 @@ struct _parser_t {
     int depth;
     xmpp_stanza_t *stanza;
     
+    // 已经交给expat的字节数, 和当前顶层stanza开始的位置
+    XML_Index fed;
+    XML_Index stanza_start;
+    
+    // 当前顶层stanza的整个树都从这里分配, stanza回调返回以后一次回收
+    mem_arena_t *arena;
+    
     int reset;
 };
 
@@ -30,57 +37,92 @@ static inline void disconnect_parser_error(xmpp_conn_t *conn)
 
 #define PARSER_ERROR_RETURN(conn) disconnect_parser_error(conn); return;
 
-static char *_xml_name(xmpp_ctx_t *ctx, const char *nsname)
+// 名字总是在分隔符后面直到结尾, 直接返回原字符串里面的位置
+static const char *_xml_name(const char *nsname)
 {
-    char *result = NULL;
     const char *c;
-    int len;
     
     c = strchr(nsname, NAMESPACE_SEP);
     if (c == NULL)
-        return xmpp_strdup(ctx, nsname);
-        
-    c++;
-    len = strlen(c);
-    result = xmpp_alloc(ctx, len + 1);
-    if (result != NULL) {
-        memcpy(result, c, len);
-        result[len] = '\0';
-    }
-    
-    return result;
+        return nsname;
+    return c + 1;
+}
+
+// 优先使用上下文的原子, 原子表满了再从分配器拷贝
+static const char *_parser_atom(parser_t *parser, const char *s, size_t len)
+{
+    const char *atom = atom_intern(parser->conn->ctx, s, len);
+    if (atom)
+        return atom;
+    return arena_strndup(parser->arena, s, len);
 }
 
-static char *_xml_namespace(xmpp_ctx_t *ctx, const char *nsname)
+static const char *_xml_namespace(parser_t *parser, const char *nsname)
 {
-    char *result = NULL;
     const char *c;
     
     c = strchr(nsname, NAMESPACE_SEP);
-    if (c != NULL) {
-        result = xmpp_alloc(ctx, (c-nsname) + 1);
-        if (result != NULL) {
-            memcpy(result, nsname, (c-nsname));
-            result[c-nsname] = '\0';
-        }
-    }
-    
-    return result;
+    if (c == NULL)
+        return NULL;
+    return _parser_atom(parser, nsname, c - nsname);
 }
 
-static void _set_attributes(xmpp_stanza_t *stanza, const XML_Char **attrs)
+// 属性名都用原子, 值只有type做成原子, 其他的值基本不重复
+static int _set_attributes(parser_t *parser, xmpp_stanza_t *stanza, const XML_Char **attrs)
 {
-    char *attr;
+    xmpp_atoms_t *atoms = parser->conn->ctx->atoms;
+    const char *key, *value;
     int i;
     
     if (!attrs)
-        return;
+        return XMPP_EOK;
         
     for (i = 0; attrs[i]; i += 2) {
-        attr = _xml_name(stanza->ctx, attrs[i]);
-        xmpp_stanza_set_attribute(stanza, attr, attrs[i+1]);
-        xmpp_free(stanza->ctx, attr);
+        key = _xml_name(attrs[i]);
+        key = _parser_atom(parser, key, strlen(key));
+        if (atoms && key == atoms->type)
+            value = _parser_atom(parser, attrs[i+1], strlen(attrs[i+1]));
+        else
+            value = arena_strndup(parser->arena, attrs[i+1], strlen(attrs[i+1]));
+        if (!key || !value || stanza_set_attribute_nocopy(stanza, key, value) != XMPP_EOK)
+            return XMPP_EMEM;
     }
+    return XMPP_EOK;
+}
+
+// 新建一个元素stanza, 名字, 属性和命名空间都不拷贝
+static xmpp_stanza_t *_new_element(parser_t *parser, const char *name, const char *ns,
+                                   const XML_Char **attrs)
+{
+    xmpp_ctx_t *ctx = parser->conn->ctx;
+    xmpp_stanza_t *stanza;
+    
+    stanza = stanza_new_arena(ctx, parser->arena);
+    if (!stanza)
+        return NULL;
+        
+    name = _parser_atom(parser, name, strlen(name));
+    if (!name || stanza_set_name_nocopy(stanza, name) != XMPP_EOK)
+        return NULL;
+    if (_set_attributes(parser, stanza, attrs) != XMPP_EOK)
+        return NULL;
+    if (ns && stanza_set_attribute_nocopy(stanza, XMPP_ATOM(ctx, xmlns), ns) != XMPP_EOK)
+        return NULL;
+    return stanza;
+}
+
+// 回收当前的stanza树
+static void _release_stanza(parser_t *parser)
+{
+    xmpp_stanza_t *root = parser->stanza;
+    
+    if (root) {
+        while (root->parent)
+            root = root->parent;
+        stanza_arena_release(root);
+        parser->stanza = NULL;
+    }
+    arena_reset(parser->arena);
 }
 
 // expat回调
@@ -88,11 +130,13 @@ static void _start_element(void *userdata, const XML_Char *nsname, const XML_Cha
 {
     parser_t *parser = (parser_t *)userdata;
     xmpp_stanza_t *child;
-    char *ns, *name;
+    const char *name;
+    const char *ns = NULL;
     
-    // 把namespace分离
-    ns = _xml_namespace(parser->conn->ctx, nsname);
-    name = _xml_name(parser->conn->ctx, nsname);
+    // 把namespace分离, 第一层只需要名字
+    name = _xml_name(nsname);
+    if (parser->depth > 0)
+        ns = _xml_namespace(parser, nsname);
     
     if (parser->depth == 0) {
         // xml流第一层
@@ -103,36 +147,25 @@ static void _start_element(void *userdata, const XML_Char *nsname, const XML_Cha
     } else {
         // xml流大于等于第二层
         if (!parser->stanza && parser->depth == 1) {
-            parser->stanza = xmpp_stanza_new(parser->conn->ctx);
+            parser->stanza = _new_element(parser, name, ns, attrs);
             if (!parser->stanza) {
                 PARSER_ERROR_RETURN(parser->conn);
             }
-            xmpp_stanza_set_name(parser->stanza, name);
-            _set_attributes(parser->stanza, attrs);
-            if (ns)
-                xmpp_stanza_set_ns(parser->stanza, ns);
+            parser->stanza_start = XML_GetCurrentByteIndex(parser->expat);
                 
         } else if (parser->depth > 1 && parser->stanza) {
-            child = xmpp_stanza_new(parser->conn->ctx);
+            child = _new_element(parser, name, ns, attrs);
             if (!child) {
                 PARSER_ERROR_RETURN(parser->conn);
             }
-            xmpp_stanza_set_name(child, name);
-            _set_attributes(child, attrs);
-            if (ns)
-                xmpp_stanza_set_ns(child, ns);
                 
             xmpp_stanza_add_child(parser->stanza, child);
-            xmpp_stanza_release(child);
             parser->stanza = child;
         } else {
             PARSER_ERROR_RETURN(parser->conn);
         }
     }
     
-    if (ns) xmpp_free(parser->conn->ctx, ns);
-    if (name) xmpp_free(parser->conn->ctx, name);
-    
     parser->depth++;
 }
 
@@ -155,8 +188,8 @@ static void _end_element(void *userdata, const XML_Char *name)
             if (parser->stanzacb)
                 parser->stanzacb(parser->stanza, parser->userdata);
                 
-            xmpp_stanza_release(parser->stanza);
-            parser->stanza = NULL;
+            // 整个树一次回收, handler需要保留的话已经拷贝出去了
+            _release_stanza(parser);
         }
     }
 }
@@ -172,14 +205,13 @@ static void _characters(void *userdata, const XML_Char *s, int len)
         PARSER_ERROR_RETURN(parser->conn);
     }
     
-    stanza = xmpp_stanza_new(parser->conn->ctx);
+    stanza = stanza_new_arena(parser->conn->ctx, parser->arena);
     if (!stanza) {
         PARSER_ERROR_RETURN(parser->conn);
     }
     xmpp_stanza_set_text_safe(stanza, s, len);
     
     xmpp_stanza_add_child(parser->stanza, stanza);
-    xmpp_stanza_release(stanza);
 }
 
 // 新建一个解析器
@@ -201,7 +233,14 @@ parser_t *parser_new(xmpp_conn_t *conn,
         parser->userdata = userdata;
         parser->depth = 0;
         parser->stanza = NULL;
+        parser->fed = 0;
+        parser->stanza_start = 0;
         parser->reset = 0;
+        parser->arena = arena_new(ARENA_CHUNK_SIZE);
+        if (!parser->arena) {
+            xmpp_free(conn->ctx, parser);
+            return NULL;
+        }
         parser_reset(parser);
     }
     
@@ -214,6 +253,8 @@ void parser_free(parser_t *parser)
     if (parser->expat)
         XML_ParserFree(parser->expat);
         
+    _release_stanza(parser);
+    arena_free(parser->arena);
     xmpp_free(parser->conn->ctx, parser);
 }
 
@@ -223,8 +264,8 @@ static void _defer_parser_reset(parser_t *parser)
     if (parser->expat)
         XML_ParserFree(parser->expat);
         
-    if (parser->stanza)
-        xmpp_stanza_release(parser->stanza);
+    // 丢弃没有解析完的stanza
+    _release_stanza(parser);
         
     parser->expat = XML_ParserCreateNS(NULL, NAMESPACE_SEP);
     if (!parser->expat) {
@@ -233,6 +274,8 @@ static void _defer_parser_reset(parser_t *parser)
     
     parser->depth = 0;
     parser->stanza = NULL;
+    parser->fed = 0;
+    parser->stanza_start = 0;
     
     XML_SetUserData(parser->expat, parser);
     XML_SetElementHandler(parser->expat, _start_element, _end_element);
@@ -251,9 +294,21 @@ int parser_reset(parser_t *parser)
 // 解析xml流字符串
 int parser_feed(parser_t *parser, char *chunk, int len)
 {
+    int ret;
+    
     if (parser->reset) {
         _defer_parser_reset(parser);
     }
-    return XML_Parse(parser->expat, chunk, len, 0);
+    ret = XML_Parse(parser->expat, chunk, len, 0);
+    parser->fed += len;
+    
+    // 压缩流解压出来的stanza太大, 多半是压缩炸弹
+    if (ret && parser->stanza && parser->conn->compressed &&
+        parser->fed - parser->stanza_start > XMPP_ZLIB_STANZA_MAX) {
+        xmpp_error(parser->conn->ctx, "xmpp", "Inflated stanza exceeds %d bytes.",
+                   XMPP_ZLIB_STANZA_MAX);
+        return 0;
+    }
+    return ret;
 }
 
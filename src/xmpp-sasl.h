@@ -1,5 +1,5 @@
 /* sasl.h
- * sasl认证支持 plain、digest md5
+ * sasl认证支持 plain、digest md5、scram-sha-1、scram-sha-256和它们的-PLUS通道绑定
  */
 
 #ifndef __IMCORE_XMPP_SASL_H__
@@ -10,4 +10,26 @@
 char *sasl_plain(xmpp_ctx_t *ctx, const char *authid, const char *password);
 char *sasl_digest_md5(xmpp_ctx_t *ctx, const char *challenge, const char *jid, const char *password);
 
+// SCRAM认证的状态, 从发出client-first-message到校验服务器签名
+typedef struct _sasl_scram_t sasl_scram_t;
+
+// mech是"SCRAM-SHA-1" "SCRAM-SHA-256"或者带-PLUS的, cbtype不为NULL的话用cbdata做通道绑定
+// cb_supported表示客户端支持通道绑定但是服务器没有提供-PLUS. nonce为NULL的话随机生成
+sasl_scram_t *sasl_scram_new(xmpp_ctx_t *ctx, const char *mech, const char *domain,
+                             const char *authcid, const char *cbtype,
+                             const unsigned char *cbdata, size_t cblen, int cb_supported,
+                             const char *nonce);
+void sasl_scram_free(sasl_scram_t *scram);
+const char *sasl_scram_mech(sasl_scram_t *scram);
+// 已经发出了client-final-message, 再收到的challenge是server-final-message
+int sasl_scram_final_sent(sasl_scram_t *scram);
+// 返回base64编码的消息, 用xmpp_free释放
+char *sasl_scram_client_first(sasl_scram_t *scram);
+char *sasl_scram_client_final(sasl_scram_t *scram, const char *challenge,
+                              const char *authcid, const char *password);
+// 校验server-final-message里面的服务器签名, 通过返回1
+int sasl_scram_verify(sasl_scram_t *scram, const char *text);
+// 已经校验过服务器签名, <success/>里面没有带的时候用
+int sasl_scram_verified(sasl_scram_t *scram);
+
 #endif /* __IMCORE_XMPP_SASL_H__ */
@@ -0,0 +1,503 @@
+/* xmpp-scram.c
+ * SASL SCRAM-SHA-1 SCRAM-SHA-256 (RFC 5802, RFC 7677), -PLUS的话绑定TLS通道
+ * PBKDF2算出来的ClientKey和ServerKey按服务器, 用户, salt和迭代次数缓存, 所有上下文共享,
+ * 重新登录的时候服务器给的salt和迭代次数没变就不用再算
+ */
+#include "xmpp-inl.h"
+#include "xmpp-sasl.h"
+#include "base64.h"
+#include "im-atomic.h"
+
+#include <stdlib.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+// 客户端nonce的随机字节数, base64以后32个字符
+#define SCRAM_NONCE_SIZE 24
+// 迭代次数上限, 防止服务器给一个很大的数让客户端一直算
+#define SCRAM_MAX_ITERATIONS 10000000
+// 缓存的条目上限, 满了整个清空
+#define SCRAM_CACHE_MAX 256
+
+typedef struct _scram_keys_t {
+    unsigned char pass_digest[SHA256_DIGEST_LENGTH];   // 密码改了以后缓存不能再用
+    unsigned char client_key[EVP_MAX_MD_SIZE];
+    unsigned char server_key[EVP_MAX_MD_SIZE];
+} scram_keys_t;
+
+struct _sasl_scram_t {
+    xmpp_ctx_t *ctx;
+    const EVP_MD *md;
+    char *mech;
+    char *domain;                      // 缓存按服务器区分, 可以为NULL
+    char *gs2_header;                  // "n,," "y,," 或者 "p=<cbtype>,,"
+    unsigned char *cbdata;             // 通道绑定数据, 只有-PLUS才有
+    size_t cblen;
+    char *nonce;
+    char *client_first_bare;
+    char *auth_message;
+    unsigned char server_signature[EVP_MAX_MD_SIZE];
+    int final_sent;                    // 已经发出client-final-message
+    int verified;                      // 服务器签名校验通过
+};
+
+static im_thread_mutex_t *volatile scram_lock = NULL;
+static hash_t *scram_cache = NULL;
+static volatile long scram_hits = 0;
+static volatile long scram_misses = 0;
+
+static im_thread_mutex_t *_scram_get_lock()
+{
+    im_thread_mutex_t *lock = im_atomic_load_ptr((void *volatile *)&scram_lock);
+
+    if (!lock) {
+        lock = im_thread_mutex_create();
+        if (!im_atomic_cas_ptr((void *volatile *)&scram_lock, NULL, lock)) {
+            // 其他线程已经创建了
+            im_thread_mutex_destroy(lock);
+            lock = im_atomic_load_ptr((void *volatile *)&scram_lock);
+        }
+    }
+    return lock;
+}
+
+static void _scram_keys_free(void *p)
+{
+    // 密钥不留在释放的内存里
+    OPENSSL_cleanse(p, sizeof(scram_keys_t));
+    safe_mem_free(p);
+}
+
+// 命中的话拷贝出ClientKey和ServerKey
+static int _scram_cache_get(const char *key, const unsigned char *pass_digest,
+                            unsigned char *client_key, unsigned char *server_key, size_t len)
+{
+    im_thread_mutex_t *lock = _scram_get_lock();
+    scram_keys_t *keys;
+    int found = 0;
+
+    if (!lock)
+        return 0;
+    im_thread_mutex_lock(lock);
+    if (scram_cache && (keys = hash_get(scram_cache, key)) != NULL &&
+        CRYPTO_memcmp(keys->pass_digest, pass_digest, SHA256_DIGEST_LENGTH) == 0) {
+        memcpy(client_key, keys->client_key, len);
+        memcpy(server_key, keys->server_key, len);
+        found = 1;
+    }
+    im_thread_mutex_unlock(lock);
+
+    im_atomic_inc(found ? &scram_hits : &scram_misses);
+    return found;
+}
+
+static void _scram_cache_put(const char *key, const unsigned char *pass_digest,
+                             const unsigned char *client_key, const unsigned char *server_key,
+                             size_t len)
+{
+    im_thread_mutex_t *lock = _scram_get_lock();
+    scram_keys_t *keys;
+
+    if (!lock)
+        return;
+    keys = safe_mem_calloc(sizeof(scram_keys_t), NULL);
+    if (!keys)
+        return;
+    memcpy(keys->pass_digest, pass_digest, SHA256_DIGEST_LENGTH);
+    memcpy(keys->client_key, client_key, len);
+    memcpy(keys->server_key, server_key, len);
+
+    im_thread_mutex_lock(lock);
+    if (scram_cache && hash_num_keys(scram_cache) >= SCRAM_CACHE_MAX) {
+        hash_release(scram_cache);
+        scram_cache = NULL;
+    }
+    if (!scram_cache)
+        scram_cache = hash_new(32, _scram_keys_free);
+    // 同一个key已经有了的话替换掉
+    if (!scram_cache || hash_add(scram_cache, key, keys) != 0)
+        _scram_keys_free(keys);
+    im_thread_mutex_unlock(lock);
+}
+
+// 用户名里面的','和'='要转义
+static char *_scram_escape_name(xmpp_ctx_t *ctx, const char *name)
+{
+    const char *p;
+    char *result, *q;
+    size_t len = 0;
+
+    for (p = name; *p; p++)
+        len += (*p == ',' || *p == '=') ? 3 : 1;
+    result = xmpp_alloc(ctx, len + 1);
+    if (!result)
+        return NULL;
+    for (p = name, q = result; *p; p++) {
+        if (*p == ',') {
+            memcpy(q, "=2C", 3);
+            q += 3;
+        } else if (*p == '=') {
+            memcpy(q, "=3D", 3);
+            q += 3;
+        } else {
+            *q++ = *p;
+        }
+    }
+    *q = '\0';
+    return result;
+}
+
+// 解码base64, 返回以'\0'结尾的字符串
+static char *_scram_decode(const char *text, size_t *len)
+{
+    size_t n = text ? strlen(text) : 0;
+    int dlen;
+    char *result;
+
+    if (n < 4)
+        return NULL;
+    dlen = base64_decoded_len(text, n);
+    result = (char *)base64_decode(text, n);
+    if (result && len)
+        *len = dlen;
+    return result;
+}
+
+// 服务器消息里面的属性, "r=xxx,s=yyy,i=4096"取出一个属性的值, 不分配内存
+static const char *_scram_attr(const char *msg, char name, size_t *len)
+{
+    const char *p = msg, *end;
+
+    while (p && *p) {
+        end = strchr(p, ',');
+        if (p[0] == name && p[1] == '=') {
+            p += 2;
+            *len = end ? (size_t)(end - p) : strlen(p);
+            return p;
+        }
+        p = end ? end + 1 : NULL;
+    }
+    return NULL;
+}
+
+sasl_scram_t *sasl_scram_new(xmpp_ctx_t *ctx, const char *mech, const char *domain,
+                             const char *authcid, const char *cbtype,
+                             const unsigned char *cbdata, size_t cblen, int cb_supported,
+                             const char *nonce)
+{
+    sasl_scram_t *scram;
+    unsigned char random[SCRAM_NONCE_SIZE];
+    char *name;
+
+    scram = safe_mem_calloc(sizeof(sasl_scram_t), NULL);
+    if (!scram)
+        return NULL;
+    scram->ctx = ctx;
+
+    if (strncmp(mech, "SCRAM-SHA-256", 13) == 0)
+        scram->md = EVP_sha256();
+    else if (strncmp(mech, "SCRAM-SHA-1", 11) == 0)
+        scram->md = EVP_sha1();
+    if (!scram->md)
+        goto error;
+    scram->mech = xmpp_strdup(ctx, mech);
+    if (!scram->mech)
+        goto error;
+    if (domain && *domain && !(scram->domain = xmpp_strdup(ctx, domain)))
+        goto error;
+
+    // gs2头: p表示使用通道绑定, y表示客户端支持但是认为服务器不支持, n表示不支持
+    if (cbtype) {
+        scram->gs2_header = xmpp_alloc(ctx, strlen(cbtype) + 5);
+        if (!scram->gs2_header || !cbdata || !(scram->cbdata = xmpp_alloc(ctx, cblen)))
+            goto error;
+        sprintf(scram->gs2_header, "p=%s,,", cbtype);
+        memcpy(scram->cbdata, cbdata, cblen);
+        scram->cblen = cblen;
+    } else {
+        scram->gs2_header = xmpp_strdup(ctx, cb_supported ? "y,," : "n,,");
+        if (!scram->gs2_header)
+            goto error;
+    }
+
+    if (nonce) {
+        scram->nonce = xmpp_strdup(ctx, nonce);
+    } else {
+        if (RAND_bytes(random, sizeof(random)) != 1)
+            goto error;
+        scram->nonce = base64_encode((char *)random, sizeof(random));
+    }
+    name = _scram_escape_name(ctx, authcid);
+    if (!scram->nonce || !name)
+        goto error;
+    scram->client_first_bare = xmpp_alloc(ctx, strlen(name) + strlen(scram->nonce) + 6);
+    if (scram->client_first_bare)
+        sprintf(scram->client_first_bare, "n=%s,r=%s", name, scram->nonce);
+    xmpp_free(ctx, name);
+    if (!scram->client_first_bare)
+        goto error;
+    return scram;
+
+error:
+    sasl_scram_free(scram);
+    return NULL;
+}
+
+void sasl_scram_free(sasl_scram_t *scram)
+{
+    if (!scram)
+        return;
+    if (scram->mech) xmpp_free(scram->ctx, scram->mech);
+    if (scram->domain) xmpp_free(scram->ctx, scram->domain);
+    if (scram->gs2_header) xmpp_free(scram->ctx, scram->gs2_header);
+    if (scram->cbdata) xmpp_free(scram->ctx, scram->cbdata);
+    if (scram->nonce) xmpp_free(scram->ctx, scram->nonce);
+    if (scram->client_first_bare) xmpp_free(scram->ctx, scram->client_first_bare);
+    if (scram->auth_message) xmpp_free(scram->ctx, scram->auth_message);
+    OPENSSL_cleanse(scram->server_signature, sizeof(scram->server_signature));
+    safe_mem_free(scram);
+}
+
+const char *sasl_scram_mech(sasl_scram_t *scram)
+{
+    return scram->mech;
+}
+
+int sasl_scram_final_sent(sasl_scram_t *scram)
+{
+    return scram->final_sent;
+}
+
+int sasl_scram_verified(sasl_scram_t *scram)
+{
+    return scram->verified;
+}
+
+char *sasl_scram_client_first(sasl_scram_t *scram)
+{
+    size_t hlen = strlen(scram->gs2_header);
+    size_t blen = strlen(scram->client_first_bare);
+    char *msg, *result;
+
+    msg = xmpp_alloc(scram->ctx, hlen + blen + 1);
+    if (!msg)
+        return NULL;
+    memcpy(msg, scram->gs2_header, hlen);
+    memcpy(msg + hlen, scram->client_first_bare, blen + 1);
+    result = base64_encode(msg, hlen + blen);
+    xmpp_free(scram->ctx, msg);
+    return result;
+}
+
+// 算ClientKey和ServerKey, 缓存里面有的话直接用
+static int _scram_keys(sasl_scram_t *scram, const char *password, const char *authcid_bare,
+                       const char *salt_b64, size_t salt_b64_len, int iterations,
+                       unsigned char *client_key, unsigned char *server_key)
+{
+    unsigned char pass_digest[SHA256_DIGEST_LENGTH];
+    unsigned char salted[EVP_MAX_MD_SIZE];
+    unsigned char *salt;
+    char *key;
+    size_t salt_len = 0, len = EVP_MD_size(scram->md);
+    unsigned int n;
+    char *salt_text;
+    const char *domain;
+    int ok = 0;
+
+    SHA256((const unsigned char *)password, strlen(password), pass_digest);
+
+    // 缓存的key: 机制 服务器 用户 salt 迭代次数
+    domain = scram->domain ? scram->domain : "";
+    key = xmpp_alloc(scram->ctx, strlen(scram->mech) + strlen(domain) +
+                     strlen(authcid_bare) + salt_b64_len + 16);
+    salt_text = xmpp_alloc(scram->ctx, salt_b64_len + 1);
+    if (!key || !salt_text) {
+        if (key) xmpp_free(scram->ctx, key);
+        if (salt_text) xmpp_free(scram->ctx, salt_text);
+        return 0;
+    }
+    memcpy(salt_text, salt_b64, salt_b64_len);
+    salt_text[salt_b64_len] = '\0';
+    sprintf(key, "%s %s %s %s %d", scram->mech, domain, authcid_bare, salt_text,
+            iterations);
+
+    if (_scram_cache_get(key, pass_digest, client_key, server_key, len)) {
+        ok = 1;
+    } else if ((salt = (unsigned char *)_scram_decode(salt_text, &salt_len)) != NULL) {
+        // SaltedPassword = Hi(password, salt, i), 这里是慢的地方
+        if (PKCS5_PBKDF2_HMAC(password, (int)strlen(password), salt, (int)salt_len,
+                              iterations, scram->md, (int)len, salted) == 1 &&
+            HMAC(scram->md, salted, (int)len, (const unsigned char *)"Client Key", 10,
+                 client_key, &n) &&
+            HMAC(scram->md, salted, (int)len, (const unsigned char *)"Server Key", 10,
+                 server_key, &n)) {
+            _scram_cache_put(key, pass_digest, client_key, server_key, len);
+            ok = 1;
+        }
+        OPENSSL_cleanse(salted, sizeof(salted));
+        safe_mem_free(salt);
+    }
+
+    OPENSSL_cleanse(pass_digest, sizeof(pass_digest));
+    xmpp_free(scram->ctx, salt_text);
+    xmpp_free(scram->ctx, key);
+    return ok;
+}
+
+char *sasl_scram_client_final(sasl_scram_t *scram, const char *challenge,
+                              const char *authcid, const char *password)
+{
+    unsigned char client_key[EVP_MAX_MD_SIZE], server_key[EVP_MAX_MD_SIZE];
+    unsigned char stored_key[EVP_MAX_MD_SIZE], signature[EVP_MAX_MD_SIZE];
+    const char *r, *s, *i;
+    size_t rlen, slen, ilen, hlen, len = EVP_MD_size(scram->md), cbind_len, k;
+    char *server_first = NULL, *cbind = NULL, *cbind_b64 = NULL, *proof_b64 = NULL;
+    char *final_msg = NULL, *result = NULL;
+    unsigned int n;
+    int iterations;
+
+    if (scram->final_sent || !password)
+        return NULL;
+    server_first = _scram_decode(challenge, NULL);
+    if (!server_first)
+        goto done;
+
+    // 服务器nonce必须以客户端nonce开头, 有不认识的强制扩展m=的话失败
+    r = _scram_attr(server_first, 'r', &rlen);
+    s = _scram_attr(server_first, 's', &slen);
+    i = _scram_attr(server_first, 'i', &ilen);
+    if (server_first[0] == 'm' || !r || !s || !i || slen == 0 ||
+        rlen <= strlen(scram->nonce) || strncmp(r, scram->nonce, strlen(scram->nonce)) != 0) {
+        xmpp_error(scram->ctx, "SASL", "Bad SCRAM server-first-message.");
+        goto done;
+    }
+    iterations = atoi(i);
+    if (iterations <= 0 || iterations > SCRAM_MAX_ITERATIONS) {
+        xmpp_error(scram->ctx, "SASL", "SCRAM iteration count %d refused.", iterations);
+        goto done;
+    }
+
+    // c= gs2头加上通道绑定数据
+    hlen = strlen(scram->gs2_header);
+    cbind_len = hlen + scram->cblen;
+    cbind = xmpp_alloc(scram->ctx, cbind_len + 1);
+    if (!cbind)
+        goto done;
+    memcpy(cbind, scram->gs2_header, hlen);
+    if (scram->cblen)
+        memcpy(cbind + hlen, scram->cbdata, scram->cblen);
+    cbind_b64 = base64_encode(cbind, cbind_len);
+    if (!cbind_b64)
+        goto done;
+
+    // client-final-message-without-proof, 后面留出证明的位置
+    final_msg = xmpp_alloc(scram->ctx, strlen(cbind_b64) + rlen +
+                           base64_encoded_len(len) + 12);
+    scram->auth_message = xmpp_alloc(scram->ctx, strlen(scram->client_first_bare) +
+                                     strlen(server_first) + strlen(cbind_b64) + rlen + 10);
+    if (!final_msg || !scram->auth_message)
+        goto done;
+    sprintf(final_msg, "c=%s,r=%.*s", cbind_b64, (int)rlen, r);
+    sprintf(scram->auth_message, "%s,%s,%s", scram->client_first_bare, server_first, final_msg);
+
+    if (!_scram_keys(scram, password, authcid, s, slen, iterations, client_key, server_key))
+        goto done;
+
+    // ClientProof = ClientKey XOR HMAC(H(ClientKey), AuthMessage)
+    EVP_Digest(client_key, len, stored_key, &n, scram->md, NULL);
+    HMAC(scram->md, stored_key, (int)len, (unsigned char *)scram->auth_message,
+         strlen(scram->auth_message), signature, &n);
+    for (k = 0; k < len; k++)
+        signature[k] ^= client_key[k];
+    proof_b64 = base64_encode((char *)signature, len);
+
+    // 服务器最后要给出的签名
+    HMAC(scram->md, server_key, (int)len, (unsigned char *)scram->auth_message,
+         strlen(scram->auth_message), scram->server_signature, &n);
+    if (!proof_b64)
+        goto done;
+
+    strcat(final_msg, ",p=");
+    strcat(final_msg, proof_b64);
+    result = base64_encode(final_msg, strlen(final_msg));
+    if (result)
+        scram->final_sent = 1;
+
+done:
+    OPENSSL_cleanse(client_key, sizeof(client_key));
+    OPENSSL_cleanse(server_key, sizeof(server_key));
+    OPENSSL_cleanse(stored_key, sizeof(stored_key));
+    OPENSSL_cleanse(signature, sizeof(signature));
+    if (server_first) safe_mem_free(server_first);
+    if (cbind) xmpp_free(scram->ctx, cbind);
+    if (cbind_b64) safe_mem_free(cbind_b64);
+    if (proof_b64) safe_mem_free(proof_b64);
+    if (final_msg) xmpp_free(scram->ctx, final_msg);
+    return result;
+}
+
+int sasl_scram_verify(sasl_scram_t *scram, const char *text)
+{
+    char *server_final = _scram_decode(text, NULL);
+    const char *v, *e;
+    char *expect;
+    size_t vlen, elen;
+    int ok = 0;
+
+    if (!server_final || !scram->final_sent)
+        goto done;
+    e = _scram_attr(server_final, 'e', &elen);
+    if (e) {
+        xmpp_error(scram->ctx, "SASL", "SCRAM server error: %.*s.", (int)elen, e);
+        goto done;
+    }
+    v = _scram_attr(server_final, 'v', &vlen);
+    expect = base64_encode((char *)scram->server_signature, EVP_MD_size(scram->md));
+    if (v && expect && strlen(expect) == vlen && CRYPTO_memcmp(v, expect, vlen) == 0)
+        ok = scram->verified = 1;
+    if (expect)
+        safe_mem_free(expect);
+
+done:
+    if (server_final)
+        safe_mem_free(server_final);
+    return ok;
+}
+
+void xmpp_scram_cache_stats(long *hits, long *misses, int *entries)
+{
+    im_thread_mutex_t *lock = _scram_get_lock();
+
+    if (hits)
+        *hits = im_atomic_load(&scram_hits);
+    if (misses)
+        *misses = im_atomic_load(&scram_misses);
+    if (!entries)
+        return;
+    *entries = 0;
+    if (lock) {
+        im_thread_mutex_lock(lock);
+        if (scram_cache)
+            *entries = hash_num_keys(scram_cache);
+        im_thread_mutex_unlock(lock);
+    }
+}
+
+void xmpp_scram_cache_clear(void)
+{
+    im_thread_mutex_t *lock = _scram_get_lock();
+
+    if (!lock)
+        return;
+    im_thread_mutex_lock(lock);
+    if (scram_cache) {
+        hash_release(scram_cache);
+        scram_cache = NULL;
+    }
+    im_thread_mutex_unlock(lock);
+    im_atomic_store(&scram_hits, 0);
+    im_atomic_store(&scram_misses, 0);
+}
@@ -0,0 +1,375 @@
+/* xmpp-sm.c
+ * XEP-0198流管理, 发出的stanza在服务器确认之前保存在连接的队列里面
+ * 断线以后用同一个连接重新登录的时候先尝试恢复流, 恢复成功不用再绑定资源, 没有确认的stanza直接重发
+ */
+#include "xmpp-inl.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// 攒够这么多没有确认的stanza就请求确认
+#define XMPP_SM_ACK_BATCH 5
+// 不够一批的话最多等这么久(毫秒)再请求确认
+#define XMPP_SM_ACK_DELAY 1000
+
+// 等待确认的stanza, 保存序列化以后的内容, 发送以后应用程序修改stanza不影响重发
+typedef struct _xmpp_sm_entry_t {
+    struct list_head node;   // 按发送顺序挂在conn->sm_queue上
+    size_t len;
+    char data[1];            // 和结构一起分配
+} xmpp_sm_entry_t;
+
+// 计数的只有这三种stanza, 其他的元素比如<r/>和<a/>本身都不计数
+static int _sm_is_stanza(xmpp_stanza_t *stanza)
+{
+    const char *name = xmpp_stanza_get_name_ptr(stanza);
+
+    return name && (strcmp(name, "message") == 0 || strcmp(name, "presence") == 0 ||
+                    strcmp(name, "iq") == 0);
+}
+
+static void _sm_queue_clear(xmpp_conn_t *conn)
+{
+    xmpp_sm_entry_t *entry;
+
+    while (!list_empty(&conn->sm_queue)) {
+        entry = list_first_entry(&conn->sm_queue, xmpp_sm_entry_t, node);
+        list_del(&entry->node);
+        xmpp_free(conn->ctx, entry);
+    }
+    conn->sm_queue_len = 0;
+}
+
+static void _sm_request_ack(xmpp_conn_t *conn)
+{
+    conn->sm_unrequested = 0;
+    if (conn->ctx->timers)
+        im_timer_del(conn->ctx->timers, &conn->sm_timer);
+    xmpp_send_raw_string(conn, "<r xmlns='%s'/>", XMPP_NS_SM);
+}
+
+static void _sm_ack_timeout(im_timer_t *timer, void *userdata)
+{
+    xmpp_conn_t *conn = userdata;
+
+    if (conn->sm_enabled && conn->sm_unrequested > 0)
+        _sm_request_ack(conn);
+}
+
+// 服务器确认收到了h个stanza, 从队列头上去掉新确认的
+static void _sm_handle_ack(xmpp_conn_t *conn, const char *attr)
+{
+    xmpp_sm_entry_t *entry;
+    uint32_t h, n;
+
+    if (!attr)
+        return;
+    h = (uint32_t)strtoul(attr, NULL, 10);
+    // 计数按2^32回绕
+    n = h - conn->sm_acked;
+    if (n > (uint32_t)conn->sm_queue_len) {
+        xmpp_warn(conn->ctx, "xmpp", "Server acked %u stanzas, only %d unacked.",
+                  n, conn->sm_queue_len);
+        n = conn->sm_queue_len;
+    }
+    while (n-- > 0) {
+        entry = list_first_entry(&conn->sm_queue, xmpp_sm_entry_t, node);
+        list_del(&entry->node);
+        xmpp_free(conn->ctx, entry);
+        conn->sm_queue_len--;
+    }
+    conn->sm_acked = h;
+}
+
+static void _sm_handle_resumed(xmpp_conn_t *conn, xmpp_stanza_t *stanza)
+{
+    struct list_head *pos;
+    xmpp_sm_entry_t *entry;
+
+    xmpp_debug(conn->ctx, "xmpp", "Stream %s resumed.", conn->sm_id);
+    _sm_handle_ack(conn, xmpp_stanza_get_attribute(stanza, "h"));
+    conn->sm_resuming = 0;
+    conn->sm_enabled = 1;
+    conn->sm_inbound = 1;
+    conn->sm_resumed = 1;
+
+    // 服务器没有收到的按原来的顺序重发, 还留在队列里面等确认
+    list_for_each(pos, &conn->sm_queue) {
+        entry = list_entry(pos, xmpp_sm_entry_t, node);
+        xmpp_send_raw(conn, entry->data, entry->len);
+        if (conn->state != XMPP_STATE_CONNECTED)
+            break;
+    }
+
+    // 重发的时候写失败, 连接已经断开并且通知过了
+    if (conn->state != XMPP_STATE_CONNECTED)
+        return;
+    if (conn->sm_queue_len > 0)
+        _sm_request_ack(conn);
+
+    // 资源和在线状态都还在服务器上, 直接算握手完成
+    conn->authenticated = 1;
+    conn->conn_handler(conn, XMPP_CONN_CONNECT, 0, NULL, conn->userdata);
+}
+
+static void _sm_handle_failed(xmpp_conn_t *conn, xmpp_stanza_t *stanza)
+{
+    if (conn->sm_resuming) {
+        xmpp_info(conn->ctx, "xmpp", "Stream %s can not be resumed.", conn->sm_id);
+        // 新的服务器会在failed里面告诉我们上一个流收到了多少, 这些不用重发
+        _sm_handle_ack(conn, xmpp_stanza_get_attribute(stanza, "h"));
+        conn->sm_resuming = 0;
+        xmpp_free(conn->ctx, conn->sm_id);
+        conn->sm_id = NULL;
+        conn->sm_handled = 0;
+        conn->sm_acked = 0;
+        // 按新会话绑定资源, 剩下的stanza绑定以后重发. SASL2的请求里面已经带着Bind2, 服务器接着绑定
+        if (!conn->sasl2)
+            auth_bind(conn);
+    } else {
+        xmpp_warn(conn->ctx, "xmpp", "Server refused to enable stream management.");
+        conn->sm_enabled = 0;
+        _sm_queue_clear(conn);
+    }
+}
+
+int sm_fire_stanza(xmpp_conn_t *conn, xmpp_stanza_t *stanza)
+{
+    const char *ns = xmpp_stanza_get_ns(stanza);
+    const char *name, *resume, *id;
+
+    if (!ns || strcmp(ns, XMPP_NS_SM) != 0) {
+        // 服务器从<enabled/>以后开始计数
+        if (conn->sm_inbound && _sm_is_stanza(stanza))
+            conn->sm_handled++;
+        return 0;
+    }
+
+    name = xmpp_stanza_get_name_ptr(stanza);
+    if (!name)
+        return 1;
+
+    if (strcmp(name, "r") == 0) {
+        if (conn->sm_inbound)
+            xmpp_send_raw_string(conn, "<a xmlns='%s' h='%u'/>", XMPP_NS_SM,
+                                 (unsigned int)conn->sm_handled);
+    } else if (strcmp(name, "a") == 0) {
+        if (conn->sm_enabled)
+            _sm_handle_ack(conn, xmpp_stanza_get_attribute(stanza, "h"));
+    } else if (strcmp(name, "enabled") == 0) {
+        conn->sm_inbound = 1;
+        conn->sm_handled = 0;
+        resume = xmpp_stanza_get_attribute(stanza, "resume");
+        id = xmpp_stanza_get_id_ptr(stanza);
+        if (id && resume && (strcmp(resume, "true") == 0 || strcmp(resume, "1") == 0)) {
+            if (conn->sm_id)
+                xmpp_free(conn->ctx, conn->sm_id);
+            conn->sm_id = xmpp_strdup(conn->ctx, id);
+        }
+        xmpp_debug(conn->ctx, "xmpp", "Stream management enabled%s.",
+                   conn->sm_id ? ", resumable" : "");
+    } else if (strcmp(name, "resumed") == 0) {
+        if (conn->sm_resuming)
+            _sm_handle_resumed(conn, stanza);
+    } else if (strcmp(name, "failed") == 0) {
+        _sm_handle_failed(conn, stanza);
+    }
+    return 1;
+}
+
+int sm_send(xmpp_conn_t *conn, xmpp_stanza_t *stanza)
+{
+    xmpp_sm_entry_t *entry;
+    size_t len;
+    int ret;
+
+    if (!conn->sm_enabled || !_sm_is_stanza(stanza))
+        return 0;
+
+    // 先序列化到连接的暂存缓冲区, 拷一份进队列再整块写出去
+    if (!conn->sm_buf && !(conn->sm_buf = evbuffer_new()))
+        return XMPP_EMEM;
+    ret = stanza_render(stanza, conn->sm_buf);
+    len = evbuffer_get_length(conn->sm_buf);
+    if (ret != XMPP_EOK || !(entry = xmpp_alloc(conn->ctx, sizeof(xmpp_sm_entry_t) + len))) {
+        evbuffer_drain(conn->sm_buf, len);
+        return ret != XMPP_EOK ? ret : XMPP_EMEM;
+    }
+    entry->len = len;
+    evbuffer_remove(conn->sm_buf, entry->data, len);
+    list_add_tail(&entry->node, &conn->sm_queue);
+    conn->sm_queue_len++;
+
+    xmpp_send_raw(conn, entry->data, len);
+
+    // 写失败的话连接已经断开, 队列留着下次恢复
+    if (conn->state != XMPP_STATE_CONNECTED)
+        return 1;
+    if (++conn->sm_unrequested >= XMPP_SM_ACK_BATCH)
+        _sm_request_ack(conn);
+    else if (conn->ctx->timers && !im_timer_pending(&conn->sm_timer))
+        im_timer_add(conn->ctx->timers, &conn->sm_timer, XMPP_SM_ACK_DELAY);
+    return 1;
+}
+
+static int _sm_can_resume(xmpp_conn_t *conn)
+{
+    if (!conn->sm_id)
+        return 0;
+
+    // 服务器不支持的话上一个流恢复不了了
+    if (!conn->sm_support) {
+        xmpp_free(conn->ctx, conn->sm_id);
+        conn->sm_id = NULL;
+        conn->sm_handled = 0;
+        conn->sm_acked = 0;
+        return 0;
+    }
+    return 1;
+}
+
+xmpp_stanza_t *sm_make_resume(xmpp_conn_t *conn)
+{
+    xmpp_stanza_t *resume;
+    char h[16];
+
+    if (!_sm_can_resume(conn) || !(resume = xmpp_stanza_new(conn->ctx)))
+        return NULL;
+    sprintf(h, "%u", (unsigned int)conn->sm_handled);
+    xmpp_stanza_set_name(resume, "resume");
+    xmpp_stanza_set_ns(resume, XMPP_NS_SM);
+    xmpp_stanza_set_attribute(resume, "h", h);
+    xmpp_stanza_set_attribute(resume, "previd", conn->sm_id);
+    conn->sm_resuming = 1;
+    return resume;
+}
+
+int sm_resume(xmpp_conn_t *conn)
+{
+    xmpp_stanza_t *resume;
+
+    // 流id是服务器给的, 按stanza序列化转义, 不能直接拼进xml
+    if (!(resume = sm_make_resume(conn)))
+        return 0;
+    xmpp_send(conn, resume);
+    xmpp_stanza_release(resume);
+    return 1;
+}
+
+// 上一个流没有确认的stanza在新的会话里面重发, 启用了流管理的话重新进队列
+static void _sm_resend_pending(xmpp_conn_t *conn)
+{
+    struct list_head pending;
+    xmpp_sm_entry_t *entry;
+
+    INIT_LIST_HEAD(&pending);
+    list_splice_init(&conn->sm_queue, &pending);
+    conn->sm_queue_len = 0;
+    while (!list_empty(&pending)) {
+        entry = list_first_entry(&pending, xmpp_sm_entry_t, node);
+        list_del(&entry->node);
+        if (conn->sm_enabled) {
+            list_add_tail(&entry->node, &conn->sm_queue);
+            conn->sm_queue_len++;
+            conn->sm_unrequested++;
+        }
+        xmpp_send_raw(conn, entry->data, entry->len);
+        if (!conn->sm_enabled)
+            xmpp_free(conn->ctx, entry);
+    }
+    if (conn->sm_unrequested > 0 && conn->state == XMPP_STATE_CONNECTED)
+        _sm_request_ack(conn);
+}
+
+void sm_established(xmpp_conn_t *conn)
+{
+    conn->sm_resumed = 0;
+    if (conn->sm_support) {
+        xmpp_send_raw_string(conn, "<enable xmlns='%s' resume='true'/>", XMPP_NS_SM);
+        conn->sm_enabled = 1;
+        conn->sm_acked = 0;
+    }
+    _sm_resend_pending(conn);
+}
+
+void sm_established_inline(xmpp_conn_t *conn, xmpp_stanza_t *result)
+{
+    const char *name = result ? xmpp_stanza_get_name_ptr(result) : NULL;
+
+    if (name && strcmp(name, "failed") == 0) {
+        xmpp_warn(conn->ctx, "xmpp", "Server refused to enable stream management.");
+        conn->sm_support = 0;
+    }
+    // 服务器没有处理<bind/>里面的<enable/>的话单独启用
+    if (!name || strcmp(name, "enabled") != 0) {
+        sm_established(conn);
+        return;
+    }
+
+    conn->sm_resumed = 0;
+    conn->sm_enabled = 1;
+    conn->sm_acked = 0;
+    sm_fire_stanza(conn, result);
+    _sm_resend_pending(conn);
+}
+
+void sm_disconnected(xmpp_conn_t *conn)
+{
+    // 队列和流id留着, 重新连接的时候恢复
+    conn->sm_enabled = 0;
+    conn->sm_inbound = 0;
+    conn->sm_resuming = 0;
+    conn->sm_support = 0;
+    conn->sm_unrequested = 0;
+    if (conn->ctx->timers)
+        im_timer_del(conn->ctx->timers, &conn->sm_timer);
+}
+
+void sm_reset(xmpp_conn_t *conn)
+{
+    sm_disconnected(conn);
+    _sm_queue_clear(conn);
+    if (conn->sm_id) {
+        xmpp_free(conn->ctx, conn->sm_id);
+        conn->sm_id = NULL;
+    }
+    conn->sm_handled = 0;
+    conn->sm_acked = 0;
+    conn->sm_resumed = 0;
+}
+
+void sm_init(xmpp_conn_t *conn)
+{
+    conn->sm_support = 0;
+    conn->sm_enabled = 0;
+    conn->sm_inbound = 0;
+    conn->sm_resuming = 0;
+    conn->sm_resumed = 0;
+    conn->sm_id = NULL;
+    conn->sm_handled = 0;
+    conn->sm_acked = 0;
+    INIT_LIST_HEAD(&conn->sm_queue);
+    conn->sm_queue_len = 0;
+    conn->sm_unrequested = 0;
+    conn->sm_buf = NULL;
+    im_timer_init(&conn->sm_timer, _sm_ack_timeout, conn);
+}
+
+void sm_free(xmpp_conn_t *conn)
+{
+    sm_reset(conn);
+    if (conn->sm_buf) {
+        evbuffer_free(conn->sm_buf);
+        conn->sm_buf = NULL;
+    }
+}
+
+int xmpp_conn_sm_unacked(xmpp_conn_t *conn)
+{
+    return conn->sm_queue_len;
+}
+
+int xmpp_conn_is_resumed(xmpp_conn_t *conn)
+{
+    return conn->sm_resumed;
+}
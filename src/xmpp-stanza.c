@@ -3,6 +3,7 @@
  * 基本不需要修改，可以添加针对要用的stanza增加helper方法
  */
 #include "xmpp-inl.h"
+#include "xmpp-escape.h"
 
 xmpp_stanza_t *xmpp_stanza_new(xmpp_ctx_t *ctx)
 {
@@ -17,14 +18,146 @@ xmpp_stanza_t *xmpp_stanza_new(xmpp_ctx_t *ctx)
         stanza->children = NULL;
         stanza->parent = NULL;
         stanza->data = NULL;
-        stanza->attributes = NULL;
+        stanza->attrs = stanza->inline_attrs;
+        stanza->attr_count = 0;
+        stanza->attr_capacity = XMPP_STANZA_INLINE_ATTRS;
+        stanza->attr_index = NULL;
+        stanza->arena = NULL;
     }
     return stanza;
 }
 
-// 引用拷贝
+xmpp_stanza_t *stanza_new_arena(xmpp_ctx_t *ctx, mem_arena_t *arena)
+{
+    xmpp_stanza_t *stanza;
+    stanza = arena_alloc(arena, sizeof(xmpp_stanza_t));
+    if (stanza != NULL) {
+        memset(stanza, 0, sizeof(xmpp_stanza_t));
+        stanza->ref = 1;
+        stanza->ctx = ctx;
+        stanza->type = XMPP_STANZA_UNKNOWN;
+        stanza->attrs = stanza->inline_attrs;
+        stanza->attr_capacity = XMPP_STANZA_INLINE_ATTRS;
+        stanza->arena = arena;
+    }
+    return stanza;
+}
+
+void stanza_arena_release(xmpp_stanza_t *stanza)
+{
+    xmpp_stanza_t *child, *tchild;
+
+    child = stanza->children;
+    while (child) {
+        tchild = child;
+        child = child->next;
+        if (tchild->arena)
+            stanza_arena_release(tchild);
+        else
+            xmpp_stanza_release(tchild);
+    }
+}
+
+// 字符串和stanza从同一个地方分配
+static char *_stanza_strndup(xmpp_stanza_t *stanza, const char *s, size_t len)
+{
+    char *p;
+    if (stanza->arena)
+        return arena_strndup(stanza->arena, s, len);
+    p = xmpp_alloc(stanza->ctx, len + 1);
+    if (p) {
+        memcpy(p, s, len);
+        p[len] = 0;
+    }
+    return p;
+}
+
+static void _stanza_free_data(xmpp_stanza_t *stanza)
+{
+    if (stanza->data && !stanza->arena)
+        xmpp_free(stanza->ctx, stanza->data);
+    stanza->data = NULL;
+}
+
+static void _stanza_free_attrs(xmpp_stanza_t *stanza)
+{
+    int i;
+    for (i = 0; i < stanza->attr_count; i++)
+        xmpp_free(stanza->ctx, stanza->attrs[i].key);
+    if (stanza->attrs != stanza->inline_attrs)
+        xmpp_free(stanza->ctx, stanza->attrs);
+    if (stanza->attr_index)
+        hash_release(stanza->attr_index);
+}
+
+static int _stanza_find_attr(xmpp_stanza_t *stanza, const char *key)
+{
+    int i;
+    
+    if (stanza->attr_index)
+        return (int)(intptr_t)hash_get(stanza->attr_index, key) - 1;
+        
+    // 解析出来的属性名都是原子, 用原子查找只比较指针
+    for (i = 0; i < stanza->attr_count; i++) {
+        if (atom_equal(stanza->ctx, stanza->attrs[i].key, key))
+            return i;
+    }
+    return -1;
+}
+
+// 新加了第i个属性, 属性多了以后建立索引
+static int _stanza_index_attr(xmpp_stanza_t *stanza, int i)
+{
+    if (!stanza->attr_index) {
+        if (stanza->attr_count < XMPP_STANZA_ATTR_INDEX)
+            return XMPP_EOK;
+        if (stanza->arena)
+            stanza->attr_index = hash_new_arena(stanza->attr_count * 2, NULL, stanza->arena);
+        else
+            stanza->attr_index = hash_new(stanza->attr_count * 2, NULL);
+        if (!stanza->attr_index)
+            return XMPP_EMEM;
+        for (i = 0; i < stanza->attr_count; i++)
+            hash_add(stanza->attr_index, stanza->attrs[i].key, (void *)(intptr_t)(i + 1));
+        return XMPP_EOK;
+    }
+    if (hash_add(stanza->attr_index, stanza->attrs[i].key, (void *)(intptr_t)(i + 1)))
+        return XMPP_EMEM;
+    return XMPP_EOK;
+}
+
+static const char *_stanza_get_attr(xmpp_stanza_t *stanza, const char *key)
+{
+    int i = _stanza_find_attr(stanza, key);
+    return i >= 0 ? stanza->attrs[i].value : NULL;
+}
+
+static int _stanza_grow_attrs(xmpp_stanza_t *stanza)
+{
+    int capacity = stanza->attr_capacity * 2;
+    xmpp_attr_t *attrs;
+    
+    if (stanza->arena)
+        attrs = arena_alloc(stanza->arena, capacity * sizeof(xmpp_attr_t));
+    else if (stanza->attrs == stanza->inline_attrs)
+        attrs = xmpp_alloc(stanza->ctx, capacity * sizeof(xmpp_attr_t));
+    else
+        attrs = xmpp_realloc(stanza->ctx, stanza->attrs, capacity * sizeof(xmpp_attr_t));
+    if (!attrs)
+        return XMPP_EMEM;
+        
+    if (stanza->arena || stanza->attrs == stanza->inline_attrs)
+        memcpy(attrs, stanza->attrs, stanza->attr_count * sizeof(xmpp_attr_t));
+    stanza->attrs = attrs;
+    stanza->attr_capacity = capacity;
+    return XMPP_EOK;
+}
+
+// 引用拷贝, 解析器生成的stanza在处理完以后就会回收, 所以深度拷贝一份
 xmpp_stanza_t *xmpp_stanza_clone(xmpp_stanza_t *stanza)
 {
+    if (stanza->arena)
+        return xmpp_stanza_copy(stanza);
     stanza->ref++;
     return stanza;
 }
@@ -33,9 +166,7 @@ xmpp_stanza_t *xmpp_stanza_clone(xmpp_stanza_t *stanza)
 xmpp_stanza_t *xmpp_stanza_copy(const xmpp_stanza_t *stanza)
 {
     xmpp_stanza_t *copy, *child, *copychild, *tail;
-    hash_iterator_t *iter;
-    const char *key;
-    void *val;
+    int i;
     
     copy = xmpp_stanza_new(stanza->ctx);
     if (!copy)
@@ -50,25 +181,10 @@ xmpp_stanza_t *xmpp_stanza_copy(const xmpp_stanza_t *stanza)
         if (!copy->data) goto copy_error;
     }
     
-    // 属性
-    if (stanza->attributes) {
-        copy->attributes = hash_new(8, xmpp_hash_free);
-        if (!copy->attributes) goto copy_error;
-        iter = hash_iter_new(stanza->attributes);
-        if (!iter) {
+    // 属性, 按原来的顺序
+    for (i = 0; i < stanza->attr_count; i++) {
+        if (xmpp_stanza_set_attribute(copy, stanza->attrs[i].key, stanza->attrs[i].value))
             goto copy_error;
-        }
-        while ((key = hash_iter_next(iter))) {
-            val = xmpp_strdup(stanza->ctx,
-                              (char *)hash_get(stanza->attributes, key));
-                              
-            if (!val)
-                goto copy_error;
-                
-            if (hash_add(copy->attributes, key, val))
-                goto copy_error;
-        }
-        hash_iter_release(iter);
     }
     
     // 递归复制所有child
@@ -102,6 +218,13 @@ int xmpp_stanza_release(xmpp_stanza_t *stanza)
     int released = 0;
     xmpp_stanza_t *child, *tchild;
     
+    // 由解析器统一回收
+    if (stanza->arena) {
+        if (stanza->ref > 1)
+            stanza->ref--;
+        return 0;
+    }
+    
     // 引用计数判断
     if (stanza->ref > 1)
         stanza->ref--;
@@ -113,7 +236,7 @@ int xmpp_stanza_release(xmpp_stanza_t *stanza)
             child = child->next;
             xmpp_stanza_release(tchild);
         }
-        if (stanza->attributes) hash_release(stanza->attributes);
+        _stanza_free_attrs(stanza);
         if (stanza->data) xmpp_free(stanza->ctx, stanza->data);
         xmpp_free(stanza->ctx, stanza);
         released = 1;
@@ -131,233 +254,231 @@ int xmpp_stanza_is_tag(xmpp_stanza_t *stanza)
     return (stanza && stanza->type == XMPP_STANZA_TAG);
 }
 
-static char *_escape_xml(xmpp_ctx_t *ctx, char *text)
+// 序列化输出, 写到evbuffer预留的空间或者一块连续内存
+typedef struct _stanza_sink_t {
+    xmpp_ctx_t *ctx;
+    struct evbuffer *out;               // NULL表示写到buf
+    struct evbuffer_iovec vec;          // evbuffer当前预留的空间
+    char *buf;
+    size_t size;
+    char *ptr;
+    char *end;
+    int error;
+} stanza_sink_t;
+
+// 每次向evbuffer预留的大小, evbuffer最后一块剩余的空间够的话不会分配
+#define STANZA_SINK_RESERVE 4096
+// to_text的初始大小
+#define STANZA_SINK_TEXT_SIZE 256
+
+// 把已经写入的数据提交给evbuffer
+static void _sink_commit(stanza_sink_t *sink)
 {
-    size_t len = 0;
-    char *src;
-    char *dst;
+    if (sink->out && sink->vec.iov_base) {
+        sink->vec.iov_len = sink->ptr - (char *)sink->vec.iov_base;
+        if (evbuffer_commit_space(sink->out, &sink->vec, 1) < 0)
+            sink->error = XMPP_EMEM;
+        sink->vec.iov_base = NULL;
+        sink->ptr = sink->end = NULL;
+    }
+}
+
+static int _sink_grow(stanza_sink_t *sink, size_t need)
+{
+    size_t used, size;
     char *buf;
-    for (src = text; *src != '\0'; src++) {
-        switch (*src) {
-        case '<':   /* "&lt;" */
-        case '>':   /* "&gt;" */
-            len += 4;
-            break;
-        case '&':   /* "&amp;" */
-            len += 5;
-            break;
-        case '"':
-            len += 6; /*"&quot;" */
-            break;
-        default:
-            len++;
+    
+    if (sink->error)
+        return -1;
+        
+    if (sink->out) {
+        _sink_commit(sink);
+        size = need > STANZA_SINK_RESERVE ? need : STANZA_SINK_RESERVE;
+        if (evbuffer_reserve_space(sink->out, size, &sink->vec, 1) != 1) {
+            sink->vec.iov_base = NULL;
+            sink->error = XMPP_EMEM;
+            return -1;
+        }
+        sink->ptr = sink->vec.iov_base;
+        sink->end = sink->ptr + sink->vec.iov_len;
+    } else {
+        used = sink->ptr - sink->buf;
+        size = sink->size ? sink->size : STANZA_SINK_TEXT_SIZE;
+        while (size - used < need)
+            size *= 2;
+        buf = xmpp_realloc(sink->ctx, sink->buf, size);
+        if (!buf) {
+            sink->error = XMPP_EMEM;
+            return -1;
         }
+        sink->buf = buf;
+        sink->size = size;
+        sink->ptr = buf + used;
+        sink->end = buf + size;
     }
-    if ((buf = xmpp_alloc(ctx, (len+1) * sizeof(char))) == NULL)
-        return NULL;    /* Error */
-    dst = buf;
-    for (src = text; *src != '\0'; src++) {
-        switch (*src) {
+    return 0;
+}
+
+static inline void _sink_write(stanza_sink_t *sink, const char *data, size_t len)
+{
+    if ((size_t)(sink->end - sink->ptr) < len && _sink_grow(sink, len))
+        return;
+    memcpy(sink->ptr, data, len);
+    sink->ptr += len;
+}
+
+static inline void _sink_puts(stanza_sink_t *sink, const char *s)
+{
+    _sink_write(sink, s, strlen(s));
+}
+
+// 边拷贝边转义, 不需要转义的连续字符一次写入
+static void _sink_escape(stanza_sink_t *sink, const char *text, int attr)
+{
+    const char *s = text;
+    size_t len = strlen(text), n;
+    
+    while (len) {
+        n = xml_escape_span(s, len, attr);
+        if (n)
+            _sink_write(sink, s, n);
+        if (n == len)
+            break;
+        s += n;
+        len -= n + 1;
+            
+        switch (*s) {
         case '<':
-            strcpy(dst, "&lt;");
-            dst += 4;
+            _sink_write(sink, "&lt;", 4);
             break;
         case '>':
-            strcpy(dst, "&gt;");
-            dst += 4;
+            _sink_write(sink, "&gt;", 4);
             break;
         case '&':
-            strcpy(dst, "&amp;");
-            dst += 5;
+            _sink_write(sink, "&amp;", 5);
             break;
         case '"':
-            strcpy(dst, "&quot;");
-            dst += 6;
+            _sink_write(sink, "&quot;", 6);
+            break;
+        case '\'':
+            // 属性值用单引号括起来
+            _sink_write(sink, "&apos;", 6);
             break;
-        default:
-            *dst = *src;
-            dst++;
         }
+        s++;
     }
-    *dst = '\0';
-    return buf;
 }
 
-static inline void _render_update(int *written, int length, int lastwrite, size_t *left, char **ptr)
+// 递归序列化, 只遍历一次
+static void _render_stanza_recursive(stanza_sink_t *sink, xmpp_stanza_t *stanza)
 {
-    *written += lastwrite;
-    if (*written > length) {
-        *left = 0;
-        *ptr = NULL;
-    } else {
-        *left -= lastwrite;
-        *ptr = &(*ptr)[lastwrite];
-    }
-}
-
-// 递归序列化
-static int _render_stanza_recursive(xmpp_stanza_t *stanza, char *buf, size_t buflen)
-{
-    int ret, written;
-    
-    char *ptr = buf;
-    size_t left = buflen;
-    
     xmpp_stanza_t *child;
-    hash_iterator_t *iter;
-    
-    const char *key;
-    char *tmp;
-    char *value;
+    const char *key, *value, *parent_ns;
+    int i;
     
-    // 已经写了字符数
-    written = 0;
-    
-    if (stanza->type == XMPP_STANZA_UNKNOWN)
-        return XMPP_EINVOP;
+    if (sink->error)
+        return;
         
+    if (stanza->type == XMPP_STANZA_UNKNOWN || !stanza->data) {
+        sink->error = XMPP_EINVOP;
+        return;
+    }
+    
     if (stanza->type == XMPP_STANZA_TEXT) {
-        if (!stanza->data) {
-            return XMPP_EINVOP;
-        }
-        
         // xml字符转换
-        tmp = _escape_xml(stanza->ctx, stanza->data);
-        if (tmp == NULL)
-            return XMPP_EMEM;
-            
-        ret = im_snprintf(ptr, left, "%s", tmp);
-        xmpp_free(stanza->ctx, tmp);
-        if (ret < 0)
-            return XMPP_EMEM;
-        _render_update(&written, buflen, ret, &left, &ptr);
-        
-    } else {
-        if (!stanza->data)
-            return XMPP_EINVOP;
-            
-        // 输出xml标签头
-        ret = im_snprintf(ptr, left, "<%s", stanza->data);
-        if (ret < 0)
-            return XMPP_EMEM;
-        _render_update(&written, buflen, ret, &left, &ptr);
+        _sink_escape(sink, stanza->data, 0);
+        return;
+    }
+    
+    // 输出xml标签头
+    _sink_write(sink, "<", 1);
+    _sink_puts(sink, stanza->data);
+    
+    // 输出标签属性
+    for (i = 0; i < stanza->attr_count; i++) {
+        key = stanza->attrs[i].key;
+        value = stanza->attrs[i].value;
         
-        // 输出标签属性
-        if (stanza->attributes && hash_num_keys(stanza->attributes) > 0) {
-            iter = hash_iter_new(stanza->attributes);
-            while ((key = hash_iter_next(iter))) {
-                value = (char*)hash_get(stanza->attributes, key);
-                if (!value)
+        // 处理xmlns属性, 和父元素相同或者是默认的jabber:client就不输出
+        if (atom_equal(stanza->ctx, key, XMPP_ATOM(stanza->ctx, xmlns))) {
+            if (stanza->parent) {
+                parent_ns = xmpp_stanza_get_ns(stanza->parent);
+                if (parent_ns && !strcmp(value, parent_ns))
                     continue;
-                    
-                // 处理xmlns属性
-                if (!strcmp(key, "xmlns")) {
-                
-                    if (stanza->parent && stanza->parent->attributes) {
-                        char *parent_key_value = (char*)hash_get(stanza->parent->attributes, key);
-                        if (parent_key_value && !strcmp(value, parent_key_value)) {
-                            continue;
-                        }
-                    }
-                    
-                    if (!stanza->parent && !strcmp(value, XMPP_NS_CLIENT))
-                        continue;
-                }
-                
-                tmp = _escape_xml(stanza->ctx, value);
-                if (tmp == NULL)
-                    return XMPP_EMEM;
-                    
-                // 输出并更新索引
-                ret = im_snprintf(ptr, left, " %s='%s'", key, tmp);
-                xmpp_free(stanza->ctx, tmp);
-                if (ret < 0)
-                    return XMPP_EMEM;
-                _render_update(&written, buflen, ret, &left, &ptr);
+            } else if (!strcmp(value, XMPP_NS_CLIENT)) {
+                continue;
             }
-            hash_iter_release(iter);
-        }
-        if (!stanza->children) {
-            // 没有子元素则关闭标签
-            ret = im_snprintf(ptr, left, "/>");
-            if (ret < 0)
-                return XMPP_EMEM;
-            _render_update(&written, buflen, ret, &left, &ptr);
-        } else {
-            // 输出起始标签结束
-            ret = im_snprintf(ptr, left, ">");
-            if (ret < 0)
-                return XMPP_EMEM;
-            _render_update(&written, buflen, ret, &left, &ptr);
-            
-            // 循环输出子元素
-            child = stanza->children;
-            while (child) {
-                ret = _render_stanza_recursive(child, ptr, left);
-                if (ret < 0)
-                    return ret;
-                _render_update(&written, buflen, ret, &left, &ptr);
-                child = child->next;
-            }
-            
-            // 输出结束标签
-            ret = im_snprintf(ptr, left, "</%s>", stanza->data);
-            if (ret < 0)
-                return XMPP_EMEM;
-            _render_update(&written, buflen, ret, &left, &ptr);
         }
+        
+        _sink_write(sink, " ", 1);
+        _sink_puts(sink, key);
+        _sink_write(sink, "='", 2);
+        _sink_escape(sink, value, 1);
+        _sink_write(sink, "'", 1);
     }
-    return written;
+    
+    if (!stanza->children) {
+        // 没有子元素则关闭标签
+        _sink_write(sink, "/>", 2);
+        return;
+    }
+    
+    // 输出起始标签结束
+    _sink_write(sink, ">", 1);
+    
+    // 循环输出子元素
+    for (child = stanza->children; child; child = child->next)
+        _render_stanza_recursive(sink, child);
+        
+    // 输出结束标签
+    _sink_write(sink, "</", 2);
+    _sink_puts(sink, stanza->data);
+    _sink_write(sink, ">", 1);
+}
+
+int stanza_render(xmpp_stanza_t *stanza, struct evbuffer *out)
+{
+    stanza_sink_t sink;
+    
+    memset(&sink, 0, sizeof(sink));
+    sink.ctx = stanza->ctx;
+    sink.out = out;
+    
+    _render_stanza_recursive(&sink, stanza);
+    _sink_commit(&sink);
+    return sink.error;
 }
 
 // xml stanza 转 字符串
 int  xmpp_stanza_to_text(xmpp_stanza_t *stanza, char **const buf, size_t *buflen)
 {
-    char *buffer, *tmp;
-    size_t length;
-    int ret;
+    stanza_sink_t sink;
+    
+    memset(&sink, 0, sizeof(sink));
+    sink.ctx = stanza->ctx;
     
-    // 单位缓冲区大小
-    length = 128;
-    buffer = xmpp_alloc(stanza->ctx, length);
-    if (!buffer) {
+    _render_stanza_recursive(&sink, stanza);
+    // 结尾的0
+    _sink_write(&sink, "", 1);
+    if (sink.error) {
+        if (sink.buf)
+            xmpp_free(stanza->ctx, sink.buf);
         *buf = NULL;
         *buflen = 0;
-        return XMPP_EMEM;
+        return sink.error;
     }
     
-    ret = _render_stanza_recursive(stanza, buffer, length);
-    if (ret < 0)
-        return ret;
-        
-    // 缓冲区不够大，再分配一个单位大小，之前的解析内容保留
-    if ((size_t)ret > length - 1) {
-        tmp = xmpp_realloc(stanza->ctx, buffer, ret + 1);
-        if (!tmp) {
-            xmpp_free(stanza->ctx, buffer);
-            *buf = NULL;
-            *buflen = 0;
-            return XMPP_EMEM;
-        }
-        length = ret + 1;
-        buffer = tmp;
-        ret = _render_stanza_recursive(stanza, buffer, length);
-        if ((size_t)ret > length - 1)
-            return XMPP_EMEM;
-    }
-    
-    buffer[length - 1] = 0;
-    *buf = buffer;
-    *buflen = ret;
+    *buf = sink.buf;
+    *buflen = sink.ptr - sink.buf - 1;
     return XMPP_EOK;
 }
 
 int xmpp_stanza_set_name(xmpp_stanza_t *stanza, const char *name)
 {
     if (stanza->type == XMPP_STANZA_TEXT) return XMPP_EINVOP;
-    if (stanza->data) xmpp_free(stanza->ctx, stanza->data);
+    _stanza_free_data(stanza);
     stanza->type = XMPP_STANZA_TAG;
-    stanza->data = xmpp_strdup(stanza->ctx, name);
+    stanza->data = _stanza_strndup(stanza, name, strlen(name));
     return XMPP_EOK;
 }
 
@@ -369,60 +490,96 @@ char *xmpp_stanza_get_name_ptr(xmpp_stanza_t *stanza)
 
 int xmpp_stanza_get_attribute_count(xmpp_stanza_t *stanza)
 {
-    if (stanza->attributes == NULL) {
-        return 0;
-    }
-    return hash_num_keys(stanza->attributes);
+    return stanza->attr_count;
 }
 
 int xmpp_stanza_get_attributes(xmpp_stanza_t *stanza, const char **attr, int attrlen)
 {
-    hash_iterator_t *iter;
-    const char *key;
     int num = 0;
-    if (stanza->attributes == NULL) {
-        return 0;
-    }
-    iter = hash_iter_new(stanza->attributes);
-    while ((key = hash_iter_next(iter)) != NULL && attrlen) {
-        attr[num++] = key;
-        attrlen--;
-        if (attrlen == 0) {
-            hash_iter_release(iter);
-            return num;
-        }
-        attr[num++] = hash_get(stanza->attributes, key);
-        attrlen--;
-        if (attrlen == 0) {
-            hash_iter_release(iter);
-            return num;
-        }
+    int i;
+    for (i = 0; i < stanza->attr_count && num < attrlen; i++) {
+        attr[num++] = stanza->attrs[i].key;
+        if (num == attrlen)
+            break;
+        attr[num++] = stanza->attrs[i].value;
     }
-    hash_iter_release(iter);
     return num;
 }
 
 int xmpp_stanza_set_attribute(xmpp_stanza_t *stanza, const char *key, const char *value)
 {
-    char *val;
+    size_t klen, vlen;
+    char *pair;
+    int i;
     if (stanza->type != XMPP_STANZA_TAG) {
         return XMPP_EINVOP;
     }
     
-    if (!stanza->attributes) {
-        stanza->attributes = hash_new(8, xmpp_hash_free);
-        if (!stanza->attributes) return XMPP_EMEM;
-    }
-    
-    val = xmpp_strdup(stanza->ctx, value);
-    if (!val) {
+    // key和value一起分配
+    klen = strlen(key);
+    vlen = strlen(value);
+    if (stanza->arena)
+        pair = arena_alloc(stanza->arena, klen + vlen + 2);
+    else
+        pair = xmpp_alloc(stanza->ctx, klen + vlen + 2);
+    if (!pair) {
         return XMPP_EMEM;
     }
+    memcpy(pair, key, klen + 1);
+    memcpy(pair + klen + 1, value, vlen + 1);
     
-    hash_add(stanza->attributes, key, val);
+    i = _stanza_find_attr(stanza, key);
+    if (i >= 0) {
+        // 已经存在则替换值, 位置不变, 索引也不用改
+        if (!stanza->arena)
+            xmpp_free(stanza->ctx, stanza->attrs[i].key);
+        stanza->attrs[i].key = pair;
+        stanza->attrs[i].value = pair + klen + 1;
+        return XMPP_EOK;
+    } else {
+        if (stanza->attr_count == stanza->attr_capacity &&
+            _stanza_grow_attrs(stanza) != XMPP_EOK) {
+            if (!stanza->arena)
+                xmpp_free(stanza->ctx, pair);
+            return XMPP_EMEM;
+        }
+        i = stanza->attr_count++;
+    }
+    stanza->attrs[i].key = pair;
+    stanza->attrs[i].value = pair + klen + 1;
+    return _stanza_index_attr(stanza, i);
+}
+
+int stanza_set_name_nocopy(xmpp_stanza_t *stanza, const char *name)
+{
+    if (stanza->type == XMPP_STANZA_TEXT || !stanza->arena) return XMPP_EINVOP;
+    stanza->type = XMPP_STANZA_TAG;
+    stanza->data = (char *)name;
     return XMPP_EOK;
 }
 
+int stanza_set_attribute_nocopy(xmpp_stanza_t *stanza, const char *key, const char *value)
+{
+    int i;
+    if (stanza->type != XMPP_STANZA_TAG || !stanza->arena) {
+        return XMPP_EINVOP;
+    }
+    
+    i = _stanza_find_attr(stanza, key);
+    if (i >= 0) {
+        stanza->attrs[i].value = (char *)value;
+        return XMPP_EOK;
+    }
+    if (stanza->attr_count == stanza->attr_capacity &&
+        _stanza_grow_attrs(stanza) != XMPP_EOK) {
+        return XMPP_EMEM;
+    }
+    i = stanza->attr_count++;
+    stanza->attrs[i].key = (char *)key;
+    stanza->attrs[i].value = (char *)value;
+    return _stanza_index_attr(stanza, i);
+}
+
 int xmpp_stanza_set_ns(xmpp_stanza_t *stanza, const char *ns)
 {
     return xmpp_stanza_set_attribute(stanza, "xmlns", ns);
@@ -432,8 +589,15 @@ int xmpp_stanza_add_child(xmpp_stanza_t *stanza, xmpp_stanza_t *child)
 {
     xmpp_stanza_t *s;
     
-    // 添加引用计数
-    xmpp_stanza_clone(child);
+    if (child->arena && child->arena != stanza->arena) {
+        // 解析器的stanza挂到其他树上, 拷贝一份
+        child = xmpp_stanza_copy(child);
+        if (!child)
+            return XMPP_EMEM;
+    } else {
+        // 添加引用计数
+        child->ref++;
+    }
     
     child->parent = stanza;
     if (!stanza->children) {
@@ -453,9 +617,8 @@ int xmpp_stanza_set_text(xmpp_stanza_t *stanza, const char *text)
         return XMPP_EINVOP;
         
     stanza->type = XMPP_STANZA_TEXT;
-    if (stanza->data)
-        xmpp_free(stanza->ctx, stanza->data);
-    stanza->data = xmpp_strdup(stanza->ctx, text);
+    _stanza_free_data(stanza);
+    stanza->data = _stanza_strndup(stanza, text, strlen(text));
     
     return XMPP_EOK;
 }
@@ -467,15 +630,11 @@ int xmpp_stanza_set_text_safe(xmpp_stanza_t *stanza, const char *text, size_t si
     stanza->type = XMPP_STANZA_TEXT;
     
     // 释放之前的
-    if (stanza->data)
-        xmpp_free(stanza->ctx, stanza->data);
-        
-    stanza->data = xmpp_alloc(stanza->ctx, size + 1);
+    _stanza_free_data(stanza);
+    
+    stanza->data = _stanza_strndup(stanza, text, size);
     if (!stanza->data)
         return XMPP_EMEM;
-        
-    memcpy(stanza->data, text, size);
-    stanza->data[size] = 0;
     return XMPP_EOK;
 }
 
@@ -483,27 +642,21 @@ char *xmpp_stanza_get_id_ptr(xmpp_stanza_t *stanza)
 {
     if (stanza->type != XMPP_STANZA_TAG)
         return NULL;
-    if (!stanza->attributes)
-        return NULL;
-    return (char *)hash_get(stanza->attributes, "id");
+    return (char *)_stanza_get_attr(stanza, XMPP_ATOM(stanza->ctx, id));
 }
 
 const char * xmpp_stanza_get_ns(xmpp_stanza_t *stanza)
 {
     if (stanza->type != XMPP_STANZA_TAG)
         return NULL;
-    if (!stanza->attributes)
-        return NULL;
-    return (char *)hash_get(stanza->attributes, "xmlns");
+    return (char *)_stanza_get_attr(stanza, XMPP_ATOM(stanza->ctx, xmlns));
 }
 
 char *xmpp_stanza_get_type_ptr(xmpp_stanza_t *stanza)
 {
     if (stanza->type != XMPP_STANZA_TAG)
         return NULL;
-    if (!stanza->attributes)
-        return NULL;
-    return (char *)hash_get(stanza->attributes, "type");
+    return (char *)_stanza_get_attr(stanza, XMPP_ATOM(stanza->ctx, type));
 }
 
 xmpp_stanza_t *xmpp_stanza_get_child_by_name(xmpp_stanza_t *stanza, const char *name)
@@ -562,7 +715,5 @@ const char * xmpp_stanza_get_attribute(xmpp_stanza_t *stanza, const char *name)
 {
     if (stanza->type != XMPP_STANZA_TAG)
         return NULL;
-    if (!stanza->attributes)
-        return NULL;
-    return hash_get(stanza->attributes, name);
+    return _stanza_get_attr(stanza, name);
 }
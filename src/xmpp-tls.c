@@ -0,0 +1,330 @@
+/* xmpp-tls.c
+ * 客户端TLS会话缓存, 按服务器域名和端口保存会话和ticket, 所有上下文共享
+ * 断线重连的时候带上缓存的会话做简短握手, 服务器和客户端都省掉证书和密钥交换
+ */
+#include "xmpp-inl.h"
+#include "im-atomic.h"
+
+#include <time.h>
+
+// 缓存的服务器数量上限, 满了先清理过期的, 还是满的话整个清空
+#define XMPP_TLS_CACHE_MAX 1024
+// 每个服务器保留的会话数量. TLS 1.3的ticket只用一次, 同时重连的连接各自取一个
+#define XMPP_TLS_SESSIONS_PER_SERVER 8
+#define XMPP_TLS_KEY_SIZE 300
+
+typedef struct _xmpp_tls_entry_t {
+    int count;
+    SSL_SESSION *sessions[XMPP_TLS_SESSIONS_PER_SERVER];   // 最新的在最后
+} xmpp_tls_entry_t;
+
+static im_thread_mutex_t *volatile tls_lock = NULL;
+static hash_t *tls_cache = NULL;
+static int tls_ex_index = -1;
+static volatile long tls_hits = 0;
+static volatile long tls_misses = 0;
+
+static im_thread_mutex_t *_tls_get_lock()
+{
+    im_thread_mutex_t *lock = im_atomic_load_ptr((void *volatile *)&tls_lock);
+
+    if (!lock) {
+        lock = im_thread_mutex_create();
+        if (!im_atomic_cas_ptr((void *volatile *)&tls_lock, NULL, lock)) {
+            // 其他线程已经创建了
+            im_thread_mutex_destroy(lock);
+            lock = im_atomic_load_ptr((void *volatile *)&tls_lock);
+        }
+    }
+    return lock;
+}
+
+static int _tls_session_expired(SSL_SESSION *session, time_t now)
+{
+    return now >= (time_t)(SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session));
+}
+
+static void _tls_entry_free(void *p)
+{
+    xmpp_tls_entry_t *entry = p;
+    int i;
+
+    for (i = 0; i < entry->count; i++)
+        SSL_SESSION_free(entry->sessions[i]);
+    safe_mem_free(entry);
+}
+
+// SNI的服务器域名加上端口
+static int _tls_make_key(xmpp_conn_t *conn, char *key)
+{
+    const char *port = conn->connectport ? conn->connectport : "5222";
+
+    if (!conn->domain || strlen(conn->domain) + strlen(port) + 2 > XMPP_TLS_KEY_SIZE)
+        return 0;
+    sprintf(key, "%s:%s", conn->domain, port);
+    return 1;
+}
+
+// 清理过期的会话, 调用者持有锁
+static void _tls_cache_evict()
+{
+    hash_iterator_t *iter;
+    xmpp_tls_entry_t *entry;
+    const char **keys;
+    const char *key;
+    time_t now = time(NULL);
+    int n = 0, i, j;
+
+    keys = safe_mem_malloc(sizeof(char *) * hash_num_keys(tls_cache), NULL);
+    iter = hash_iter_new(tls_cache);
+    if (keys && iter) {
+        while ((key = hash_iter_next(iter)) != NULL) {
+            entry = hash_get(tls_cache, key);
+            for (i = 0, j = 0; i < entry->count; i++) {
+                if (_tls_session_expired(entry->sessions[i], now))
+                    SSL_SESSION_free(entry->sessions[i]);
+                else
+                    entry->sessions[j++] = entry->sessions[i];
+            }
+            entry->count = j;
+            if (j == 0)
+                keys[n++] = key;
+        }
+    }
+    if (iter)
+        hash_iter_release(iter);
+
+    for (i = 0; i < n; i++)
+        hash_drop(tls_cache, keys[i]);
+    safe_mem_free(keys);
+
+    if (hash_num_keys(tls_cache) >= XMPP_TLS_CACHE_MAX) {
+        hash_release(tls_cache);
+        tls_cache = NULL;
+    }
+}
+
+// 取一个没有过期的会话, 返回的会话持有一个引用
+static SSL_SESSION *_tls_cache_get(const char *key)
+{
+    im_thread_mutex_t *lock = _tls_get_lock();
+    xmpp_tls_entry_t *entry;
+    SSL_SESSION *session = NULL;
+    time_t now = time(NULL);
+
+    if (!lock)
+        return NULL;
+
+    im_thread_mutex_lock(lock);
+    if (tls_cache && (entry = hash_get(tls_cache, key)) != NULL) {
+        while (entry->count > 0) {
+            session = entry->sessions[entry->count - 1];
+            if (_tls_session_expired(session, now)) {
+                SSL_SESSION_free(session);
+                session = NULL;
+                entry->count--;
+                continue;
+            }
+            // TLS 1.3的ticket用过一次就拿走, 握手以后服务器会发新的
+            if (SSL_SESSION_get_protocol_version(session) >= TLS1_3_VERSION)
+                entry->count--;
+            else
+                SSL_SESSION_up_ref(session);
+            break;
+        }
+    }
+    im_thread_mutex_unlock(lock);
+    return session;
+}
+
+// 接管session的引用, 失败返回0
+static int _tls_cache_put(const char *key, SSL_SESSION *session)
+{
+    im_thread_mutex_t *lock = _tls_get_lock();
+    xmpp_tls_entry_t *entry;
+    int ret = 0;
+
+    if (!lock)
+        return 0;
+
+    im_thread_mutex_lock(lock);
+    if (tls_cache && hash_num_keys(tls_cache) >= XMPP_TLS_CACHE_MAX &&
+        !hash_get(tls_cache, key))
+        _tls_cache_evict();
+    if (!tls_cache)
+        tls_cache = hash_new(64, _tls_entry_free);
+
+    if (tls_cache) {
+        entry = hash_get(tls_cache, key);
+        if (!entry) {
+            entry = safe_mem_calloc(sizeof(xmpp_tls_entry_t), NULL);
+            if (entry && hash_add(tls_cache, key, entry) != 0) {
+                safe_mem_free(entry);
+                entry = NULL;
+            }
+        }
+        if (entry) {
+            // 满了丢掉最旧的
+            if (entry->count == XMPP_TLS_SESSIONS_PER_SERVER) {
+                SSL_SESSION_free(entry->sessions[0]);
+                memmove(entry->sessions, entry->sessions + 1,
+                        sizeof(SSL_SESSION *) * (XMPP_TLS_SESSIONS_PER_SERVER - 1));
+                entry->count--;
+            }
+            entry->sessions[entry->count++] = session;
+            ret = 1;
+        }
+    }
+    im_thread_mutex_unlock(lock);
+    return ret;
+}
+
+// 握手完成或者收到TLS 1.3的ticket时调用, 返回1表示保留了session的引用
+static int _tls_new_session_cb(SSL *ssl, SSL_SESSION *session)
+{
+    xmpp_conn_t *conn = SSL_get_ex_data(ssl, tls_ex_index);
+    char key[XMPP_TLS_KEY_SIZE];
+
+    if (!conn || !SSL_SESSION_is_resumable(session) || !_tls_make_key(conn, key))
+        return 0;
+    return _tls_cache_put(key, session);
+}
+
+void tls_ctx_init(SSL_CTX *ssl_ctx)
+{
+    im_thread_mutex_t *lock = _tls_get_lock();
+
+    if (!ssl_ctx || !lock)
+        return;
+
+    im_thread_mutex_lock(lock);
+    if (tls_ex_index < 0)
+        tls_ex_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+    im_thread_mutex_unlock(lock);
+    if (tls_ex_index < 0)
+        return;
+
+    // 会话由上面的缓存保存, 不用OpenSSL内部的缓存
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT |
+                                   SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ssl_ctx, _tls_new_session_cb);
+    SSL_CTX_clear_options(ssl_ctx, SSL_OP_NO_TICKET);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // 网络断开不算致命错误, 断线重连的时候会话还能用. xml流本身有结束标记, 截断可以发现
+    SSL_CTX_set_options(ssl_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+}
+
+SSL *tls_new(xmpp_conn_t *conn)
+{
+    SSL *ssl = SSL_new(conn->ctx->ssl_ctx);
+    SSL_SESSION *session;
+    unsigned char addr[16];
+    char key[XMPP_TLS_KEY_SIZE];
+
+    if (!ssl)
+        return NULL;
+
+    // SNI用jid的域名, 数字地址不能作为SNI
+    if (conn->domain && evutil_inet_pton(AF_INET, conn->domain, addr) != 1 &&
+        evutil_inet_pton(AF_INET6, conn->domain, addr) != 1)
+        SSL_set_tlsext_host_name(ssl, conn->domain);
+
+    if (tls_ex_index < 0 || !_tls_make_key(conn, key))
+        return ssl;
+    SSL_set_ex_data(ssl, tls_ex_index, conn);
+
+    session = _tls_cache_get(key);
+    if (session) {
+        SSL_set_session(ssl, session);
+        SSL_SESSION_free(session);
+    }
+    return ssl;
+}
+
+void tls_handshake_done(xmpp_conn_t *conn, SSL *ssl)
+{
+    if (SSL_session_reused(ssl)) {
+        im_atomic_inc(&tls_hits);
+        xmpp_debug(conn->ctx, "tls", "TLS session resumed for %s", conn->domain);
+    } else {
+        im_atomic_inc(&tls_misses);
+    }
+}
+
+const char *tls_channel_binding(xmpp_conn_t *conn, int types, unsigned char *buf, size_t *len)
+{
+    struct bufferevent *bev;
+    SSL *ssl = NULL;
+
+    // 压缩的话tls在下面一层
+    for (bev = conn->evbuffer; bev && !ssl; bev = bufferevent_get_underlying(bev))
+        ssl = bufferevent_openssl_get_ssl(bev);
+    if (!ssl || !SSL_is_init_finished(ssl))
+        return NULL;
+
+    if (SSL_version(ssl) >= TLS1_3_VERSION) {
+        // RFC 9266, TLS 1.3没有tls-unique
+        if (types && !(types & SASL_CB_TLS_EXPORTER))
+            return NULL;
+        if (SSL_export_keying_material(ssl, buf, 32, "EXPORTER-Channel-Binding", 24,
+                                       NULL, 0, 0) != 1)
+            return NULL;
+        *len = 32;
+        return "tls-exporter";
+    }
+
+    // RFC 5929, 第一个Finished消息, 完整握手是客户端发的, 简短握手是服务器发的
+    if (types && !(types & SASL_CB_TLS_UNIQUE))
+        return NULL;
+    if (SSL_session_reused(ssl))
+        *len = SSL_get_peer_finished(ssl, buf, 64);
+    else
+        *len = SSL_get_finished(ssl, buf, 64);
+    return *len > 0 ? "tls-unique" : NULL;
+}
+
+void xmpp_tls_cache_stats(long *hits, long *misses, int *sessions)
+{
+    im_thread_mutex_t *lock = _tls_get_lock();
+    hash_iterator_t *iter;
+    xmpp_tls_entry_t *entry;
+    const char *key;
+    int n = 0;
+
+    if (hits)
+        *hits = im_atomic_load(&tls_hits);
+    if (misses)
+        *misses = im_atomic_load(&tls_misses);
+    if (!sessions)
+        return;
+
+    if (lock) {
+        im_thread_mutex_lock(lock);
+        if (tls_cache && (iter = hash_iter_new(tls_cache)) != NULL) {
+            while ((key = hash_iter_next(iter)) != NULL) {
+                entry = hash_get(tls_cache, key);
+                n += entry->count;
+            }
+            hash_iter_release(iter);
+        }
+        im_thread_mutex_unlock(lock);
+    }
+    *sessions = n;
+}
+
+void xmpp_tls_cache_clear(void)
+{
+    im_thread_mutex_t *lock = _tls_get_lock();
+
+    if (!lock)
+        return;
+    im_thread_mutex_lock(lock);
+    if (tls_cache) {
+        hash_release(tls_cache);
+        tls_cache = NULL;
+    }
+    im_thread_mutex_unlock(lock);
+    im_atomic_store(&tls_hits, 0);
+    im_atomic_store(&tls_misses, 0);
+}
@@ -0,0 +1,203 @@
+/* xmpp-zlib.c
+ * XEP-0138 zlib流压缩, 和tls一样用bufferevent过滤器叠在连接的bufferevent上面
+ * 发送可以每次写都同步flush, 交互延迟最低; 也可以攒一段时间再flush, 批量数据压缩率更高
+ */
+#include "xmpp-inl.h"
+
+#include <zlib.h>
+
+// 每次向输出缓冲区申请的空间
+#define XMPP_ZLIB_CHUNK 4096
+// 每次过滤最多解压出来的数据, 也是过滤器输入缓冲区的高水位, 剩下的留在底层等连接读走以后再解压
+#define XMPP_ZLIB_READ_MAX 65536
+// 每次交给inflate的压缩数据, deflate最大压缩比约1000:1, 一片最多解压出500K左右
+#define XMPP_ZLIB_INFLATE_SLICE 512
+
+typedef struct _xmpp_zlib_t {
+    xmpp_conn_t *conn;
+    struct bufferevent *bev;     // 压缩过滤器
+    z_stream deflate;
+    z_stream inflate;
+    unsigned long flush_delay;   // 毫秒, 0表示每次写都flush
+    im_timer_t timer;            // 批量模式下延迟flush
+    int deflate_init;
+    int inflate_init;
+    int failed;                  // 解压出错, 后面的数据都丢掉
+} xmpp_zlib_t;
+
+static void _zlib_free(void *ctx)
+{
+    xmpp_zlib_t *z = ctx;
+
+    // 连接断开的时候已经摘掉了, 这里只剩下zlib的状态
+    if (z->conn && z->conn->ctx->timers)
+        im_timer_del(z->conn->ctx->timers, &z->timer);
+    if (z->deflate_init)
+        deflateEnd(&z->deflate);
+    if (z->inflate_init)
+        inflateEnd(&z->inflate);
+    safe_mem_free(z);
+}
+
+// 输出空间用完就再申请一块, 直到zlib不再有输出. 返回输出的字节数, 出错返回-1
+static int _zlib_pump(z_stream *zs, struct evbuffer *dst, int flush, int compress)
+{
+    struct evbuffer_iovec vec;
+    int ret, produced = 0;
+
+    do {
+        if (evbuffer_reserve_space(dst, XMPP_ZLIB_CHUNK, &vec, 1) < 1)
+            return -1;
+        zs->next_out = vec.iov_base;
+        zs->avail_out = (uInt)vec.iov_len;
+        ret = compress ? deflate(zs, flush) : inflate(zs, flush);
+        vec.iov_len -= zs->avail_out;
+        evbuffer_commit_space(dst, &vec, 1);
+        produced += (int)vec.iov_len;
+
+        // 没有可以处理的数据时返回Z_BUF_ERROR, 不算错误
+        if (ret != Z_OK && ret != Z_BUF_ERROR && ret != Z_STREAM_END)
+            return -1;
+        if (ret == Z_STREAM_END)
+            break;
+    } while (zs->avail_out == 0);
+    return produced;
+}
+
+// 处理src里面的数据, flush不是Z_NO_FLUSH的话最后再flush一次.
+// max_out不为0的时候输出达到max_out就停下, 剩下的数据留在src里面, 解压时按小片输入限制单次的输出
+static enum bufferevent_filter_result _zlib_process(z_stream *zs, struct evbuffer *src,
+        struct evbuffer *dst, int flush, int compress, size_t max_out)
+{
+    struct evbuffer_iovec vec;
+    size_t len;
+    int n, produced = 0;
+
+    while (evbuffer_peek(src, -1, NULL, &vec, 1) > 0) {
+        if (max_out && (size_t)produced >= max_out)
+            break;
+        len = vec.iov_len;
+        if (!compress && len > XMPP_ZLIB_INFLATE_SLICE)
+            len = XMPP_ZLIB_INFLATE_SLICE;
+        zs->next_in = vec.iov_base;
+        zs->avail_in = (uInt)len;
+        n = _zlib_pump(zs, dst, Z_NO_FLUSH, compress);
+        if (n < 0)
+            return BEV_ERROR;
+        produced += n;
+        evbuffer_drain(src, len - zs->avail_in);
+        // 解压遇到流结束, 剩下的数据不认识
+        if (zs->avail_in > 0)
+            return BEV_ERROR;
+    }
+    zs->next_in = NULL;
+    zs->avail_in = 0;
+
+    if (flush != Z_NO_FLUSH) {
+        n = _zlib_pump(zs, dst, flush, compress);
+        if (n < 0)
+            return BEV_ERROR;
+        produced += n;
+    }
+    return produced > 0 ? BEV_OK : BEV_NEED_MORE;
+}
+
+static enum bufferevent_filter_result _zlib_input(struct evbuffer *src, struct evbuffer *dst,
+        ev_ssize_t limit, enum bufferevent_flush_mode mode, void *ctx)
+{
+    xmpp_zlib_t *z = ctx;
+    enum bufferevent_filter_result ret;
+    size_t max_out = XMPP_ZLIB_READ_MAX;
+
+    if (z->failed) {
+        evbuffer_drain(src, evbuffer_get_length(src));
+        return BEV_ERROR;
+    }
+
+    // 输入缓冲区有高水位的时候libevent给出剩余的空间
+    if (limit > 0 && (size_t)limit < max_out)
+        max_out = (size_t)limit;
+    ret = _zlib_process(&z->inflate, src, dst, Z_SYNC_FLUSH, 0, max_out);
+    if (ret == BEV_ERROR) {
+        if (z->conn)
+            xmpp_error(z->conn->ctx, "zlib", "Inflate failed: %s.",
+                       z->inflate.msg ? z->inflate.msg : "corrupt stream");
+        // 过滤器不会把输入错误报告出去, 自己延迟触发错误事件, 这里不能释放bufferevent
+        z->failed = 1;
+        evbuffer_drain(src, evbuffer_get_length(src));
+        bufferevent_trigger_event(z->bev, BEV_EVENT_READING | BEV_EVENT_ERROR,
+                                  BEV_TRIG_DEFER_CALLBACKS);
+    }
+    return ret;
+}
+
+static enum bufferevent_filter_result _zlib_output(struct evbuffer *src, struct evbuffer *dst,
+        ev_ssize_t limit, enum bufferevent_flush_mode mode, void *ctx)
+{
+    xmpp_zlib_t *z = ctx;
+    int flush = Z_SYNC_FLUSH;
+
+    // 批量模式下普通的写只压缩不flush, 定时器到了再flush
+    if (mode == BEV_NORMAL && z->flush_delay && z->conn && z->conn->ctx->timers) {
+        flush = Z_NO_FLUSH;
+        if (evbuffer_get_length(src) > 0 && !im_timer_pending(&z->timer))
+            im_timer_add(z->conn->ctx->timers, &z->timer, z->flush_delay);
+    }
+    // 上次flush以后没有新数据的话zlib不会再输出
+    return _zlib_process(&z->deflate, src, dst, flush, 1, 0);
+}
+
+static void _zlib_flush_timeout(im_timer_t *timer, void *userdata)
+{
+    xmpp_zlib_t *z = userdata;
+
+    bufferevent_flush(z->bev, EV_WRITE, BEV_FLUSH);
+}
+
+struct bufferevent *zlib_filter_new(xmpp_conn_t *conn, struct bufferevent *underlying)
+{
+    xmpp_zlib_t *z;
+    struct bufferevent *bev;
+
+    z = safe_mem_calloc(sizeof(xmpp_zlib_t), NULL);
+    if (!z)
+        return NULL;
+    z->conn = conn;
+    z->flush_delay = conn->compress_flush_delay;
+    im_timer_init(&z->timer, _zlib_flush_timeout, z);
+    if (deflateInit(&z->deflate, conn->compress_level) == Z_OK)
+        z->deflate_init = 1;
+    if (inflateInit(&z->inflate) == Z_OK)
+        z->inflate_init = 1;
+    if (!z->deflate_init || !z->inflate_init) {
+        _zlib_free(z);
+        return NULL;
+    }
+
+    // 底下可能是socket也可能是tls过滤器, 释放的时候一起释放
+    bev = bufferevent_filter_new(underlying, _zlib_input, _zlib_output,
+                                 BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS,
+                                 _zlib_free, z);
+    if (!bev) {
+        _zlib_free(z);
+        return NULL;
+    }
+    // 解压出来的数据不超过高水位, 连接读走以后libevent继续解压底层剩下的数据
+    bufferevent_setwatermark(bev, EV_READ, 0, XMPP_ZLIB_READ_MAX);
+    z->bev = bev;
+    conn->zlib = z;
+    return bev;
+}
+
+void zlib_filter_detach(xmpp_conn_t *conn)
+{
+    xmpp_zlib_t *z = conn->zlib;
+
+    // bufferevent可能延迟释放, 先停掉定时器, 以后不再碰连接
+    if (!z)
+        return;
+    if (conn->ctx->timers)
+        im_timer_del(conn->ctx->timers, &z->timer);
+    z->conn = NULL;
+    conn->zlib = NULL;
+}
@@ -15,9 +15,14 @@ extern "C" {
 #define XMPP_NS_STREAMS_IETF "urn:ietf:params:xml:ns:xmpp-streams"
 #define XMPP_NS_TLS "urn:ietf:params:xml:ns:xmpp-tls"
 #define XMPP_NS_SASL "urn:ietf:params:xml:ns:xmpp-sasl"
+#define XMPP_NS_SASL_CB "urn:xmpp:sasl-cb:0"
+#define XMPP_NS_SASL2 "urn:xmpp:sasl:2"
 #define XMPP_NS_COMPRESSION "http://jabber.org/features/compress"
+#define XMPP_NS_COMPRESS "http://jabber.org/protocol/compress"
 #define XMPP_NS_BIND "urn:ietf:params:xml:ns:xmpp-bind"
+#define XMPP_NS_BIND2 "urn:xmpp:bind:0"
 #define XMPP_NS_SESSION "urn:ietf:params:xml:ns:xmpp-session"
+#define XMPP_NS_SM "urn:xmpp:sm:3"
 #define XMPP_NS_AUTH "jabber:iq:auth"
 #define XMPP_NS_DISCO_INFO "http://jabber.org/protocol/disco#info"
 #define XMPP_NS_DISCO_ITEMS "http://jabber.org/protocol/disco#items"
@@ -56,6 +61,11 @@ xmpp_log_t *xmpp_get_default_logger(xmpp_log_level_t level);
 // 上下文对象
 typedef struct _xmpp_ctx_t xmpp_ctx_t;
 xmpp_ctx_t *xmpp_ctx_new(im_thread_t *workthread, const xmpp_log_t *log);
+// 增加引用计数, 多个连接可以共享一个上下文
+xmpp_ctx_t *xmpp_ctx_clone(xmpp_ctx_t *ctx);
+// 在另一个线程上创建上下文, 和ctx共享SSL_CTX以及日志
+xmpp_ctx_t *xmpp_ctx_fork(xmpp_ctx_t *ctx, im_thread_t *workthread);
+// 减少引用计数, 到0释放
 void xmpp_ctx_free(xmpp_ctx_t *ctx);
 
 //连接类型
@@ -125,6 +135,10 @@ const char *xmpp_conn_get_pass(const xmpp_conn_t *conn);
 void xmpp_conn_set_timeout(xmpp_conn_t *conn, unsigned long usec);
 void xmpp_conn_set_pass(xmpp_conn_t *conn, const char *pass);
 void xmpp_conn_disable_tls(xmpp_conn_t *conn);
+// XEP-0138 zlib流压缩, 服务器支持的话在sasl以后启用. level是1-9的压缩等级, 0表示不压缩(默认)
+// flush_delay是毫秒, 0表示每次发送都立即flush, 延迟最低; 大于0的话这段时间里面发送的数据攒在一起flush,
+// 适合名册和消息记录同步这样的批量数据, 压缩率更高
+void xmpp_conn_set_compression(xmpp_conn_t *conn, int level, unsigned long flush_delay);
 
 // 连接状态回调
 typedef void(*xmpp_conn_handler)(xmpp_conn_t *conn,
@@ -169,7 +183,43 @@ void xmpp_handler_delete(xmpp_conn_t *conn, xmpp_handler handler);
 void xmpp_id_handler_add(xmpp_conn_t *conn, xmpp_handler handler, const char *id, void *userdata);
 void xmpp_id_handler_delete(xmpp_conn_t *conn, xmpp_handler handler, const char *id);
 
+// 异步IQ请求的结果
+#define XMPP_IQ_RESULT        0    // 收到type="result"的应答
+#define XMPP_IQ_ERROR         1    // 收到type="error"的应答
+#define XMPP_IQ_TIMEOUT       2    // 超时没有收到应答
+#define XMPP_IQ_CANCELED      3    // 连接断开或者释放, 请求不会再有应答. 可以恢复的流断线时不取消
+
+// 异步IQ回调, 只在有应答的时候stanza不为NULL, 每个请求正好调用一次
+typedef void (*xmpp_iq_handler)(xmpp_conn_t *conn, int status, xmpp_stanza_t *stanza, void *userdata);
+
+// 发送get或者set请求, 没有id的话自动生成并写回stanza, 不用等上一个请求的应答
+// timeout是毫秒, 0表示使用连接的超时设置. 返回XMPP_EOK以后handler一定会被调用一次
+// 只接受请求的to发出的应答, 发给服务器或者自己账号的请求接受没有from或者自己账号的应答.
+// 启用了流管理的连接断线以后请求保持等待, 恢复流的时候自动重发, 应用程序不要自己重试
+int xmpp_iq_send_async(xmpp_conn_t *conn, xmpp_stanza_t *iq, unsigned long timeout,
+                       xmpp_iq_handler handler, void *userdata);
+// 取消等待应答的请求, 不调用handler
+int xmpp_iq_cancel(xmpp_conn_t *conn, const char *id);
+int xmpp_iq_pending_count(xmpp_conn_t *conn);
+
+// XEP-0198流管理, 服务器支持的话绑定资源以后自动启用. 断线以后用同一个连接重新调用xmpp_connect_client
+// 会先尝试恢复流, 恢复成功跳过资源绑定, 没有确认的stanza自动重发; xmpp_disconnect主动断开的流不再恢复
+int xmpp_conn_sm_unacked(xmpp_conn_t *conn);
+// 最近一次XMPP_CONN_CONNECT是恢复的流, 名册和在线状态都还在服务器上, 不用重新获取和发送
+int xmpp_conn_is_resumed(xmpp_conn_t *conn);
+
+// TLS会话缓存, 按服务器域名和端口保存, 所有上下文共享. 统计握手复用会话的次数
+// 和完整握手的次数, sessions是缓存里面的会话数量
+void xmpp_tls_cache_stats(long *hits, long *misses, int *sessions);
+void xmpp_tls_cache_clear(void);
+
+// SCRAM认证的PBKDF2结果缓存, 按服务器, 用户, salt和迭代次数保存ClientKey和ServerKey, 所有上下文共享
+// 服务器换了salt或者迭代次数, 或者密码变了都要重新计算. entries是缓存里面的条目数量
+void xmpp_scram_cache_stats(long *hits, long *misses, int *entries);
+void xmpp_scram_cache_clear(void);
+
 // Stanza操作
+// handler收到的stanza在handler返回以后整体回收, 需要保留的话用clone或者copy拷贝出来
 xmpp_stanza_t *xmpp_stanza_new(xmpp_ctx_t *ctx);
 xmpp_stanza_t *xmpp_stanza_clone(xmpp_stanza_t *stanza);
 xmpp_stanza_t * xmpp_stanza_copy(const xmpp_stanza_t *stanza);